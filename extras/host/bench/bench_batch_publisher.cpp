@@ -0,0 +1,109 @@
+// PUBLISH packets and CPU per published value for sensor traffic sent directly, batched and batched + packed.
+// bench_batch_publisher [values per second] [topics] [seconds]
+// The CPU time is that of the whole process, so it includes the in-process broker, which also gets fewer packets.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTBatchPublisher.h>
+#include <atomic>
+#include <string>
+#include <time.h>
+#include <vector>
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+static double processCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+enum class Mode
+{
+    Direct,
+    Batched,
+    Packed
+};
+
+int main(int argc, char** argv)
+{
+    int valuesPerSecond = argc > 1 ? atoi(argv[1]) : 2000;
+    int topicCount = argc > 2 ? atoi(argv[2]) : 40;
+    int seconds = argc > 3 ? atoi(argv[3]) : 3;
+
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("bench-batch");
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.start();
+    if (!waitFor([&]() { return connected == 1; }, 5000))
+    {
+        printf("not connected to the loopback broker\n");
+        return 1;
+    }
+
+    std::vector<std::string> topics;
+    for (int i = 0; i < topicCount; i++)
+        topics.push_back("sensors/" + std::to_string(i) + "/value");
+
+    printf("%d values/s over %d topics for %d s, batches of up to 64 values in a 100 ms window\n", valuesPerSecond, topicCount, seconds);
+    printf("%-16s %10s %12s %14s %14s\n", "mode", "packets/s", "packets/val", "CPU us/value", "avg latency ms");
+    for (Mode mode : { Mode::Direct, Mode::Batched, Mode::Packed })
+    {
+        ESP32_MQTTBatchPublisher batch(client);
+        if (mode == Mode::Packed)
+            batch.enablePacking("sensors/packed", 1024);
+        if (mode != Mode::Direct)
+            batch.begin(64, 32, 16, 100);
+
+        uint32_t packetsBefore = broker.getReceivedCount(3);
+        double cpuBefore = processCpuUs();
+        unsigned long start = millis();
+        int values = 0;
+        // paced like periodic sensor reads
+        while (millis() - start < (unsigned long)seconds * 1000)
+        {
+            int due = (int)((unsigned long long)(millis() - start) * valuesPerSecond / 1000);
+            for (; values < due; values++)
+            {
+                std::string payload = std::to_string(values % 1000) + ".5";
+                if (mode == Mode::Direct)
+                    client.publish(topics[values % topicCount].c_str(), payload.c_str(), 0);
+                else
+                    batch.publish(topics[values % topicCount].c_str(), payload.c_str(), 0);
+            }
+            delay(1);
+        }
+        float latencyMs = mode == Mode::Direct ? 0 : batch.getStats().averageLatencyUs / 1000.0f;
+        batch.end();
+        unsigned long elapsed = millis() - start;
+        // until the last messages reached the broker
+        uint32_t packets = broker.getReceivedCount(3) - packetsBefore;
+        for (uint32_t previous = -1; packets != previous; packets = broker.getReceivedCount(3) - packetsBefore)
+        {
+            previous = packets;
+            delay(100);
+        }
+        double cpu = processCpuUs() - cpuBefore;
+
+        const char* name = mode == Mode::Direct ? "publish()" : mode == Mode::Batched ? "batched" : "batched, packed";
+        printf("%-16s %10.0f %12.3f %14.2f %14.1f\n", name, packets * 1000.0 / elapsed, (double)packets / values, cpu / values, latencyMs);
+    }
+
+    client.stop();
+    broker.end();
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Publish throughput, event dispatch latency and heap per message of the client against the loopback broker.
+// bench_client [messages] [payload bytes]
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : 20000;
+    size_t payloadSize = argc > 2 ? atoi(argv[2]) : 64;
+
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0), confirmed(0), received(0);
+    std::vector<uint32_t> latencies;
+    latencies.reserve(messages);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("bench-client");
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("bench/latency", 0); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessagePublishConfirmed([&](int msgId) { confirmed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        unsigned long sent;
+        memcpy(&sent, data, sizeof(sent));
+        latencies.push_back(micros() - sent);
+        received++;
+    });
+    client.start();
+    if (!waitFor([&]() { return subscribed == 1; }, 5000))
+    {
+        printf("not connected to the loopback broker\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> payload(std::max(payloadSize, sizeof(unsigned long)), 'x');
+    printf("%d messages, %u byte payload\n", messages, (unsigned)payload.size());
+
+    for (int qos = 0; qos <= 1; qos++)
+    {
+        uint32_t before = broker.getReceivedCount(3);
+        int confirmedBefore = confirmed;
+        unsigned long start = micros();
+        for (int i = 0; i < messages; i++)
+            client.publish("bench/throughput", payload.data(), payload.size(), qos);
+        waitFor([&]() { return broker.getReceivedCount(3) - before >= (uint32_t)messages && (qos == 0 || confirmed - confirmedBefore >= messages); }, 60000);
+        unsigned long elapsed = micros() - start;
+        printf("publish QoS %d: %.0f messages/s (%.2f us per publish())\n", qos, messages * 1e6 / elapsed, (double)elapsed / messages);
+    }
+
+    // one message at a time: publish() -> broker -> MQTT task -> handler
+    int latencyMessages = std::min(messages, 2000);
+    for (int i = 0; i < latencyMessages; i++)
+    {
+        unsigned long now = micros();
+        memcpy(payload.data(), &now, sizeof(now));
+        int before = received;
+        client.publish("bench/latency", payload.data(), payload.size(), 0);
+        waitFor([&]() { return received > before; }, 1000);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty())
+        printf("dispatch latency (publish to handler): p50 %u us, p99 %u us, max %u us\n", latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+
+    // QoS 1 messages wait in the esp-mqtt outbox while the broker doesn't acknowledge them
+    broker.setBlackhole(true);
+    size_t heapBefore = ESP32_MQTTHostHeap::getUsedBytes();
+    int held = std::min(messages, 1000);
+    for (int i = 0; i < held; i++)
+        client.publish("bench/memory", payload.data(), payload.size(), 1);
+    size_t heapHeld = ESP32_MQTTHostHeap::getUsedBytes();
+    printf("heap per unacknowledged QoS 1 message: %.0f bytes (outbox %d bytes)\n", (double)(heapHeld - heapBefore) / held, client.getOutboxBufferSize());
+    broker.setBlackhole(false);
+
+    client.stop();
+    broker.end();
+    return 0;
+}
@@ -0,0 +1,158 @@
+// Encode and decode cost per value of the payload codecs against snprintf() and atof()/strtol(), for the types sensor
+// values usually have: a temperature (float, 2 decimals), a pressure (double), a counter (int32_t) and a state (bool).
+// bench_codecs [values]
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTCodecs.h>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile double sink;
+
+template<typename Function>
+static double measure(int count, Function function)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+        function(i);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+template<typename T>
+static T valueOf(int i);
+
+template<>
+float valueOf<float>(int i)
+{
+    return (i % 8000) * 0.01f - 20.0f;
+}
+
+template<>
+double valueOf<double>(int i)
+{
+    return 950.0 + (i % 100000) * 0.001;
+}
+
+template<>
+int32_t valueOf<int32_t>(int i)
+{
+    return (int32_t)((uint32_t)i * 7919u);     // wraps around
+}
+
+template<>
+bool valueOf<bool>(int i)
+{
+    return i & 1;
+}
+
+// snprintf() and the matching parser, as sensor code usually does it
+static size_t printfEncode(float value, char* buf)
+{
+    return snprintf(buf, 32, "%.2f", value);
+}
+
+static size_t printfEncode(double value, char* buf)
+{
+    return snprintf(buf, 32, "%.6f", value);
+}
+
+static size_t printfEncode(int32_t value, char* buf)
+{
+    return snprintf(buf, 32, "%ld", (long)value);
+}
+
+static size_t printfEncode(bool value, char* buf)
+{
+    return snprintf(buf, 32, "%s", value ? "true" : "false");
+}
+
+template<typename T>
+static T printfDecode(const char* text);
+
+template<>
+float printfDecode<float>(const char* text)
+{
+    return atof(text);
+}
+
+template<>
+double printfDecode<double>(const char* text)
+{
+    return atof(text);
+}
+
+template<>
+int32_t printfDecode<int32_t>(const char* text)
+{
+    return strtol(text, nullptr, 10);
+}
+
+template<>
+bool printfDecode<bool>(const char* text)
+{
+    return strcmp(text, "true") == 0;
+}
+
+// payloads of Samples values, encoded once for the decode loops
+static const int Samples = 4096;
+
+template<typename T>
+static void printfRow(const char* type, int count)
+{
+    static char payloads[Samples][32];
+    size_t bytes = 0;
+    for (int i = 0; i < Samples; i++)
+        bytes += printfEncode(valueOf<T>(i * 97), payloads[i]);
+
+    char buf[32];
+    double encodeNs = measure(count, [&](int i) {
+        sink = sink + printfEncode(valueOf<T>(i), buf);
+    });
+    double decodeNs = measure(count, [&](int i) {
+        sink = sink + printfDecode<T>(payloads[i % Samples]);
+    });
+    printf("%-8s %-18s %12.1f %12.1f %9.1f\n", type, "snprintf/ato*", encodeNs, decodeNs, (double)bytes / Samples);
+}
+
+template<template<typename> class Codec, typename T>
+static void codecRow(const char* type, const char* name, int count)
+{
+    static uint8_t payloads[Samples][Codec<T>::maxSize];
+    static size_t lengths[Samples];
+    size_t bytes = 0;
+    for (int i = 0; i < Samples; i++)
+        bytes += lengths[i] = Codec<T>::encode(valueOf<T>(i * 97), payloads[i]);
+
+    uint8_t buf[Codec<T>::maxSize];
+    double encodeNs = measure(count, [&](int i) {
+        sink = sink + Codec<T>::encode(valueOf<T>(i), buf);
+    });
+    double decodeNs = measure(count, [&](int i) {
+        T value;
+        Codec<T>::decode(payloads[i % Samples], lengths[i % Samples], value);
+        sink = sink + value;
+    });
+    printf("%-8s %-18s %12.1f %12.1f %9.1f\n", type, name, encodeNs, decodeNs, (double)bytes / Samples);
+}
+
+template<typename T>
+static void compare(const char* type, int count)
+{
+    printfRow<T>(type, count);
+    codecRow<ESP32_MQTTTextCodec, T>(type, "ESP32_MQTTText", count);
+    codecRow<ESP32_MQTTCborCodec, T>(type, "ESP32_MQTTCbor", count);
+    codecRow<ESP32_MQTTRawCodec, T>(type, "ESP32_MQTTRaw", count);
+}
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    printf("%-8s %-18s %12s %12s %9s\n", "type", "codec", "encode ns", "decode ns", "avg bytes");
+    compare<float>("float", count);
+    compare<double>("double", count);
+    compare<int32_t>("int32_t", count);
+    compare<bool>("bool", count);
+    return 0;
+}
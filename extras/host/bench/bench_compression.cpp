@@ -0,0 +1,171 @@
+// LZ4 compression of payloads devices typically publish: compression ratio, CPU time per KB to compress and to
+// decompress, and the RAM a client with enableCompression() for messages of that size holds per KB of message.
+// bench_compression [KB compressed per payload]
+// The RAM is the heap of a created client with compression minus one without: the compressed and decompressed
+// message buffers and the match finder table. compress() and decompress() allocate nothing.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <math.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+static volatile size_t sink;
+
+static double threadCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static uint32_t randomState = 1;
+
+static uint32_t nextRandom()
+{
+    randomState = randomState * 1103515245u + 12345u;
+    return randomState >> 8;
+}
+
+// devices/esp32-01/telemetry: one reading of every sensor
+static std::string telemetry()
+{
+    std::string json = "{\"ts\":1718000000,\"device\":\"esp32-01\",\"fw\":\"2.4.1\",\"rssi\":-61,\"sensors\":[";
+    for (int i = 0; i < 12; i++)
+    {
+        char reading[96];
+        snprintf(reading, sizeof(reading), "%s{\"id\":\"s%02d\",\"type\":\"%s\",\"value\":%.2f}", i > 0 ? "," : "", i, i % 3 == 0 ? "temperature" : i % 3 == 1 ? "humidity" : "pressure", (nextRandom() % 100000) / 100.0);
+        json += reading;
+    }
+    return json + "]}";
+}
+
+// devices/esp32-01/diagnostics: heap, tasks and their stack high water marks
+static std::string diagnostics()
+{
+    static const char* tasks[] = { "mqtt_task", "wifi", "tiT", "esp_timer", "loopTask", "sensor_poll", "ota", "IDLE0", "IDLE1", "ipc0", "ipc1", "sys_evt" };
+    std::string json = "{\"uptime\":864123,\"heap\":{\"free\":154320,\"minFree\":98304,\"largest\":65536},\"tasks\":[";
+    for (int round = 0; round < 4; round++)
+    {
+        for (int i = 0; i < 12; i++)
+        {
+            char task[160];
+            snprintf(task, sizeof(task), "%s{\"name\":\"%s\",\"core\":%d,\"priority\":%u,\"stackFree\":%u,\"cpu\":%.1f,\"state\":\"%s\"}", round + i > 0 ? "," : "", tasks[i], i % 2, nextRandom() % 24, 512 + nextRandom() % 4096, (nextRandom() % 1000) / 10.0, nextRandom() % 4 == 0 ? "running" : "blocked");
+            json += task;
+        }
+    }
+    return json + "]}";
+}
+
+// devices/esp32-01/logs: a bundle of esp-idf log lines
+static std::string logBundle()
+{
+    static const char* lines[] = {
+        "I (%u) wifi:connected with plant-ap, aid = %u, channel 6, BW20, bssid = 24:5a:4c:12:9e:%02x",
+        "I (%u) mqtt: published %u bytes to devices/esp32-01/telemetry",
+        "W (%u) sensor: retry %u reading the humidity sensor on i2c port 0",
+        "I (%u) esp_netif_handlers: sta ip: 10.20.%u.%u, mask: 255.255.255.0, gw: 10.20.0.1",
+        "E (%u) ota: download of chunk %u failed, status %u",
+    };
+    std::string text;
+    while (text.size() < 8000)
+    {
+        char line[160];
+        snprintf(line, sizeof(line), lines[nextRandom() % 5], nextRandom() % 10000000, nextRandom() % 256, nextRandom() % 256);
+        text += line;
+        text += '\n';
+    }
+    return text;
+}
+
+// ota/manifest/esp32: files with their SHA-256, the hashes don't compress
+static std::string otaManifest()
+{
+    std::string json = "{\"version\":\"2.5.0\",\"files\":[";
+    for (int i = 0; i < 24; i++)
+    {
+        char hash[65];
+        for (int j = 0; j < 64; j++)
+            hash[j] = "0123456789abcdef"[nextRandom() % 16];
+        hash[64] = '\0';
+        char file[192];
+        snprintf(file, sizeof(file), "%s{\"path\":\"/spiffs/www/asset-%02d.js.gz\",\"size\":%u,\"sha256\":\"%s\"}", i > 0 ? "," : "", i, 1024 + nextRandom() % 65536, hash);
+        json += file;
+    }
+    return json + "]}";
+}
+
+// devices/esp32-01/vibration: 16-bit accelerometer samples, a sine with noise
+static std::string vibration()
+{
+    std::string samples(2048, '\0');
+    for (size_t i = 0; i < samples.size(); i += 2)
+    {
+        int16_t value = (int16_t)(2000 * sin(i * 0.05) + (int)(nextRandom() % 64) - 32);
+        memcpy(&samples[i], &value, 2);
+    }
+    return samples;
+}
+
+// an encrypted or already compressed payload
+static std::string encrypted()
+{
+    std::string data(4096, '\0');
+    for (char& c : data)
+        c = (char)nextRandom();
+    return data;
+}
+
+static size_t clientHeap(size_t maxMessageSize)
+{
+    size_t before = ESP32_MQTTHostHeap::getUsedBytes();
+    ESP32_MQTTClient* client = new ESP32_MQTTClient();
+    client->setBrokerUri("mqtt://127.0.0.1:1");
+    if (maxMessageSize > 0)
+        client->enableCompression("bench/#", maxMessageSize);
+    client->createClient();
+    size_t used = ESP32_MQTTHostHeap::getUsedBytes() - before;
+    delete client;
+    return used;
+}
+
+static void row(const char* name, const std::string& payload, size_t kbPerPayload)
+{
+    ESP32_MQTTCompressor compressor;
+    compressor.init();
+    std::vector<uint8_t> compressed(ESP32_MQTTCompressor::getMaxCompressedSize(payload.size()));
+    std::vector<uint8_t> decompressed(payload.size());
+    size_t compressedLen = compressor.compress((const uint8_t*)payload.data(), payload.size(), compressed.data(), compressed.size());
+
+    int iterations = (int)(kbPerPayload * 1024 / payload.size()) + 1;
+    double kb = iterations * payload.size() / 1024.0;
+    double start = threadCpuUs();
+    for (int i = 0; i < iterations; i++)
+        sink = sink + compressor.compress((const uint8_t*)payload.data(), payload.size(), compressed.data(), compressed.size());
+    double compressUs = (threadCpuUs() - start) / kb;
+    start = threadCpuUs();
+    for (int i = 0; i < iterations; i++)
+        sink = sink + ESP32_MQTTCompressor::decompress(compressed.data(), compressedLen, decompressed.data(), decompressed.size());
+    double decompressUs = (threadCpuUs() - start) / kb;
+
+    bool ok = ESP32_MQTTCompressor::decompress(compressed.data(), compressedLen, decompressed.data(), decompressed.size()) == (int)payload.size() && memcmp(decompressed.data(), payload.data(), payload.size()) == 0;
+    size_t ram = clientHeap(payload.size()) - clientHeap(0);
+    printf("%-12s %8u %8u %6.2f %-7s %12.2f %12.2f %10.0f\n", name, (unsigned int)payload.size(), (unsigned int)compressedLen, (double)payload.size() / compressedLen,
+        compressed[0] == 1 ? "lz4" : "stored", compressUs, decompressUs, ram / (payload.size() / 1024.0));
+    if (!ok)
+        printf("%s: round trip failed\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    size_t kbPerPayload = argc > 1 ? atoi(argv[1]) : 16384;
+
+    printf("%-12s %8s %8s %6s %-7s %12s %12s %10s\n", "payload", "bytes", "sent", "ratio", "method", "comp us/KB", "decomp us/KB", "RAM B/KB");
+    row("telemetry", telemetry(), kbPerPayload);
+    row("diagnostics", diagnostics(), kbPerPayload);
+    row("log bundle", logBundle(), kbPerPayload);
+    row("ota manifest", otaManifest(), kbPerPayload);
+    row("vibration", vibration(), kbPerPayload);
+    row("encrypted", encrypted(), kbPerPayload);
+    return 0;
+}
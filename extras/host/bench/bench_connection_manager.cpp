@@ -0,0 +1,192 @@
+// Two broker connections bridging a plant broker to a cloud broker, as two clients with their own dispatch tasks and
+// reassembly buffers and as an ESP32_MQTTConnectionManager sharing them: memory, forwarding latency and throughput.
+// bench_connection_manager [messages per second] [saturation messages per second]
+// A producer publishes to the plant broker, the bridge forwards plant/# to site-42/plant/# on the cloud broker, where a
+// consumer measures the latency from the producer's publish(). Both setups use a 16 event queue and 2 x 8 KB reassembly.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTConnectionManager.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const int LatencyMessages = 4000;
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+struct Endpoint
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> connected { 0 };
+    std::atomic<int> subscribed { 0 };
+
+    void start(ESP32_MQTTHostBroker& broker, const char* name)
+    {
+        client.setBrokerUri(broker.getUri());
+        client.setClientName(name);
+        client.onMqttConnected([this](int sessionPresent) { connected++; });
+        client.onMqttTopicSubscribed([this](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+        client.start();
+    }
+};
+
+// publishes count messages at messagesPerSecond, returns how many the producer accepted
+static uint32_t produce(ESP32_MQTTClient& producer, int count, unsigned int messagesPerSecond)
+{
+    uint8_t payload[64] = {};
+    uint32_t accepted = 0;
+    unsigned long intervalUs = 1000000 / messagesPerSecond;
+    unsigned long next = micros();
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t sentUs = micros();
+        memcpy(payload, &sentUs, sizeof(sentUs));
+        if (producer.publish("plant/line1/press/temperature", payload, sizeof(payload), 0, false) >= 0)
+            accepted++;
+        next += intervalUs;
+        while ((long)(next - micros()) > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+    return accepted;
+}
+
+static void run(bool manager, unsigned int messagesPerSecond, unsigned int saturationPerSecond)
+{
+    ESP32_MQTTHostBroker plantBroker, cloudBroker;
+    plantBroker.begin();
+    cloudBroker.begin();
+
+    std::mutex latenciesMutex;
+    std::vector<uint32_t> latenciesUs;
+    std::atomic<uint32_t> received(0);
+    Endpoint consumer;
+    consumer.client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        uint32_t sentUs;
+        memcpy(&sentUs, data, sizeof(sentUs));
+        received++;
+        std::lock_guard<std::mutex> lock(latenciesMutex);
+        latenciesUs.push_back(micros() - sentUs);
+    });
+    consumer.start(cloudBroker, "bench-cloud-consumer");
+    Endpoint producer;
+    producer.start(plantBroker, "bench-plant-producer");
+    if (!waitFor([&]() { return consumer.connected == 1 && producer.connected == 1; }, 5000))
+    {
+        printf("not connected to the loopback brokers\n");
+        exit(1);
+    }
+    consumer.client.subscribe("site-42/#", 0);
+
+    size_t heapBefore = ESP32_MQTTHostHeap::getUsedBytes();
+    size_t stacksBefore = ESP32_MQTTHostTasks::getStackBytes();
+    ESP32_MQTTConnectionManager* bridge = nullptr;
+    ESP32_MQTTClient* plant = nullptr;
+    ESP32_MQTTClient* cloud = nullptr;
+    if (manager)
+    {
+        bridge = new ESP32_MQTTConnectionManager();
+        int plantId = bridge->addConnection(plantBroker.getUri());
+        int cloudId = bridge->addConnection(cloudBroker.getUri());
+        bridge->enableSharedDispatch(16);
+        bridge->enableSharedReassembly(8192, 2);
+        bridge->addForwardingRule(plantId, "#", cloudId, 0, "plant/", "site-42/plant/");
+        bridge->start();
+        plant = bridge->getConnection(plantId);
+        cloud = bridge->getConnection(cloudId);
+    }
+    else
+    {
+        plant = new ESP32_MQTTClient();
+        cloud = new ESP32_MQTTClient();
+        plant->setBrokerUri(plantBroker.getUri());
+        cloud->setBrokerUri(cloudBroker.getUri());
+        for (ESP32_MQTTClient* client : { plant, cloud })
+        {
+            client->enableDispatchTask(16);
+            client->enableMessageReassembly(8192, 2);
+        }
+        plant->enableAutoResubscribe();
+        plant->subscribe("plant/#", 0, [cloud](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+            char forwarded[ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH + 1];
+            snprintf(forwarded, sizeof(forwarded), "site-42/%.*s", topicLen, topic);
+            cloud->publish(forwarded, (const uint8_t*)data, dataLen, 0, retain);
+        });
+        plant->start();
+        cloud->start();
+    }
+    // the client objects are left out, they are the same in both setups
+    size_t heap = ESP32_MQTTHostHeap::getUsedBytes() - heapBefore - (manager ? 0 : 2 * sizeof(ESP32_MQTTClient));
+    size_t stacks = ESP32_MQTTHostTasks::getStackBytes() - stacksBefore;
+    if (!waitFor([&]() { return plant->isConnected() && cloud->isConnected() && consumer.subscribed == 1; }, 5000))
+    {
+        printf("the bridge didn't connect\n");
+        exit(1);
+    }
+    delay(200);     // until the bridge subscription is acknowledged
+
+    produce(producer.client, LatencyMessages, messagesPerSecond);
+    waitFor([&]() { return received == (uint32_t)LatencyMessages; }, 2000);
+    std::vector<uint32_t> latencies;
+    {
+        std::lock_guard<std::mutex> lock(latenciesMutex);
+        latencies.swap(latenciesUs);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    if (latencies.empty())
+        latencies.push_back(0);
+
+    // a second at the higher rate, then until nothing more arrives
+    received = 0;
+    uint32_t offered = produce(producer.client, saturationPerSecond, saturationPerSecond);
+    uint32_t previous;
+    unsigned long drainStart = millis();
+    do
+    {
+        previous = received;
+        delay(200);
+    } while (received != previous && millis() - drainStart < 5000);
+
+    printf("%-20s %9zu %10zu %8u %8.1f %8.1f %9u %9u\n", manager ? "connection manager" : "two clients", heap, stacks, (unsigned int)latencies.size(),
+        latencies[latencies.size() / 2] / 1.0, latencies[latencies.size() * 99 / 100] / 1.0, offered, (uint32_t)received);
+
+    if (manager)
+    {
+        bridge->stop();
+        delete bridge;
+    }
+    else
+    {
+        plant->stop();
+        cloud->stop();
+        delete plant;
+        delete cloud;
+    }
+    producer.client.stop();
+    consumer.client.stop();
+    plantBroker.end();
+    cloudBroker.end();
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int messagesPerSecond = argc > 1 ? atoi(argv[1]) : 2000;
+    unsigned int saturationPerSecond = argc > 2 ? atoi(argv[2]) : 20000;
+
+    printf("plant/# forwarded to the cloud broker, latency at %u messages/s, then 1 s at %u messages/s\n", messagesPerSecond,
+        saturationPerSecond);
+    printf("%-20s %9s %10s %8s %8s %8s %9s %9s\n", "", "heap B", "stacks B", "latency", "p50 us", "p99 us", "offered", "forwarded");
+    run(false, messagesPerSecond, saturationPerSecond);
+    run(true, messagesPerSecond, saturationPerSecond);
+    return 0;
+}
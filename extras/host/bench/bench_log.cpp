@@ -0,0 +1,124 @@
+// Time per received message spent in the MQTT task at each log level, against formatting the old log_d line with
+// snprintf() for every message.
+// bench_log [bursts]
+// A task standing in for the MQTT task passes bursts of 16 DATA events with 200 byte payloads to a client that isn't
+// started, one burst per millisecond. The time is the median over the bursts. The log task prints to a counter.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTLog.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+static const int BurstSize = 16;
+
+static std::atomic<uint32_t> printedLines(0);
+static volatile int sink;
+
+struct Run
+{
+    int bursts;
+    bool eager;
+    char payload[200];
+    std::atomic<double> nsPerMessage;
+    std::atomic<bool> done;
+};
+
+static void mqttTask(void* arg)
+{
+    Run* run = (Run*)arg;
+    std::vector<double> perMessage;
+    int msgId = 0;
+    for (int burst = 0; burst < run->bursts; burst++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BurstSize; i++)
+        {
+            esp_mqtt_event_t event = {};
+            event.event_id = MQTT_EVENT_DATA;
+            event.msg_id = ++msgId;
+            event.qos = 1;
+            event.topic = (char*)"plant/line3/cell7/temperature";
+            event.topic_len = 29;
+            event.data = run->payload;
+            event.data_len = sizeof(run->payload);
+            event.total_data_len = sizeof(run->payload);
+            if (run->eager)
+            {
+                char line[512];
+                sink += snprintf(line, sizeof(line), "MQTT_EVENT_DATA, msg_id: %d, topic: %.*s, data: %.*s", event.msg_id, event.topic_len, event.topic, event.data_len, event.data);
+            }
+            ESP32_MQTTHostEvents::dispatch("bench-log", &event);
+        }
+        perMessage.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BurstSize);
+        vTaskDelay(1);
+    }
+    std::sort(perMessage.begin(), perMessage.end());
+    run->nsPerMessage = perMessage[perMessage.size() / 2];
+    run->done = true;
+    vTaskDelete(nullptr);
+}
+
+static double measure(int bursts, bool eager)
+{
+    Run run;
+    run.bursts = bursts;
+    run.eager = eager;
+    run.done = false;
+    for (size_t i = 0; i < sizeof(run.payload); i++)
+        run.payload[i] = i < 100 ? 'a' + i % 26 : (char)i;
+    TaskHandle_t task;
+    xTaskCreatePinnedToCore(mqttTask, "mqtt", 4096, &run, 5, &task, 0);
+    while (!run.done)
+        delay(2);
+    return run.nsPerMessage;
+}
+
+int main(int argc, char** argv)
+{
+    int bursts = argc > 1 ? atoi(argv[1]) : 2000;
+
+    ESP32_MQTTClient client;
+    client.setBrokerUri("mqtt://127.0.0.1:1");
+    client.setClientName("bench-log");
+    client.onMqttMessageReceived([](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {});
+    client.createClient();
+    ESP32_MQTTLog::setOutput([](const char* line, size_t length, void* context) { printedLines++; });
+
+    struct Case
+    {
+        const char* name;
+        ESP32_MQTTLogLevel connection;
+        ESP32_MQTTLogLevel data;
+        uint32_t sampleEvery;
+        bool eager;
+    };
+    const Case cases[] = {
+        { "all off", ESP32_MQTTLogLevel::None, ESP32_MQTTLogLevel::None, 1, false },
+        { "connection at Info", ESP32_MQTTLogLevel::Info, ESP32_MQTTLogLevel::None, 1, false },
+        { "data at Debug (topic, length)", ESP32_MQTTLogLevel::Info, ESP32_MQTTLogLevel::Debug, 1, false },
+        { "data at Verbose, every 16th payload", ESP32_MQTTLogLevel::Info, ESP32_MQTTLogLevel::Verbose, 16, false },
+        { "data at Verbose, every payload", ESP32_MQTTLogLevel::Info, ESP32_MQTTLogLevel::Verbose, 1, false },
+        { "snprintf() of the old log_d line", ESP32_MQTTLogLevel::None, ESP32_MQTTLogLevel::None, 1, true },
+    };
+
+    measure(200, false);    // warm-up
+    printf("%d bursts of %d DATA events, 200 byte payloads, payloads cut to 32 bytes\n", bursts, BurstSize);
+    printf("%-36s %12s %8s %8s\n", "", "ns/message", "lines", "dropped");
+    for (const Case& c : cases)
+    {
+        ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+        ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Connection, c.connection);
+        ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Data, c.data);
+        ESP32_MQTTLog::setPayloadLogging(32, c.sampleEvery);
+        uint32_t linesBefore = printedLines;
+        uint32_t dropsBefore = ESP32_MQTTLog::getDropCount();
+        double ns = measure(bursts, c.eager);
+        delay(5 * ESP32_MQTT_LOG_FLUSH_MS);
+        printf("%-36s %12.1f %8u %8u\n", c.name, ns, (uint32_t)printedLines - linesBefore, ESP32_MQTTLog::getDropCount() - dropsBefore);
+    }
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+    ESP32_MQTTLog::setOutput(nullptr);
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Latency of alarms sent with publishAsync() behind saturating telemetry, with all messages in one queue and with the
+// alarms in a traffic class of weight 8.
+// bench_publish_classes [messages per second] [alarms]
+// Four producers keep the telemetry queue full, an alarm is published every 5 ms. The rate limit stands in for a slow
+// uplink. The latency is measured from publishAsync() until a subscriber on the loopback broker receives the alarm.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+static void run(ESP32_MQTTHostBroker& broker, bool alarmClass, unsigned int messagesPerSecond, int alarms)
+{
+    std::mutex latenciesMutex;
+    std::vector<uint32_t> latenciesUs;
+    ESP32_MQTTClient subscriber;
+    std::atomic<int> subscribed(0);
+    subscriber.setBrokerUri(broker.getUri());
+    subscriber.setClientName("bench-classes-subscriber");
+    subscriber.onMqttConnected([&](int sessionPresent) { subscriber.subscribe("alarm/#", 0); });
+    subscriber.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    subscriber.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        uint32_t sentUs;
+        memcpy(&sentUs, data, sizeof(sentUs));
+        std::lock_guard<std::mutex> lock(latenciesMutex);
+        latenciesUs.push_back(micros() - sentUs);
+    });
+    subscriber.start();
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("bench-classes");
+    client.enableAsyncPublish(256, 128, ESP32_MQTTQueueFullPolicy::Block, 1000);
+    client.setPublishRateLimit(messagesPerSecond, 20);
+    if (alarmClass)
+        client.addPublishClassTopic(client.addPublishClass(8, 32), "alarm/#");
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.start();
+    if (!waitFor([&]() { return connected == 1 && subscribed == 1; }, 5000))
+    {
+        printf("not connected to the loopback broker\n");
+        exit(1);
+    }
+
+    uint32_t packetsBefore = broker.getReceivedCount(3);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < 4; i++)
+    {
+        producers.emplace_back([&]() {
+            uint8_t payload[64] = {};
+            while (!stop)
+                client.publishAsync("telemetry/esp32-01/samples", payload, sizeof(payload));
+        });
+    }
+    unsigned long start = millis();
+    for (int i = 0; i < alarms; i++)
+    {
+        uint32_t sentUs = micros();
+        client.publishAsync("alarm/esp32-01/overheat", (const uint8_t*)&sentUs, sizeof(sentUs));
+        delay(5);
+    }
+    unsigned long elapsed = millis() - start;
+    waitFor([&]() {
+        std::lock_guard<std::mutex> lock(latenciesMutex);
+        return (int)latenciesUs.size() == alarms;
+    }, 5000);
+    stop = true;
+    for (std::thread& producer : producers)
+        producer.join();
+    uint32_t packets = broker.getReceivedCount(3) - packetsBefore;
+    client.stop();
+    subscriber.stop();
+
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    if (latenciesUs.empty())
+        latenciesUs.push_back(0);
+    printf("%-22s %8zu %10.2f %10.2f %10.2f %12.0f\n", alarmClass ? "alarm class weight 8" : "single queue", latenciesUs.size(),
+        latenciesUs[latenciesUs.size() / 2] / 1000.0, latenciesUs[latenciesUs.size() * 99 / 100] / 1000.0, latenciesUs.back() / 1000.0,
+        packets * 1000.0 / std::max(1UL, elapsed));
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int messagesPerSecond = argc > 1 ? atoi(argv[1]) : 2000;
+    int alarms = argc > 2 ? atoi(argv[2]) : 400;
+
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+    printf("4 telemetry producers, an alarm every 5 ms, %u messages/s, 256 queue slots\n", messagesPerSecond);
+    printf("%-22s %8s %10s %10s %10s %12s\n", "", "alarms", "p50 ms", "p99 ms", "max ms", "messages/s");
+    run(broker, false, messagesPerSecond, alarms);
+    run(broker, true, messagesPerSecond, alarms);
+    broker.end();
+    return 0;
+}
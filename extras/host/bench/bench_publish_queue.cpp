@@ -0,0 +1,122 @@
+// Caller latency of publish() against publishAsync() with each queue full policy, for 1 to 8 producer tasks.
+// bench_publish_queue [socket write us] [messages per producer]
+// esp_mqtt_client_publish() is modelled as a socket write of a fixed duration under the client lock, each producer publishes
+// one message per ms. The queue has 32 slots and one sender task takes the messages out and does the write.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTPublishQueue.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static std::mutex clientLock;
+static int socketWriteUs;
+
+static void socketWrite()
+{
+    std::lock_guard<std::mutex> lock(clientLock);
+    std::this_thread::sleep_for(std::chrono::microseconds(socketWriteUs));
+}
+
+static double percentileUs(std::vector<uint32_t>& latenciesNs, double percentile)
+{
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+    return latenciesNs[(size_t)(percentile * (latenciesNs.size() - 1))] / 1000.0;
+}
+
+// runs the producers, publish(producer, sequence) returns true if the message was accepted
+template<typename Publish>
+static std::vector<uint32_t> runProducers(int producers, int messages, Publish publish)
+{
+    std::vector<std::vector<uint32_t>> latencies(producers);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&, p]() {
+            Clock::time_point next = Clock::now();
+            for (int i = 0; i < messages; i++)
+            {
+                next += std::chrono::milliseconds(1);
+                Clock::time_point start = Clock::now();
+                publish(p, i);
+                latencies[p].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::vector<uint32_t> all;
+    for (std::vector<uint32_t>& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    return all;
+}
+
+int main(int argc, char** argv)
+{
+    socketWriteUs = argc > 1 ? atoi(argv[1]) : 200;
+    int messages = argc > 2 ? atoi(argv[2]) : 2000;
+    const char* policyNames[] = { "FailFast", "Block", "DropOldest" };
+
+    printf("socket write %d us, one message per ms per producer, %d messages each, 32 slots\n", socketWriteUs, messages);
+    printf("%-11s %9s %10s %10s %9s %s\n", "", "producers", "p50 us", "p99 us", "dropped", "order");
+    for (int producers : { 1, 4, 8 })
+    {
+        std::vector<uint32_t> latencies = runProducers(producers, messages, [](int p, int i) { socketWrite(); });
+        printf("%-11s %9d %10.1f %10.1f %9s\n", "publish()", producers, percentileUs(latencies, 0.5), percentileUs(latencies, 0.99), "-");
+
+        for (int policy = 0; policy < 3; policy++)
+        {
+            ESP32_MQTTPublishQueue queue;
+            queue.init(32, 256);
+            std::atomic<bool> done(false);
+            std::vector<int> last(producers, -1);
+            bool inOrder = true;
+            std::thread sender([&]() {
+                ESP32_MQTTQueuedMessage message;
+                while (true)
+                {
+                    if (queue.claim(message))
+                    {
+                        int p, i;
+                        memcpy(&p, message.payload, sizeof(p));
+                        memcpy(&i, message.payload + sizeof(p), sizeof(i));
+                        if (i <= last[p])
+                            inOrder = false;
+                        last[p] = i;
+                        socketWrite();
+                        queue.release();
+                    }
+                    else if (done)
+                    {
+                        break;
+                    }
+                    else
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    }
+                }
+            });
+
+            latencies = runProducers(producers, messages, [&](int p, int i) {
+                uint8_t payload[64] = {};
+                memcpy(payload, &p, sizeof(p));
+                memcpy(payload + sizeof(p), &i, sizeof(i));
+                queue.push("devices/esp32-01/sensors/temperature", payload, sizeof(payload), 1, false, (ESP32_MQTTQueueFullPolicy)policy, 1000);
+            });
+            while (queue.getSize() > 0)
+                delay(1);
+            done = true;
+            sender.join();
+            printf("%-11s %9d %10.1f %10.1f %9u %s\n", policyNames[policy], producers, percentileUs(latencies, 0.5), percentileUs(latencies, 0.99),
+                queue.getDropCount(), inOrder ? "fifo" : "REORDERED");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+// publishStream() of 256 KB, 1 MB and 4 MB payloads at QoS 1 into a subscribeStream(..., segmented = true) sink on the
+// loopback broker: throughput and peak heap, with the default 1 KB and with an 8 KB out buffer.
+// bench_publish_stream [repeats]
+// MB/s runs from the call of publishStream() to the end of the stream in the receiving sink. The peak heap is the most
+// the process heap (sender, receiver and broker) grew above its level before the call, sampled every 100 us by a thread.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTStream.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+static std::atomic<size_t> received(0);
+static std::atomic<int> ended(0), endedOk(0);
+
+static ESP32_MQTTCallbackSink sink(
+    [](const char* topic, int topicLen, size_t totalLength) {
+        received = 0;
+        return true;
+    },
+    [](const uint8_t* data, size_t length, size_t offset) {
+        received += length;
+        return true;
+    },
+    [](bool ok) {
+        if (ok)
+            endedOk++;
+        ended++;
+    });
+
+// the payload is generated by the reader, as if it was read from a file
+static int reader(uint8_t* buf, size_t length, size_t offset)
+{
+    for (size_t i = 0; i < length; i++)
+        buf[i] = (uint8_t)((offset + i) * 31);
+    return (int)length;
+}
+
+static void row(ESP32_MQTTClient& sender, int outPacketSize, size_t length, int repeats)
+{
+    double bestMBps = 0;
+    long peakBytes = 0;
+    for (int i = 0; i < repeats; i++)
+    {
+        int endedBefore = ended;
+        long baseBytes = (long)ESP32_MQTTHostHeap::getUsedBytes();
+        std::atomic<long> peak(baseBytes);
+        std::atomic<bool> sampling(true);
+        std::thread sampler([&]() {
+            while (sampling)
+            {
+                long used = (long)ESP32_MQTTHostHeap::getUsedBytes();
+                if (used > peak)
+                    peak = used;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        });
+
+        unsigned long startUs = micros();
+        int result = sender.publishStream("bench/stream", length, reader, 1);
+        bool done = result == 0 && waitFor([&]() { return ended == endedBefore + 1; }, 30000);
+        unsigned long elapsedUs = std::max(1UL, micros() - startUs);
+        sampling = false;
+        sampler.join();
+        if (!done || endedOk != ended || received != length)
+        {
+            printf("%u KB with a %d byte out buffer failed, publishStream(): %d\n", (unsigned int)(length / 1024), outPacketSize, result);
+            return;
+        }
+        bestMBps = std::max(bestMBps, length / 1024.0 / 1024.0 / (elapsedUs / 1e6));
+        peakBytes = std::max(peakBytes, peak - baseBytes);
+    }
+    printf("%8u %10d %10.1f %14ld\n", (unsigned int)(length / 1024), outPacketSize, bestMBps, peakBytes);
+}
+
+int main(int argc, char** argv)
+{
+    int repeats = argc > 1 ? atoi(argv[1]) : 5;
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+
+    ESP32_MQTTClient receiver;
+    std::atomic<int> subscribed(0);
+    receiver.setBrokerUri(broker.getUri());
+    receiver.setClientName("bench-stream-receiver");
+    receiver.setMaxInPacketSize(8192);
+    receiver.onMqttConnected([&](int sessionPresent) { receiver.subscribeStream("bench/stream", 1, &sink, ESP32_MQTTStreamDigest::None, nullptr, true); });
+    receiver.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    receiver.start();
+    waitFor([&]() { return subscribed == 1; }, 5000);
+
+    printf("%8s %10s %10s %14s\n", "KB", "out buffer", "MB/s", "peak heap B");
+    for (int outPacketSize : { 1024, 8192 })
+    {
+        ESP32_MQTTClient sender;
+        std::atomic<int> connected(0);
+        sender.setBrokerUri(broker.getUri());
+        sender.setClientName("bench-stream-sender");
+        sender.setMaxOutPacketSize(outPacketSize);
+        sender.onMqttConnected([&](int sessionPresent) { connected++; });
+        sender.start();
+        waitFor([&]() { return connected == 1; }, 5000);
+        // the first stream of a client allocates what stays allocated, such as outbox entries
+        int endedBefore = ended;
+        sender.publishStream("bench/stream", 64 * 1024, reader, 1);
+        waitFor([&]() { return ended == endedBefore + 1; }, 5000);
+        for (size_t length : { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 })
+            row(sender, outPacketSize, length, repeats);
+        sender.stop();
+    }
+
+    receiver.stop();
+    broker.end();
+    return 0;
+}
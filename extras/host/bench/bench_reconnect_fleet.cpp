@@ -0,0 +1,105 @@
+// Recovery of a fleet after a broker restart: every client reconnects either at a fixed interval (setReconnectTimeout())
+// or with ESP32_MQTTReconnectPolicy, against a broker accepting a limited number of connections per second.
+// bench_reconnect_fleet [clients] [accepts per second]
+// Simulated time in 10 ms ticks. Attempts above the accept rate are refused. When the attempts of one tick exceed
+// OverloadFactor times its budget the broker is overloaded and refuses all of them, like a broker knocked over again.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTReconnectPolicy.h>
+#include <functional>
+#include <queue>
+#include <vector>
+
+static const unsigned long TickMs = 10;
+static const unsigned long FixedDelayMs = 10000;
+static const int OverloadFactor = 20;
+static const unsigned long GiveUpMs = 30 * 60 * 1000;
+
+struct Result
+{
+    unsigned long recoveredMs;  // all clients connected, GiveUpMs if not
+    unsigned long attempts;
+    unsigned long peakAttemptsPerSecond;
+    unsigned int overloadedTicks;
+};
+
+// nextDelay(client, now) returns the delay after a refused attempt
+static Result simulate(int clients, int acceptsPerSecond, std::function<unsigned long(int, unsigned long)> nextDelay)
+{
+    typedef std::pair<unsigned long, int> Attempt;     // due time, client
+    std::priority_queue<Attempt, std::vector<Attempt>, std::greater<Attempt>> due;
+    for (int i = 0; i < clients; i++)
+        due.push({ nextDelay(i, 0), i });
+
+    Result result = {};
+    int connected = 0;
+    int budget = std::max(1, acceptsPerSecond * (int)TickMs / 1000);
+    unsigned long secondStart = 0, attemptsThisSecond = 0;
+    std::vector<int> attempting;
+    for (unsigned long now = 0; connected < clients && now < GiveUpMs; now += TickMs)
+    {
+        attempting.clear();
+        while (!due.empty() && due.top().first <= now)
+        {
+            attempting.push_back(due.top().second);
+            due.pop();
+        }
+
+        bool overloaded = (int)attempting.size() > budget * OverloadFactor;
+        if (overloaded)
+            result.overloadedTicks++;
+        int accepted = 0;
+        for (int client : attempting)
+        {
+            if (!overloaded && accepted < budget)
+            {
+                accepted++;
+                connected++;
+            }
+            else
+                due.push({ now + nextDelay(client, now), client });
+        }
+
+        result.attempts += attempting.size();
+        if (now - secondStart >= 1000)
+        {
+            secondStart = now;
+            attemptsThisSecond = 0;
+        }
+        attemptsThisSecond += attempting.size();
+        result.peakAttemptsPerSecond = std::max(result.peakAttemptsPerSecond, attemptsThisSecond);
+        result.recoveredMs = now;
+    }
+    if (connected < clients)
+        result.recoveredMs = GiveUpMs;
+    return result;
+}
+
+static void print(const char* name, const Result& result)
+{
+    if (result.recoveredMs >= GiveUpMs)
+        printf("%-28s %14s", name, "never");
+    else
+        printf("%-28s %14.1f", name, result.recoveredMs / 1000.0);
+    printf(" %10lu %16lu %15u\n", result.attempts, result.peakAttemptsPerSecond, result.overloadedTicks);
+}
+
+int main(int argc, char** argv)
+{
+    int clients = argc > 1 ? atoi(argv[1]) : 5000;
+    int acceptsPerSecond = argc > 2 ? atoi(argv[2]) : 500;
+
+    printf("%d clients disconnected by a broker restart, broker accepts %d connections/s\n", clients, acceptsPerSecond);
+    printf("%-28s %14s %10s %16s %15s\n", "reconnect", "recovered (s)", "attempts", "peak attempts/s", "overload ticks");
+
+    // all clients lost the connection at the same moment, so they retry in lockstep
+    print("fixed 10 s", simulate(clients, acceptsPerSecond, [](int client, unsigned long now) { return FixedDelayMs; }));
+
+    for (unsigned long baseDelayMs : { 1000UL, 5000UL })
+    {
+        std::vector<ESP32_MQTTReconnectPolicy> policies(clients, ESP32_MQTTReconnectPolicy(baseDelayMs, 60000, 30000));
+        char name[40];
+        snprintf(name, sizeof(name), "backoff %lu s..60 s, jitter", baseDelayMs / 1000);
+        print(name, simulate(clients, acceptsPerSecond, [&](int client, unsigned long now) { return policies[client].nextDelay(now); }));
+    }
+    return 0;
+}
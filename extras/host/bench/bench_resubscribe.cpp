@@ -0,0 +1,151 @@
+// Subscribing again to 200 topic filters after the broker restarted without sessions: restoreSubscriptions() of
+// enableAutoResubscribe() against an application calling esp_mqtt_client_subscribe() for every filter in its
+// MQTT_EVENT_CONNECTED handler.
+// bench_resubscribe [restarts]
+// The time runs from MQTT_EVENT_BEFORE_CONNECT of the connection that succeeds to the last SUBACK, so both include the
+// CONNECT/CONNACK round trip. Packets and bytes are what the broker received per restart, the CONNECT included.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+static const int Filters = 200;
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+static std::vector<std::string> filters;
+
+struct Run
+{
+    std::atomic<uint32_t> beforeConnectUs { 0 };
+    std::atomic<uint32_t> doneUs { 0 };
+    std::atomic<int> rounds { 0 };
+    std::atomic<int> connected { 0 };
+    std::atomic<int> subscribed { 0 };
+    std::vector<uint32_t> timesUs;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+};
+
+// one esp_mqtt_client_subscribe() per filter, the way an application restores its subscriptions in onMqttConnected
+static void rawEventHandler(void* arg, esp_event_base_t base, int32_t eventId, void* eventData)
+{
+    Run* run = static_cast<Run*>(arg);
+    esp_mqtt_event_handle_t event = static_cast<esp_mqtt_event_handle_t>(eventData);
+    if (eventId == MQTT_EVENT_BEFORE_CONNECT)
+        run->beforeConnectUs = micros();
+    else if (eventId == MQTT_EVENT_CONNECTED)
+    {
+        run->subscribed = 0;
+        for (const std::string& filter : filters)
+            esp_mqtt_client_subscribe(event->client, filter.c_str(), 1);
+        run->connected++;
+    }
+    else if (eventId == MQTT_EVENT_SUBSCRIBED && ++run->subscribed == Filters)
+    {
+        run->doneUs = micros();
+        run->rounds++;
+    }
+}
+
+// restarts the broker on the same port until the client has subscribed again restarts times
+static void restart(ESP32_MQTTHostBroker& broker, Run& run, int restarts)
+{
+    uint16_t port = broker.getPort();
+    for (int i = 0; i < restarts; i++)
+    {
+        int rounds = run.rounds;
+        uint32_t packets = broker.getReceivedCount(8);
+        uint64_t bytes = broker.getReceivedBytes();
+        broker.end();
+        broker.begin(port);
+        if (!waitFor([&]() { return run.rounds == rounds + 1; }, 10000))
+        {
+            printf("restart %d: the subscriptions were not restored\n", i);
+            return;
+        }
+        run.timesUs.push_back(run.doneUs - run.beforeConnectUs);
+        run.packets += broker.getReceivedCount(8) - packets;
+        run.bytes += broker.getReceivedBytes() - bytes;
+    }
+}
+
+static void report(const char* name, Run& run)
+{
+    std::vector<uint32_t>& times = run.timesUs;
+    if (times.empty())
+        return;
+    std::sort(times.begin(), times.end());
+    uint64_t sum = 0;
+    for (uint32_t time : times)
+        sum += time;
+    printf("%-36s %10.0f %10u %10u %12.1f %10.0f\n", name, (double)sum / times.size(), times[times.size() / 2], times.back(),
+        (double)run.packets / times.size(), (double)run.bytes / times.size());
+}
+
+int main(int argc, char** argv)
+{
+    int restarts = argc > 1 ? atoi(argv[1]) : 20;
+    for (int i = 0; i < Filters; i++)
+        filters.push_back("site-42/line" + std::to_string(i / 10) + "/machine" + std::to_string(i % 10) + "/+");
+
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+
+    Run restored;
+    {
+        ESP32_MQTTClient client;
+        client.setBrokerUri(broker.getUri());
+        client.setClientName("bench-resubscribe");
+        client.setReconnectTimeout(100);
+        client.enableAutoResubscribe();
+        client.onMqttBeforeConnect([&]() { restored.beforeConnectUs = micros(); });
+        client.onMqttConnected([&](int sessionPresent) { restored.connected++; });
+        client.onMqttSubscriptionsRestored([&](int subscribedCount, int failedCount) {
+            restored.doneUs = micros();
+            restored.subscribed = subscribedCount;
+            restored.rounds++;
+        });
+        client.start();
+        waitFor([&]() { return restored.connected == 1; }, 5000);
+        for (const std::string& filter : filters)
+            client.subscribe(filter.c_str(), 1);
+        waitFor([&]() { return client.getSubscriptionGrantedQos(filters.back().c_str()) == 1; }, 5000);
+        restart(broker, restored, restarts);
+        client.stop();
+    }
+
+    Run single;
+    {
+        esp_mqtt_client_config_t config = {};
+        config.broker.address.uri = broker.getUri();
+        config.credentials.client_id = "bench-resubscribe-single";
+        config.network.reconnect_timeout_ms = 100;
+        esp_mqtt_client_handle_t client = esp_mqtt_client_init(&config);
+        esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, rawEventHandler, &single);
+        esp_mqtt_client_start(client);
+        waitFor([&]() { return single.rounds == 1; }, 5000);
+        restart(broker, single, restarts);
+        esp_mqtt_client_stop(client);
+        esp_mqtt_client_destroy(client);
+    }
+    broker.end();
+
+    printf("%d filters, %d broker restarts\n", Filters, restarts);
+    printf("%-36s %10s %10s %10s %12s %10s\n", "", "mean us", "p50 us", "max us", "SUBSCRIBEs", "bytes");
+    report("restoreSubscriptions()", restored);
+    report("esp_mqtt_client_subscribe() x 200", single);
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Retained publishes suppressed by ESP32_MQTTRetainedCache for a device publishing 200 retained topics every 10 s for an
+// hour: 120 noisy temperatures, 40 status strings which rarely change and 40 static configurations.
+// bench_retained_cache [time scale]
+// The cache reads millis(), so the hour runs in simulated time shortened by the time scale (default 1000: a 10 s cycle
+// takes 10 ms, the 15 min refresh interval 900 ms). The check() time excludes the waits between cycles.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTRetainedCache.h>
+#include <chrono>
+#include <random>
+#include <string.h>
+
+static const int Cycles = 360;
+static const unsigned long CycleMs = 10000;
+
+static void run(size_t capacity, float deadband, unsigned long refreshIntervalMs, unsigned long timeScale)
+{
+    ESP32_MQTTRetainedCache cache;
+    cache.init(capacity, refreshIntervalMs / timeScale);
+
+    std::mt19937 rng(1);
+    std::normal_distribution<float> noise(0, 0.05f);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    float temperatures[120];
+    for (int i = 0; i < 120; i++)
+        temperatures[i] = 20 + i % 5;
+    int states[40] = {};
+    const char* stateNames[] = { "online", "idle", "busy" };
+
+    char topic[64], payload[128];
+    uint32_t sent = 0;
+    double checkNs = 0;
+    unsigned long start = millis();
+    for (int cycle = 0; cycle < Cycles; cycle++)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            float topicDeadband = 0;
+            if (i < 120)
+            {
+                // slow drift plus sensor noise
+                temperatures[i] += 0.002f + noise(rng) * 0.2f;
+                snprintf(topic, sizeof(topic), "site/dev%03d/temperature", i);
+                snprintf(payload, sizeof(payload), "%.2f", temperatures[i] + noise(rng));
+                topicDeadband = deadband;
+            }
+            else if (i < 160)
+            {
+                if (uniform(rng) < 0.01f)
+                    states[i - 120] = (states[i - 120] + 1) % 3;
+                snprintf(topic, sizeof(topic), "site/dev%03d/status", i);
+                snprintf(payload, sizeof(payload), "%s", stateNames[states[i - 120]]);
+            }
+            else
+            {
+                snprintf(topic, sizeof(topic), "site/dev%03d/config", i);
+                snprintf(payload, sizeof(payload), "{\"interval\":10,\"unit\":\"C\",\"fw\":\"1.4.2\",\"id\":%d}", i);
+            }
+
+            auto checkStart = std::chrono::steady_clock::now();
+            if (cache.check(topic, (const uint8_t*)payload, strlen(payload), topicDeadband))
+                sent++;
+            checkNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - checkStart).count();
+        }
+        // the next cycle starts CycleMs of simulated time after this one
+        unsigned long next = start + (cycle + 1) * CycleMs / timeScale;
+        while ((long)(next - millis()) > 0)
+            delay(1);
+    }
+
+    char refresh[16] = "never";
+    if (refreshIntervalMs > 0)
+        snprintf(refresh, sizeof(refresh), "%lu min", refreshIntervalMs / 60000);
+    printf("%8zu %9.2f %9s %8u %8u %11.1f %7zu %8.0f\n", capacity, deadband, refresh, cache.getCheckedCount(), sent,
+        100.0 * cache.getSuppressedCount() / cache.getCheckedCount(), cache.getMemoryUsage(), checkNs / cache.getCheckedCount());
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long timeScale = argc > 1 ? atol(argv[1]) : 1000;
+
+    printf("200 retained topics every 10 s for an hour, time scaled 1:%lu\n", timeScale);
+    printf("%8s %9s %9s %8s %8s %11s %7s %8s\n", "capacity", "deadband", "refresh", "checked", "sent", "suppressed%", "bytes", "ns/check");
+    run(256, 0, 0, timeScale);
+    run(256, 0, 15 * 60000, timeScale);
+    run(256, 0.2f, 15 * 60000, timeScale);
+    run(256, 0.5f, 15 * 60000, timeScale);
+    // smaller than the number of topics: publishing them in turn evicts every entry before it is used again
+    run(128, 0.2f, 15 * 60000, timeScale);
+    return 0;
+}
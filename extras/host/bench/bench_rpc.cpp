@@ -0,0 +1,90 @@
+// Round-trip latency and throughput of RPC calls against an echo server on the loopback broker, with 1 to 256 calls
+// kept in flight. The server runs in the same client, so a call is two PUBLISH packets through the broker.
+// bench_rpc [calls per run] [payload bytes] [qos]
+// The percentiles are upper bounds of the histogram buckets (getLatency()).
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTRpc.h>
+#include <atomic>
+#include <string>
+#include <unistd.h>
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 5000;
+    int payloadSize = argc > 2 ? atoi(argv[2]) : 64;
+    int qos = argc > 3 ? atoi(argv[3]) : 0;
+
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("bench-rpc");
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.start();
+    if (!waitFor([&]() { return client.isConnected(); }, 5000))
+    {
+        printf("not connected to the loopback broker\n");
+        return 1;
+    }
+
+    ESP32_MQTTRpc server(client);
+    server.begin("bench/rpc/server-reply", 1, qos);
+    server.serve("bench/rpc/echo", [](ESP32_MQTTRpcRequest& request) { request.reply(request.payload, request.length); });
+    waitFor([&]() { return subscribed == 2; }, 5000);
+
+    std::string payload(payloadSize, 'x');
+    printf("%d calls per run, %d byte payload, QoS %d\n", calls, payloadSize, qos);
+    printf("%9s %10s %10s %10s %10s %11s %9s\n", "in flight", "calls/s", "p50 us", "p99 us", "max us", "max pending", "timeouts");
+    for (int window : { 1, 8, 64, 256 })
+    {
+        ESP32_MQTTRpc rpc(client);
+        int before = subscribed;
+        rpc.begin("bench/rpc/reply", window, qos);
+        waitFor([&]() { return subscribed == before + 1; }, 5000);
+
+        std::atomic<int> completed(0), failed(0);
+        ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler = [&](ESP32_MQTTRpcStatus status, const uint8_t* data, size_t length) {
+            if (status != ESP32_MQTTRpcStatus::Ok || length != (size_t)payloadSize)
+                failed++;
+            completed++;
+        };
+
+        unsigned long start = millis();
+        int sent = 0;
+        while (sent < calls)
+        {
+            // a new call as soon as one of the window completed
+            if (rpc.call("bench/rpc/echo", (const uint8_t*)payload.data(), payload.size(), 10000, handler) >= 0)
+                sent++;
+            else
+                usleep(50);
+        }
+        waitFor([&]() { return completed == calls; }, 30000);
+        unsigned long elapsed = std::max(1UL, millis() - start);
+
+        ESP32_MQTTHistogramSnapshot latency;
+        rpc.getLatency(latency);
+        printf("%9d %10.0f %10u %10u %10u %11u %9lu%s\n", window, calls * 1000.0 / elapsed, latency.p50Us, latency.p99Us, latency.maxUs,
+            (unsigned)rpc.getMaxPendingCount(), rpc.getTimeoutCount(), failed == 0 ? "" : "  (failed calls)");
+        rpc.end();
+    }
+
+    server.end();
+    client.stop();
+    broker.end();
+    return 0;
+}
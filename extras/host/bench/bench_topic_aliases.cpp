@@ -0,0 +1,41 @@
+// Topic and header bytes of QoS 0 publishes with 8, 16 and 32 topic aliases against sending the full topic.
+// bench_topic_aliases [publishes] [hot topic percent]
+// 32 topics of about 50 bytes, the given share of the publishes goes to 8 hot topics. Counted per PUBLISH: the topic length
+// field, the topic, the alias property (3 bytes) and 8 bytes for the fixed header and the property length.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTTopicAliasTable.h>
+#include <random>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    int publishes = argc > 1 ? atoi(argv[1]) : 100000;
+    int hotPercent = argc > 2 ? atoi(argv[2]) : 80;
+
+    std::vector<std::string> topics;
+    for (int device = 0; device < 4; device++)
+        for (const char* metric : { "temperature", "humidity", "pressure", "co2", "voltage", "current", "power", "energy" })
+            topics.push_back("site/plant-7/line-3/device-ab1" + std::to_string(device) + "/sensor/" + metric);
+
+    printf("%d publishes over %zu topics, %d%% to 8 hot topics\n", publishes, topics.size(), hotPercent);
+    printf("%8s %14s %14s %8s %10s\n", "aliases", "bytes full", "bytes aliased", "saved", "hits");
+    for (int capacity : { 8, 16, 32 })
+    {
+        ESP32_MQTTTopicAliasTable table;
+        table.init(capacity);
+        std::mt19937 random(3);
+        size_t fullBytes = 0, sentBytes = 0;
+        for (int i = 0; i < publishes; i++)
+        {
+            const std::string& topic = (int)(random() % 100) < hotPercent ? topics[random() % 8] : topics[random() % topics.size()];
+            bool established;
+            uint16_t alias = table.getAlias(topic.c_str(), topic.size(), established);
+            table.confirm(alias);
+            fullBytes += 2 + topic.size() + 8;
+            sentBytes += 2 + (established ? 0 : topic.size()) + (alias != 0 ? 3 : 0) + 8;
+        }
+        printf("%8d %14zu %14zu %7.1f%% %10u\n", capacity, fullBytes, sentBytes, 100.0 * (fullBytes - sentBytes) / fullBytes, table.getHitCount());
+    }
+    return 0;
+}
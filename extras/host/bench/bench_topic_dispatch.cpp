@@ -0,0 +1,108 @@
+// Dispatch cost per message of the topic trie against a linear scan of the filters (strncmp for plain filters,
+// ESP32_MQTTTopicTrie::matches() for wildcard ones), for 10, 100 and 1000 subscribed filters.
+// bench_topic_dispatch [topic file]
+// The topic file holds one captured topic per line, without it a stream of sensor topics is generated.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTTopicTrie.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static const int Rounds = 20;
+
+struct Filter
+{
+    std::string filter;
+    bool wildcard;
+};
+
+// one route per device level, every 10th as a wildcard subscription to all metrics of the device
+static std::vector<Filter> createFilters(int count)
+{
+    std::vector<Filter> filters;
+    for (int i = 0; i < count; i++)
+    {
+        std::string device = "site/" + std::to_string(i / 100) + "/device/" + std::to_string(i % 100);
+        if (i % 10 == 9)
+            filters.push_back({ "site/" + std::to_string(i / 100) + "/+/" + std::to_string(i % 100) + "/#", true });
+        else
+            filters.push_back({ device + "/temperature", false });
+    }
+    return filters;
+}
+
+static std::vector<std::string> createTopics(int filterCount, int count)
+{
+    static const char* metrics[] = { "temperature", "humidity", "battery" };
+    std::vector<std::string> topics;
+    uint32_t seed = 1;
+    for (int i = 0; i < count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int device = (seed >> 8) % (filterCount * 2);   // half of the topics match no filter
+        topics.push_back("site/" + std::to_string(device / 100) + "/device/" + std::to_string(device % 100) + "/" + metrics[(seed >> 4) % 3]);
+    }
+    return topics;
+}
+
+static void countMatch(int routeId, void* context)
+{
+    (*(uint64_t*)context) += routeId + 1;
+}
+
+template<typename Dispatch>
+static double measure(const std::vector<std::string>& topics, Dispatch dispatch)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < Rounds; round++)
+        for (const std::string& topic : topics)
+            dispatch(topic);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (Rounds * topics.size());
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> captured;
+    if (argc > 1)
+    {
+        std::ifstream file(argv[1]);
+        std::string line;
+        while (std::getline(file, line))
+            if (!line.empty())
+                captured.push_back(line);
+    }
+
+    printf("%8s %14s %14s\n", "filters", "trie ns/msg", "linear ns/msg");
+    for (int filterCount : { 10, 100, 1000 })
+    {
+        std::vector<Filter> filters = createFilters(filterCount);
+        std::vector<std::string> topics = captured.empty() ? createTopics(filterCount, 10000) : captured;
+
+        ESP32_MQTTTopicTrie trie;
+        for (size_t i = 0; i < filters.size(); i++)
+            trie.insert(filters[i].filter.c_str(), i);
+
+        // the checksums keep the compiler from dropping the loops and show both dispatch the same routes
+        uint64_t trieSum = 0;
+        double trieNs = measure(topics, [&](const std::string& topic) {
+            trie.match(topic.data(), topic.size(), countMatch, &trieSum);
+        });
+
+        uint64_t linearSum = 0;
+        double linearNs = measure(topics, [&](const std::string& topic) {
+            for (size_t i = 0; i < filters.size(); i++)
+            {
+                const Filter& f = filters[i];
+                bool matched = f.wildcard ? ESP32_MQTTTopicTrie::matches(f.filter.c_str(), topic.data(), topic.size())
+                    : f.filter.size() == topic.size() && strncmp(f.filter.c_str(), topic.data(), topic.size()) == 0;
+                if (matched)
+                    countMatch(i, &linearSum);
+            }
+        });
+
+        printf("%8d %14.1f %14.1f%s\n", filterCount, trieNs, linearNs, trieSum == linearSum ? "" : "  (routes differ)");
+    }
+    return 0;
+}
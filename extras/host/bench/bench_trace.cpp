@@ -0,0 +1,152 @@
+// Cost of tracing and the timeline of a QoS 1 message. bench_trace is built with ESP32_MQTTCLIENT_TRACING_ENABLED,
+// bench_trace_disabled without it, for the cost of the trace points in publish().
+// bench_trace [trace.json]
+// The client publishes to itself on the loopback broker with a dispatch task. The trace of the last messages is written
+// to the file, for chrome://tracing or ui.perfetto.dev.
+#include <ESP32_MQTTHost.h>
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTTrace.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+static const int Rounds = 200;
+static const int PerRound = 100;
+
+static volatile unsigned long sink;
+
+static bool waitFor(std::function<bool()> condition, unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
+
+// median over the rounds of the time per call, the esp-mqtt task runs in between
+template<typename Function>
+static double measure(Function function)
+{
+    std::vector<double> perCall;
+    for (int round = 0; round < Rounds; round++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < PerRound; i++)
+            function(i);
+        perCall.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / PerRound);
+        delay(1);
+    }
+    std::sort(perCall.begin(), perCall.end());
+    return perCall[perCall.size() / 2];
+}
+
+static void collect(const char* text, size_t length, void* context)
+{
+    ((std::string*)context)->append(text, length);
+}
+
+int main(int argc, char** argv)
+{
+    ESP32_MQTTHostBroker broker;
+    broker.begin();
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), subscribed(0), received(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("bench-trace");
+    client.enableDispatchTask(64);
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) { received++; });
+    client.start();
+    if (!waitFor([&]() { return connected == 1; }, 5000))
+    {
+        printf("not connected to the loopback broker\n");
+        return 1;
+    }
+    client.subscribe("bench/trace/in", 1);
+    waitFor([&]() { return subscribed == 1; }, 5000);
+
+    printf("tracing %s, median of %d rounds of %d calls\n", ESP32_MQTTCLIENT_TRACING_ENABLED ? "enabled" : "disabled", Rounds, PerRound);
+    printf("micros()                      %8.1f ns\n", measure([](int i) { sink = sink + micros(); }));
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+    printf("trace point                   %8.1f ns\n", measure([](int i) {
+        ESP32_MQTT_TRACE_START(startUs);
+        ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Publish, i, 0, startUs);
+    }));
+#endif
+    printf("publish() QoS 0, 64 bytes     %8.1f ns\n", measure([&](int i) {
+        static const uint8_t payload[64] = {};
+        client.publish("bench/trace/out", payload, sizeof(payload), 0, false);
+    }));
+
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+    // a few QoS 1 messages to itself, one at a time, and the timeline of the last one
+    ESP32_MQTTTrace::clear();
+    ESP32_MQTT_TRACE_TASK_NAME(xTaskGetCurrentTaskHandle(), "producer");
+    int msgId = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        msgId = client.publish("bench/trace/in", "payload", 1, false);
+        waitFor([&]() { return received == i + 1; }, 1000);
+        delay(10);
+    }
+    std::string json;
+    size_t records = ESP32_MQTTTrace::dumpChromeJson(collect, &json);
+    printf("\nmessage %d, times relative to the start of publish():\n", msgId);
+    // the pieces of the JSON this bench needs, the rest is for the trace viewers
+    struct Step
+    {
+        long long ts;
+        std::string thread;
+        std::string name;
+        unsigned int dur;
+    };
+    std::vector<Step> steps;
+    char bind[32];
+    snprintf(bind, sizeof(bind), "\"bind_id\":\"0x%x\"", msgId);
+    size_t pos = 0;
+    while ((pos = json.find(bind, pos)) != std::string::npos)
+    {
+        size_t start = json.rfind(",{", pos);
+        std::string record = json.substr(start + 1, pos - start - 1);
+        std::string name = record.substr(9, record.find('"', 9) - 9);
+        long long ts = atoll(record.c_str() + record.find("\"ts\":") + 5);
+        unsigned int tid = atoi(record.c_str() + record.find("\"tid\":") + 6);
+        unsigned int dur = atoi(record.c_str() + record.find("\"dur\":") + 6);
+        char thread[64] = "?";
+        char threadKey[48];
+        snprintf(threadKey, sizeof(threadKey), "\"tid\":%u,\"args\":{\"name\":\"", tid);
+        size_t threadPos = json.find(threadKey);
+        if (threadPos != std::string::npos)
+        {
+            threadPos += strlen(threadKey);
+            snprintf(thread, sizeof(thread), "%s", json.substr(threadPos, json.find('"', threadPos) - threadPos).c_str());
+        }
+        steps.push_back({ ts, thread, name, dur });
+        pos++;
+    }
+    std::sort(steps.begin(), steps.end(), [](const Step& a, const Step& b) { return a.ts < b.ts; });
+    for (const Step& step : steps)
+        printf("  %-10s %-10s +%6lld us  %5u us\n", step.thread.c_str(), step.name.c_str(), step.ts - steps[0].ts, step.dur);
+    if (argc > 1)
+    {
+        FILE* file = fopen(argv[1], "w");
+        if (file != nullptr)
+        {
+            fwrite(json.data(), 1, json.size(), file);
+            fclose(file);
+            printf("%zu records written to %s\n", records, argv[1]);
+        }
+    }
+#endif
+
+    client.stop();
+    broker.end();
+    return 0;
+}
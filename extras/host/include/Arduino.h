@@ -0,0 +1,46 @@
+#pragma once
+
+// Host stand-in for the parts of arduino-esp32 the library uses, see ESP32_MQTTPlatform.h.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include "esp_err.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+// 0 none, 1 error, 2 warning, 3 info, 4 debug, 5 verbose, like CORE_DEBUG_LEVEL of arduino-esp32
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 1
+#endif
+
+// no format checking: the library prints size_t with %u, which is right on the 32 bit ESP32
+int log_printf(const char* format, ...);
+
+#define ESP32_MQTT_HOST_LOG(level, letter, format, ...) do { if (CORE_DEBUG_LEVEL >= level) log_printf("[%6lu][" letter "] " format "\r\n", millis(), ##__VA_ARGS__); } while (0)
+#define log_e(format, ...) ESP32_MQTT_HOST_LOG(1, "E", format, ##__VA_ARGS__)
+#define log_w(format, ...) ESP32_MQTT_HOST_LOG(2, "W", format, ##__VA_ARGS__)
+#define log_i(format, ...) ESP32_MQTT_HOST_LOG(3, "I", format, ##__VA_ARGS__)
+#define log_d(format, ...) ESP32_MQTT_HOST_LOG(4, "D", format, ##__VA_ARGS__)
+#define log_v(format, ...) ESP32_MQTT_HOST_LOG(5, "V", format, ##__VA_ARGS__)
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+class IPAddress
+{
+public:
+    IPAddress() : _address{} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address{ a, b, c, d } {}
+    uint8_t operator[](int index) const { return _address[index]; }
+
+private:
+    uint8_t _address[4];
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+// Helpers of the host build which don't exist on the device: RAM partitions, task statistics, heap usage, injected events.
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <mqtt_client.h>
+
+class ESP32_MQTTHostPartition
+{
+public:
+    static const esp_partition_t* create(const char* label, uint32_t size, uint32_t eraseSize = 4096);  // filled with 0xFF like erased flash
+    static const uint8_t* getData(const esp_partition_t* partition);
+    static void removeAll();
+};
+
+class ESP32_MQTTHostTasks
+{
+public:
+    static size_t getCreatedCount();        // tasks created since start
+    static size_t getStackBytes();          // sum of the stack sizes the tasks were created with
+};
+
+class ESP32_MQTTHostHeap
+{
+public:
+    static size_t getUsedBytes();           // heap in use by the process (mallinfo2)
+};
+
+// Passes an event to the handlers of a client, as its esp-mqtt task would but in the calling thread, to measure the
+// event path without a socket. Meant for a client that was created but not started, whose task raises no events.
+class ESP32_MQTTHostEvents
+{
+public:
+    static bool dispatch(const char* clientId, esp_mqtt_event_t* event);   // false if no client has the id
+};
+
+// MQTT 3.1.1 and MQTT 5 broker on 127.0.0.1 for tests and benchmarks: QoS 0-2, wildcards, retained messages and
+// persistent sessions (no offline queueing). MQTT 5 clients can use topic aliases, publish properties (forwarded to
+// MQTT 5 subscribers) and subscription identifiers; the session expiry interval is ignored. The fault injection applies
+// to everything the broker sends.
+class ESP32_MQTTHostBroker
+{
+public:
+    ESP32_MQTTHostBroker();
+    ~ESP32_MQTTHostBroker();
+    bool begin(uint16_t port = 0);           // 0 picks a free port
+    void end();
+    uint16_t getPort();
+    const char* getUri();                    // "mqtt://127.0.0.1:<port>"
+
+    void setDelay(uint32_t delayMs, uint32_t jitterMs = 0);  // added to every packet the broker sends
+    void setBlackhole(bool blackhole);      // received packets are dropped, connections stay open
+    void setRefuseConnections(bool refuse); // CONNACK "server unavailable"
+    void setRejectSubscriptions(const char* filterPrefix);  // SUBACK 0x80 for matching filters, nullptr for none
+    void setTopicAliasMaximum(uint16_t maximum);    // announced to MQTT 5 clients in CONNACK, default 10, 0 for no aliases
+    void closeConnections();                 // like a broker restart, sessions are kept
+
+    size_t getConnectionCount();
+    uint32_t getReceivedCount(uint8_t packetType);  // packets of the type (3 = PUBLISH, ...) received since begin()
+    uint64_t getReceivedBytes();
+
+private:
+    struct State;
+    State* _state;
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+// the esp-mqtt stand-in behaves like the one of this ESP-IDF version (multi topic SUBSCRIBE, MQTT_EVENT_DELETED)
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(5, 3, 0)
@@ -0,0 +1,250 @@
+#pragma once
+
+// Host stand-in for the esp-mqtt client of ESP-IDF 5.x. It speaks MQTT 3.1.1 over plain TCP ("mqtt://host:port") and
+// follows esp-mqtt where the library depends on its behaviour:
+// - a task per client runs the connection, reads the socket and calls the event handler with the API lock held
+// - publish() writes to the socket in the calling task, enqueue() leaves the sending to the client task
+// - QoS 1/2 messages wait in the outbox until they are acknowledged, are resent after message_retransmit_timeout and
+//   are deleted (MQTT_EVENT_DELETED) when they are older than ESP32_MQTT_HOST_OUTBOX_EXPIRED_MS
+// - messages bigger than the in buffer are delivered in chunks, only the first one carries the topic
+// - SUBACK return codes are passed in the data of MQTT_EVENT_SUBSCRIBED
+// - MQTT 5 needs CONFIG_MQTT_PROTOCOL_5: publish properties (checked against the broker's Topic Alias Maximum), user
+//   properties and the properties of received messages, the other MQTT 5 properties and APIs are left out
+// TLS and websockets are not supported.
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_idf_version.h"
+
+#define ESP32_MQTT_HOST_OUTBOX_EXPIRED_MS 30000
+
+typedef const char* esp_event_base_t;
+typedef void (*esp_event_handler_t)(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+typedef struct esp_mqtt_client* esp_mqtt_client_handle_t;
+
+typedef enum esp_mqtt_event_id_t
+{
+    MQTT_EVENT_ANY = -1,
+    MQTT_EVENT_ERROR = 0,
+    MQTT_EVENT_CONNECTED,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_SUBSCRIBED,
+    MQTT_EVENT_UNSUBSCRIBED,
+    MQTT_EVENT_PUBLISHED,
+    MQTT_EVENT_DATA,
+    MQTT_EVENT_BEFORE_CONNECT,
+    MQTT_EVENT_DELETED,
+    MQTT_USER_EVENT
+} esp_mqtt_event_id_t;
+
+typedef enum esp_mqtt_connect_return_code_t
+{
+    MQTT_CONNECTION_ACCEPTED = 0,
+    MQTT_CONNECTION_REFUSE_PROTOCOL,
+    MQTT_CONNECTION_REFUSE_ID_REJECTED,
+    MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE,
+    MQTT_CONNECTION_REFUSE_BAD_USERNAME,
+    MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED
+} esp_mqtt_connect_return_code_t;
+
+typedef enum esp_mqtt_error_type_t
+{
+    MQTT_ERROR_TYPE_NONE = 0,
+    MQTT_ERROR_TYPE_TCP_TRANSPORT,
+    MQTT_ERROR_TYPE_CONNECTION_REFUSED,
+    MQTT_ERROR_TYPE_SUBSCRIBE_FAILED
+} esp_mqtt_error_type_t;
+
+typedef enum esp_mqtt_transport_t
+{
+    MQTT_TRANSPORT_UNKNOWN = 0x0,
+    MQTT_TRANSPORT_OVER_TCP,
+    MQTT_TRANSPORT_OVER_SSL,
+    MQTT_TRANSPORT_OVER_WS,
+    MQTT_TRANSPORT_OVER_WSS
+} esp_mqtt_transport_t;
+
+typedef enum esp_mqtt_protocol_ver_t
+{
+    MQTT_PROTOCOL_UNDEFINED = 0,
+    MQTT_PROTOCOL_V_3_1,
+    MQTT_PROTOCOL_V_3_1_1,
+    MQTT_PROTOCOL_V_5
+} esp_mqtt_protocol_ver_t;
+
+typedef struct esp_mqtt_error_codes
+{
+    esp_err_t esp_tls_last_esp_err;
+    int esp_tls_stack_err;
+    int esp_tls_cert_verify_flags;
+    esp_mqtt_error_type_t error_type;
+    esp_mqtt_connect_return_code_t connect_return_code;
+    int esp_transport_sock_errno;
+} esp_mqtt_error_codes_t;
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+typedef struct esp_mqtt5_user_property_list_t* mqtt5_user_property_handle_t;
+
+typedef struct
+{
+    const char* key;
+    const char* value;
+} esp_mqtt5_user_property_item_t;
+
+typedef struct
+{
+    bool payload_format_indicator;
+    uint32_t message_expiry_interval;
+    uint16_t topic_alias;
+    const char* response_topic;
+    const char* correlation_data;
+    uint16_t correlation_data_len;
+    const char* content_type;
+    mqtt5_user_property_handle_t user_property;
+} esp_mqtt5_publish_property_config_t;
+
+typedef struct
+{
+    bool payload_format_indicator;
+    char* response_topic;
+    int response_topic_len;
+    char* correlation_data;
+    uint16_t correlation_data_len;
+    char* content_type;
+    int content_type_len;
+    uint16_t subscribe_id;
+    mqtt5_user_property_handle_t user_property;
+} esp_mqtt5_event_property_t;
+#endif
+
+typedef struct esp_mqtt_event_t
+{
+    esp_mqtt_event_id_t event_id;
+    esp_mqtt_client_handle_t client;
+    char* data;
+    int data_len;
+    int total_data_len;
+    int current_data_offset;
+    char* topic;
+    int topic_len;
+    int msg_id;
+    int session_present;
+    esp_mqtt_error_codes_t* error_handle;
+    bool retain;
+    int qos;
+    bool dup;
+    esp_mqtt_protocol_ver_t protocol_ver;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    esp_mqtt5_event_property_t* property;
+#endif
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t* esp_mqtt_event_handle_t;
+
+typedef struct topic_t
+{
+    const char* filter;
+    int qos;
+} esp_mqtt_topic_t;
+
+typedef struct esp_mqtt_client_config_t
+{
+    struct broker_t
+    {
+        struct address_t
+        {
+            const char* uri;
+            const char* hostname;
+            esp_mqtt_transport_t transport;
+            const char* path;
+            uint32_t port;
+        } address;
+        struct verification_t
+        {
+            bool use_global_ca_store;
+            const char* certificate;
+            size_t certificate_len;
+            bool skip_cert_common_name_check;
+            const char* common_name;
+        } verification;
+    } broker;
+    struct credentials_t
+    {
+        const char* username;
+        const char* client_id;
+        bool set_null_client_id;
+        struct authentication_t
+        {
+            const char* password;
+            const char* certificate;
+            size_t certificate_len;
+            const char* key;
+            size_t key_len;
+        } authentication;
+    } credentials;
+    struct session_t
+    {
+        struct last_will_t
+        {
+            const char* topic;
+            const char* msg;
+            int msg_len;
+            int qos;
+            int retain;
+        } last_will;
+        bool disable_clean_session;
+        int keepalive;
+        bool disable_keepalive;
+        esp_mqtt_protocol_ver_t protocol_ver;
+        int message_retransmit_timeout;
+    } session;
+    struct network_t
+    {
+        int reconnect_timeout_ms;
+        int timeout_ms;
+        int refresh_connection_after_ms;
+        bool disable_auto_reconnect;
+    } network;
+    struct task_t
+    {
+        int priority;
+        int stack_size;
+    } task;
+    struct buffer_t
+    {
+        int size;
+        int out_size;
+    } buffer;
+    struct outbox_config_t
+    {
+        uint64_t limit;
+    } outbox;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t* config);
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char* uri);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client);
+int esp_mqtt_client_subscribe_single(esp_mqtt_client_handle_t client, const char* topic, int qos);
+int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t* topic_list, int size);
+static inline int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char* topic, int qos) { return esp_mqtt_client_subscribe_single(client, topic, qos); }
+static inline int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t* topic_list, int size) { return esp_mqtt_client_subscribe_multiple(client, topic_list, size); }
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char* topic);
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain);
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain, bool store);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void* event_handler_arg);
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client);
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+typedef esp_mqtt_client_handle_t esp_mqtt5_client_handle_t;
+
+esp_err_t esp_mqtt5_client_set_publish_property(esp_mqtt5_client_handle_t client, const esp_mqtt5_publish_property_config_t* property);  // used by the following publishes
+esp_err_t esp_mqtt5_client_set_user_property(mqtt5_user_property_handle_t* user_property, esp_mqtt5_user_property_item_t item[], uint8_t item_num);  // appends copies of the items, creates the list if *user_property is NULL
+esp_err_t esp_mqtt5_client_get_user_property(mqtt5_user_property_handle_t user_property, esp_mqtt5_user_property_item_t* item, uint8_t* item_num);  // copies of the keys and values, the caller frees them
+uint8_t esp_mqtt5_client_get_user_property_count(mqtt5_user_property_handle_t user_property);
+void esp_mqtt5_client_delete_user_property(mqtt5_user_property_handle_t user_property);
+#endif
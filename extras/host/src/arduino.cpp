@@ -0,0 +1,77 @@
+#include <Arduino.h>
+#include <ESP32_MQTTHost.h>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <stdarg.h>
+#include <thread>
+#include <malloc.h>
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+int64_t esp_timer_get_time(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(uint32_t ms)
+{
+	vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+int log_printf(const char* format, ...)
+{
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	va_list args;
+	va_start(args, format);
+	int length = vfprintf(stderr, format, args);
+	va_end(args);
+	return length;
+}
+
+uint32_t esp_random(void)
+{
+	static std::mutex mutex;
+	static std::mt19937 generator(std::random_device{}());
+	std::lock_guard<std::mutex> lock(mutex);
+	return generator();
+}
+
+const char* esp_err_to_name(esp_err_t code)
+{
+	switch (code)
+	{
+	case ESP_OK:
+		return "ESP_OK";
+	case ESP_FAIL:
+		return "ESP_FAIL";
+	case ESP_ERR_NO_MEM:
+		return "ESP_ERR_NO_MEM";
+	case ESP_ERR_INVALID_ARG:
+		return "ESP_ERR_INVALID_ARG";
+	case ESP_ERR_INVALID_STATE:
+		return "ESP_ERR_INVALID_STATE";
+	case ESP_ERR_INVALID_SIZE:
+		return "ESP_ERR_INVALID_SIZE";
+	case ESP_ERR_NOT_FOUND:
+		return "ESP_ERR_NOT_FOUND";
+	default:
+		return "UNKNOWN ERROR";
+	}
+}
+
+size_t ESP32_MQTTHostHeap::getUsedBytes()
+{
+	return mallinfo2().uordblks;
+}
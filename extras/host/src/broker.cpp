@@ -0,0 +1,709 @@
+// Loopback MQTT 3.1.1 and MQTT 5 broker for tests and benchmarks, see ESP32_MQTTHost.h. One thread serves all connections.
+#include <ESP32_MQTTHost.h>
+#include "mqtt_packet.h"
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace ESP32_MQTTHostPacket;
+
+namespace
+{
+	struct Subscription
+	{
+		std::string filter;
+		int qos;
+		uint32_t subscriptionId;	// MQTT 5, 0 for none
+	};
+
+	struct Session
+	{
+		std::vector<Subscription> subscriptions;
+	};
+
+	struct Connection
+	{
+		int sock;
+		std::vector<uint8_t> rx;
+		bool connected;
+		bool closing;
+		std::string clientId;
+		bool clean;
+		uint16_t nextId;
+		std::set<int> incomingQos2;
+		int64_t lastDue;
+		std::string willTopic;
+		std::string willMessage;
+		int willQos;
+		bool willRetain;
+		uint8_t version;		// protocol level, 4 (MQTT 3.1.1) or 5
+		std::map<uint16_t, std::string> topicAliases;		// set by the client, for this connection
+	};
+
+	struct Outgoing
+	{
+		int64_t due;
+		int connection;
+		std::vector<uint8_t> packet;
+		bool closeAfter;
+	};
+
+	struct Retained
+	{
+		std::vector<uint8_t> payload;
+		int qos;
+		std::vector<uint8_t> properties;
+	};
+
+	int64_t nowMs()
+	{
+		return esp_timer_get_time() / 1000;
+	}
+}
+
+struct ESP32_MQTTHostBroker::State
+{
+	std::thread thread;
+	std::mutex mutex;
+	bool running = false;
+	int listenSock = -1;
+	int wakePipe[2] = { -1, -1 };
+	uint16_t port = 0;
+	std::string uri;
+	uint32_t delayMs = 0;
+	uint32_t jitterMs = 0;
+	bool blackhole = false;
+	bool refuse = false;
+	std::string rejectPrefix;
+	bool rejectSubscriptions = false;
+	uint16_t topicAliasMaximum = 10;
+	std::map<int, Connection> connections;
+	int nextConnection = 1;
+	std::map<std::string, Session> sessions;
+	std::map<std::string, Retained> retained;
+	std::deque<Outgoing> outgoing;
+	uint32_t received[16] = {};
+	uint64_t receivedBytes = 0;
+
+	void wake()
+	{
+		char byte = 0;
+		if (write(wakePipe[1], &byte, 1) < 0)
+			log_e("Can't wake the broker");
+	}
+
+	void send(int id, std::vector<uint8_t> packet, bool closeAfter = false)
+	{
+		Connection& c = connections[id];
+		int64_t due = nowMs() + delayMs + (jitterMs > 0 ? esp_random() % (jitterMs + 1) : 0);
+		// a connection delivers in order, the jitter can't reorder its packets
+		if (due < c.lastDue)
+			due = c.lastDue;
+		c.lastDue = due;
+		Outgoing o = { due, id, std::move(packet), closeAfter };
+		auto it = outgoing.end();
+		while (it != outgoing.begin() && (it - 1)->due > due)
+			--it;
+		outgoing.insert(it, std::move(o));
+	}
+
+	bool writeAll(int sock, const std::vector<uint8_t>& packet)
+	{
+		size_t written = 0;
+		int64_t deadline = nowMs() + 5000;
+		while (written < packet.size())
+		{
+			ssize_t n = ::send(sock, packet.data() + written, packet.size() - written, MSG_NOSIGNAL);
+			if (n > 0)
+			{
+				written += n;
+				continue;
+			}
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return false;
+			if (nowMs() > deadline)
+				return false;
+			pollfd pfd = { sock, POLLOUT, 0 };
+			poll(&pfd, 1, 100);
+		}
+		return true;
+	}
+
+	// properties are the MQTT 5 publish properties which are forwarded, a MQTT 3.1.1 subscriber gets none
+	void deliver(int id, const std::string& topic, const std::vector<uint8_t>& payload, int qos, bool retain, const std::vector<uint8_t>& properties, const std::vector<uint32_t>& subscriptionIds)
+	{
+		Connection& c = connections[id];
+		Writer w;
+		w.string(topic);
+		if (qos > 0)
+		{
+			if (++c.nextId == 0)
+				c.nextId = 1;
+			w.u16(c.nextId);
+		}
+		if (c.version == 5)
+		{
+			Writer p;
+			p.bytes(properties.data(), properties.size());
+			for (uint32_t subscriptionId : subscriptionIds)
+			{
+				p.u8(SUBSCRIPTION_IDENTIFIER);
+				p.varint(subscriptionId);
+			}
+			w.properties(p);
+		}
+		w.bytes(payload.data(), payload.size());
+		send(id, w.finish((PUBLISH << 4) | (qos << 1) | (retain ? 1 : 0)));
+	}
+
+	void route(const std::string& topic, const std::vector<uint8_t>& payload, int qos, bool retain, const std::vector<uint8_t>& properties)
+	{
+		if (retain)
+		{
+			if (payload.empty())
+				retained.erase(topic);
+			else
+				retained[topic] = { payload, qos, properties };
+		}
+		for (auto& entry : connections)
+		{
+			Connection& c = entry.second;
+			if (!c.connected)
+				continue;
+			// one message with the identifiers of all matching subscriptions
+			int grantedQos = -1;
+			std::vector<uint32_t> subscriptionIds;
+			for (const Subscription& s : sessions[c.clientId].subscriptions)
+			{
+				if (matches(s.filter, topic))
+				{
+					grantedQos = std::max(grantedQos, s.qos);
+					if (s.subscriptionId != 0)
+						subscriptionIds.push_back(s.subscriptionId);
+				}
+			}
+			if (grantedQos >= 0)
+				deliver(entry.first, topic, payload, std::min(qos, grantedQos), false, properties, subscriptionIds);
+		}
+	}
+
+	void handleConnect(int id, Reader& r)
+	{
+		Connection& c = connections[id];
+		std::string protocol = r.string();
+		uint8_t level = r.u8();
+		uint8_t flags = r.u8();
+		r.u16();
+		// the properties of a MQTT 5 CONNECT and will are ignored, sessions are kept like for MQTT 3.1.1
+		if (level == 5)
+			r.properties();
+		c.clientId = r.string();
+		if (flags & 0x04)
+		{
+			if (level == 5)
+				r.properties();
+			c.willTopic = r.string();
+			c.willMessage = r.string();
+			c.willQos = (flags >> 3) & 0x03;
+			c.willRetain = (flags & 0x20) != 0;
+		}
+		if (r.failed || protocol != "MQTT" || (level != 4 && level != 5))
+		{
+			send(id, { CONNACK << 4, 2, 0, 1 }, true);
+			return;
+		}
+		c.version = level;
+		if (refuse)
+		{
+			// server unavailable
+			send(id, level == 5 ? std::vector<uint8_t> { CONNACK << 4, 3, 0, 0x88, 0 } : std::vector<uint8_t> { CONNACK << 4, 2, 0, 3 }, true);
+			return;
+		}
+		if (c.clientId.empty())
+			c.clientId = "host-" + std::to_string(id);
+		// a second connection with the same client id takes over the session
+		for (auto& entry : connections)
+		{
+			if (entry.first != id && entry.second.connected && entry.second.clientId == c.clientId)
+			{
+				entry.second.closing = true;
+				shutdown(entry.second.sock, SHUT_RDWR);
+			}
+		}
+		c.clean = (flags & 0x02) != 0;
+		bool sessionPresent = !c.clean && sessions.count(c.clientId) > 0;
+		if (c.clean)
+			sessions.erase(c.clientId);
+		sessions[c.clientId];
+		c.connected = true;
+		Writer w;
+		w.u8(sessionPresent ? 1 : 0);
+		w.u8(0);
+		if (c.version == 5)
+		{
+			Writer p;
+			if (topicAliasMaximum > 0)
+			{
+				p.u8(TOPIC_ALIAS_MAXIMUM);
+				p.u16(topicAliasMaximum);
+			}
+			w.properties(p);
+		}
+		send(id, w.finish(CONNACK << 4));
+	}
+
+	void handleSubscribe(int id, uint16_t packetId, Reader& r)
+	{
+		Connection& c = connections[id];
+		Session& session = sessions[c.clientId];
+		Writer w;
+		w.u16(packetId);
+		uint32_t subscriptionId = 0;
+		if (c.version == 5)
+		{
+			Reader properties = r.properties();
+			Property property;
+			while (nextProperty(properties, property))
+			{
+				if (property.id == SUBSCRIPTION_IDENTIFIER)
+					subscriptionId = property.value;
+			}
+			w.properties(Writer());
+		}
+		std::vector<Subscription> added;
+		while (r.remaining() > 0 && !r.failed)
+		{
+			std::string filter = r.string();
+			// the other MQTT 5 subscription options are ignored
+			int qos = r.u8() & 0x03;
+			if (rejectSubscriptions && filter.compare(0, rejectPrefix.size(), rejectPrefix) == 0)
+			{
+				w.u8(0x80);
+				continue;
+			}
+			bool replaced = false;
+			for (Subscription& s : session.subscriptions)
+			{
+				if (s.filter == filter)
+				{
+					s.qos = qos;
+					s.subscriptionId = subscriptionId;
+					replaced = true;
+				}
+			}
+			if (!replaced)
+				session.subscriptions.push_back({ filter, qos, subscriptionId });
+			added.push_back({ filter, qos, subscriptionId });
+			w.u8((uint8_t)qos);
+		}
+		send(id, w.finish(SUBACK << 4));
+		for (const Subscription& s : added)
+		{
+			for (auto& entry : retained)
+			{
+				if (matches(s.filter, entry.first))
+				{
+					std::vector<uint32_t> subscriptionIds;
+					if (s.subscriptionId != 0)
+						subscriptionIds.push_back(s.subscriptionId);
+					deliver(id, entry.first, entry.second.payload, std::min(s.qos, entry.second.qos), true, entry.second.properties, subscriptionIds);
+				}
+			}
+		}
+	}
+
+	void handleUnsubscribe(int id, uint16_t packetId, Reader& r)
+	{
+		Connection& c = connections[id];
+		Session& session = sessions[c.clientId];
+		Writer w;
+		w.u16(packetId);
+		if (c.version == 5)
+		{
+			r.properties();
+			w.properties(Writer());
+		}
+		while (r.remaining() > 0 && !r.failed)
+		{
+			std::string filter = r.string();
+			if (c.version == 5)
+				w.u8(0);
+			for (auto it = session.subscriptions.begin(); it != session.subscriptions.end(); ++it)
+			{
+				if (it->filter == filter)
+				{
+					session.subscriptions.erase(it);
+					break;
+				}
+			}
+		}
+		send(id, w.finish(UNSUBACK << 4));
+	}
+
+	// Resolves the topic alias of a MQTT 5 PUBLISH and copies the other properties to forward them, false for an
+	// alias out of range or an empty topic with an unknown alias (protocol errors which close the connection).
+	bool readPublishProperties(Connection& c, Reader& r, std::string& topic, std::vector<uint8_t>& forwarded)
+	{
+		Reader properties = r.properties();
+		uint16_t alias = 0;
+		Property property;
+		while (nextProperty(properties, property))
+		{
+			if (property.id == TOPIC_ALIAS)
+				alias = (uint16_t)property.value;
+			else
+				forwarded.insert(forwarded.end(), properties.data + property.begin, properties.data + property.end);
+		}
+		if (properties.failed || r.failed)
+			return false;
+		if (alias == 0)
+			return !topic.empty();
+		if (alias > topicAliasMaximum)
+			return false;
+		if (!topic.empty())
+		{
+			c.topicAliases[alias] = topic;
+			return true;
+		}
+		auto it = c.topicAliases.find(alias);
+		if (it == c.topicAliases.end())
+			return false;
+		topic = it->second;
+		return true;
+	}
+
+	// false when the connection has to be closed
+	bool handlePacket(int id, const uint8_t* packet, size_t length, size_t headerLength)
+	{
+		Connection& c = connections[id];
+		uint8_t type = packet[0] >> 4;
+		received[type]++;
+		receivedBytes += length;
+		Reader r(packet + headerLength, length - headerLength);
+		if (!c.connected && type != CONNECT)
+			return false;
+		switch (type)
+		{
+		case CONNECT:
+			handleConnect(id, r);
+			break;
+		case PUBLISH:
+		{
+			int qos = (packet[0] >> 1) & 0x03;
+			std::string topic = r.string();
+			uint16_t packetId = qos > 0 ? r.u16() : 0;
+			std::vector<uint8_t> properties;
+			if (c.version == 5 && !readPublishProperties(c, r, topic, properties))
+				return false;
+			if (r.failed)
+				return false;
+			std::vector<uint8_t> payload(packet + headerLength + r.position, packet + length);
+			if (qos == 2)
+			{
+				if (c.incomingQos2.insert(packetId).second)
+					route(topic, payload, qos, packet[0] & 0x01, properties);
+				send(id, ack(PUBREC << 4, packetId));
+			}
+			else
+			{
+				route(topic, payload, qos, packet[0] & 0x01, properties);
+				if (qos == 1)
+					send(id, ack(PUBACK << 4, packetId));
+			}
+			break;
+		}
+		case PUBREL:
+		{
+			uint16_t packetId = r.u16();
+			c.incomingQos2.erase(packetId);
+			send(id, ack(PUBCOMP << 4, packetId));
+			break;
+		}
+		case PUBREC:
+			send(id, ack((PUBREL << 4) | 0x02, r.u16()));
+			break;
+		case SUBSCRIBE:
+			handleSubscribe(id, r.u16(), r);
+			break;
+		case UNSUBSCRIBE:
+			handleUnsubscribe(id, r.u16(), r);
+			break;
+		case PINGREQ:
+			send(id, { PINGRESP << 4, 0 });
+			break;
+		case DISCONNECT:
+			c.willTopic.clear();
+			return false;
+		default:
+			break;
+		}
+		return true;
+	}
+
+	void closeConnection(int id)
+	{
+		Connection& c = connections[id];
+		close(c.sock);
+		bool publishWill = c.connected && !c.closing && !c.willTopic.empty();
+		std::string willTopic = c.willTopic;
+		std::vector<uint8_t> willMessage(c.willMessage.begin(), c.willMessage.end());
+		int willQos = c.willQos;
+		bool willRetain = c.willRetain;
+		if (c.connected && c.clean)
+			sessions.erase(c.clientId);
+		connections.erase(id);
+		for (auto it = outgoing.begin(); it != outgoing.end();)
+			it = it->connection == id ? outgoing.erase(it) : it + 1;
+		if (publishWill)
+			route(willTopic, willMessage, willQos, willRetain, {});
+	}
+
+	void readConnection(int id)
+	{
+		Connection& c = connections[id];
+		uint8_t buffer[16384];
+		bool open = true;
+		for (;;)
+		{
+			ssize_t n = recv(c.sock, buffer, sizeof(buffer), 0);
+			if (n > 0)
+			{
+				if (!blackhole)
+					c.rx.insert(c.rx.end(), buffer, buffer + n);
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				break;
+			open = false;
+			break;
+		}
+		size_t headerLength;
+		long length;
+		while (open && !c.rx.empty() && (length = frameLength(c.rx.data(), c.rx.size(), &headerLength)) != 0)
+		{
+			if (length < 0)
+			{
+				open = false;
+				break;
+			}
+			std::vector<uint8_t> packet(c.rx.begin(), c.rx.begin() + length);
+			c.rx.erase(c.rx.begin(), c.rx.begin() + length);
+			if (!handlePacket(id, packet.data(), packet.size(), headerLength))
+			{
+				open = false;
+				break;
+			}
+		}
+		if (!open)
+			closeConnection(id);
+	}
+
+	void sendDue()
+	{
+		int64_t now = nowMs();
+		while (!outgoing.empty() && outgoing.front().due <= now)
+		{
+			Outgoing o = std::move(outgoing.front());
+			outgoing.pop_front();
+			auto it = connections.find(o.connection);
+			if (it == connections.end())
+				continue;
+			if (!writeAll(it->second.sock, o.packet) || o.closeAfter)
+				closeConnection(o.connection);
+		}
+	}
+
+	void loop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running)
+		{
+			sendDue();
+			std::vector<pollfd> pfds;
+			std::vector<int> ids;
+			pfds.push_back({ listenSock, POLLIN, 0 });
+			pfds.push_back({ wakePipe[0], POLLIN, 0 });
+			for (auto& entry : connections)
+			{
+				pfds.push_back({ entry.second.sock, POLLIN, 0 });
+				ids.push_back(entry.first);
+			}
+			int timeout = outgoing.empty() ? 1000 : (int)std::max<int64_t>(0, outgoing.front().due - nowMs());
+			lock.unlock();
+			poll(pfds.data(), pfds.size(), timeout);
+			lock.lock();
+			if (pfds[1].revents & POLLIN)
+			{
+				char buffer[64];
+				while (read(wakePipe[0], buffer, sizeof(buffer)) > 0)
+					;
+			}
+			if (pfds[0].revents & POLLIN)
+			{
+				int sock = accept(listenSock, nullptr, nullptr);
+				if (sock >= 0)
+				{
+					fcntl(sock, F_SETFL, O_NONBLOCK);
+					int one = 1;
+					setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					Connection c = {};
+					c.sock = sock;
+					connections[nextConnection++] = c;
+				}
+			}
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				if ((pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) && connections.count(ids[i]) > 0)
+					readConnection(ids[i]);
+			}
+		}
+		while (!connections.empty())
+		{
+			connections.begin()->second.closing = true;
+			closeConnection(connections.begin()->first);
+		}
+	}
+};
+
+ESP32_MQTTHostBroker::ESP32_MQTTHostBroker()
+{
+	_state = new State();
+}
+
+ESP32_MQTTHostBroker::~ESP32_MQTTHostBroker()
+{
+	end();
+	delete _state;
+}
+
+bool ESP32_MQTTHostBroker::begin(uint16_t port)
+{
+	if (_state->running)
+		return false;
+	_state->listenSock = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(_state->listenSock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	socklen_t length = sizeof(address);
+	if (bind(_state->listenSock, (sockaddr*)&address, sizeof(address)) != 0 || listen(_state->listenSock, 16) != 0 ||
+		getsockname(_state->listenSock, (sockaddr*)&address, &length) != 0 || pipe(_state->wakePipe) != 0)
+	{
+		log_e("Broker can't listen on port %u: %s", port, strerror(errno));
+		close(_state->listenSock);
+		return false;
+	}
+	fcntl(_state->listenSock, F_SETFL, O_NONBLOCK);
+	fcntl(_state->wakePipe[0], F_SETFL, O_NONBLOCK);
+	_state->port = ntohs(address.sin_port);
+	_state->uri = "mqtt://127.0.0.1:" + std::to_string(_state->port);
+	_state->running = true;
+	_state->thread = std::thread([this]() { _state->loop(); });
+	return true;
+}
+
+void ESP32_MQTTHostBroker::end()
+{
+	{
+		std::lock_guard<std::mutex> lock(_state->mutex);
+		if (!_state->running)
+			return;
+		_state->running = false;
+		_state->wake();
+	}
+	_state->thread.join();
+	close(_state->listenSock);
+	close(_state->wakePipe[0]);
+	close(_state->wakePipe[1]);
+	_state->sessions.clear();
+	_state->retained.clear();
+	_state->outgoing.clear();
+}
+
+uint16_t ESP32_MQTTHostBroker::getPort()
+{
+	return _state->port;
+}
+
+const char* ESP32_MQTTHostBroker::getUri()
+{
+	return _state->uri.c_str();
+}
+
+void ESP32_MQTTHostBroker::setDelay(uint32_t delayMs, uint32_t jitterMs)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	_state->delayMs = delayMs;
+	_state->jitterMs = jitterMs;
+}
+
+void ESP32_MQTTHostBroker::setBlackhole(bool blackhole)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	_state->blackhole = blackhole;
+}
+
+void ESP32_MQTTHostBroker::setRefuseConnections(bool refuse)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	_state->refuse = refuse;
+}
+
+void ESP32_MQTTHostBroker::setRejectSubscriptions(const char* filterPrefix)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	_state->rejectSubscriptions = filterPrefix != nullptr;
+	_state->rejectPrefix = filterPrefix != nullptr ? filterPrefix : "";
+}
+
+void ESP32_MQTTHostBroker::setTopicAliasMaximum(uint16_t maximum)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	_state->topicAliasMaximum = maximum;
+}
+
+void ESP32_MQTTHostBroker::closeConnections()
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	for (auto& entry : _state->connections)
+	{
+		entry.second.closing = true;
+		shutdown(entry.second.sock, SHUT_RDWR);
+	}
+	_state->wake();
+}
+
+size_t ESP32_MQTTHostBroker::getConnectionCount()
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	size_t count = 0;
+	for (auto& entry : _state->connections)
+		count += entry.second.connected ? 1 : 0;
+	return count;
+}
+
+uint32_t ESP32_MQTTHostBroker::getReceivedCount(uint8_t packetType)
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	return packetType < 16 ? _state->received[packetType] : 0;
+}
+
+uint64_t ESP32_MQTTHostBroker::getReceivedBytes()
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	return _state->receivedBytes;
+}
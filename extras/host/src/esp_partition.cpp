@@ -0,0 +1,106 @@
+// Partitions in RAM. Like NOR flash, a write can only clear bits, erasing sets a whole erase block back to 0xFF.
+#include <ESP32_MQTTHost.h>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+	struct HostPartition
+	{
+		esp_partition_t partition;
+		std::vector<uint8_t> data;
+	};
+
+	std::mutex partitionMutex;
+	std::vector<HostPartition*> partitions;
+
+	HostPartition* findPartition(const esp_partition_t* partition)
+	{
+		for (HostPartition* p : partitions)
+		{
+			if (&p->partition == partition)
+				return p;
+		}
+		return nullptr;
+	}
+}
+
+const esp_partition_t* ESP32_MQTTHostPartition::create(const char* label, uint32_t size, uint32_t eraseSize)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	HostPartition* p = new HostPartition();
+	p->partition.type = ESP_PARTITION_TYPE_DATA;
+	p->partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+	p->partition.size = size;
+	p->partition.erase_size = eraseSize;
+	strncpy(p->partition.label, label, sizeof(p->partition.label) - 1);
+	p->data.assign(size, 0xFF);
+	partitions.push_back(p);
+	return &p->partition;
+}
+
+const uint8_t* ESP32_MQTTHostPartition::getData(const esp_partition_t* partition)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	HostPartition* p = findPartition(partition);
+	return p != nullptr ? p->data.data() : nullptr;
+}
+
+void ESP32_MQTTHostPartition::removeAll()
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	for (HostPartition* p : partitions)
+		delete p;
+	partitions.clear();
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	for (HostPartition* p : partitions)
+	{
+		if ((type == ESP_PARTITION_TYPE_ANY || p->partition.type == type) && (label == nullptr || strcmp(p->partition.label, label) == 0))
+			return &p->partition;
+	}
+	return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	HostPartition* p = findPartition(partition);
+	if (p == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	if (src_offset > p->data.size() || size > p->data.size() - src_offset)
+		return ESP_ERR_INVALID_SIZE;
+	memcpy(dst, p->data.data() + src_offset, size);
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	HostPartition* p = findPartition(partition);
+	if (p == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	if (dst_offset > p->data.size() || size > p->data.size() - dst_offset)
+		return ESP_ERR_INVALID_SIZE;
+	const uint8_t* bytes = (const uint8_t*)src;
+	for (size_t i = 0; i < size; i++)
+		p->data[dst_offset + i] &= bytes[i];
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+	std::lock_guard<std::mutex> lock(partitionMutex);
+	HostPartition* p = findPartition(partition);
+	if (p == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	if (offset % p->partition.erase_size != 0 || size % p->partition.erase_size != 0)
+		return ESP_ERR_INVALID_ARG;
+	if (offset > p->data.size() || size > p->data.size() - offset)
+		return ESP_ERR_INVALID_SIZE;
+	memset(p->data.data() + offset, 0xFF, size);
+	return ESP_OK;
+}
@@ -0,0 +1,140 @@
+// esp_timer with one dispatcher thread that runs the callbacks of all timers, like the esp_timer task on the device.
+#include <Arduino.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+struct esp_timer
+{
+	esp_timer_cb_t callback;
+	void* arg;
+	uint64_t period;     // microseconds, 0 for a one-shot timer
+	int64_t due;
+	bool armed;
+	bool deleted;
+};
+
+namespace
+{
+	// never destroyed: the dispatcher thread still waits on them while the process exits, and destroying a condition
+	// variable with a waiter blocks
+	std::mutex& timerMutex = *new std::mutex();
+	std::condition_variable& timerCondition = *new std::condition_variable();
+	std::multimap<int64_t, esp_timer*>& timerQueue = *new std::multimap<int64_t, esp_timer*>();
+	std::thread* timerThread = nullptr;
+	esp_timer* runningTimer = nullptr;
+
+	void unschedule(esp_timer* timer)
+	{
+		auto range = timerQueue.equal_range(timer->due);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second == timer)
+			{
+				timerQueue.erase(it);
+				break;
+			}
+		}
+		timer->armed = false;
+	}
+
+	void schedule(esp_timer* timer, int64_t due)
+	{
+		timer->due = due;
+		timer->armed = true;
+		timerQueue.emplace(due, timer);
+		timerCondition.notify_all();
+	}
+
+	void timerLoop()
+	{
+		pthread_setname_np(pthread_self(), "esp_timer");
+		std::unique_lock<std::mutex> lock(timerMutex);
+		for (;;)
+		{
+			if (timerQueue.empty())
+			{
+				timerCondition.wait(lock);
+				continue;
+			}
+			int64_t now = esp_timer_get_time();
+			auto first = timerQueue.begin();
+			if (first->first > now)
+			{
+				timerCondition.wait_for(lock, std::chrono::microseconds(first->first - now));
+				continue;
+			}
+			esp_timer* timer = first->second;
+			timerQueue.erase(first);
+			timer->armed = false;
+			if (timer->period > 0)
+				schedule(timer, std::max(timer->due + (int64_t)timer->period, now));
+			runningTimer = timer;
+			lock.unlock();
+			timer->callback(timer->arg);
+			lock.lock();
+			runningTimer = nullptr;
+			if (timer->deleted)
+				delete timer;
+			timerCondition.notify_all();
+		}
+	}
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle)
+{
+	if (create_args == nullptr || create_args->callback == nullptr || out_handle == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::mutex> lock(timerMutex);
+	if (timerThread == nullptr)
+	{
+		timerThread = new std::thread(timerLoop);
+		timerThread->detach();
+	}
+	*out_handle = new esp_timer{ create_args->callback, create_args->arg, 0, 0, false, false };
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	std::lock_guard<std::mutex> lock(timerMutex);
+	if (timer->armed)
+		return ESP_ERR_INVALID_STATE;
+	timer->period = 0;
+	schedule(timer, esp_timer_get_time() + timeout_us);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+	std::lock_guard<std::mutex> lock(timerMutex);
+	if (timer->armed)
+		return ESP_ERR_INVALID_STATE;
+	timer->period = period;
+	schedule(timer, esp_timer_get_time() + period);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	std::lock_guard<std::mutex> lock(timerMutex);
+	if (!timer->armed)
+		return ESP_ERR_INVALID_STATE;
+	unschedule(timer);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+	std::unique_lock<std::mutex> lock(timerMutex);
+	if (timer->armed)
+		return ESP_ERR_INVALID_STATE;
+	// the callback may still be running in the dispatcher, it frees the timer when it returns
+	if (runningTimer == timer)
+		timer->deleted = true;
+	else
+		delete timer;
+	return ESP_OK;
+}
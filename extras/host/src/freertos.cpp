@@ -0,0 +1,234 @@
+// FreeRTOS tasks, notifications and semaphores on top of std::thread.
+#include <Arduino.h>
+#include <ESP32_MQTTHost.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+struct ESP32_MQTTHostTask
+{
+	std::string name;
+	std::mutex mutex;
+	std::condition_variable condition;
+	uint32_t notifications = 0;
+	bool deleted = false;
+};
+
+struct ESP32_MQTTHostSemaphore
+{
+	std::mutex mutex;
+	std::condition_variable condition;
+	int count = 0;
+	bool recursive = false;
+	std::thread::id owner;
+	int depth = 0;
+};
+
+static thread_local ESP32_MQTTHostTask* currentTask = nullptr;
+// handles stay valid after their thread ended (vTaskDelete() of a finished task), they are kept for the process lifetime
+static std::mutex taskRegistryMutex;
+static std::vector<ESP32_MQTTHostTask*>* taskRegistry = new std::vector<ESP32_MQTTHostTask*>();
+static std::atomic<size_t> createdTaskCount(0);
+static std::atomic<size_t> createdStackBytes(0);
+
+static ESP32_MQTTHostTask* newTask(const char* name)
+{
+	ESP32_MQTTHostTask* task = new ESP32_MQTTHostTask();
+	task->name = name != nullptr ? name : "";
+	std::lock_guard<std::mutex> lock(taskRegistryMutex);
+	taskRegistry->push_back(task);
+	return task;
+}
+
+// A deleted task can't be killed from the outside, it ends the next time it waits (vTaskDelay, ulTaskNotifyTake).
+static void exitIfDeleted(ESP32_MQTTHostTask* task, std::unique_lock<std::mutex>& lock)
+{
+	if (task->deleted)
+	{
+		lock.unlock();
+		pthread_exit(nullptr);
+	}
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stackDepth, void* arg, UBaseType_t priority, TaskHandle_t* createdTask, BaseType_t coreId)
+{
+	ESP32_MQTTHostTask* task = newTask(name);
+	createdTaskCount++;
+	createdStackBytes += stackDepth;
+	if (createdTask != nullptr)
+		*createdTask = task;
+	std::thread([task, function, arg]() {
+		currentTask = task;
+		pthread_setname_np(pthread_self(), task->name.substr(0, 15).c_str());
+		function(arg);
+		// returning from a task function is an error on FreeRTOS, the tasks of the library delete themselves
+		log_e("Task %s returned", task->name.c_str());
+	}).detach();
+	return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* arg, UBaseType_t priority, TaskHandle_t* createdTask)
+{
+	return xTaskCreatePinnedToCore(function, name, stackDepth, arg, priority, createdTask, tskNO_AFFINITY);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	// threads which weren't created as tasks (main, esp_timer) get a handle on first use
+	if (currentTask == nullptr)
+		currentTask = newTask("main");
+	return currentTask;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	if (task == nullptr || task == currentTask)
+		pthread_exit(nullptr);
+	std::lock_guard<std::mutex> lock(task->mutex);
+	task->deleted = true;
+	task->condition.notify_all();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	ESP32_MQTTHostTask* task = xTaskGetCurrentTaskHandle();
+	std::unique_lock<std::mutex> lock(task->mutex);
+	exitIfDeleted(task, lock);
+	task->condition.wait_for(lock, std::chrono::milliseconds(ticks), [task]() { return task->deleted; });
+	exitIfDeleted(task, lock);
+}
+
+char* pcTaskGetName(TaskHandle_t task)
+{
+	if (task == nullptr)
+		task = xTaskGetCurrentTaskHandle();
+	return &task->name[0];
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)millis();
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+	ESP32_MQTTHostTask* task = xTaskGetCurrentTaskHandle();
+	std::unique_lock<std::mutex> lock(task->mutex);
+	exitIfDeleted(task, lock);
+	auto ready = [task]() { return task->notifications > 0 || task->deleted; };
+	if (ticksToWait == portMAX_DELAY)
+		task->condition.wait(lock, ready);
+	else
+		task->condition.wait_for(lock, std::chrono::milliseconds(ticksToWait), ready);
+	exitIfDeleted(task, lock);
+	uint32_t value = task->notifications;
+	if (value > 0)
+		task->notifications = clearCountOnExit ? 0 : value - 1;
+	return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	std::lock_guard<std::mutex> lock(task->mutex);
+	task->notifications++;
+	task->condition.notify_all();
+	return pdPASS;
+}
+
+static SemaphoreHandle_t createSemaphore(int count, bool recursive)
+{
+	ESP32_MQTTHostSemaphore* semaphore = new ESP32_MQTTHostSemaphore();
+	semaphore->count = count;
+	semaphore->recursive = recursive;
+	return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return createSemaphore(0, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return createSemaphore(1, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+	return createSemaphore(1, true);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+	std::unique_lock<std::mutex> lock(semaphore->mutex);
+	auto ready = [semaphore]() { return semaphore->count > 0; };
+	if (ticksToWait == portMAX_DELAY)
+		semaphore->condition.wait(lock, ready);
+	else if (!semaphore->condition.wait_for(lock, std::chrono::milliseconds(ticksToWait), ready))
+		return pdFALSE;
+	semaphore->count--;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+	std::lock_guard<std::mutex> lock(semaphore->mutex);
+	if (semaphore->count > 0)
+		return pdFALSE;
+	semaphore->count++;
+	semaphore->condition.notify_one();
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+	std::unique_lock<std::mutex> lock(semaphore->mutex);
+	if (semaphore->depth > 0 && semaphore->owner == std::this_thread::get_id())
+	{
+		semaphore->depth++;
+		return pdTRUE;
+	}
+	auto ready = [semaphore]() { return semaphore->count > 0; };
+	if (ticksToWait == portMAX_DELAY)
+		semaphore->condition.wait(lock, ready);
+	else if (!semaphore->condition.wait_for(lock, std::chrono::milliseconds(ticksToWait), ready))
+		return pdFALSE;
+	semaphore->count--;
+	semaphore->owner = std::this_thread::get_id();
+	semaphore->depth = 1;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore)
+{
+	std::lock_guard<std::mutex> lock(semaphore->mutex);
+	if (semaphore->depth == 0 || semaphore->owner != std::this_thread::get_id())
+		return pdFALSE;
+	if (--semaphore->depth == 0)
+	{
+		semaphore->owner = std::thread::id();
+		semaphore->count++;
+		semaphore->condition.notify_one();
+	}
+	return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+	delete semaphore;
+}
+
+size_t ESP32_MQTTHostTasks::getCreatedCount()
+{
+	return createdTaskCount;
+}
+
+size_t ESP32_MQTTHostTasks::getStackBytes()
+{
+	return createdStackBytes;
+}
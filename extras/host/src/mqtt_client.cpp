@@ -0,0 +1,1257 @@
+// esp-mqtt stand-in for the host build, see mqtt_client.h. The client task follows the loop of esp-mqtt 5.x: with the
+// API lock held it connects, handles one received packet, sends one queued (enqueue()) or retransmits one
+// unacknowledged message and sends the keepalive ping, then it releases the lock and waits up to
+// ESP32_MQTT_HOST_POLL_READ_TIMEOUT_MS for the socket. MQTT 5 connections send no properties of their own in CONNECT,
+// SUBSCRIBE and UNSUBSCRIBE, and the properties of the acks are skipped.
+#include <Arduino.h>
+#include <ESP32_MQTTHost.h>
+#include <mqtt_client.h>
+#include "mqtt_packet.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace ESP32_MQTTHostPacket;
+
+#define ESP32_MQTT_HOST_POLL_READ_TIMEOUT_MS 1000
+
+namespace
+{
+	enum ClientState
+	{
+		STATE_INIT,
+		STATE_CONNECTED,
+		STATE_WAIT_RECONNECT
+	};
+
+	struct OutboxItem
+	{
+		int msgId;
+		uint8_t type;
+		int qos;
+		std::vector<uint8_t> packet;
+		int64_t created;
+		int64_t sent;
+		bool queued;
+	};
+
+	struct EventHandler
+	{
+		esp_mqtt_event_id_t event;
+		esp_event_handler_t handler;
+		void* arg;
+	};
+
+	int64_t nowMs()
+	{
+		return esp_timer_get_time() / 1000;
+	}
+}
+
+struct esp_mqtt_client
+{
+	std::string host;
+	int port;
+	bool uriSupported;
+	std::string clientId;
+	std::string username;
+	std::string password;
+	bool hasUsername;
+	bool hasPassword;
+	std::string willTopic;
+	std::string willMessage;
+	int willQos;
+	bool willRetain;
+	bool cleanSession;
+	int keepalive;
+	int retransmitMs;
+	int reconnectMs;
+	int timeoutMs;
+	bool autoReconnect;
+	int bufferSize;
+	uint64_t outboxLimit;
+	int taskPriority;
+	int taskStackSize;
+	bool v5;
+	uint16_t topicAliasMaximum;		// the broker's, from CONNACK
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	// esp_mqtt5_client_set_publish_property(), the pointers point to the strings and the list below
+	esp_mqtt5_publish_property_config_t publishProperty;
+	std::string publishResponseTopic;
+	std::string publishCorrelationData;
+	std::string publishContentType;
+#endif
+
+	std::vector<EventHandler> handlers;
+	std::recursive_mutex api;
+	esp_mqtt_error_codes_t error;
+
+	bool run;
+	bool stopped;
+	std::mutex stopMutex;
+	std::condition_variable stopCondition;
+	TaskHandle_t task;
+	int wakePipe[2];
+
+	ClientState state;
+	int sock;
+	std::vector<uint8_t> rx;
+	std::deque<OutboxItem> outbox;
+	uint16_t lastMsgId;
+	std::set<int> incomingQos2;
+	int64_t reconnectTick;
+	int64_t waitTimeoutMs;
+	bool disconnectRequested;
+	int64_t keepaliveTick;
+	bool waitPingResp;
+};
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+struct esp_mqtt5_user_property_list_t
+{
+	std::vector<std::pair<std::string, std::string>> items;
+};
+#endif
+
+// clients from init to destroy, for ESP32_MQTTHostEvents
+static std::mutex clientsMutex;
+static std::vector<esp_mqtt_client_handle_t>* clients = new std::vector<esp_mqtt_client_handle_t>();
+
+static bool parseUri(esp_mqtt_client_handle_t client, const char* uri)
+{
+	std::string value(uri);
+	size_t schemeEnd = value.find("://");
+	std::string scheme = schemeEnd != std::string::npos ? value.substr(0, schemeEnd) : "mqtt";
+	std::string rest = schemeEnd != std::string::npos ? value.substr(schemeEnd + 3) : value;
+	size_t pathStart = rest.find('/');
+	if (pathStart != std::string::npos)
+		rest = rest.substr(0, pathStart);
+	size_t at = rest.rfind('@');
+	if (at != std::string::npos)
+		rest = rest.substr(at + 1);
+	size_t colon = rest.rfind(':');
+	client->host = colon != std::string::npos ? rest.substr(0, colon) : rest;
+	client->port = colon != std::string::npos ? atoi(rest.c_str() + colon + 1) : 1883;
+	client->uriSupported = scheme == "mqtt" || scheme == "tcp";
+	if (!client->uriSupported)
+		log_e("Host esp-mqtt supports only mqtt:// URIs, not %s", uri);
+	return client->uriSupported;
+}
+
+static void dispatchEvent(esp_mqtt_client_handle_t client, esp_mqtt_event_t* event)
+{
+	event->client = client;
+	event->error_handle = &client->error;
+	event->protocol_ver = client->v5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+	for (EventHandler& h : client->handlers)
+	{
+		if (h.event == MQTT_EVENT_ANY || h.event == event->event_id)
+			h.handler(h.arg, "MQTT_EVENTS", event->event_id, event);
+	}
+}
+
+static void dispatchSimpleEvent(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t id, int msgId)
+{
+	esp_mqtt_event_t event = {};
+	event.event_id = id;
+	event.msg_id = msgId;
+	dispatchEvent(client, &event);
+}
+
+static void wake(esp_mqtt_client_handle_t client)
+{
+	char byte = 0;
+	if (write(client->wakePipe[1], &byte, 1) < 0)
+		log_e("Can't wake the MQTT task");
+}
+
+static bool writeAll(esp_mqtt_client_handle_t client, const std::vector<uint8_t>& packet)
+{
+	size_t written = 0;
+	int64_t deadline = nowMs() + client->timeoutMs;
+	while (written < packet.size())
+	{
+		ssize_t n = send(client->sock, packet.data() + written, packet.size() - written, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			written += n;
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			client->error.esp_transport_sock_errno = errno;
+			return false;
+		}
+		int64_t remaining = deadline - nowMs();
+		if (remaining <= 0)
+			return false;
+		pollfd pfd = { client->sock, POLLOUT, 0 };
+		poll(&pfd, 1, (int)remaining);
+	}
+	return true;
+}
+
+static void abortConnection(esp_mqtt_client_handle_t client)
+{
+	if (client->sock >= 0)
+		close(client->sock);
+	client->sock = -1;
+	client->rx.clear();
+	client->state = STATE_WAIT_RECONNECT;
+	client->reconnectTick = nowMs();
+	client->waitTimeoutMs = client->autoReconnect ? client->reconnectMs : -1;
+	client->waitPingResp = false;
+	dispatchSimpleEvent(client, MQTT_EVENT_DISCONNECTED, 0);
+}
+
+static void dispatchTransportError(esp_mqtt_client_handle_t client, int sockErrno)
+{
+	client->error.error_type = MQTT_ERROR_TYPE_TCP_TRANSPORT;
+	client->error.esp_transport_sock_errno = sockErrno;
+	dispatchSimpleEvent(client, MQTT_EVENT_ERROR, 0);
+}
+
+static int tcpConnect(esp_mqtt_client_handle_t client, int* sockErrno)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	std::string port = std::to_string(client->port);
+	if (getaddrinfo(client->host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr)
+	{
+		*sockErrno = EHOSTUNREACH;
+		return -1;
+	}
+	int sock = socket(result->ai_family, SOCK_STREAM, 0);
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	int r = connect(sock, result->ai_addr, result->ai_addrlen);
+	freeaddrinfo(result);
+	if (r < 0 && errno == EINPROGRESS)
+	{
+		pollfd pfd = { sock, POLLOUT, 0 };
+		if (poll(&pfd, 1, client->timeoutMs) == 1)
+		{
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length);
+			r = error == 0 ? 0 : -1;
+			errno = error;
+		}
+		else
+		{
+			errno = ETIMEDOUT;
+		}
+	}
+	if (r < 0)
+	{
+		*sockErrno = errno;
+		close(sock);
+		return -1;
+	}
+	// lwIP keeps Nagle on, but a localhost round trip with Nagle and delayed acks would stall for 40 ms
+	int one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sock;
+}
+
+// Reads what the socket has, false when the connection is closed or broken.
+static bool readAvailable(esp_mqtt_client_handle_t client)
+{
+	uint8_t buffer[4096];
+	for (;;)
+	{
+		ssize_t n = recv(client->sock, buffer, sizeof(buffer), 0);
+		if (n > 0)
+		{
+			client->rx.insert(client->rx.end(), buffer, buffer + n);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n < 0 && errno == EINTR)
+			continue;
+		client->error.esp_transport_sock_errno = n == 0 ? ENOTCONN : errno;
+		return false;
+	}
+}
+
+static bool hasCompletePacket(esp_mqtt_client_handle_t client)
+{
+	size_t headerLength;
+	return !client->rx.empty() && frameLength(client->rx.data(), client->rx.size(), &headerLength) != 0;
+}
+
+static std::vector<uint8_t> connectPacket(esp_mqtt_client_handle_t client)
+{
+	Writer w;
+	w.string("MQTT", 4);
+	w.u8(client->v5 ? 5 : 4);
+	uint8_t flags = client->cleanSession ? 0x02 : 0;
+	if (!client->willTopic.empty())
+		flags |= 0x04 | (client->willQos << 3) | (client->willRetain ? 0x20 : 0);
+	if (client->hasUsername)
+		flags |= 0x80;
+	if (client->hasPassword)
+		flags |= 0x40;
+	w.u8(flags);
+	w.u16((uint16_t)client->keepalive);
+	if (client->v5)
+		w.properties(Writer());
+	w.string(client->clientId);
+	if (!client->willTopic.empty())
+	{
+		if (client->v5)
+			w.properties(Writer());
+		w.string(client->willTopic);
+		w.string(client->willMessage);
+	}
+	if (client->hasUsername)
+		w.string(client->username);
+	if (client->hasPassword)
+		w.string(client->password);
+	return w.finish(CONNECT << 4);
+}
+
+static void connectBroker(esp_mqtt_client_handle_t client)
+{
+	dispatchSimpleEvent(client, MQTT_EVENT_BEFORE_CONNECT, 0);
+	memset(&client->error, 0, sizeof(client->error));
+	client->disconnectRequested = false;
+	int sockErrno = 0;
+	client->sock = client->uriSupported ? tcpConnect(client, &sockErrno) : -1;
+	if (client->sock < 0)
+	{
+		log_e("Error transport connect");
+		dispatchTransportError(client, sockErrno);
+		abortConnection(client);
+		return;
+	}
+	if (!writeAll(client, connectPacket(client)))
+	{
+		dispatchTransportError(client, client->error.esp_transport_sock_errno);
+		abortConnection(client);
+		return;
+	}
+	int64_t deadline = nowMs() + client->timeoutMs;
+	while (!hasCompletePacket(client))
+	{
+		int64_t remaining = deadline - nowMs();
+		pollfd pfd = { client->sock, POLLIN, 0 };
+		if (remaining <= 0 || poll(&pfd, 1, (int)remaining) <= 0 || !readAvailable(client))
+		{
+			log_e("No CONNACK from %s:%d", client->host.c_str(), client->port);
+			dispatchTransportError(client, remaining <= 0 ? ETIMEDOUT : client->error.esp_transport_sock_errno);
+			abortConnection(client);
+			return;
+		}
+	}
+	size_t headerLength;
+	long length = frameLength(client->rx.data(), client->rx.size(), &headerLength);
+	Reader r(client->rx.data() + headerLength, length > 0 ? length - headerLength : 0);
+	int sessionPresent = r.u8() & 0x01;
+	int returnCode = r.u8();
+	client->topicAliasMaximum = 0;
+	if (client->v5)
+	{
+		Reader properties = r.properties();
+		Property property;
+		while (nextProperty(properties, property))
+		{
+			if (property.id == TOPIC_ALIAS_MAXIMUM)
+				client->topicAliasMaximum = property.value;
+		}
+	}
+	if ((client->rx[0] >> 4) != CONNACK || r.failed)
+	{
+		dispatchTransportError(client, 0);
+		abortConnection(client);
+		return;
+	}
+	client->rx.erase(client->rx.begin(), client->rx.begin() + length);
+	// MQTT 5 reason codes are passed as they are, like esp-mqtt does
+	if (returnCode != 0)
+	{
+		log_e("Connection refused, return code %d", returnCode);
+		client->error.error_type = MQTT_ERROR_TYPE_CONNECTION_REFUSED;
+		client->error.connect_return_code = (esp_mqtt_connect_return_code_t)returnCode;
+		dispatchSimpleEvent(client, MQTT_EVENT_ERROR, 0);
+		abortConnection(client);
+		return;
+	}
+	client->state = STATE_CONNECTED;
+	client->keepaliveTick = nowMs();
+	client->waitPingResp = false;
+	// whatever wasn't acknowledged on the previous connection goes out again
+	for (OutboxItem& item : client->outbox)
+	{
+		if (!item.queued && item.type == PUBLISH)
+			item.packet[0] |= 0x08;
+		item.queued = true;
+	}
+	esp_mqtt_event_t event = {};
+	event.event_id = MQTT_EVENT_CONNECTED;
+	event.session_present = sessionPresent;
+	dispatchEvent(client, &event);
+}
+
+static bool deleteOutboxItem(esp_mqtt_client_handle_t client, int msgId, uint8_t type)
+{
+	for (auto it = client->outbox.begin(); it != client->outbox.end(); ++it)
+	{
+		if (it->msgId == msgId && it->type == type)
+		{
+			client->outbox.erase(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+static OutboxItem* findOutboxItem(esp_mqtt_client_handle_t client, int msgId, uint8_t type)
+{
+	for (OutboxItem& item : client->outbox)
+	{
+		if (item.msgId == msgId && item.type == type)
+			return &item;
+	}
+	return nullptr;
+}
+
+static void deliverPublish(esp_mqtt_client_handle_t client, const uint8_t* packet, size_t packetLength, size_t headerLength)
+{
+	int qos = (packet[0] >> 1) & 0x03;
+	Reader r(packet + headerLength, packetLength - headerLength);
+	uint16_t topicLength = r.u16();
+	const char* topic = (const char*)packet + headerLength + 2;
+	r.position += topicLength;
+	int msgId = qos > 0 ? r.u16() : 0;
+	Reader properties = client->v5 ? r.properties() : Reader(nullptr, 0);
+	if (r.failed || r.position > r.length)
+		return;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	// the strings point into the packet, the user property list is freed after the event like in esp-mqtt
+	esp_mqtt5_event_property_t eventProperty = {};
+	esp_mqtt5_user_property_list_t userProperty;
+	Property property;
+	while (nextProperty(properties, property))
+	{
+		switch (property.id)
+		{
+		case PAYLOAD_FORMAT_INDICATOR:
+			eventProperty.payload_format_indicator = property.value != 0;
+			break;
+		case RESPONSE_TOPIC:
+			eventProperty.response_topic = (char*)property.data;
+			eventProperty.response_topic_len = (int)property.length;
+			break;
+		case CORRELATION_DATA:
+			eventProperty.correlation_data = (char*)property.data;
+			eventProperty.correlation_data_len = (uint16_t)property.length;
+			break;
+		case CONTENT_TYPE:
+			eventProperty.content_type = (char*)property.data;
+			eventProperty.content_type_len = (int)property.length;
+			break;
+		case SUBSCRIPTION_IDENTIFIER:
+			eventProperty.subscribe_id = (uint16_t)property.value;
+			break;
+		case USER_PROPERTY:
+			userProperty.items.emplace_back(std::string(property.data, property.length), std::string(property.data2, property.length2));
+			break;
+		default:
+			break;
+		}
+	}
+	if (!userProperty.items.empty())
+		eventProperty.user_property = &userProperty;
+#endif
+	if (qos == 2 && client->incomingQos2.count(msgId) > 0)
+	{
+		writeAll(client, ack(PUBREC << 4, msgId));
+		return;
+	}
+	const uint8_t* payload = packet + headerLength + r.position;
+	int payloadLength = (int)(packetLength - headerLength - r.position);
+	// the first read into the in buffer holds the headers too, later reads only payload
+	int firstCapacity = std::max(0, client->bufferSize - (int)(headerLength + r.position));
+	int offset = 0;
+	bool first = true;
+	do
+	{
+		int chunk = std::min(payloadLength - offset, first ? firstCapacity : client->bufferSize);
+		esp_mqtt_event_t event = {};
+		event.event_id = MQTT_EVENT_DATA;
+		event.data = (char*)payload + offset;
+		event.data_len = chunk;
+		event.total_data_len = payloadLength;
+		event.current_data_offset = offset;
+		event.topic = first ? (char*)topic : nullptr;
+		event.topic_len = first ? topicLength : 0;
+		event.msg_id = msgId;
+		event.qos = qos;
+		event.retain = packet[0] & 0x01;
+		event.dup = (packet[0] & 0x08) != 0;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		event.property = first && client->v5 ? &eventProperty : nullptr;
+#endif
+		dispatchEvent(client, &event);
+		offset += chunk;
+		first = false;
+	} while (offset < payloadLength);
+	if (qos == 1)
+		writeAll(client, ack(PUBACK << 4, msgId));
+	else if (qos == 2)
+	{
+		client->incomingQos2.insert(msgId);
+		writeAll(client, ack(PUBREC << 4, msgId));
+	}
+}
+
+// Handles one received packet, false when the connection has to be aborted.
+static bool processReceive(esp_mqtt_client_handle_t client)
+{
+	// packets which arrived before the broker closed the connection are still handled
+	bool open = readAvailable(client);
+	size_t headerLength;
+	long length = client->rx.empty() ? 0 : frameLength(client->rx.data(), client->rx.size(), &headerLength);
+	if (length < 0)
+		return false;
+	if (length == 0)
+		return open;
+	std::vector<uint8_t> packet(client->rx.begin(), client->rx.begin() + length);
+	client->rx.erase(client->rx.begin(), client->rx.begin() + length);
+	uint8_t type = packet[0] >> 4;
+	int msgId = packet.size() >= headerLength + 2 ? (packet[headerLength] << 8) | packet[headerLength + 1] : 0;
+	switch (type)
+	{
+	case PUBLISH:
+		deliverPublish(client, packet.data(), packet.size(), headerLength);
+		break;
+	case PUBACK:
+		if (deleteOutboxItem(client, msgId, PUBLISH))
+			dispatchSimpleEvent(client, MQTT_EVENT_PUBLISHED, msgId);
+		break;
+	case PUBREC:
+		if (OutboxItem* item = findOutboxItem(client, msgId, PUBLISH))
+		{
+			item->type = PUBREL;
+			item->packet = ack((PUBREL << 4) | 0x02, msgId);
+			item->sent = nowMs();
+		}
+		return writeAll(client, ack((PUBREL << 4) | 0x02, msgId));
+	case PUBREL:
+		client->incomingQos2.erase(msgId);
+		return writeAll(client, ack(PUBCOMP << 4, msgId));
+	case PUBCOMP:
+		if (deleteOutboxItem(client, msgId, PUBREL))
+			dispatchSimpleEvent(client, MQTT_EVENT_PUBLISHED, msgId);
+		break;
+	case SUBACK:
+		if (deleteOutboxItem(client, msgId, SUBSCRIBE))
+		{
+			// the return codes, after the properties of MQTT 5
+			Reader r(packet.data() + headerLength, packet.size() - headerLength);
+			r.u16();
+			if (client->v5)
+				r.properties();
+			if (r.failed)
+				return false;
+			esp_mqtt_event_t event = {};
+			event.event_id = MQTT_EVENT_SUBSCRIBED;
+			event.msg_id = msgId;
+			event.data = (char*)packet.data() + headerLength + r.position;
+			event.data_len = (int)r.remaining();
+			client->error.error_type = MQTT_ERROR_TYPE_NONE;
+			for (int i = 0; i < event.data_len; i++)
+			{
+				if ((uint8_t)event.data[i] >= 0x80)
+					client->error.error_type = MQTT_ERROR_TYPE_SUBSCRIBE_FAILED;
+			}
+			dispatchEvent(client, &event);
+		}
+		break;
+	case UNSUBACK:
+		if (deleteOutboxItem(client, msgId, UNSUBSCRIBE))
+			dispatchSimpleEvent(client, MQTT_EVENT_UNSUBSCRIBED, msgId);
+		break;
+	case PINGRESP:
+		client->waitPingResp = false;
+		break;
+	default:
+		log_w("Unexpected packet type %d", type);
+		break;
+	}
+	return true;
+}
+
+static void deleteExpiredMessages(esp_mqtt_client_handle_t client)
+{
+	int64_t now = nowMs();
+	for (auto it = client->outbox.begin(); it != client->outbox.end();)
+	{
+		if (now - it->created > ESP32_MQTT_HOST_OUTBOX_EXPIRED_MS)
+		{
+			int msgId = it->msgId;
+			it = client->outbox.erase(it);
+			dispatchSimpleEvent(client, MQTT_EVENT_DELETED, msgId);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+static bool sendOutbox(esp_mqtt_client_handle_t client)
+{
+	for (auto it = client->outbox.begin(); it != client->outbox.end(); ++it)
+	{
+		if (!it->queued)
+			continue;
+		if (!writeAll(client, it->packet))
+			return false;
+		if (it->type == PUBLISH && it->qos == 0)
+		{
+			client->outbox.erase(it);
+		}
+		else
+		{
+			it->queued = false;
+			it->sent = nowMs();
+		}
+		return true;
+	}
+	if (client->retransmitMs <= 0)
+		return true;
+	OutboxItem* oldest = nullptr;
+	for (OutboxItem& item : client->outbox)
+	{
+		if (oldest == nullptr || item.sent < oldest->sent)
+			oldest = &item;
+	}
+	if (oldest != nullptr && nowMs() - oldest->sent > client->retransmitMs)
+	{
+		if (oldest->type == PUBLISH)
+			oldest->packet[0] |= 0x08;
+		oldest->sent = nowMs();
+		return writeAll(client, oldest->packet);
+	}
+	return true;
+}
+
+static bool processKeepalive(esp_mqtt_client_handle_t client)
+{
+	if (client->keepalive <= 0)
+		return true;
+	int64_t keepaliveMs = client->keepalive * 1000LL;
+	if (client->waitPingResp)
+	{
+		if (nowMs() - client->keepaliveTick > keepaliveMs)
+		{
+			log_e("No PING_RESP, disconnected");
+			abortConnection(client);
+			return false;
+		}
+		return true;
+	}
+	if (nowMs() - client->keepaliveTick > keepaliveMs / 2)
+	{
+		if (!writeAll(client, Writer().finish(PINGREQ << 4)))
+		{
+			abortConnection(client);
+			return false;
+		}
+		client->keepaliveTick = nowMs();
+		client->waitPingResp = true;
+	}
+	return true;
+}
+
+static void drainWakePipe(esp_mqtt_client_handle_t client)
+{
+	char buffer[64];
+	while (read(client->wakePipe[0], buffer, sizeof(buffer)) > 0)
+		;
+}
+
+static void clientTask(void* arg)
+{
+	esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
+	std::unique_lock<std::recursive_mutex> lock(client->api);
+	while (client->run)
+	{
+		switch (client->state)
+		{
+		case STATE_INIT:
+			connectBroker(client);
+			break;
+		case STATE_CONNECTED:
+			if (client->disconnectRequested)
+			{
+				client->disconnectRequested = false;
+				writeAll(client, Writer().finish(DISCONNECT << 4));
+				abortConnection(client);
+				break;
+			}
+			if (!processReceive(client))
+			{
+				abortConnection(client);
+				break;
+			}
+			deleteExpiredMessages(client);
+			if (!sendOutbox(client))
+			{
+				abortConnection(client);
+				break;
+			}
+			processKeepalive(client);
+			break;
+		case STATE_WAIT_RECONNECT:
+		{
+			if (client->waitTimeoutMs >= 0 && nowMs() - client->reconnectTick >= client->waitTimeoutMs)
+			{
+				client->state = STATE_INIT;
+				client->reconnectTick = nowMs();
+				break;
+			}
+			int timeout = client->waitTimeoutMs >= 0 ? (int)std::max<int64_t>(1, client->waitTimeoutMs / 2) : ESP32_MQTT_HOST_POLL_READ_TIMEOUT_MS;
+			lock.unlock();
+			pollfd pfd = { client->wakePipe[0], POLLIN, 0 };
+			poll(&pfd, 1, timeout);
+			drainWakePipe(client);
+			lock.lock();
+			continue;
+		}
+		}
+		if (client->state == STATE_CONNECTED)
+		{
+			int timeout = hasCompletePacket(client) ? 0 : ESP32_MQTT_HOST_POLL_READ_TIMEOUT_MS;
+			int sock = client->sock;
+			lock.unlock();
+			pollfd pfds[2] = { { sock, POLLIN, 0 }, { client->wakePipe[0], POLLIN, 0 } };
+			poll(pfds, 2, timeout);
+			drainWakePipe(client);
+			lock.lock();
+		}
+	}
+	bool wasConnected = client->state == STATE_CONNECTED;
+	if (wasConnected)
+		writeAll(client, Writer().finish(DISCONNECT << 4));
+	if (client->sock >= 0)
+		close(client->sock);
+	client->sock = -1;
+	client->rx.clear();
+	client->state = STATE_INIT;
+	if (wasConnected)
+		dispatchSimpleEvent(client, MQTT_EVENT_DISCONNECTED, 0);
+	lock.unlock();
+	{
+		std::lock_guard<std::mutex> stopLock(client->stopMutex);
+		client->stopped = true;
+		client->stopCondition.notify_all();
+	}
+	vTaskDelete(nullptr);
+}
+
+static int nextMsgId(esp_mqtt_client_handle_t client)
+{
+	if (++client->lastMsgId == 0)
+		client->lastMsgId = 1;
+	return client->lastMsgId;
+}
+
+static std::string copyString(const char* value)
+{
+	return value != nullptr ? std::string(value) : std::string();
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t* config)
+{
+	esp_mqtt_client_handle_t client = new esp_mqtt_client();
+	if (config->broker.address.uri != nullptr)
+	{
+		parseUri(client, config->broker.address.uri);
+	}
+	else
+	{
+		client->host = copyString(config->broker.address.hostname);
+		client->port = config->broker.address.port != 0 ? config->broker.address.port : 1883;
+		client->uriSupported = config->broker.address.transport == MQTT_TRANSPORT_UNKNOWN || config->broker.address.transport == MQTT_TRANSPORT_OVER_TCP;
+	}
+	if (config->credentials.client_id != nullptr)
+	{
+		client->clientId = config->credentials.client_id;
+	}
+	else if (!config->credentials.set_null_client_id)
+	{
+		char id[16];
+		snprintf(id, sizeof(id), "ESP32_%06X", (unsigned)(esp_random() & 0xFFFFFF));
+		client->clientId = id;
+	}
+	client->hasUsername = config->credentials.username != nullptr;
+	client->username = copyString(config->credentials.username);
+	client->hasPassword = config->credentials.authentication.password != nullptr;
+	client->password = copyString(config->credentials.authentication.password);
+	client->willTopic = copyString(config->session.last_will.topic);
+	if (config->session.last_will.msg != nullptr)
+	{
+		int length = config->session.last_will.msg_len > 0 ? config->session.last_will.msg_len : (int)strlen(config->session.last_will.msg);
+		client->willMessage.assign(config->session.last_will.msg, length);
+	}
+	client->willQos = config->session.last_will.qos;
+	client->willRetain = config->session.last_will.retain != 0;
+	client->cleanSession = !config->session.disable_clean_session;
+	client->keepalive = config->session.disable_keepalive ? 0 : (config->session.keepalive > 0 ? config->session.keepalive : 120);
+	client->retransmitMs = config->session.message_retransmit_timeout > 0 ? config->session.message_retransmit_timeout : 1000;
+	client->reconnectMs = config->network.reconnect_timeout_ms > 0 ? config->network.reconnect_timeout_ms : 10000;
+	client->timeoutMs = config->network.timeout_ms > 0 ? config->network.timeout_ms : 10000;
+	client->autoReconnect = !config->network.disable_auto_reconnect;
+	client->bufferSize = config->buffer.size > 0 ? config->buffer.size : 1024;
+	client->outboxLimit = config->outbox.limit;
+	client->taskPriority = config->task.priority > 0 ? config->task.priority : 5;
+	client->taskStackSize = config->task.stack_size > 0 ? config->task.stack_size : 6144;
+	client->v5 = config->session.protocol_ver == MQTT_PROTOCOL_V_5;
+	client->topicAliasMaximum = 0;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	client->publishProperty = {};
+#else
+	if (client->v5)
+	{
+		log_e("Please first enable MQTT_PROTOCOL_5 feature in menuconfig");
+		delete client;
+		return nullptr;
+	}
+#endif
+	client->run = false;
+	client->stopped = true;
+	client->task = nullptr;
+	client->state = STATE_INIT;
+	client->sock = -1;
+	client->lastMsgId = 0;
+	client->reconnectTick = 0;
+	client->waitTimeoutMs = 0;
+	client->disconnectRequested = false;
+	client->keepaliveTick = 0;
+	client->waitPingResp = false;
+	memset(&client->error, 0, sizeof(client->error));
+	if (pipe(client->wakePipe) != 0)
+	{
+		delete client;
+		return nullptr;
+	}
+	fcntl(client->wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(client->wakePipe[1], F_SETFL, O_NONBLOCK);
+	std::lock_guard<std::mutex> lock(clientsMutex);
+	clients->push_back(client);
+	return client;
+}
+
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char* uri)
+{
+	if (client == nullptr || uri == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	return parseUri(client, uri) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (client->run)
+	{
+		log_e("Client has started");
+		return ESP_FAIL;
+	}
+	client->run = true;
+	client->stopped = false;
+	client->state = STATE_INIT;
+	if (xTaskCreatePinnedToCore(clientTask, "mqtt_task", client->taskStackSize, client, client->taskPriority, &client->task, tskNO_AFFINITY) != pdPASS)
+	{
+		client->run = false;
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (client->state != STATE_WAIT_RECONNECT)
+		return ESP_FAIL;
+	client->waitTimeoutMs = 0;
+	wake(client);
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (!client->run)
+	{
+		log_w("Client asked to disconnect, but was not started");
+		return ESP_FAIL;
+	}
+	client->disconnectRequested = true;
+	wake(client);
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	{
+		std::lock_guard<std::recursive_mutex> lock(client->api);
+		if (!client->run)
+		{
+			log_w("Client asked to stop, but was not started");
+			return ESP_FAIL;
+		}
+		if (xTaskGetCurrentTaskHandle() == client->task)
+		{
+			log_e("Client cannot be stopped from MQTT task");
+			return ESP_FAIL;
+		}
+		client->run = false;
+		wake(client);
+	}
+	std::unique_lock<std::mutex> stopLock(client->stopMutex);
+	client->stopCondition.wait(stopLock, [client]() { return client->stopped; });
+	client->task = nullptr;
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	if (client->run)
+		esp_mqtt_client_stop(client);
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		clients->erase(std::remove(clients->begin(), clients->end(), client), clients->end());
+	}
+	close(client->wakePipe[0]);
+	close(client->wakePipe[1]);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	esp_mqtt5_client_delete_user_property(client->publishProperty.user_property);
+#endif
+	delete client;
+	return ESP_OK;
+}
+
+static int subscribeTopics(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t* topics, int count)
+{
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (client->state != STATE_CONNECTED)
+	{
+		log_e("Client has not connected");
+		return -1;
+	}
+	int msgId = nextMsgId(client);
+	Writer w;
+	w.u16(msgId);
+	if (client->v5)
+		w.properties(Writer());
+	for (int i = 0; i < count; i++)
+	{
+		w.string(topics[i].filter, strlen(topics[i].filter));
+		w.u8((uint8_t)topics[i].qos);
+	}
+	client->outbox.push_back({ msgId, SUBSCRIBE, 1, w.finish((SUBSCRIBE << 4) | 0x02), nowMs(), nowMs(), false });
+	if (!writeAll(client, client->outbox.back().packet))
+	{
+		log_e("Error to subscribe topic=%s, qos=%d", topics[0].filter, topics[0].qos);
+		abortConnection(client);
+		return -1;
+	}
+	return msgId;
+}
+
+int esp_mqtt_client_subscribe_single(esp_mqtt_client_handle_t client, const char* topic, int qos)
+{
+	if (client == nullptr || topic == nullptr)
+		return -1;
+	esp_mqtt_topic_t t = { topic, qos };
+	return subscribeTopics(client, &t, 1);
+}
+
+int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t* topic_list, int size)
+{
+	if (client == nullptr || topic_list == nullptr || size <= 0)
+		return -1;
+	return subscribeTopics(client, topic_list, size);
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char* topic)
+{
+	if (client == nullptr || topic == nullptr)
+		return -1;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (client->state != STATE_CONNECTED)
+	{
+		log_e("Client has not connected");
+		return -1;
+	}
+	int msgId = nextMsgId(client);
+	Writer w;
+	w.u16(msgId);
+	if (client->v5)
+		w.properties(Writer());
+	w.string(topic, strlen(topic));
+	client->outbox.push_back({ msgId, UNSUBSCRIBE, 1, w.finish((UNSUBSCRIBE << 4) | 0x02), nowMs(), nowMs(), false });
+	if (!writeAll(client, client->outbox.back().packet))
+	{
+		abortConnection(client);
+		return -1;
+	}
+	return msgId;
+}
+
+static uint64_t outboxBytes(esp_mqtt_client_handle_t client)
+{
+	uint64_t size = 0;
+	for (const OutboxItem& item : client->outbox)
+		size += item.packet.size();
+	return size;
+}
+
+static Writer publishProperties(esp_mqtt_client_handle_t client)
+{
+	Writer w;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	const esp_mqtt5_publish_property_config_t& property = client->publishProperty;
+	if (property.payload_format_indicator)
+	{
+		w.u8(PAYLOAD_FORMAT_INDICATOR);
+		w.u8(1);
+	}
+	if (property.message_expiry_interval > 0)
+	{
+		w.u8(MESSAGE_EXPIRY_INTERVAL);
+		w.u32(property.message_expiry_interval);
+	}
+	if (property.topic_alias > 0)
+	{
+		w.u8(TOPIC_ALIAS);
+		w.u16(property.topic_alias);
+	}
+	if (property.response_topic != nullptr)
+	{
+		w.u8(RESPONSE_TOPIC);
+		w.string(client->publishResponseTopic);
+	}
+	if (property.correlation_data != nullptr)
+	{
+		w.u8(CORRELATION_DATA);
+		w.string(client->publishCorrelationData);
+	}
+	if (property.content_type != nullptr)
+	{
+		w.u8(CONTENT_TYPE);
+		w.string(client->publishContentType);
+	}
+	if (property.user_property != nullptr)
+	{
+		for (const std::pair<std::string, std::string>& item : property.user_property->items)
+		{
+			w.u8(USER_PROPERTY);
+			w.string(item.first);
+			w.string(item.second);
+		}
+	}
+#endif
+	return w;
+}
+
+// Builds the PUBLISH and stores it in the outbox when it has to wait (QoS > 0 or store), returns the message id,
+// 0 for a QoS 0 message, -1 on a bad argument and -2 when the outbox limit is reached.
+static int enqueuePublish(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain, bool store, std::vector<uint8_t>* packet)
+{
+	if (topic == nullptr || qos < 0 || qos > 2)
+		return -1;
+	// like esp-mqtt, a length of 0 means that data is a C string
+	if (len <= 0 && data != nullptr)
+		len = (int)strlen(data);
+	if (client->outboxLimit > 0 && qos > 0 && len + outboxBytes(client) > client->outboxLimit)
+		return -2;
+	int msgId = qos > 0 ? nextMsgId(client) : 0;
+	Writer w;
+	w.string(topic, strlen(topic));
+	if (qos > 0)
+		w.u16(msgId);
+	if (client->v5)
+		w.properties(publishProperties(client));
+	if (len > 0)
+		w.bytes(data, len);
+	*packet = w.finish((PUBLISH << 4) | (qos << 1) | (retain ? 0x01 : 0));
+	if (qos > 0 || store)
+		client->outbox.push_back({ msgId, PUBLISH, qos, *packet, nowMs(), nowMs(), true });
+	return msgId;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain)
+{
+	if (client == nullptr)
+		return -1;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	std::vector<uint8_t> packet;
+	int msgId = enqueuePublish(client, topic, data, len, qos, retain, false, &packet);
+	if (msgId < 0)
+		return msgId;
+	if (client->state != STATE_CONNECTED)
+	{
+		// QoS > 0 messages are resent after the next connect, QoS 0 messages are lost
+		deleteExpiredMessages(client);
+		return msgId;
+	}
+	if (qos > 0)
+		client->outbox.back().queued = false;
+	if (!writeAll(client, packet))
+	{
+		log_e("Error to public data to topic=%s, qos=%d", topic, qos);
+		abortConnection(client);
+		return -1;
+	}
+	return msgId;
+}
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain, bool store)
+{
+	if (client == nullptr)
+		return -1;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	std::vector<uint8_t> packet;
+	int msgId = enqueuePublish(client, topic, data, len, qos, retain, store, &packet);
+	// QoS 0 messages which aren't stored are not sent at all
+	if (msgId == 0 && !store)
+		return -1;
+	return msgId;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void* event_handler_arg)
+{
+	if (client == nullptr || event_handler == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	client->handlers.push_back({ event, event_handler, event_handler_arg });
+	return ESP_OK;
+}
+
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
+{
+	if (client == nullptr)
+		return 0;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	return (int)outboxBytes(client);
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+esp_err_t esp_mqtt5_client_set_publish_property(esp_mqtt5_client_handle_t client, const esp_mqtt5_publish_property_config_t* property)
+{
+	if (client == nullptr || property == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	std::lock_guard<std::recursive_mutex> lock(client->api);
+	if (!client->v5)
+	{
+		log_e("MQTT 5 properties need protocol_ver MQTT_PROTOCOL_V_5");
+		return ESP_FAIL;
+	}
+	if (property->topic_alias > client->topicAliasMaximum)
+	{
+		log_e("Topic alias %d is bigger than server support %d", property->topic_alias, client->topicAliasMaximum);
+		return ESP_FAIL;
+	}
+	mqtt5_user_property_handle_t userProperty = client->publishProperty.user_property;
+	client->publishProperty = *property;
+	client->publishProperty.user_property = userProperty;
+	client->publishResponseTopic = copyString(property->response_topic);
+	client->publishCorrelationData.assign(property->correlation_data != nullptr ? property->correlation_data : "", property->correlation_data != nullptr ? property->correlation_data_len : 0);
+	client->publishContentType = copyString(property->content_type);
+	// the list is copied, the caller keeps its own
+	if (userProperty != nullptr)
+		userProperty->items.clear();
+	if (property->user_property != nullptr)
+	{
+		if (userProperty == nullptr)
+			client->publishProperty.user_property = new esp_mqtt5_user_property_list_t();
+		client->publishProperty.user_property->items = property->user_property->items;
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt5_client_set_user_property(mqtt5_user_property_handle_t* user_property, esp_mqtt5_user_property_item_t item[], uint8_t item_num)
+{
+	if (user_property == nullptr || (item == nullptr && item_num > 0))
+		return ESP_ERR_INVALID_ARG;
+	if (*user_property == nullptr)
+		*user_property = new esp_mqtt5_user_property_list_t();
+	for (uint8_t i = 0; i < item_num; i++)
+		(*user_property)->items.emplace_back(copyString(item[i].key), copyString(item[i].value));
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt5_client_get_user_property(mqtt5_user_property_handle_t user_property, esp_mqtt5_user_property_item_t* item, uint8_t* item_num)
+{
+	if (user_property == nullptr || item == nullptr || item_num == nullptr)
+		return ESP_ERR_INVALID_ARG;
+	if (*item_num < user_property->items.size())
+	{
+		log_e("User property item number is not enough");
+		return ESP_FAIL;
+	}
+	for (size_t i = 0; i < user_property->items.size(); i++)
+	{
+		item[i].key = strdup(user_property->items[i].first.c_str());
+		item[i].value = strdup(user_property->items[i].second.c_str());
+	}
+	*item_num = (uint8_t)user_property->items.size();
+	return ESP_OK;
+}
+
+uint8_t esp_mqtt5_client_get_user_property_count(mqtt5_user_property_handle_t user_property)
+{
+	return user_property != nullptr ? (uint8_t)user_property->items.size() : 0;
+}
+
+void esp_mqtt5_client_delete_user_property(mqtt5_user_property_handle_t user_property)
+{
+	delete user_property;
+}
+#endif
+
+bool ESP32_MQTTHostEvents::dispatch(const char* clientId, esp_mqtt_event_t* event)
+{
+	esp_mqtt_client_handle_t client = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		for (esp_mqtt_client_handle_t c : *clients)
+		{
+			if (c->clientId == clientId)
+				client = c;
+		}
+	}
+	if (client == nullptr)
+		return false;
+	dispatchEvent(client, event);
+	return true;
+}
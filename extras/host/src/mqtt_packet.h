@@ -0,0 +1,243 @@
+#pragma once
+
+// MQTT 3.1.1 and MQTT 5 packet encoding shared by the esp-mqtt stand-in and the loopback broker.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace ESP32_MQTTHostPacket
+{
+    enum Type : uint8_t
+    {
+        CONNECT = 1,
+        CONNACK = 2,
+        PUBLISH = 3,
+        PUBACK = 4,
+        PUBREC = 5,
+        PUBREL = 6,
+        PUBCOMP = 7,
+        SUBSCRIBE = 8,
+        SUBACK = 9,
+        UNSUBSCRIBE = 10,
+        UNSUBACK = 11,
+        PINGREQ = 12,
+        PINGRESP = 13,
+        DISCONNECT = 14
+    };
+
+    // MQTT 5 properties the stand-ins use, nextProperty() reads all of them
+    enum PropertyId : uint8_t
+    {
+        PAYLOAD_FORMAT_INDICATOR = 0x01,
+        MESSAGE_EXPIRY_INTERVAL = 0x02,
+        CONTENT_TYPE = 0x03,
+        RESPONSE_TOPIC = 0x08,
+        CORRELATION_DATA = 0x09,
+        SUBSCRIPTION_IDENTIFIER = 0x0B,
+        TOPIC_ALIAS_MAXIMUM = 0x22,
+        TOPIC_ALIAS = 0x23,
+        USER_PROPERTY = 0x26
+    };
+
+    struct Writer
+    {
+        std::vector<uint8_t> body;
+
+        void u8(uint8_t value) { body.push_back(value); }
+        void u16(uint16_t value) { body.push_back(value >> 8); body.push_back(value & 0xFF); }
+        void bytes(const void* data, size_t length) { body.insert(body.end(), (const uint8_t*)data, (const uint8_t*)data + length); }
+        void string(const char* data, size_t length) { u16((uint16_t)length); bytes(data, length); }
+        void string(const std::string& value) { string(value.data(), value.size()); }
+        void u32(uint32_t value) { u16(value >> 16); u16(value & 0xFFFF); }
+        void varint(size_t value) { varint(body, value); }
+
+        // MQTT 5 property length and the properties written into properties
+        void properties(const Writer& properties)
+        {
+            varint(properties.body.size());
+            bytes(properties.body.data(), properties.body.size());
+        }
+
+        // the complete packet: fixed header, remaining length and the body written so far
+        std::vector<uint8_t> finish(uint8_t firstByte) const
+        {
+            std::vector<uint8_t> packet;
+            packet.reserve(body.size() + 5);
+            packet.push_back(firstByte);
+            varint(packet, body.size());
+            packet.insert(packet.end(), body.begin(), body.end());
+            return packet;
+        }
+
+        static void varint(std::vector<uint8_t>& out, size_t value)
+        {
+            do
+            {
+                uint8_t digit = value % 128;
+                value /= 128;
+                out.push_back(value > 0 ? digit | 0x80 : digit);
+            } while (value > 0);
+        }
+    };
+
+    struct Reader
+    {
+        const uint8_t* data;
+        size_t length;
+        size_t position;
+        bool failed;
+
+        Reader(const uint8_t* data, size_t length) : data(data), length(length), position(0), failed(false) {}
+        size_t remaining() const { return length - position; }
+        uint8_t u8() { if (remaining() < 1) { failed = true; return 0; } return data[position++]; }
+        uint16_t u16() { if (remaining() < 2) { failed = true; return 0; } uint16_t value = (data[position] << 8) | data[position + 1]; position += 2; return value; }
+        std::string string()
+        {
+            uint16_t stringLength = u16();
+            if (failed || remaining() < stringLength) { failed = true; return std::string(); }
+            std::string value((const char*)data + position, stringLength);
+            position += stringLength;
+            return value;
+        }
+        uint32_t u32() { uint32_t high = u16(); return (high << 16) | u16(); }
+        uint32_t varint()
+        {
+            uint32_t value = 0;
+            for (int shift = 0; shift < 28; shift += 7)
+            {
+                uint8_t digit = u8();
+                value |= (uint32_t)(digit & 0x7F) << shift;
+                if (failed || (digit & 0x80) == 0)
+                    return value;
+            }
+            failed = true;
+            return 0;
+        }
+        // the MQTT 5 properties at the position, skipped in this reader
+        Reader properties()
+        {
+            uint32_t propertiesLength = varint();
+            if (failed || remaining() < propertiesLength) { failed = true; return Reader(data, 0); }
+            Reader properties(data + position, propertiesLength);
+            position += propertiesLength;
+            return properties;
+        }
+    };
+
+    // One MQTT 5 property: numbers in value, strings and binary data in data (a user property's value in data2).
+    // begin/end delimit the whole property in the property reader, to copy it to another packet.
+    struct Property
+    {
+        uint8_t id;
+        uint32_t value;
+        const char* data;
+        size_t length;
+        const char* data2;
+        size_t length2;
+        size_t begin;
+        size_t end;
+    };
+
+    // Reads the next property, false at the end or when the property is malformed or unknown (then r.failed is set).
+    inline bool nextProperty(Reader& r, Property& p)
+    {
+        if (r.remaining() == 0 || r.failed)
+            return false;
+        p = {};
+        p.begin = r.position;
+        p.id = r.u8();
+        auto readBinary = [&r](const char*& data, size_t& length) {
+            length = r.u16();
+            if (r.failed || r.remaining() < length) { r.failed = true; return; }
+            data = (const char*)r.data + r.position;
+            r.position += length;
+        };
+        // grouped by the type of the value
+        switch (p.id)
+        {
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            p.value = r.u8();
+            break;
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            p.value = r.u16();
+            break;
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            p.value = r.u32();
+            break;
+        case 0x0B:
+            p.value = r.varint();
+            break;
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            readBinary(p.data, p.length);
+            break;
+        case 0x26:
+            readBinary(p.data, p.length);
+            readBinary(p.data2, p.length2);
+            break;
+        default:
+            r.failed = true;
+            break;
+        }
+        p.end = r.position;
+        return !r.failed;
+    }
+
+    // Length of the complete packet at the start of buffer, 0 when more bytes are needed, -1 when malformed.
+    inline long frameLength(const uint8_t* buffer, size_t available, size_t* headerLength)
+    {
+        size_t remaining = 0;
+        size_t multiplier = 1;
+        for (size_t i = 1; i < 5; i++)
+        {
+            if (i >= available)
+                return 0;
+            remaining += (buffer[i] & 0x7F) * multiplier;
+            multiplier *= 128;
+            if ((buffer[i] & 0x80) == 0)
+            {
+                *headerLength = i + 1;
+                return available >= i + 1 + remaining ? (long)(i + 1 + remaining) : 0;
+            }
+        }
+        return -1;
+    }
+
+    inline std::vector<uint8_t> ack(uint8_t firstByte, uint16_t packetId)
+    {
+        Writer w;
+        w.u16(packetId);
+        return w.finish(firstByte);
+    }
+
+    // Topic filter matching with + and # wildcards, topics starting with $ don't match wildcards at the first level.
+    inline bool matches(const std::string& filter, const std::string& topic)
+    {
+        if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#'))
+            return false;
+        size_t f = 0, t = 0;
+        while (f < filter.size())
+        {
+            if (filter[f] == '#')
+                return true;
+            if (filter[f] == '+')
+            {
+                while (t < topic.size() && topic[t] != '/')
+                    t++;
+                f++;
+            }
+            else
+            {
+                if (t >= topic.size() || filter[f] != topic[t])
+                {
+                    // "a/#" also matches "a"
+                    return t == topic.size() && filter.compare(f, std::string::npos, "/#") == 0;
+                }
+                f++;
+                t++;
+            }
+        }
+        return t == topic.size();
+    }
+}
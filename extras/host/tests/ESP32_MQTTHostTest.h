@@ -0,0 +1,24 @@
+#pragma once
+
+// Minimal checks for the host tests: a failed CHECK prints the condition and makes main() return 1.
+#include <ESP32_MQTTHost.h>
+#include <stdio.h>
+
+static int esp32MqttHostTestFailures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); esp32MqttHostTestFailures++; } } while (0)
+#define TEST_RESULT() (printf(esp32MqttHostTestFailures == 0 ? "OK\n" : "%d check(s) failed\n", esp32MqttHostTestFailures), esp32MqttHostTestFailures == 0 ? 0 : 1)
+
+// waits until condition() is true, false after timeoutMs
+template<typename Condition>
+static bool waitFor(Condition condition, unsigned long timeoutMs = 5000)
+{
+    unsigned long start = millis();
+    while (!condition())
+    {
+        if (millis() - start > timeoutMs)
+            return false;
+        delay(1);
+    }
+    return true;
+}
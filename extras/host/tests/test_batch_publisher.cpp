@@ -0,0 +1,89 @@
+// Batch publisher: coalescing, the flush after the window (from the flush task), packing and unpacking.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTBatchPublisher.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0);
+    std::mutex receivedMutex;
+    std::vector<std::pair<std::string, std::string>> received;
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("batch-test");
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("batch/#", 0); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        received.push_back({ std::string(topic, topicLen), std::string(data, dataLen) });
+    });
+    auto receivedCount = [&]() {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        return received.size();
+    };
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    // repeated QoS 0 values of a topic are coalesced, QoS 1 values are kept
+    {
+        ESP32_MQTTBatchPublisher batch(client);
+        CHECK(batch.begin(8, 32, 16, 50));
+        CHECK(batch.publish("batch/a", "1") == 0);
+        CHECK(batch.publish("batch/a", "2") == 0);
+        CHECK(batch.publish("batch/a", "3") == 0);
+        CHECK(batch.publish("batch/b", "1", 1) == 0);
+        CHECK(batch.publish("batch/b", "2", 1) == 0);
+        CHECK(batch.publish("batch/this/topic/is/longer/than/32", "1") == -1);
+        CHECK(waitFor([&]() { return receivedCount() == 3; }));
+        ESP32_MQTTBatchStats stats = batch.getStats();
+        CHECK(stats.valuesSubmitted == 5);
+        CHECK(stats.packetsSaved == 2);
+        CHECK(stats.packetsSent == 3);
+        CHECK(stats.batches == 1);
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        CHECK(received[0] == std::make_pair(std::string("batch/a"), std::string("3")));
+    }
+
+    // the QoS 0 values of a batch travel in one message, the QoS 1 value on its own
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        received.clear();
+    }
+    ESP32_MQTTBatchPublisher packed(client);
+    packed.enablePacking("batch/packed", 256);
+    CHECK(packed.begin(8, 32, 16, 50));
+    CHECK(packed.publish("sensors/1", "21.5") == 0);
+    CHECK(packed.publish("sensors/2", "") == 0);
+    CHECK(packed.publish("sensors/3", "40") == 0);
+    CHECK(packed.publish("batch/alarm", "on", 1) == 0);
+    CHECK(waitFor([&]() { return receivedCount() == 2; }));
+    CHECK(packed.getStats().valuesPacked == 3);
+    CHECK(packed.getStats().packetsSent == 2);
+
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        for (auto& m : received)
+            if (m.first == "batch/packed")
+                message = m.second;
+    }
+    std::vector<std::string> values;
+    CHECK(ESP32_MQTTBatchPublisher::unpack((const uint8_t*)message.data(), message.size(), [&](const char* topic, size_t topicLen, const uint8_t* payload, size_t length) {
+        values.push_back(std::string(topic, topicLen) + "=" + std::string((const char*)payload, length));
+    }));
+    CHECK(values.size() == 3);
+    CHECK(values.size() == 3 && values[0] == "sensors/1=21.5" && values[1] == "sensors/2=" && values[2] == "sensors/3=40");
+    CHECK(!ESP32_MQTTBatchPublisher::unpack((const uint8_t*)message.data(), message.size() - 1, [](const char*, size_t, const uint8_t*, size_t) {}));
+    packed.end();
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
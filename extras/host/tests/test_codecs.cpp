@@ -0,0 +1,91 @@
+// Round trips and malformed input of the text, CBOR and raw payload codecs.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTCodecs.h>
+#include <math.h>
+#include <string>
+
+template<template<typename> class Codec, typename T>
+static bool roundTrip(T value)
+{
+    uint8_t buf[Codec<T>::maxSize];
+    size_t length = Codec<T>::encode(value, buf);
+    T decoded {};
+    return length <= Codec<T>::maxSize && Codec<T>::decode(buf, length, decoded) && decoded == value;
+}
+
+template<typename T>
+static std::string text(T value)
+{
+    uint8_t buf[ESP32_MQTTTextCodec<T>::maxSize];
+    size_t length = ESP32_MQTTTextCodec<T>::encode(value, buf);
+    return std::string((const char*)buf, length);
+}
+
+template<template<typename> class Codec, typename T>
+static bool decode(const char* data, T& value)
+{
+    return Codec<T>::decode((const uint8_t*)data, strlen(data), value);
+}
+
+int main()
+{
+    // text
+    CHECK(text(21.5f) == "21.5");
+    CHECK(text(-0.0625) == "-0.0625");
+    CHECK(text(1013.25) == "1013.25");
+    CHECK(text(true) == "true");
+    CHECK(text((int64_t)INT64_MIN) == "-9223372036854775808");
+    CHECK(text((uint64_t)UINT64_MAX) == "18446744073709551615");
+    CHECK(roundTrip<ESP32_MQTTTextCodec>(21.5f));
+    CHECK(roundTrip<ESP32_MQTTTextCodec>((int8_t)-128));
+    CHECK(roundTrip<ESP32_MQTTTextCodec>((int64_t)INT64_MIN));
+    CHECK(roundTrip<ESP32_MQTTTextCodec>((uint64_t)UINT64_MAX));
+    CHECK(roundTrip<ESP32_MQTTTextCodec>(false));
+    double d = 0;
+    CHECK(decode<ESP32_MQTTTextCodec>(text(1.23e20).c_str(), d) && fabs(d - 1.23e20) < 1e14);
+    CHECK(decode<ESP32_MQTTTextCodec>(text(3.5e-7).c_str(), d) && fabs(d - 3.5e-7) < 1e-12);
+    float f = 0;
+    CHECK(decode<ESP32_MQTTTextCodec>(text(0.1f).c_str(), f) && f == 0.1f);
+    int i = 0;
+    CHECK(!decode<ESP32_MQTTTextCodec>("12x", i));
+    CHECK(!decode<ESP32_MQTTTextCodec>("", i));
+    uint8_t u8 = 0;
+    CHECK(!decode<ESP32_MQTTTextCodec>("300", u8));
+    CHECK(!decode<ESP32_MQTTTextCodec>("-1", u8));
+    bool b = false;
+    CHECK(decode<ESP32_MQTTTextCodec>("1", b) && b);
+    CHECK(!decode<ESP32_MQTTTextCodec>("yes", b));
+
+    // CBOR
+    CHECK(roundTrip<ESP32_MQTTCborCodec>(21.5f));
+    CHECK(roundTrip<ESP32_MQTTCborCodec>(3.14159));
+    CHECK(roundTrip<ESP32_MQTTCborCodec>(-1000000));
+    CHECK(roundTrip<ESP32_MQTTCborCodec>((int64_t)INT64_MIN));
+    CHECK(roundTrip<ESP32_MQTTCborCodec>((uint16_t)500));
+    CHECK(roundTrip<ESP32_MQTTCborCodec>(false));
+    uint8_t buf[ESP32_MQTTCborCodec<int>::maxSize];
+    CHECK(ESP32_MQTTCborCodec<int>::encode(23, buf) == 1);
+    CHECK(ESP32_MQTTCborCodec<int>::encode(-1000000, buf) == 5);
+    const uint8_t half[] = { 0xf9, 0x3c, 0x00 };    // 1.0 in half precision
+    CHECK(ESP32_MQTTCborCodec<float>::decode(half, sizeof(half), f) && f == 1.0f);
+    const uint8_t negative[] = { 0x20 };            // -1
+    unsigned int u = 0;
+    CHECK(!ESP32_MQTTCborCodec<unsigned int>::decode(negative, sizeof(negative), u));
+    CHECK(ESP32_MQTTCborCodec<int>::decode(negative, sizeof(negative), i) && i == -1);
+    CHECK(!ESP32_MQTTCborCodec<int>::decode(half, sizeof(half), i));
+    const uint8_t truncated[] = { 0x1a, 0x00 };
+    CHECK(!ESP32_MQTTCborCodec<int>::decode(truncated, sizeof(truncated), i));
+
+    // raw
+    struct Reading
+    {
+        int32_t id;
+        float value;
+        bool operator==(const Reading& other) const { return id == other.id && value == other.value; }
+    };
+    CHECK(roundTrip<ESP32_MQTTRawCodec>(42.0f));
+    CHECK(roundTrip<ESP32_MQTTRawCodec>(Reading { 7, -3.25f }));
+    CHECK(!ESP32_MQTTRawCodec<float>::decode(half, sizeof(half), f));
+
+    return TEST_RESULT();
+}
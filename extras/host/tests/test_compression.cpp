@@ -0,0 +1,174 @@
+// Compression: a JSON payload goes through enableCompression(), publish() and the receiving handler unchanged while a
+// client without compression sees the LZ4 block, incompressible and short payloads are sent stored, and a malformed
+// message is dropped. ESP32_MQTTCompressor::decompress() rejects a truncated block, a match offset past the output and
+// an announced length over the limit.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const size_t MaxMessageSize = 8192;
+
+struct Subscriber
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed { 0 };
+    std::mutex receivedMutex;
+    std::map<std::string, std::string> received;
+
+    void start(const char* uri, const char* name)
+    {
+        client.setBrokerUri(uri);
+        client.setClientName(name);
+        client.onMqttConnected([this](int sessionPresent) { client.subscribe("zip/#", 0); });
+        client.onMqttTopicSubscribed([this](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+        client.onMqttMessageReceived([this](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+            std::lock_guard<std::mutex> lock(receivedMutex);
+            received[std::string(topic, topicLen)] = std::string(data, dataLen);
+        });
+        CHECK(client.start());
+        CHECK(waitFor([this]() { return subscribed == 1; }));
+    }
+
+    bool has(const std::string& topic)
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        return received.count(topic) > 0;
+    }
+
+    std::string get(const std::string& topic)
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        return received[topic];
+    }
+};
+
+static std::string telemetryJson()
+{
+    std::string json = "{\"device\":\"esp32-01\",\"readings\":[";
+    for (int i = 0; i < 40; i++)
+        json += (i > 0 ? "," : "") + std::string("{\"sensor\":\"temperature-") + std::to_string(i % 8) + "\",\"value\":" + std::to_string(20 + i % 7) + ".5,\"unit\":\"C\"}";
+    return json + "]}";
+}
+
+static std::string randomBytes(size_t length)
+{
+    std::string data(length, '\0');
+    uint32_t state = 12345;
+    for (size_t i = 0; i < length; i++)
+    {
+        state = state * 1103515245u + 12345u;
+        data[i] = (char)(state >> 24);
+    }
+    return data;
+}
+
+static void testRoundTrip(ESP32_MQTTHostBroker& broker)
+{
+    ESP32_MQTTClient sender;
+    std::atomic<int> connected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("compression-sender");
+    CHECK(sender.enableCompression("zip/#", MaxMessageSize));
+    sender.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+
+    Subscriber receiver, raw;
+    // stored payloads bigger than the in buffer are decompressed after reassembly
+    CHECK(receiver.client.enableCompression("zip/#", MaxMessageSize));
+    receiver.client.enableMessageReassembly(MaxMessageSize);
+    receiver.start(broker.getUri(), "compression-receiver");
+    raw.client.setMaxInPacketSize(MaxMessageSize);
+    raw.start(broker.getUri(), "compression-raw");
+
+    // compressible, the peer without compression gets the header and the LZ4 block
+    std::string json = telemetryJson();
+    CHECK(sender.publish("zip/json", (const uint8_t*)json.data(), json.size(), 1) > 0);
+    CHECK(waitFor([&]() { return receiver.has("zip/json") && raw.has("zip/json"); }));
+    CHECK(receiver.get("zip/json") == json);
+    std::string block = raw.get("zip/json");
+    CHECK(block.size() < json.size() / 2 && block[0] == 1);
+    CHECK(ESP32_MQTTCompressor::getOriginalLength((const uint8_t*)block.data(), block.size()) == (int)json.size());
+    std::vector<uint8_t> out(MaxMessageSize);
+    CHECK(ESP32_MQTTCompressor::decompress((const uint8_t*)block.data(), block.size(), out.data(), out.size()) == (int)json.size());
+    CHECK(memcmp(out.data(), json.data(), json.size()) == 0);
+    CHECK(sender.getCompressionInputBytes() == json.size() && sender.getCompressionOutputBytes() == block.size());
+
+    // incompressible and short payloads are stored
+    std::string random = randomBytes(2000), shortText = "short";
+    CHECK(sender.publish("zip/random", (const uint8_t*)random.data(), random.size(), 1) > 0);
+    CHECK(sender.publish("zip/short", shortText.c_str(), 1) > 0);
+    CHECK(waitFor([&]() { return receiver.has("zip/random") && raw.has("zip/random") && receiver.has("zip/short") && raw.has("zip/short"); }));
+    CHECK(receiver.get("zip/random") == random);
+    CHECK(raw.get("zip/random") == std::string("\0\xd0\x07\0\0", 5) + random);    // method 0, length 2000
+    CHECK(receiver.get("zip/short") == shortText);
+    CHECK(raw.get("zip/short") == std::string("\0\x05\0\0\0", 5) + shortText);
+
+    // a malformed message from a peer without compression is dropped, the next one gets through
+    std::string truncated = block.substr(0, block.size() - 10);
+    CHECK(raw.client.publish("zip/broken", (const uint8_t*)truncated.data(), truncated.size(), 1) > 0);
+    CHECK(sender.publish("zip/after", (const uint8_t*)json.data(), json.size(), 1) > 0);
+    CHECK(waitFor([&]() { return receiver.has("zip/after"); }));
+    CHECK(receiver.get("zip/after") == json);
+    CHECK(!receiver.has("zip/broken"));
+    CHECK(receiver.client.getDecompressionDropCount() == 1);
+
+    CHECK(raw.client.stop());
+    CHECK(receiver.client.stop());
+    CHECK(sender.stop());
+}
+
+static void testMalformed()
+{
+    ESP32_MQTTCompressor compressor;
+    CHECK(compressor.init());
+    std::string json = telemetryJson();
+    std::vector<uint8_t> block(ESP32_MQTTCompressor::getMaxCompressedSize(json.size()));
+    size_t blockLen = compressor.compress((const uint8_t*)json.data(), json.size(), block.data(), block.size());
+    CHECK(blockLen > 0 && block[0] == 1);
+    std::vector<uint8_t> out(json.size());
+    CHECK(ESP32_MQTTCompressor::decompress(block.data(), blockLen, out.data(), out.size()) == (int)json.size());
+
+    // truncated anywhere in the block
+    for (size_t length = 0; length < blockLen; length++)
+        CHECK(ESP32_MQTTCompressor::decompress(block.data(), length, out.data(), out.size()) == -1);
+
+    // one literal, then a match 5 bytes back
+    uint8_t pastOutput[] = { 1, 10, 0, 0, 0, 0x10, 'a', 5, 0, 'b', 'c', 'd', 'e', 'f' };
+    CHECK(ESP32_MQTTCompressor::decompress(pastOutput, sizeof(pastOutput), out.data(), out.size()) == -1);
+    // a zero offset
+    uint8_t zeroOffset[] = { 1, 10, 0, 0, 0, 0x10, 'a', 0, 0 };
+    CHECK(ESP32_MQTTCompressor::decompress(zeroOffset, sizeof(zeroOffset), out.data(), out.size()) == -1);
+
+    // announced length over the output buffer, for both methods
+    uint8_t tooLong[] = { 1, 0xa0, 0x86, 0x01, 0, 0x10, 'a' };    // 100000
+    CHECK(ESP32_MQTTCompressor::getOriginalLength(tooLong, sizeof(tooLong)) == 100000);
+    CHECK(ESP32_MQTTCompressor::decompress(tooLong, sizeof(tooLong), out.data(), out.size()) == -1);
+    tooLong[0] = 0;
+    CHECK(ESP32_MQTTCompressor::decompress(tooLong, sizeof(tooLong), out.data(), out.size()) == -1);
+    CHECK(ESP32_MQTTCompressor::decompress(block.data(), blockLen, out.data(), json.size() - 1) == -1);
+    // and over INT32_MAX
+    uint8_t huge[] = { 1, 0xff, 0xff, 0xff, 0xff, 0x10, 'a' };
+    CHECK(ESP32_MQTTCompressor::getOriginalLength(huge, sizeof(huge)) == -1);
+
+    // a block decoding to less than announced, an unknown method
+    uint8_t shorter[] = { 1, 10, 0, 0, 0, 0x20, 'a', 'b' };
+    CHECK(ESP32_MQTTCompressor::decompress(shorter, sizeof(shorter), out.data(), out.size()) == -1);
+    uint8_t method[] = { 2, 1, 0, 0, 0, 'a' };
+    CHECK(ESP32_MQTTCompressor::decompress(method, sizeof(method), out.data(), out.size()) == -1);
+}
+
+int main()
+{
+    testMalformed();
+
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    testRoundTrip(broker);
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,102 @@
+// Connection manager bridging two loopback brokers: topics rewritten in both directions, a message bigger than the in
+// packet size forwarded through the shared reassembly buffers, and messages it can't forward counted as dropped.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTConnectionManager.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Endpoint
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> connected { 0 };
+    std::atomic<int> subscribed { 0 };
+    std::mutex messagesMutex;
+    std::vector<std::pair<std::string, std::string>> messages;
+
+    bool start(ESP32_MQTTHostBroker& broker, const char* name, const char* topicFilter)
+    {
+        client.setBrokerUri(broker.getUri());
+        client.setClientName(name);
+        client.onMqttConnected([this, topicFilter](int sessionPresent) {
+            connected++;
+            client.subscribe(topicFilter, 0);
+        });
+        client.onMqttTopicSubscribed([this](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+        client.onMqttMessageReceived([this](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            messages.emplace_back(std::string(topic, topicLen), std::string(data, dataLen));
+        });
+        return client.start();
+    }
+
+    size_t count()
+    {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        return messages.size();
+    }
+};
+
+int main()
+{
+    ESP32_MQTTHostBroker plantBroker, cloudBroker;
+    CHECK(plantBroker.begin());
+    CHECK(cloudBroker.begin());
+
+    Endpoint plantDevice, cloudService;
+    cloudService.client.enableMessageReassembly(8192);
+    CHECK(plantDevice.start(plantBroker, "manager-test-plant", "plant/commands/#"));
+    CHECK(cloudService.start(cloudBroker, "manager-test-cloud", "site-42/plant/#"));
+
+    ESP32_MQTTConnectionManager manager;
+    int plant = manager.addConnection(plantBroker.getUri());
+    int cloud = manager.addConnection(cloudBroker.getUri());
+    CHECK(plant == 0 && cloud == 1);
+    manager.enableSharedDispatch(16);
+    manager.enableSharedReassembly(8192, 2);
+    CHECK(manager.addForwardingRule(plant, "line1/#", cloud, 1, "plant/", "site-42/plant/") >= 0);
+    CHECK(manager.addForwardingRule(cloud, "#", plant, 1, "site-42/commands/", "plant/commands/") >= 0);
+    CHECK(manager.start());
+    ESP32_MQTTClient* plantConnection = manager.getConnection(plant);
+    ESP32_MQTTClient* cloudConnection = manager.getConnection(cloud);
+    CHECK(plantConnection != nullptr && cloudConnection != nullptr);
+    if (plantConnection == nullptr || cloudConnection == nullptr)
+        return TEST_RESULT();
+    CHECK(waitFor([&]() {
+        return plantConnection->isConnected() && cloudConnection->isConnected() && plantDevice.subscribed == 1 && cloudService.subscribed == 1;
+    }));
+    delay(200);     // until the forwarding subscriptions are acknowledged
+
+    plantDevice.client.publish("plant/line1/press/temperature", (const uint8_t*)"21.5", 4, 0, false);
+    plantDevice.client.publish("plant/line2/press/temperature", (const uint8_t*)"22.5", 4, 0, false);     // no rule
+    cloudService.client.publish("site-42/commands/line1/stop", (const uint8_t*)"now", 3, 1, false);
+    CHECK(waitFor([&]() { return cloudService.count() == 1 && plantDevice.count() == 1; }));
+    CHECK(cloudService.messages[0].first == "site-42/plant/line1/press/temperature" && cloudService.messages[0].second == "21.5");
+    CHECK(plantDevice.messages[0].first == "plant/commands/line1/stop" && plantDevice.messages[0].second == "now");
+
+    // bigger than the 1024 byte in packet size, arrives in chunks
+    std::string big(6000, '\0');
+    for (size_t i = 0; i < big.size(); i++)
+        big[i] = 'a' + i % 26;
+    plantDevice.client.publish("plant/line1/press/recipe", (const uint8_t*)big.data(), big.size(), 0, false);
+    CHECK(waitFor([&]() { return cloudService.count() == 2; }));
+    CHECK(cloudService.messages[1].first == "site-42/plant/line1/press/recipe" && cloudService.messages[1].second == big);
+    CHECK(manager.getForwardedCount() == 3);
+    CHECK(manager.getForwardDropCount() == 0);
+
+    // the rewritten topic would be longer than ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH
+    std::string longTopic = "plant/line1/" + std::string(ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH, 'x');
+    plantDevice.client.publish(longTopic.c_str(), (const uint8_t*)"1", 1, 0, false);
+    CHECK(waitFor([&]() { return manager.getForwardDropCount() == 1; }));
+    delay(200);
+    CHECK(cloudService.count() == 2);
+    CHECK(manager.getForwardedCount() == 3);
+
+    CHECK(manager.stop());
+    plantDevice.client.stop();
+    cloudService.client.stop();
+    plantBroker.end();
+    cloudBroker.end();
+    return TEST_RESULT();
+}
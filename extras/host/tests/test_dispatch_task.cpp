@@ -0,0 +1,161 @@
+// Dispatch task: the event queue passes events from a synthetic producer thread intact and in order, counting the
+// drops when it is full, and a slow message handler in the dispatch task doesn't keep the MQTT task from reading. A full
+// queue drops messages and callbacks, but SUBACKs and a reconnect are still handled for the restored subscriptions.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTEventQueue.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+static const int QueueEvents = 200000;
+
+static void testQueue()
+{
+    ESP32_MQTTEventQueue queue;
+    CHECK(queue.init(64, 32));
+    CHECK(queue.getCapacity() == 64);
+
+    std::atomic<int> pushed(0), dropped(0);
+    std::atomic<bool> producing(true);
+    // plays the MQTT task, bursts overrun the consumer now and then
+    std::thread producer([&]() {
+        for (int i = 0; i < QueueEvents; i++)
+        {
+            std::string topic = "t/" + std::to_string(i);
+            esp_mqtt_event_t event = {};
+            event.msg_id = i;
+            event.topic = (char*)topic.data();
+            event.topic_len = topic.size();
+            event.data = (char*)&i;
+            event.data_len = sizeof(i);
+            if (queue.push(MQTT_EVENT_DATA, &event, nullptr))
+                pushed++;
+            else
+                dropped++;
+            // mostly paced, a burst of 512 every 10000 events
+            if (i % 10000 >= 512)
+                std::this_thread::sleep_for(std::chrono::microseconds(1));
+        }
+        producing = false;
+    });
+
+    int received = 0, lastId = -1, corrupted = 0;
+    while (producing || queue.front() != nullptr)
+    {
+        ESP32_MQTTQueuedEvent* queued = queue.front();
+        if (queued == nullptr)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        const esp_mqtt_event_t& event = queued->event;
+        std::string topic = "t/" + std::to_string(event.msg_id);
+        int data;
+        memcpy(&data, event.data, sizeof(data));
+        if (event.msg_id <= lastId || queued->eventId != MQTT_EVENT_DATA || event.topic_len != (int)topic.size()
+            || memcmp(event.topic, topic.data(), topic.size()) != 0 || event.data_len != sizeof(data) || data != event.msg_id)
+            corrupted++;
+        lastId = event.msg_id;
+        received++;
+        queue.pop();
+    }
+    producer.join();
+
+    CHECK(corrupted == 0);
+    CHECK(received == pushed);
+    CHECK(received + dropped == QueueEvents);
+    CHECK(queue.getDropCount() == (unsigned int)dropped);
+    CHECK(queue.getHighWaterMark() <= 64);
+    printf("queue: %d events passed, %d dropped, high-water mark %u\n", received, (int)dropped, (unsigned int)queue.getHighWaterMark());
+
+    // an event bigger than the slot is dropped
+    esp_mqtt_event_t big = {};
+    char data[64] = {};
+    big.data = data;
+    big.data_len = sizeof(data);
+    CHECK(!queue.push(MQTT_EVENT_DATA, &big, nullptr));
+    CHECK(queue.getDropCount() == (unsigned int)dropped + 1);
+    queue.deinit();
+}
+
+int main()
+{
+    testQueue();
+
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), subscribed(0), received(0), restored(0);
+    std::atomic<bool> handlerBlocked(false), releaseHandler(false);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("dispatch-test");
+    client.setReconnectTimeout(100);
+    client.enableDispatchTask(16);
+    client.enableAutoResubscribe();
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttSubscriptionsRestored([&](int subscribedCount, int failedCount) {
+        if (subscribedCount == 2 && failedCount == 0)
+            restored++;
+    });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        // the first message blocks the handler, like a slow flash write
+        if (received++ == 0)
+        {
+            handlerBlocked = true;
+            waitFor([&]() { return releaseHandler.load(); });
+            handlerBlocked = false;
+        }
+    });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+    CHECK(client.subscribe("dispatch/#", 0) >= 0);
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    ESP32_MQTTClient sender;
+    std::atomic<int> senderConnected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("dispatch-sender");
+    sender.setReconnectTimeout(100);
+    sender.onMqttConnected([&](int sessionPresent) { senderConnected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return senderConnected == 1; }));
+
+    CHECK(sender.publish("dispatch/slow", "0", 0) >= 0);
+    CHECK(waitFor([&]() { return handlerBlocked.load(); }));
+    // the MQTT task keeps reading while the handler is blocked, the queue fills up and then drops
+    for (int i = 1; i <= 100; i++)
+        CHECK(sender.publish("dispatch/burst", std::to_string(i).c_str(), 0) >= 0);
+    // the slot of the blocked message is freed after its handler, 15 of the burst fit
+    CHECK(waitFor([&]() { return client.getDispatchQueueDropCount() == 100 - 15; }));
+    CHECK(client.getDispatchQueueHighWaterMark() == 16);
+    CHECK(handlerBlocked);
+
+    // the queue stays full: the SUBACK and the events of a reconnect are dropped, the subscriptions are still tracked
+    // and restored in the MQTT task
+    unsigned int messageDrops = client.getDispatchQueueDropCount();
+    CHECK(client.subscribe("dispatch-extra/#", 1) >= 0);
+    CHECK(waitFor([&]() { return client.getSubscriptionGrantedQos("dispatch-extra/#") == 1; }));
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return restored == 1; }));
+    CHECK(client.getSubscriptionGrantedQos("dispatch/#") == 0 && client.getSubscriptionGrantedQos("dispatch-extra/#") == 1);
+    CHECK(client.getDispatchQueueDropCount() >= messageDrops + 4);   // SUBSCRIBED, DISCONNECTED, CONNECTED, 2 x SUBSCRIBED
+    CHECK(handlerBlocked && subscribed == 1 && connected == 1);
+
+    releaseHandler = true;
+    CHECK(waitFor([&]() { return received == 1 + 15; }));
+    printf("client: %d of 101 messages handled, %u dropped while the handler was blocked\n", (int)received, messageDrops);
+
+    // the restored subscription delivers again
+    CHECK(waitFor([&]() { return senderConnected == 2; }));
+    CHECK(sender.publish("dispatch/after", "1", 0) >= 0);
+    CHECK(waitFor([&]() { return received == 1 + 15 + 1; }));
+
+    CHECK(sender.stop());
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
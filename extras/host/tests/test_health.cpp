@@ -0,0 +1,64 @@
+// Health monitor: probes and the SUBACK of their subscription don't reach the callbacks, a slow broker makes the link
+// Degraded, and a half-open connection is found dead and failed over to the second broker long before the keepalive would.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string.h>
+
+int main()
+{
+    ESP32_MQTTHostBroker first, second;
+    CHECK(first.begin());
+    CHECK(second.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), subscribed(0), messages(0);
+    std::atomic<ESP32_MQTTLinkHealth> health(ESP32_MQTTLinkHealth::Unknown);
+    CHECK(client.setBrokerUri(first.getUri()));
+    CHECK(client.addBrokerUri(second.getUri()));
+    CHECK(client.setClientName("health-test"));
+    client.setReconnectTimeout(100);
+    client.enableHealthMonitor("devices/health-test/$SYS/probe", 200, 500, 3);
+    client.setHealthThresholds(150, 100);
+    client.setFailover(2, 1500);
+    client.onMqttConnected([&](int sessionPresent) {
+        connected++;
+        client.subscribe("health/#", 0);
+    });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        messages++;
+    });
+    client.onMqttHealthChanged([&](ESP32_MQTTLinkHealth linkHealth, uint32_t rttMs) { health = linkHealth; });
+    CHECK(client.start());
+
+    CHECK(waitFor([&]() { return health == ESP32_MQTTLinkHealth::Healthy; }));
+    // only the SUBACK of health/# is passed on
+    delay(500);
+    CHECK(subscribed == 1);
+    CHECK(messages == 0);
+    CHECK(client.getRttUs() > 0);
+
+    // the RTT goes above the threshold
+    first.setDelay(300);
+    CHECK(waitFor([&]() { return health == ESP32_MQTTLinkHealth::Degraded; }));
+    first.setDelay(0);
+    CHECK(waitFor([&]() { return health == ESP32_MQTTLinkHealth::Healthy; }));
+
+    // the connection stays open but nothing comes back
+    first.setBlackhole(true);
+    unsigned long start = millis();
+    CHECK(waitFor([&]() { return client.getFailoverCount() == 1; }));
+    unsigned long detectedMs = millis() - start;
+    CHECK(waitFor([&]() { return connected == 2 && health == ESP32_MQTTLinkHealth::Healthy; }));
+    CHECK(strcmp(client.getURI(), second.getUri()) == 0);
+    printf("half-open connection found dead and failed over after %lu ms\n", detectedMs);
+    delay(500);
+    CHECK(subscribed == 2);
+    CHECK(messages == 0);
+
+    CHECK(client.stop());
+    first.end();
+    second.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,57 @@
+// Periodic work runs in the housekeeping task: a slow in-flight timeout handler doesn't hold up other esp_timers.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+
+static std::atomic<int> ticks(0);
+
+static void tick(void* arg)
+{
+    ticks++;
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0), timedOut(0);
+    std::atomic<int> ticksInHandler(-1);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("housekeeping-test");
+    client.enableInflightTracking(4);
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("housekeeping/#", 0); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    esp_timer_handle_t timer;
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = tick;
+    timerArgs.name = "tick";
+    CHECK(esp_timer_create(&timerArgs, &timer) == ESP_OK);
+    CHECK(esp_timer_start_periodic(timer, 10 * 1000) == ESP_OK);
+
+    // the broker doesn't acknowledge, the publish times out and the handler takes 500 ms
+    broker.setBlackhole(true);
+    CHECK(client.publish("housekeeping/slow", (const uint8_t*)"x", 1, 1, false, 200, [&](int msgId, ESP32_MQTTPublishStatus status, uint32_t latencyUs) {
+        int before = ticks;
+        delay(500);
+        ticksInHandler = ticks - before;
+        if (status == ESP32_MQTTPublishStatus::TimedOut)
+            timedOut++;
+    }) > 0);
+    CHECK(waitFor([&]() { return ticksInHandler >= 0; }));
+    CHECK(timedOut == 1);
+    // 50 ticks are due while the handler runs, none if it ran in the esp_timer task
+    CHECK(ticksInHandler >= 25);
+    printf("esp_timer ticks during a 500 ms timeout handler: %d\n", (int)ticksInHandler);
+
+    esp_timer_stop(timer);
+    esp_timer_delete(timer);
+    broker.setBlackhole(false);
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,184 @@
+// In-flight table: a confirmation received before add() completes the publish in progress, one received before the
+// reservation doesn't complete a later message with the same msg_id, and completions of untracked messages don't push out
+// the one of a publish in progress. Tracked publishes without a timeout still complete while a blocked handler keeps the
+// dispatch queue full. Then tracked publishes pipelined from several tasks next to untracked ones.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int Tasks = 4;
+static const int MessagesPerTask = 500;
+
+static void testEarlyCompletions()
+{
+    ESP32_MQTTInflightTable table;
+    CHECK(table.init(4));
+    int completedMsgId = 0;
+    ESP32_MQTTPublishStatus completedStatus = ESP32_MQTTPublishStatus::Pending;
+    auto handler = [&](int msgId, ESP32_MQTTPublishStatus status, uint32_t latencyUs) {
+        completedMsgId = msgId;
+        completedStatus = status;
+    };
+
+    // without a publish in progress a completion of an unknown msg_id is ignored
+    table.complete(3, ESP32_MQTTPublishStatus::Confirmed);
+    uint32_t ticket = table.reserve();
+    CHECK(ticket != 0);
+    table.add(ticket, 3, 0, handler, nullptr);
+    CHECK(completedMsgId == 0);
+    CHECK(table.getCount() == 1);
+    table.complete(3, ESP32_MQTTPublishStatus::Confirmed);
+    CHECK(completedMsgId == 3);
+
+    // confirmed before publish() returned
+    ticket = table.reserve();
+    table.complete(7, ESP32_MQTTPublishStatus::Deleted);
+    table.add(ticket, 7, 0, handler, nullptr);
+    CHECK(completedMsgId == 7 && completedStatus == ESP32_MQTTPublishStatus::Deleted);
+    CHECK(table.getCount() == 0);
+
+    // the completion of msg_id 5 arrives during the first publish, the second publish gets msg_id 5 again
+    completedMsgId = 0;
+    uint32_t first = table.reserve();
+    table.complete(5, ESP32_MQTTPublishStatus::Confirmed);
+    uint32_t second = table.reserve();
+    table.add(second, 5, 0, handler, nullptr);
+    CHECK(completedMsgId == 0);
+    table.add(first, 6, 0, handler, nullptr);
+    CHECK(completedMsgId == 0);
+    CHECK(table.getCount() == 2);
+    table.complete(5, ESP32_MQTTPublishStatus::Confirmed);
+    table.complete(6, ESP32_MQTTPublishStatus::Confirmed);
+    CHECK(table.getCount() == 0);
+
+    // completions of untracked messages fill capacity + slack records, then the oldest one is dropped
+    for (int extra : { 0, 5 })
+    {
+        completedMsgId = 0;
+        ticket = table.reserve();
+        for (int i = 0; i < 11 + extra; i++)
+            table.complete(100 + i, ESP32_MQTTPublishStatus::Confirmed);
+        table.complete(9, ESP32_MQTTPublishStatus::Confirmed);
+        table.add(ticket, 9, 0, handler, nullptr);
+        CHECK(completedMsgId == 9);
+        CHECK(table.getEarlyCompletionDropCount() == (unsigned long)extra);
+    }
+
+    // a cancelled reservation releases its slot
+    for (int i = 0; i < 3; i++)
+        CHECK(table.reserve() != 0);
+    ticket = table.reserve();
+    CHECK(ticket != 0);
+    CHECK(table.reserve() == 0);
+    table.cancelReservation(ticket);
+    CHECK(table.reserve() != 0);
+    table.deinit();
+}
+
+static void testFullDispatchQueue(ESP32_MQTTHostBroker& broker)
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0), received(0), confirmedCallbacks(0), handlerCompletions(0);
+    std::atomic<bool> handlerBlocked(false), releaseHandler(false);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("inflight-dispatch-test");
+    client.enableDispatchTask(4);
+    client.enableInflightTracking(16);
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessagePublishConfirmed([&](int msgId) { confirmedCallbacks++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        if (received++ == 0)
+        {
+            handlerBlocked = true;
+            waitFor([&]() { return releaseHandler.load(); }, 10000);
+            handlerBlocked = false;
+        }
+    });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return client.isConnected(); }));
+    client.subscribe("inflight-dispatch/#", 0);
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    // the first message blocks the dispatch task, the messages after it fill the queue
+    CHECK(client.publish("inflight-dispatch/block", "0", 0) >= 0);
+    CHECK(waitFor([&]() { return handlerBlocked.load(); }));
+    for (int i = 0; i < 8; i++)
+        client.publish("inflight-dispatch/fill", "1", 0);
+    CHECK(waitFor([&]() { return client.getDispatchQueueDropCount() > 0; }));
+
+    // their PUBLISHED events are dropped, the publishes are completed anyway
+    unsigned int dropsBefore = client.getDispatchQueueDropCount();
+    ESP32_MQTTPublishToken tokens[8];
+    for (int i = 0; i < 8; i++)
+        CHECK(client.publish("inflight/dropped", (const uint8_t*)"tracked", 7, 1, false, 0, tokens[i]) > 0);
+    for (int i = 0; i < 8; i++)
+        CHECK(client.publish("inflight/dropped", (const uint8_t*)"tracked", 7, 1, false, 0, [&](int msgId, ESP32_MQTTPublishStatus status, uint32_t latencyUs) {
+            if (status == ESP32_MQTTPublishStatus::Confirmed)
+                handlerCompletions++;
+        }) > 0);
+    for (int i = 0; i < 8; i++)
+        CHECK(tokens[i].wait(5000) == ESP32_MQTTPublishStatus::Confirmed);
+    CHECK(waitFor([&]() { return handlerCompletions == 8 && client.getInflightCount() == 0; }));
+    CHECK(client.getDispatchQueueDropCount() == dropsBefore + 16);
+    CHECK(handlerBlocked && confirmedCallbacks == 0);
+
+    releaseHandler = true;
+    CHECK(waitFor([&]() { return !handlerBlocked; }));
+    CHECK(client.stop());
+}
+
+int main()
+{
+    testEarlyCompletions();
+
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    testFullDispatchQueue(broker);
+
+    ESP32_MQTTClient client;
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("inflight-test");
+    client.enableInflightTracking(64);
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return client.isConnected(); }));
+
+    std::atomic<int> confirmed(0), notConfirmed(0), failed(0);
+    std::vector<std::thread> tasks;
+    for (int t = 0; t < Tasks; t++)
+    {
+        tasks.emplace_back([&, t]() {
+            std::string topic = "inflight/" + std::to_string(t);
+            for (int i = 0; i < MessagesPerTask; i++)
+            {
+                int result;
+                while ((result = client.publish(topic.c_str(), (const uint8_t*)"tracked", 7, 1, false, 10000, [&](int msgId, ESP32_MQTTPublishStatus status, uint32_t latencyUs) {
+                    if (status == ESP32_MQTTPublishStatus::Confirmed)
+                        confirmed++;
+                    else
+                        notConfirmed++;
+                })) == -2)
+                    delay(1);
+                if (result < 0)
+                    failed++;
+            }
+        });
+    }
+    // untracked messages are confirmed between the tracked ones
+    for (int i = 0; i < MessagesPerTask; i++)
+        CHECK(client.publish("inflight/untracked", "untracked", 1) >= 0);
+    for (std::thread& task : tasks)
+        task.join();
+
+    CHECK(waitFor([&]() { return confirmed + notConfirmed == Tasks * MessagesPerTask - failed; }, 30000));
+    CHECK(failed == 0);
+    CHECK(notConfirmed == 0);
+    CHECK(client.getInflightCount() == 0);
+    printf("confirmed: %d\n", (int)confirmed);
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,266 @@
+// Runtime log levels: categories and levels, arguments copied when logged and formatted later by the log task, the
+// data path at Debug and Verbose with cut and sampled payloads, values that can't be decoded, records dropped when the
+// log task falls behind, and the output switched while lines are printed.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTLog.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::mutex linesMutex;
+static std::vector<std::string> lines;
+static std::atomic<bool> outputBlocked(false);
+static std::atomic<bool> outputInLogTask(true);
+
+static void collect(const char* line, size_t length, void* context)
+{
+    while (outputBlocked)
+        delay(1);
+    if (strcmp(pcTaskGetName(nullptr), "mqtt_log") != 0)
+        outputInLogTask = false;
+    std::lock_guard<std::mutex> lock(linesMutex);
+    lines.emplace_back(line, length);
+}
+
+static size_t lineCount()
+{
+    std::lock_guard<std::mutex> lock(linesMutex);
+    return lines.size();
+}
+
+// the lines printed so far, without the "[   123][I][mqtt connection] " prefix
+static std::vector<std::string> takeLines()
+{
+    std::lock_guard<std::mutex> lock(linesMutex);
+    std::vector<std::string> taken;
+    for (const std::string& line : lines)
+        taken.push_back(line.substr(line.find("] ", line.find("[mqtt")) + 2));
+    lines.clear();
+    return taken;
+}
+
+static void testLevels()
+{
+    CHECK(!ESP32_MQTTLog::isEnabled(ESP32_MQTTLogCategory::Connection, ESP32_MQTTLogLevel::Error));
+    ESP32_MQTTLog::setOutput(collect);
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Connection, ESP32_MQTTLogLevel::Info);
+    CHECK(ESP32_MQTTLog::getLevel(ESP32_MQTTLogCategory::Connection) == ESP32_MQTTLogLevel::Info);
+
+    char host[32] = "broker.local";
+    ESP32_MQTT_LOG(Connection, Info, "Connecting to %s port %d", host, 1883);
+    // the record has its own copy of the string
+    strcpy(host, "overwritten");
+    ESP32_MQTT_LOG(Connection, Debug, "not logged, below the level");
+    ESP32_MQTT_LOG(Publish, Error, "not logged, the category is off");
+    ESP32_MQTT_LOG(Connection, Warning, "Topic %s, %u bytes, %.1f s", ESP32_MQTTLogText("a/b/c-not-this", 5), 42u, 1.5);
+    ESP32_MQTT_LOG(Connection, Error, "Payload %s", ESP32_MQTTLogText("x\x01y\n", 4, true));
+    CHECK(waitFor([]() { return lineCount() == 3; }));
+    {
+        std::lock_guard<std::mutex> lock(linesMutex);
+        CHECK(lines[0].find("][I][mqtt connection] ") != std::string::npos);
+        CHECK(lines[1].find("][W][mqtt connection] ") != std::string::npos);
+    }
+    std::vector<std::string> taken = takeLines();
+    CHECK(taken[0] == "Connecting to broker.local port 1883");
+    CHECK(taken[1] == "Topic a/b/c, 42 bytes, 1.5 s");
+    CHECK(taken[2] == "Payload x.y.");
+    CHECK(outputInLogTask);
+
+    // strings are cut to the space left in the record, lines to ESP32_MQTT_LOG_LINE_SIZE
+    std::string longText(300, 'x');
+    ESP32_MQTT_LOG(Connection, Info, "%s|%d", longText.c_str(), 7);
+    CHECK(waitFor([]() { return lineCount() == 1; }));
+    taken = takeLines();
+    CHECK(taken[0].size() < ESP32_MQTT_LOG_ARGS_SIZE + 3 && taken[0].compare(taken[0].size() - 2, 2, "|7") == 0);
+
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+    ESP32_MQTT_LOG(Connection, Error, "not logged, everything is off");
+    delay(3 * ESP32_MQTT_LOG_FLUSH_MS);
+    CHECK(lineCount() == 0);
+}
+
+static void testDataPath()
+{
+    // a client that isn't started, the events are passed to it directly
+    ESP32_MQTTClient client;
+    std::atomic<int> received(0);
+    client.setBrokerUri("mqtt://127.0.0.1:1");
+    client.setClientName("log-test");
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) { received++; });
+    CHECK(client.createClient());
+
+    char payload[200];
+    for (size_t i = 0; i < sizeof(payload); i++)
+        payload[i] = i % 3 == 2 ? '\n' : 'a' + i % 26;
+    auto deliver = [&](int msgId) {
+        esp_mqtt_event_t event = {};
+        event.event_id = MQTT_EVENT_DATA;
+        event.msg_id = msgId;
+        event.topic = (char*)"plant/line3/temperature";
+        event.topic_len = 23;
+        event.data = payload;
+        event.data_len = sizeof(payload);
+        event.total_data_len = sizeof(payload);
+        CHECK(ESP32_MQTTHostEvents::dispatch("log-test", &event));
+    };
+
+    // off: nothing
+    deliver(1);
+    // Debug: topic and length
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Data, ESP32_MQTTLogLevel::Debug);
+    deliver(2);
+    CHECK(waitFor([]() { return lineCount() == 1; }));
+    std::vector<std::string> taken = takeLines();
+    CHECK(taken[0] == "MQTT_EVENT_DATA, msg_id: 2, topic: plant/line3/temperature, 200 bytes");
+
+    // Verbose: the first 8 bytes of every 4th payload, the others still get the Debug line
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Data, ESP32_MQTTLogLevel::Verbose);
+    ESP32_MQTTLog::setPayloadLogging(8, 4);
+    for (int i = 0; i < 8; i++)
+        deliver(10 + i);
+    CHECK(waitFor([]() { return lineCount() == 8; }));
+    taken = takeLines();
+    int withPayload = 0;
+    for (const std::string& line : taken)
+    {
+        if (line.find("200 bytes: ab.de.gh") != std::string::npos && line.size() == line.find("200 bytes: ") + 11 + 8)
+            withPayload++;
+    }
+    CHECK(withPayload == 2);
+    CHECK(received == 10);
+
+    // a value that can't be decoded is a warning
+    std::atomic<int> values(0);
+    client.subscribeValue<float>("plant/line3/setpoint", 0, [&](const char* topic, int topicLen, float value) { values++; });
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Data, ESP32_MQTTLogLevel::Warning);
+    esp_mqtt_event_t event = {};
+    event.event_id = MQTT_EVENT_DATA;
+    event.topic = (char*)"plant/line3/setpoint";
+    event.topic_len = 20;
+    event.data = (char*)"21.5";
+    event.data_len = event.total_data_len = 4;
+    CHECK(ESP32_MQTTHostEvents::dispatch("log-test", &event));
+    event.data = (char*)"warm";
+    CHECK(ESP32_MQTTHostEvents::dispatch("log-test", &event));
+    CHECK(waitFor([]() { return lineCount() == 1; }));
+    taken = takeLines();
+    CHECK(taken[0] == "Can't decode message on topic plant/line3/setpoint");
+    CHECK(values == 1);
+
+    ESP32_MQTTLog::setPayloadLogging(32, 1);
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+}
+
+static void testDrops()
+{
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Publish, ESP32_MQTTLogLevel::Info);
+    // the log task is stuck in the output, at most a ring of records waits for it
+    outputBlocked = true;
+    ESP32_MQTT_LOG(Publish, Info, "first");
+    delay(3 * ESP32_MQTT_LOG_FLUSH_MS);
+    uint32_t dropsBefore = ESP32_MQTTLog::getDropCount();
+    for (int i = 0; i < 200; i++)
+        ESP32_MQTT_LOG(Publish, Info, "record %d", i);
+    uint32_t dropped = ESP32_MQTTLog::getDropCount() - dropsBefore;
+    CHECK(dropped == 200 - ESP32_MQTT_LOG_CAPACITY);
+    outputBlocked = false;
+    CHECK(waitFor([]() { return lineCount() == 2 + ESP32_MQTT_LOG_CAPACITY; }));
+    std::vector<std::string> taken = takeLines();
+    CHECK(taken[0] == "first");
+    CHECK(taken[1] == std::to_string(dropped) + " log records dropped");
+    CHECK(taken[2] == "record 0");
+    CHECK(taken.back() == "record " + std::to_string(ESP32_MQTT_LOG_CAPACITY - 1));
+
+    // writers in several tasks: every record is printed or counted as dropped
+    dropsBefore = ESP32_MQTTLog::getDropCount();
+    std::vector<std::thread> writers;
+    for (int w = 0; w < 4; w++)
+    {
+        writers.emplace_back([w]() {
+            for (int i = 0; i < 1000; i++)
+            {
+                ESP32_MQTT_LOG(Publish, Info, "writer %d record %d", w, i);
+                if (i % 16 == 0)
+                    delay(1);
+            }
+        });
+    }
+    for (std::thread& writer : writers)
+        writer.join();
+    dropped = ESP32_MQTTLog::getDropCount() - dropsBefore;
+    CHECK(waitFor([&]() {
+        std::lock_guard<std::mutex> lock(linesMutex);
+        size_t records = 0;
+        for (const std::string& line : lines)
+            records += line.find("] writer ") != std::string::npos;
+        return records + dropped == 4000;
+    }));
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+    ESP32_MQTTLog::setOutput(nullptr);
+}
+
+// the context of each output is a counter of its own, a line with the other output's context is counted as mixed
+struct OutputCounter
+{
+    std::atomic<int> lines { 0 };
+    std::atomic<int> mixed { 0 };
+};
+
+static OutputCounter firstCounter, secondCounter;
+
+static void countFirst(const char* line, size_t length, void* context)
+{
+    if (context != &firstCounter)
+        firstCounter.mixed++;
+    ((OutputCounter*)context)->lines++;
+}
+
+static void countSecond(const char* line, size_t length, void* context)
+{
+    if (context != &secondCounter)
+        secondCounter.mixed++;
+    ((OutputCounter*)context)->lines++;
+}
+
+static void testOutputSwitch()
+{
+    // the output is switched while the log task prints, output and context always change together
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory::Publish, ESP32_MQTTLogLevel::Info);
+    std::atomic<bool> writing(true);
+    std::thread writer([&]() {
+        for (int i = 0; i < 5000; i++)
+        {
+            ESP32_MQTT_LOG(Publish, Info, "record %d", i);
+            if (i % 16 == 0)
+                delay(1);
+        }
+        writing = false;
+    });
+    for (int i = 0; writing; i++)
+    {
+        if (i % 2 == 0)
+            ESP32_MQTTLog::setOutput(countFirst, &firstCounter);
+        else
+            ESP32_MQTTLog::setOutput(countSecond, &secondCounter);
+        delay(1);
+    }
+    writer.join();
+    delay(3 * ESP32_MQTT_LOG_FLUSH_MS);
+    CHECK(firstCounter.mixed == 0 && secondCounter.mixed == 0);
+    CHECK(firstCounter.lines > 0 && secondCounter.lines > 0);
+    CHECK(firstCounter.lines + secondCounter.lines + (int)ESP32_MQTTLog::getDropCount() >= 5000);
+    ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel::None);
+    ESP32_MQTTLog::setOutput(nullptr);
+}
+
+int main()
+{
+    testLevels();
+    testDataPath();
+    testDrops();
+    testOutputSwitch();
+    return TEST_RESULT();
+}
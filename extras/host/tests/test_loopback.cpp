@@ -0,0 +1,73 @@
+// The client against the loopback broker: connect, subscribe, QoS 0-2 round trips and a message delivered in chunks.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string>
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), subscribed(0), confirmed(0), received(0);
+    std::string lastPayload;
+    int chunks = 0;
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("loopback-test");
+    client.setReconnectTimeout(100);
+    client.onMqttConnected([&](int sessionPresent) {
+        client.subscribe("test/#", 2);
+        connected++;
+    });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) {
+        CHECK(dataLen == 1 && data[0] == 2);
+        subscribed++;
+    });
+    client.onMqttMessagePublishConfirmed([&](int msgId) { confirmed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        if (currentDataOffset == 0)
+        {
+            CHECK(std::string(topic, topicLen).compare(0, 5, "test/") == 0);
+            lastPayload.clear();
+            chunks = 0;
+        }
+        lastPayload.append(data, dataLen);
+        chunks++;
+        if (currentDataOffset + dataLen == totalDataLen)
+            received++;
+    });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+    CHECK(client.isConnected());
+    CHECK(broker.getConnectionCount() == 1);
+
+    for (int qos = 0; qos <= 2; qos++)
+    {
+        int before = received;
+        std::string payload = "qos" + std::to_string(qos);
+        CHECK(client.publish("test/qos", payload.c_str(), qos) >= 0);
+        CHECK(waitFor([&]() { return received == before + 1; }));
+        CHECK(lastPayload == payload);
+    }
+    CHECK(waitFor([&]() { return confirmed == 2; }));
+
+    // bigger than the default in buffer of 1024 bytes
+    std::string large(3000, 'x');
+    for (size_t i = 0; i < large.size(); i++)
+        large[i] = 'a' + i % 26;
+    int before = received;
+    CHECK(client.publish("test/large", (const uint8_t*)large.data(), large.size(), 1) > 0);
+    CHECK(waitFor([&]() { return received == before + 1; }));
+    CHECK(lastPayload == large);
+    CHECK(chunks == 3);
+
+    // the broker going away is reported and the client reconnects
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return !client.isConnected(); }));
+    CHECK(waitFor([&]() { return connected == 2; }));
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+// Metrics on the loopback broker: per-event counters, bytes in and out and one ack latency sample per QoS 1 publish after
+// resetMetrics(), and the JSON enableMetricsPublishing() publishes to its topic.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const int Messages = 5;
+static const unsigned long ReportIntervalMs = 2000;    // a report is enqueued, the MQTT task sends it within a second
+
+static bool contains(const std::string& json, const std::string& field, unsigned int value)
+{
+    return json.find("\"" + field + "\":" + std::to_string(value) + ",") != std::string::npos;
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    // receives the reports
+    ESP32_MQTTClient observer;
+    std::atomic<int> observerSubscribed(0);
+    std::mutex reportsMutex;
+    std::vector<std::string> reports;
+    observer.setBrokerUri(broker.getUri());
+    observer.setClientName("metrics-observer");
+    observer.onMqttConnected([&](int sessionPresent) { observer.subscribe("devices/metrics-test/$SYS/mqtt", 0); });
+    observer.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { observerSubscribed++; });
+    observer.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        std::lock_guard<std::mutex> lock(reportsMutex);
+        reports.push_back(std::string(data, dataLen));
+    });
+    CHECK(observer.start());
+    CHECK(waitFor([&]() { return observerSubscribed == 1; }));
+    auto reportCount = [&]() {
+        std::lock_guard<std::mutex> lock(reportsMutex);
+        return reports.size();
+    };
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0), confirmed(0), received(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("metrics-test");
+    client.enableMetricsPublishing("devices/metrics-test/$SYS/mqtt", ReportIntervalMs);
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("metrics/#", 1); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessagePublishConfirmed([&](int msgId) { confirmed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) { received++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    ESP32_MQTTMetricsSnapshot metrics = client.getMetrics();
+    CHECK(metrics.connected && metrics.connectCount == 1 && metrics.reconnectCount == 0);
+    CHECK(metrics.eventCounts[MQTT_EVENT_CONNECTED] == 1 && metrics.eventCounts[MQTT_EVENT_SUBSCRIBED] == 1);
+    CHECK(metrics.subscribeCount == 1);
+
+    // the messages below are sent between two reports, which count as enqueued messages
+    CHECK(waitFor([&]() { return reportCount() == 1; }, 10000));
+    client.resetMetrics();
+    metrics = client.getMetrics();
+    for (int i = 0; i < ESP32_MQTT_METRICS_EVENT_TYPES; i++)
+        CHECK(metrics.eventCounts[i] == 0);
+    CHECK(metrics.connected && metrics.connectCount == 0 && metrics.subscribeCount == 0);
+    CHECK(metrics.bytesIn == 0 && metrics.bytesOut == 0 && metrics.ackLatency.count == 0);
+
+    // QoS 1 messages to itself, each is counted out and in and gives one ack latency sample
+    std::string payload = "0123456789";
+    size_t messageBytes = strlen("metrics/data") + payload.size();
+    for (int i = 0; i < Messages; i++)
+        CHECK(client.publish("metrics/data", (const uint8_t*)payload.data(), payload.size(), 1) > 0);
+    CHECK(waitFor([&]() { return confirmed == Messages && received == Messages; }));
+
+    metrics = client.getMetrics();
+    CHECK(metrics.publishCount == Messages && metrics.publishFailures == 0);
+    CHECK(metrics.eventCounts[MQTT_EVENT_PUBLISHED] == Messages);
+    CHECK(metrics.eventCounts[MQTT_EVENT_DATA] == Messages);
+    CHECK(metrics.messagesIn == Messages);
+    CHECK(metrics.bytesOut == Messages * messageBytes);
+    CHECK(metrics.bytesIn == Messages * messageBytes);
+    CHECK(metrics.ackLatency.count == Messages);
+    uint32_t samples = 0;
+    for (int i = 0; i < ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS; i++)
+        samples += metrics.ackLatency.buckets[i];
+    CHECK(samples == Messages);
+    CHECK(metrics.ackLatency.maxUs > 0 && metrics.ackLatency.p50Us <= metrics.ackLatency.p99Us);
+    CHECK(metrics.callbackTime.count >= 2 * Messages);
+
+    // QoS 0 has no ack, failures are counted apart
+    CHECK(client.publish("metrics/data", (const uint8_t*)payload.data(), payload.size(), 0) == 0);
+    CHECK(client.publish("metrics/data", (const uint8_t*)payload.data(), payload.size(), 3) < 0);
+    CHECK(waitFor([&]() { return received == Messages + 1; }));
+    metrics = client.getMetrics();
+    CHECK(metrics.publishCount == Messages + 1 && metrics.publishFailures == 1 && metrics.enqueueCount == 0);
+    CHECK(metrics.bytesOut == (Messages + 1) * messageBytes);
+    CHECK(metrics.bytesIn == (Messages + 1) * messageBytes);
+    CHECK(metrics.ackLatency.count == Messages);
+    CHECK(reportCount() == 1);
+
+    // the published JSON
+    CHECK(waitFor([&]() { return reportCount() >= 3; }, 10000));
+    std::vector<std::string> receivedReports;
+    {
+        std::lock_guard<std::mutex> lock(reportsMutex);
+        receivedReports = reports;
+    }
+    const std::string& json = receivedReports[1];
+    printf("%s\n", json.c_str());
+    CHECK(json.front() == '{' && json.back() == '}');
+    CHECK(json.compare(0, 14, "{\"connected\":1") == 0);
+    CHECK(contains(json, "connects", 0));
+    CHECK(contains(json, "published", Messages + 1));
+    CHECK(contains(json, "publishFailed", 1));
+    // a report is enqueued after its snapshot
+    CHECK(contains(json, "enqueued", 0));
+    CHECK(contains(json, "messagesIn", Messages + 1));
+    CHECK(contains(json, "bytesIn", (Messages + 1) * messageBytes));
+    CHECK(contains(json, "bytesOut", (Messages + 1) * messageBytes));
+    CHECK(json.find("\"events\":[") != std::string::npos);
+    CHECK(json.find("\"ackLatency\":{\"count\":" + std::to_string(Messages) + ",") != std::string::npos);
+    CHECK(json.find("\"callbackTime\":{\"count\":") != std::string::npos);
+    // the next one counts it
+    CHECK(contains(receivedReports[2], "enqueued", 1));
+    CHECK(contains(receivedReports[2], "bytesOut", (Messages + 1) * messageBytes + strlen("devices/metrics-test/$SYS/mqtt") + json.size()));
+
+    CHECK(client.stop());
+    CHECK(observer.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,201 @@
+// Persistent outbox: 10k messages across a disconnect and a power cycle arrive in order and without loss, messages
+// published during the replay don't wait for the replay rate, and a message evicted during the replay isn't popped twice.
+// A power loss while a record is written over an evicted one costs only the evicted message.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTPersistentOutbox.h>
+#include <atomic>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static const char* OutboxPath = "test_persistent_outbox.bin";
+static const int Messages = 10000;
+static const int ReplayRate = 5000;
+
+// received indexes in publish order, a QoS 1 retransmission may repeat an earlier one
+struct Receiver
+{
+    std::atomic<int> next { 0 };
+    std::atomic<int> outOfOrder { 0 };
+    std::atomic<int> duplicates { 0 };
+
+    void receive(const char* data, int dataLen)
+    {
+        int index = atoi(std::string(data, dataLen).c_str());
+        if (index == next)
+            next++;
+        else if (index < next)
+            duplicates++;
+        else
+            outOfOrder++;
+    }
+};
+
+static void setUp(ESP32_MQTTClient& client, ESP32_MQTTHostBroker& broker, ESP32_MQTTPersistentOutbox& outbox, unsigned int replayRate, Receiver& receiver, std::atomic<int>& subscribed)
+{
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("outbox-test");
+    client.setReconnectTimeout(100);
+    client.setPersistentOutbox(&outbox, replayRate);
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("outbox/#", 1); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        receiver.receive(data, dataLen);
+    });
+}
+
+static void publishRange(ESP32_MQTTClient& client, int first, int last)
+{
+    for (int i = first; i < last; i++)
+        CHECK(client.publish("outbox/seq", std::to_string(i).c_str(), 1) >= 0);
+}
+
+static void testEvictionDuringReplay()
+{
+    unlink(OutboxPath);
+    ESP32_MQTTPersistentOutbox outbox;
+    // room for two of these records
+    CHECK(outbox.begin(OutboxPath, 2 * (12 + 3 + 8) + 10, 16, ESP32_MQTTOutboxEvictionPolicy::DropOldest));
+    CHECK(outbox.append("t/0", (const uint8_t*)"message0", 8, 1, false));
+    CHECK(outbox.append("t/1", (const uint8_t*)"message1", 8, 1, false));
+
+    ESP32_MQTTStoredMessage message;
+    CHECK(outbox.peek(message));
+    CHECK(strcmp(message.topic, "t/0") == 0);
+    uint32_t sequence = message.sequence;
+    // the peeked message is evicted while it is being sent
+    CHECK(outbox.append("t/2", (const uint8_t*)"message2", 8, 1, false));
+    CHECK(outbox.getDroppedCount() == 1);
+    CHECK(!outbox.popIfHead(sequence));
+    CHECK(outbox.getCount() == 2);
+    CHECK(outbox.peek(message));
+    CHECK(strcmp(message.topic, "t/1") == 0);
+    CHECK(outbox.popIfHead(message.sequence));
+    CHECK(outbox.peek(message));
+    CHECK(strcmp(message.topic, "t/2") == 0);
+    outbox.end();
+    unlink(OutboxPath);
+}
+
+static std::vector<uint8_t> readFile(const char* path)
+{
+    std::vector<uint8_t> data;
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return data;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+        data.push_back(c);
+    fclose(file);
+    return data;
+}
+
+static void testPowerLossAfterEviction()
+{
+    unlink(OutboxPath);
+    ESP32_MQTTPersistentOutbox outbox;
+    CHECK(outbox.begin(OutboxPath, 2 * (12 + 3 + 8) + 10, 16, ESP32_MQTTOutboxEvictionPolicy::DropOldest));
+    CHECK(outbox.append("t/0", (const uint8_t*)"message0", 8, 1, false));
+    CHECK(outbox.append("t/1", (const uint8_t*)"message1", 8, 1, false));
+    std::vector<uint8_t> before = readFile(OutboxPath);
+    // t/0 is evicted, t/2 is written over it
+    CHECK(outbox.append("t/2", (const uint8_t*)"message2", 8, 1, false));
+    outbox.end();
+    std::vector<uint8_t> after = readFile(OutboxPath);
+    CHECK(before.size() > 64 && after.size() > 64);
+
+    // the power is lost before the header of the new record is written: the file starts with two copies of
+    // { magic, sequence, capacity, head, tail, used, count, crc }, the newer one is put back
+    uint32_t sequences[2];
+    memcpy(&sequences[0], after.data() + 4, 4);
+    memcpy(&sequences[1], after.data() + 32 + 4, 4);
+    size_t newer = (int32_t)(sequences[1] - sequences[0]) > 0 ? 1 : 0;
+    memcpy(after.data() + newer * 32, before.data() + newer * 32, 32);
+    FILE* file = fopen(OutboxPath, "wb");
+    CHECK(file != nullptr && fwrite(after.data(), 1, after.size(), file) == after.size());
+    fclose(file);
+
+    CHECK(outbox.begin(OutboxPath, 2 * (12 + 3 + 8) + 10, 16, ESP32_MQTTOutboxEvictionPolicy::DropOldest));
+    ESP32_MQTTStoredMessage message;
+    CHECK(outbox.peek(message));
+    CHECK(outbox.getCorruptedCount() == 0);
+    CHECK(outbox.getCount() == 1 && strcmp(message.topic, "t/1") == 0);
+    outbox.end();
+    unlink(OutboxPath);
+}
+
+int main()
+{
+    testEvictionDuringReplay();
+    testPowerLossAfterEviction();
+
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    unlink(OutboxPath);
+    Receiver receiver;
+    std::atomic<int> subscribed(0);
+
+    // connected: the messages go straight to esp-mqtt
+    ESP32_MQTTPersistentOutbox outbox;
+    CHECK(outbox.begin(OutboxPath, 1024 * 1024, 256));
+    ESP32_MQTTClient* client = new ESP32_MQTTClient();
+    setUp(*client, broker, outbox, ReplayRate, receiver, subscribed);
+    CHECK(client->start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+    publishRange(*client, 0, 2000);
+    CHECK(waitFor([&]() { return receiver.next == 2000; }, 30000));
+    CHECK(outbox.getCount() == 0);
+
+    // disconnected: stored in the log
+    broker.setRefuseConnections(true);
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return !client->isConnected(); }));
+    unsigned long start = millis();
+    publishRange(*client, 2000, 6000);
+    printf("append: %.0f messages/s\n", 4000 * 1000.0 / std::max(1UL, millis() - start));
+    CHECK(outbox.getCount() == 4000);
+
+    // power cycle, the log is reopened by a new client
+    client->stop();
+    delete client;
+    outbox.end();
+    CHECK(outbox.begin(OutboxPath, 1024 * 1024, 256));
+    CHECK(outbox.getCount() == 4000);
+    client = new ESP32_MQTTClient();
+    setUp(*client, broker, outbox, ReplayRate, receiver, subscribed);
+    publishRange(*client, 6000, Messages);
+    CHECK(outbox.getCount() == Messages - 2000);
+
+    broker.setRefuseConnections(false);
+    start = millis();
+    CHECK(client->start());
+    CHECK(waitFor([&]() { return receiver.next == Messages; }, 60000));
+    printf("replay: %.0f messages/s (rate limit %d)\n", (Messages - 2000) * 1000.0 / std::max(1UL, millis() - start), ReplayRate);
+    CHECK(outbox.getCount() == 0);
+    CHECK(receiver.outOfOrder == 0);
+    CHECK(outbox.getDroppedCount() == 0);
+
+    // live messages queued behind a slow replay are not held back by its rate
+    CHECK(client->stop());
+    delete client;
+    client = new ESP32_MQTTClient();
+    setUp(*client, broker, outbox, 50, receiver, subscribed);
+    publishRange(*client, Messages, Messages + 100);
+    CHECK(client->start());
+    CHECK(waitFor([&]() { return client->isConnected(); }));
+    start = millis();
+    publishRange(*client, Messages + 100, Messages + 600);
+    // the backlog takes 2 s at 50 messages/s, all 600 messages at that rate would take 12 s
+    CHECK(waitFor([&]() { return receiver.next == Messages + 600; }, 6000));
+    printf("500 messages behind a backlog of 100 replayed at 50 messages/s: %lu ms\n", millis() - start);
+    CHECK(receiver.outOfOrder == 0);
+    printf("duplicates: %d\n", (int)receiver.duplicates);
+
+    CHECK(client->stop());
+    delete client;
+    outbox.end();
+    unlink(OutboxPath);
+    broker.end();
+    return TEST_RESULT();
+}
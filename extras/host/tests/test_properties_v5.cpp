@@ -0,0 +1,246 @@
+// MQTT 5 against the loopback broker, built with CONFIG_MQTT_PROTOCOL_5: publish properties and user properties reach a
+// MQTT 5 receiver, also through the dispatch queue and as a retained message, while a MQTT 3.1.1 receiver gets the
+// message without them. Topic aliases are used for repeated QoS 0 publishes, lowered to the broker's Topic Alias
+// Maximum and forgotten on reconnect, every message arrives with its topic.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Received
+{
+    std::string topic;
+    std::string payload;
+    bool hasProperties;
+    std::string responseTopic;
+    std::string correlationData;
+    std::string contentType;
+    bool payloadIsUtf8;
+    std::vector<std::string> userProperties;    // "key=value"
+};
+
+struct Receiver
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed { 0 };
+    std::mutex receivedMutex;
+    std::vector<Received> received;
+
+    void start(const char* uri, const char* name, int protocolVersion, const char* filter)
+    {
+        client.setBrokerUri(uri);
+        client.setClientName(name);
+        client.setProtocolVersion(protocolVersion);
+        client.setReconnectTimeout(100);
+        client.onMqttConnected([this, filter](int sessionPresent) { client.subscribe(filter, 1); });
+        client.onMqttTopicSubscribed([this](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+        client.onMqttMessageReceived([this](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+            Received message = {};
+            message.topic.assign(topic, topicLen);
+            message.payload.assign(data, dataLen);
+            ESP32_MQTTMessageProperties properties;
+            message.hasProperties = client.getMessageProperties(properties);
+            if (message.hasProperties)
+            {
+                message.responseTopic.assign(properties.responseTopic != nullptr ? properties.responseTopic : "", properties.responseTopicLen);
+                message.correlationData.assign(properties.correlationData != nullptr ? (const char*)properties.correlationData : "", properties.correlationDataLen);
+                message.contentType.assign(properties.contentType != nullptr ? properties.contentType : "", properties.contentTypeLen);
+                message.payloadIsUtf8 = properties.payloadIsUtf8;
+            }
+            client.forEachMessageUserProperty([&message](const char* key, const char* value) { message.userProperties.push_back(std::string(key) + "=" + value); });
+            std::lock_guard<std::mutex> lock(receivedMutex);
+            received.push_back(message);
+        });
+        CHECK(client.start());
+        CHECK(waitFor([this]() { return subscribed == 1; }));
+    }
+
+    size_t count()
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        return received.size();
+    }
+
+    Received get(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        return received[index];
+    }
+};
+
+static void checkProperties(const Received& message)
+{
+    CHECK(message.hasProperties);
+    CHECK(message.responseTopic == "devices/esp32-01/reply");
+    CHECK(message.correlationData == std::string("\x01\0\x02", 3));
+    CHECK(message.contentType == "application/json");
+    CHECK(message.payloadIsUtf8);
+    CHECK(message.userProperties.size() == 2);
+    CHECK(message.userProperties.size() == 2 && message.userProperties[0] == "unit=C" && message.userProperties[1] == "sensor=t1");
+}
+
+static void testProperties(ESP32_MQTTHostBroker& broker, ESP32_MQTTClient& sender)
+{
+    Receiver v5, queued, v3;
+    v5.start(broker.getUri(), "properties-v5", 5, "props/#");
+    // the dispatch queue copies the properties out of the event
+    queued.client.enableDispatchTask(8);
+    queued.start(broker.getUri(), "properties-queued", 5, "props/#");
+    v3.start(broker.getUri(), "properties-v3", 3, "props/#");
+
+    ESP32_MQTTUserProperty userProperties[] = { { "unit", "C" }, { "sensor", "t1" } };
+    ESP32_MQTTPublishProperties properties;
+    properties.messageExpirySeconds = 60;
+    properties.responseTopic = "devices/esp32-01/reply";
+    properties.correlationData = (const uint8_t*)"\x01\0\x02";
+    properties.correlationDataLen = 3;
+    properties.contentType = "application/json";
+    properties.payloadIsUtf8 = true;
+    properties.userProperties = userProperties;
+    properties.userPropertyCount = 2;
+    std::string payload = "{\"t\":21.5}";
+    CHECK(sender.publish("props/a", (const uint8_t*)payload.data(), payload.size(), 1, false, properties) > 0);
+    // the properties are cleared after a publish
+    CHECK(sender.publish("props/b", "plain", 1) > 0);
+    CHECK(waitFor([&]() { return v5.count() == 2 && queued.count() == 2 && v3.count() == 2; }));
+
+    for (Receiver* receiver : { &v5, &queued })
+    {
+        Received a = receiver->get(0), b = receiver->get(1);
+        CHECK(a.topic == "props/a" && a.payload == payload);
+        checkProperties(a);
+        CHECK(b.topic == "props/b" && b.payload == "plain");
+        CHECK(b.hasProperties && b.responseTopic.empty() && b.correlationData.empty() && !b.payloadIsUtf8 && b.userProperties.empty());
+    }
+    Received a = v3.get(0);
+    CHECK(a.topic == "props/a" && a.payload == payload);
+    CHECK(!a.hasProperties && a.userProperties.empty());
+
+    // a retained message keeps its properties for later subscribers
+    CHECK(sender.publish("props/retained", (const uint8_t*)payload.data(), payload.size(), 1, true, properties) > 0);
+    CHECK(waitFor([&]() { return v5.count() == 3; }));
+    Receiver late;
+    late.start(broker.getUri(), "properties-late", 5, "props/retained");
+    CHECK(waitFor([&]() { return late.count() == 1; }));
+    CHECK(late.get(0).topic == "props/retained" && late.get(0).payload == payload);
+    checkProperties(late.get(0));
+    CHECK(sender.publish("props/retained", (const uint8_t*)"", 0, 1, true) > 0);
+
+    // properties need MQTT 5
+    Receiver plain;
+    plain.start(broker.getUri(), "properties-plain", 3, "unused");
+    CHECK(plain.client.publish("props/a", (const uint8_t*)payload.data(), payload.size(), 1, false, properties) == -1);
+
+    CHECK(plain.client.stop());
+    CHECK(late.client.stop());
+    CHECK(v3.client.stop());
+    CHECK(queued.client.stop());
+    CHECK(v5.client.stop());
+}
+
+// every message has arrived with the topic it was published to
+static bool checkTopics(Receiver& receiver, const std::vector<std::string>& topics)
+{
+    if (receiver.count() != topics.size())
+        return false;
+    bool ok = true;
+    for (size_t i = 0; i < topics.size(); i++)
+        ok = ok && receiver.get(i).topic == topics[i] && receiver.get(i).payload == std::to_string(i);
+    return ok;
+}
+
+static void testTopicAliases(ESP32_MQTTHostBroker& broker)
+{
+    Receiver receiver;
+    receiver.start(broker.getUri(), "aliases-receiver", 5, "plant/#");
+
+    ESP32_MQTTClient sender;
+    std::atomic<int> connected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("aliases-sender");
+    sender.setProtocolVersion(5);
+    sender.setReconnectTimeout(100);
+    sender.enableTopicAliases(4);
+    sender.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+
+    // three topics, the first publish of each carries the topic
+    const char* names[] = { "plant/line1/press/temperature", "plant/line1/press/pressure", "plant/line2/oven/temperature" };
+    std::vector<std::string> topics;
+    auto publish = [&](const char* topic) {
+        std::string payload = std::to_string(topics.size());
+        topics.push_back(topic);
+        CHECK(sender.publish(topic, (const uint8_t*)payload.data(), payload.size(), 0) == 0);
+    };
+    uint32_t bytesBefore = broker.getReceivedBytes();
+    for (int round = 0; round < 5; round++)
+    {
+        for (const char* topic : names)
+            publish(topic);
+    }
+    CHECK(waitFor([&]() { return checkTopics(receiver, topics); }));
+    uint32_t savedBytes = 4 * (strlen(names[0]) + strlen(names[1]) + strlen(names[2]));
+    CHECK(sender.getTopicAliasSavedBytes() == savedBytes);
+    // each alias costs 3 bytes of properties
+    CHECK(broker.getReceivedBytes() - bytesBefore < 15 * (2 + 2 + 2 + 3 + 1) + 3 * (strlen(names[0]) + 3));
+
+    // aliases are valid for one connection, the broker closes a connection using an alias it doesn't know
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return connected == 2 && receiver.subscribed == 2; }));
+    for (const char* topic : names)
+        publish(topic);
+    CHECK(waitFor([&]() { return checkTopics(receiver, topics); }));
+    CHECK(sender.getTopicAliasSavedBytes() == savedBytes);
+    CHECK(sender.isConnected() && connected == 2);
+
+    // a broker with a Topic Alias Maximum of 2: alias 3 is refused by esp-mqtt and the third topic is sent in full
+    broker.setTopicAliasMaximum(2);
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return connected == 3 && receiver.subscribed == 3; }));
+    for (int round = 0; round < 3; round++)
+    {
+        for (const char* topic : names)
+            publish(topic);
+    }
+    CHECK(waitFor([&]() { return checkTopics(receiver, topics); }));
+    CHECK(sender.isConnected() && connected == 3);
+    broker.setTopicAliasMaximum(10);
+
+    // QoS 1 messages are never aliased, they can be resent on a connection that doesn't know the alias
+    uint32_t saved = sender.getTopicAliasSavedBytes();
+    for (const char* topic : names)
+    {
+        std::string payload = std::to_string(topics.size());
+        topics.push_back(topic);
+        CHECK(sender.publish(topic, (const uint8_t*)payload.data(), payload.size(), 1) > 0);
+    }
+    CHECK(waitFor([&]() { return checkTopics(receiver, topics); }));
+    CHECK(sender.getTopicAliasSavedBytes() == saved);
+
+    CHECK(sender.stop());
+    CHECK(receiver.client.stop());
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient sender;
+    std::atomic<int> connected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("properties-sender");
+    sender.setProtocolVersion(5);
+    sender.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+    testProperties(broker, sender);
+    CHECK(sender.stop());
+
+    testTopicAliases(broker);
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,100 @@
+// Publish queue: with 4 producers pushing at once every policy keeps the order of each producer, and the messages
+// received plus the dropped or rejected ones add up to the messages pushed.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTPublishQueue.h>
+#include <atomic>
+#include <chrono>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+static const int Producers = 4;
+static const int Messages = 5000;
+
+static void testPolicy(ESP32_MQTTQueueFullPolicy policy)
+{
+    ESP32_MQTTPublishQueue queue;
+    CHECK(queue.init(16, 64));
+    std::atomic<bool> done(false);
+    std::atomic<int> received(0), accepted(0), rejected(0);
+    int last[Producers] = { -1, -1, -1, -1 };
+    std::atomic<int> reordered(0);
+
+    std::thread sender([&]() {
+        ESP32_MQTTQueuedMessage message;
+        while (true)
+        {
+            if (queue.claim(message))
+            {
+                int p, i;
+                memcpy(&p, message.payload, sizeof(p));
+                memcpy(&i, message.payload + sizeof(p), sizeof(i));
+                if (i <= last[p] || strcmp(message.topic, "queue/test") != 0)
+                    reordered++;
+                last[p] = i;
+                received++;
+                // slower than the producers, the queue fills up
+                if (received % 8 == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                queue.release();
+            }
+            else if (done)
+            {
+                break;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < Producers; p++)
+    {
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < Messages; i++)
+            {
+                uint8_t payload[8];
+                memcpy(payload, &p, sizeof(p));
+                memcpy(payload + sizeof(p), &i, sizeof(i));
+                if (queue.push("queue/test", payload, sizeof(payload), 1, false, policy, 1000) == 0)
+                    accepted++;
+                else
+                    rejected++;
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+    CHECK(waitFor([&]() { return queue.getSize() == 0; }));
+    done = true;
+    sender.join();
+
+    CHECK(reordered == 0);
+    CHECK(accepted + rejected == Producers * Messages);
+    // rejected pushes and dropped messages are both counted
+    CHECK(received == accepted - ((int)queue.getDropCount() - rejected));
+    if (policy == ESP32_MQTTQueueFullPolicy::Block)
+        CHECK(received == Producers * Messages);
+    CHECK(queue.getHighWaterMark() <= queue.getCapacity());
+    printf("policy %d: received %d, dropped or rejected %u\n", (int)policy, (int)received, queue.getDropCount());
+}
+
+int main()
+{
+    ESP32_MQTTPublishQueue queue;
+    CHECK(queue.init(4, 16));
+    CHECK(queue.push("too/long/for/the/slot", (const uint8_t*)"x", 1, 0, false, ESP32_MQTTQueueFullPolicy::FailFast, 0) == -1);
+    for (int i = 0; i < 4; i++)
+        CHECK(queue.push("a", (const uint8_t*)"x", 1, 0, false, ESP32_MQTTQueueFullPolicy::FailFast, 0) == 0);
+    CHECK(queue.push("a", (const uint8_t*)"x", 1, 0, false, ESP32_MQTTQueueFullPolicy::FailFast, 0) == -2);
+    CHECK(queue.getHighWaterMark() == 4);
+    queue.deinit();
+
+    testPolicy(ESP32_MQTTQueueFullPolicy::FailFast);
+    testPolicy(ESP32_MQTTQueueFullPolicy::Block);
+    testPolicy(ESP32_MQTTQueueFullPolicy::DropOldest);
+    return TEST_RESULT();
+}
@@ -0,0 +1,259 @@
+// Message reassembly with a 512 byte in buffer on the loopback broker: a message of several chunks is delivered whole,
+// a message arriving while the only buffer is held by a blocked handler is dropped or delivered in chunks depending on
+// the drop policy, and a reassembled message dropped by the full dispatch queue gives its buffer back. Chunks a broker
+// doesn't send (a message cut short by the next one, a chunk past the announced length) are passed to a client that
+// isn't started.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const int InPacketSize = 512;
+
+struct Chunk
+{
+    std::string topic;
+    std::string data;
+    int offset;
+    int total;
+};
+
+struct Receiver
+{
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed { 0 };
+    std::atomic<bool> blocked { false };
+    std::atomic<bool> release { false };
+    std::mutex chunksMutex;
+    std::vector<Chunk> chunks;
+
+    // messages on reassembly/block keep the handler until release
+    void setUp(const char* uri, const char* name, ESP32_MQTTReassemblyDropPolicy dropPolicy, size_t queueCapacity)
+    {
+        client.setBrokerUri(uri);
+        client.setClientName(name);
+        client.setMaxInPacketSize(InPacketSize);
+        client.enableMessageReassembly(8192, 1, dropPolicy);
+        if (queueCapacity > 0)
+            client.enableDispatchTask(queueCapacity);
+        client.onMqttConnected([this](int sessionPresent) { client.subscribe("reassembly/#", 0); });
+        client.onMqttTopicSubscribed([this](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+        client.onMqttMessageReceived([this](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+            {
+                std::lock_guard<std::mutex> lock(chunksMutex);
+                chunks.push_back({ std::string(topic != nullptr ? topic : "", topicLen), std::string(data, dataLen), currentDataOffset, totalDataLen });
+            }
+            if (topicLen == 16 && memcmp(topic, "reassembly/block", 16) == 0)
+            {
+                blocked = true;
+                waitFor([this]() { return release.load(); }, 10000);
+                blocked = false;
+                release = false;
+            }
+        });
+    }
+
+    size_t count()
+    {
+        std::lock_guard<std::mutex> lock(chunksMutex);
+        return chunks.size();
+    }
+
+    // the chunks of a topic, the ones after the first have no topic
+    std::vector<Chunk> take(const std::string& topic)
+    {
+        std::lock_guard<std::mutex> lock(chunksMutex);
+        std::vector<Chunk> taken;
+        bool inMessage = false;
+        for (const Chunk& chunk : chunks)
+        {
+            if (chunk.offset == 0)
+                inMessage = chunk.topic == topic;
+            if (inMessage)
+                taken.push_back(chunk);
+        }
+        return taken;
+    }
+};
+
+static std::string pattern(size_t length, char first)
+{
+    std::string data(length, '\0');
+    for (size_t i = 0; i < length; i++)
+        data[i] = first + i % 23;
+    return data;
+}
+
+static bool deliveredWhole(Receiver& receiver, const char* topic, const std::string& data)
+{
+    std::vector<Chunk> chunks = receiver.take(topic);
+    return chunks.size() == 1 && chunks[0].data == data && chunks[0].offset == 0 && chunks[0].total == (int)data.size();
+}
+
+static void publish(ESP32_MQTTClient& sender, const char* topic, const std::string& data)
+{
+    CHECK(sender.publish(topic, (const uint8_t*)data.data(), data.size(), 0, false) >= 0);
+}
+
+// the only buffer is held by a message whose handler is blocked in the dispatch task
+static void testPoolExhausted(ESP32_MQTTHostBroker& broker, ESP32_MQTTClient& sender, ESP32_MQTTReassemblyDropPolicy dropPolicy)
+{
+    bool deliverFragments = dropPolicy == ESP32_MQTTReassemblyDropPolicy::DeliverFragments;
+    Receiver receiver;
+    receiver.setUp(broker.getUri(), deliverFragments ? "reassembly-fragments" : "reassembly-drop", dropPolicy, 16);
+    CHECK(receiver.client.start());
+    CHECK(waitFor([&]() { return receiver.subscribed == 1; }));
+
+    std::string first = pattern(5000, 'a');
+    publish(sender, "reassembly/first", first);
+    CHECK(waitFor([&]() { return receiver.count() == 1; }));
+    CHECK(deliveredWhole(receiver, "reassembly/first", first));
+
+    std::string block = pattern(3000, 'b');
+    std::string second = pattern(2000, 'c');
+    publish(sender, "reassembly/block", block);
+    CHECK(waitFor([&]() { return receiver.blocked.load(); }));
+    publish(sender, "reassembly/second", second);
+    if (deliverFragments)
+    {
+        // 4 chunks wait in the queue
+        CHECK(waitFor([&]() { return receiver.client.getDispatchQueueHighWaterMark() >= 1 + 4; }));
+        CHECK(receiver.client.getReassemblyDropCount() == 0);
+    }
+    else
+    {
+        CHECK(waitFor([&]() { return receiver.client.getReassemblyDropCount() == 1; }));
+    }
+    receiver.release = true;
+    CHECK(waitFor([&]() { return !receiver.blocked; }));
+    CHECK(deliveredWhole(receiver, "reassembly/block", block));
+
+    if (deliverFragments)
+    {
+        CHECK(waitFor([&]() { return receiver.take("reassembly/second").size() > 1; }));
+        delay(50);
+        std::vector<Chunk> chunks = receiver.take("reassembly/second");
+        std::string joined;
+        bool inOrder = true;
+        for (const Chunk& chunk : chunks)
+        {
+            inOrder &= chunk.offset == (int)joined.size() && chunk.total == (int)second.size() && chunk.data.size() <= (size_t)InPacketSize;
+            joined += chunk.data;
+        }
+        CHECK(inOrder && joined == second);
+    }
+    else
+    {
+        delay(50);
+        CHECK(receiver.take("reassembly/second").empty());
+    }
+
+    // the buffer is back in the pool
+    std::string third = pattern(4000, 'd');
+    publish(sender, "reassembly/third", third);
+    CHECK(waitFor([&]() { return deliveredWhole(receiver, "reassembly/third", third); }));
+    CHECK(receiver.client.getReassemblyDropCount() == (deliverFragments ? 0u : 1u));
+    CHECK(receiver.client.stop());
+}
+
+// a reassembled message the full dispatch queue drops releases its buffer
+static void testQueueFull(ESP32_MQTTHostBroker& broker, ESP32_MQTTClient& sender)
+{
+    Receiver receiver;
+    receiver.setUp(broker.getUri(), "reassembly-queue", ESP32_MQTTReassemblyDropPolicy::DropMessage, 2);
+    CHECK(receiver.client.start());
+    CHECK(waitFor([&]() { return receiver.subscribed == 1; }));
+
+    publish(sender, "reassembly/block", "small");
+    CHECK(waitFor([&]() { return receiver.blocked.load(); }));
+    publish(sender, "reassembly/fill", "1");
+    publish(sender, "reassembly/fill", "2");
+    CHECK(waitFor([&]() { return receiver.client.getDispatchQueueDropCount() == 1; }));
+    std::string dropped = pattern(3000, 'e');
+    publish(sender, "reassembly/dropped", dropped);
+    CHECK(waitFor([&]() { return receiver.client.getDispatchQueueDropCount() == 2; }));
+    receiver.release = true;
+    CHECK(waitFor([&]() { return !receiver.blocked && receiver.count() == 2; }));
+
+    std::string after = pattern(3000, 'f');
+    publish(sender, "reassembly/after", after);
+    CHECK(waitFor([&]() { return deliveredWhole(receiver, "reassembly/after", after); }));
+    CHECK(receiver.take("reassembly/dropped").empty());
+    CHECK(receiver.client.getReassemblyDropCount() == 0);
+    CHECK(receiver.client.stop());
+}
+
+static void deliverChunk(const char* topic, const std::string& data, int offset, int total)
+{
+    esp_mqtt_event_t event = {};
+    event.event_id = MQTT_EVENT_DATA;
+    // esp-mqtt sends the topic only with the first chunk
+    if (offset == 0)
+    {
+        event.topic = (char*)topic;
+        event.topic_len = strlen(topic);
+    }
+    event.data = (char*)data.data();
+    event.data_len = data.size();
+    event.current_data_offset = offset;
+    event.total_data_len = total;
+    CHECK(ESP32_MQTTHostEvents::dispatch("reassembly-injected", &event));
+}
+
+static void testBrokenChunks()
+{
+    Receiver receiver;
+    receiver.setUp("mqtt://127.0.0.1:1", "reassembly-injected", ESP32_MQTTReassemblyDropPolicy::DropMessage, 0);
+    CHECK(receiver.client.createClient());
+
+    // the first message is cut short by the next one, which gets the only buffer
+    std::string cut = pattern(1500, 'g');
+    std::string next = pattern(1500, 'h');
+    deliverChunk("reassembly/cut", cut.substr(0, 500), 0, 1500);
+    deliverChunk("reassembly/cut", cut.substr(500, 500), 500, 1500);
+    deliverChunk("reassembly/next", next.substr(0, 500), 0, 1500);
+    deliverChunk("reassembly/next", next.substr(500, 500), 500, 1500);
+    deliverChunk("reassembly/next", next.substr(1000, 500), 1000, 1500);
+    CHECK(receiver.count() == 1);
+    CHECK(deliveredWhole(receiver, "reassembly/next", next));
+    CHECK(receiver.take("reassembly/cut").empty());
+
+    // a chunk past the announced length drops the message
+    std::string overrun = pattern(1000, 'i');
+    deliverChunk("reassembly/overrun", overrun.substr(0, 500), 0, 1000);
+    deliverChunk("reassembly/overrun", pattern(700, 'j'), 500, 1000);
+    deliverChunk("reassembly/overrun", "tail", 1200, 1000);
+    CHECK(receiver.count() == 1);
+    CHECK(receiver.client.getReassemblyDropCount() == 1);
+
+    // and releases the buffer
+    std::string last = pattern(1200, 'k');
+    deliverChunk("reassembly/last", last.substr(0, 600), 0, 1200);
+    deliverChunk("reassembly/last", last.substr(600), 600, 1200);
+    CHECK(receiver.count() == 2);
+    CHECK(deliveredWhole(receiver, "reassembly/last", last));
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    ESP32_MQTTClient sender;
+    std::atomic<int> connected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("reassembly-sender");
+    sender.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+
+    testPoolExhausted(broker, sender, ESP32_MQTTReassemblyDropPolicy::DropMessage);
+    testPoolExhausted(broker, sender, ESP32_MQTTReassemblyDropPolicy::DeliverFragments);
+    testQueueFull(broker, sender);
+    testBrokenChunks();
+
+    CHECK(sender.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,90 @@
+// Restoring subscriptions after broker restarts without sessions: the filters go out in several SUBSCRIBE packets of a
+// small out buffer, and every filter gets the return code of its own position in the SUBACK of its packet. The broker
+// rejects a different set of filters after each restart, so results left from the previous connection would show.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string>
+
+static const int PlantFilters = 60;
+static const int AlarmFilters = 12;
+
+static std::string plantFilter(int i)
+{
+    return "plant/line" + std::to_string(i) + "/+";
+}
+
+static std::string alarmFilter(int i)
+{
+    return "alarms/zone" + std::to_string(i);
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    uint16_t port = broker.getPort();
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), restored(0), restoredSubscribed(-1), restoredFailed(-1);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("resubscribe-test");
+    client.setReconnectTimeout(100);
+    client.setMaxOutPacketSize(256);
+    client.enableAutoResubscribe();
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.onMqttSubscriptionsRestored([&](int subscribedCount, int failedCount) {
+        restoredSubscribed = subscribedCount;
+        restoredFailed = failedCount;
+        restored++;
+    });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+
+    for (int i = 0; i < PlantFilters; i++)
+        CHECK(client.subscribe(plantFilter(i).c_str(), i % 3) > 0);
+    for (int i = 0; i < AlarmFilters; i++)
+        CHECK(client.subscribe(alarmFilter(i).c_str(), 1) > 0);
+    CHECK(waitFor([&]() { return client.getSubscriptionGrantedQos(alarmFilter(AlarmFilters - 1).c_str()) == 1; }));
+
+    // the restarted broker refuses the alarms
+    uint32_t subscribePackets = broker.getReceivedCount(8);
+    broker.end();
+    broker.setRejectSubscriptions("alarms/");
+    CHECK(broker.begin(port));
+    CHECK(waitFor([&]() { return connected == 2 && restored == 1; }));
+    CHECK(restoredSubscribed == PlantFilters);
+    CHECK(restoredFailed == AlarmFilters);
+    for (int i = 0; i < PlantFilters; i++)
+        CHECK(client.getSubscriptionGrantedQos(plantFilter(i).c_str()) == i % 3);
+    for (int i = 0; i < AlarmFilters; i++)
+        CHECK(client.getSubscriptionGrantedQos(alarmFilter(i).c_str()) == 0x80);
+    // about 20 bytes per filter in a 256 byte packet
+    uint32_t restorePackets = broker.getReceivedCount(8) - subscribePackets;
+    CHECK(restorePackets > 3 && restorePackets < (uint32_t)(PlantFilters + AlarmFilters) / 4);
+
+    // and then the plant lines
+    broker.end();
+    broker.setRejectSubscriptions("plant/line");
+    CHECK(broker.begin(port));
+    CHECK(waitFor([&]() { return connected == 3 && restored == 2; }));
+    CHECK(restoredSubscribed == AlarmFilters);
+    CHECK(restoredFailed == PlantFilters);
+    for (int i = 0; i < PlantFilters; i++)
+        CHECK(client.getSubscriptionGrantedQos(plantFilter(i).c_str()) == 0x80);
+    for (int i = 0; i < AlarmFilters; i++)
+        CHECK(client.getSubscriptionGrantedQos(alarmFilter(i).c_str()) == 1);
+
+    // the restored subscriptions deliver
+    std::atomic<int> received(0);
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) { received++; });
+    CHECK(client.publish(alarmFilter(3).c_str(), "on", 1) > 0);
+    CHECK(client.publish("plant/line3/temperature", "21.5", 1) > 0);
+    CHECK(waitFor([&]() { return received == 1; }));
+    delay(100);
+    CHECK(received == 1);
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
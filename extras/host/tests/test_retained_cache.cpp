@@ -0,0 +1,129 @@
+// Retained cache: suppression and LRU eviction against a model, deadbands and the refresh interval. Retained store:
+// updates without the retain flag, removal, eviction and filter matching.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTRetainedCache.h>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+
+static bool check(ESP32_MQTTRetainedCache& cache, const char* topic, const char* payload, float deadband = 0)
+{
+    return cache.check(topic, (const uint8_t*)payload, strlen(payload), deadband);
+}
+
+// the cache must decide like a map of the last payloads with an LRU list of capacity entries
+static void testAgainstModel(size_t capacity)
+{
+    ESP32_MQTTRetainedCache cache;
+    CHECK(cache.init(capacity, 0));
+    std::list<std::string> lru;
+    std::map<std::string, std::string> sent;
+    std::mt19937 rng(capacity);
+    int mismatches = 0;
+    for (int i = 0; i < 200000; i++)
+    {
+        std::string topic = "t/" + std::to_string(rng() % (capacity * 2 + 1));
+        std::string payload = std::to_string(rng() % 3);
+        if (rng() % 50 == 0)
+        {
+            cache.forget(topic.c_str());
+            if (sent.erase(topic) > 0)
+                lru.remove(topic);
+            continue;
+        }
+
+        bool expected = true;
+        if (sent.count(topic) > 0)
+        {
+            lru.remove(topic);
+            expected = sent[topic] != payload;
+        }
+        else if (sent.size() == capacity)
+        {
+            sent.erase(lru.back());
+            lru.pop_back();
+        }
+        lru.push_front(topic);
+        if (expected)
+            sent[topic] = payload;
+
+        if (check(cache, topic.c_str(), payload.c_str()) != expected || cache.getCount() != sent.size())
+            mismatches++;
+    }
+    CHECK(mismatches == 0);
+    CHECK(cache.getSuppressedCount() > 0);
+}
+
+static void testDeadbandAndRefresh()
+{
+    ESP32_MQTTRetainedCache cache;
+    CHECK(cache.init(16, 100));
+    CHECK(check(cache, "s/temperature", "21.50", 0.2f));
+    CHECK(!check(cache, "s/temperature", "21.50", 0.2f));
+    CHECK(!check(cache, "s/temperature", "21.65", 0.2f));
+    CHECK(check(cache, "s/temperature", "21.75", 0.2f));
+    // the deadband is measured from the last value sent, not the last one checked
+    CHECK(!check(cache, "s/temperature", "21.60", 0.2f));
+    CHECK(check(cache, "s/temperature", "21.50", 0.2f));
+    // text isn't compared by value
+    CHECK(check(cache, "s/status", "online", 0.2f));
+    CHECK(!check(cache, "s/status", "online", 0.2f));
+    CHECK(check(cache, "s/status", "idle", 0.2f));
+    delay(150);
+    CHECK(check(cache, "s/status", "idle", 0.2f));
+    CHECK(!check(cache, "s/status", "idle", 0.2f));
+    cache.clear();
+    CHECK(cache.getCount() == 0);
+    CHECK(check(cache, "s/status", "idle"));
+
+    float value;
+    CHECK(ESP32_MQTTRetainedCache::parseNumber((const uint8_t*)"-3.25", 5, value) && value == -3.25f);
+    CHECK(!ESP32_MQTTRetainedCache::parseNumber((const uint8_t*)"3.2x", 4, value));
+}
+
+static void collect(char* topic, int topicLen, char* payload, int length, void* context)
+{
+    *(std::string*)context += std::string(topic, topicLen) + "=" + std::string(payload, length) + ";";
+}
+
+static void testStore()
+{
+    ESP32_MQTTRetainedStore store;
+    CHECK(store.init(3, 32));
+    uint8_t buf[33];
+    store.store("a/1", 3, (const uint8_t*)"x", 1, true);
+    store.store("a/2", 3, (const uint8_t*)"y", 1, false);    // not retained, not stored
+    CHECK(store.get("a/2", buf, sizeof(buf)) == -1);
+    // a stored topic is updated without the retain flag
+    store.store("a/1", 3, (const uint8_t*)"zz", 2, false);
+    CHECK(store.get("a/1", buf, sizeof(buf)) == 2 && memcmp(buf, "zz", 2) == 0);
+    CHECK(store.get("a/1", buf, 1) == -1);
+
+    store.store("a/2", 3, (const uint8_t*)"y", 1, true);
+    store.store("b/3", 3, (const uint8_t*)"w", 1, true);
+    store.store("b/4", 3, (const uint8_t*)"v", 1, true);     // replaces a/1, the least recently updated
+    CHECK(store.getCount() == 3);
+    CHECK(store.get("a/1", buf, sizeof(buf)) == -1);
+    store.store("b/3", 3, nullptr, 0, true);                 // an empty retained payload removes the topic
+    CHECK(store.get("b/3", buf, sizeof(buf)) == -1);
+    CHECK(store.getCount() == 2);
+
+    std::string matched;
+    CHECK(store.forEachMatching("a/#", buf, collect, &matched) == 1);
+    CHECK(matched == "a/2=y;");
+    // topic and payload must fit the slot
+    char topic[40];
+    memset(topic, 'x', sizeof(topic));
+    store.store(topic, sizeof(topic), (const uint8_t*)"1", 1, true);
+    CHECK(store.getCount() == 2);
+}
+
+int main()
+{
+    for (size_t capacity : { 1, 2, 7, 64 })
+        testAgainstModel(capacity);
+    testDeadbandAndRefresh();
+    testStore();
+    return TEST_RESULT();
+}
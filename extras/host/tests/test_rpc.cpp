@@ -0,0 +1,84 @@
+// RPC calls: an answered call, an error reply, a call that times out with its handler running in the RPC task and
+// not in the esp_timer task, too many pending calls, and end() cancelling the pending calls.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTRpc.h>
+#include <atomic>
+#include <string>
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("rpc-test");
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return client.isConnected(); }));
+
+    ESP32_MQTTRpc rpc(client);
+    CHECK(rpc.begin("rpc-test/reply", 4));
+    CHECK(rpc.serve("rpc-test/echo", [](ESP32_MQTTRpcRequest& request) {
+        std::string payload((const char*)request.payload, request.length);
+        if (payload == "fail")
+            request.reply("failed", true);
+        else
+            request.reply(payload.c_str());
+    }) >= 0);
+    CHECK(waitFor([&]() { return subscribed == 2; }));
+
+    std::atomic<int> ok(0), error(0);
+    std::string response;
+    CHECK(rpc.call("rpc-test/echo", "hello", 2000, [&](ESP32_MQTTRpcStatus status, const uint8_t* payload, size_t length) {
+        response.assign((const char*)payload, length);
+        if (status == ESP32_MQTTRpcStatus::Ok)
+            ok++;
+    }) >= 0);
+    CHECK(waitFor([&]() { return ok == 1; }));
+    CHECK(response == "hello");
+    CHECK(rpc.call("rpc-test/echo", "fail", 2000, [&](ESP32_MQTTRpcStatus status, const uint8_t* payload, size_t length) {
+        if (status == ESP32_MQTTRpcStatus::Error && length == 6)
+            error++;
+    }) >= 0);
+    CHECK(waitFor([&]() { return error == 1; }));
+    CHECK(rpc.getPendingCount() == 0);
+
+    ESP32_MQTTHistogramSnapshot latency;
+    rpc.getLatency(latency);
+    CHECK(latency.count == 2);
+
+    // nobody serves this topic
+    std::atomic<int> timedOut(0);
+    std::string taskName;
+    unsigned long start = millis();
+    CHECK(rpc.call("rpc-test/nobody", "x", 200, [&](ESP32_MQTTRpcStatus status, const uint8_t* payload, size_t length) {
+        taskName = pcTaskGetName(nullptr);
+        if (status == ESP32_MQTTRpcStatus::TimedOut)
+            timedOut++;
+    }) >= 0);
+    CHECK(waitFor([&]() { return timedOut == 1; }));
+    unsigned long elapsed = millis() - start;
+    CHECK(elapsed >= 200 && elapsed < 1000);
+    CHECK(taskName == "mqtt_rpc");
+    CHECK(rpc.getTimeoutCount() == 1);
+
+    std::atomic<int> cancelled(0);
+    for (int i = 0; i < 4; i++)
+        CHECK(rpc.call("rpc-test/nobody", "x", 10000, [&](ESP32_MQTTRpcStatus status, const uint8_t* payload, size_t length) {
+            if (status == ESP32_MQTTRpcStatus::Cancelled)
+                cancelled++;
+        }) >= 0);
+    CHECK(rpc.call("rpc-test/nobody", "x", 10000, nullptr) == -2);
+    CHECK(rpc.getMaxPendingCount() == 4);
+    rpc.end();
+    CHECK(cancelled == 4);
+    CHECK(rpc.getPendingCount() == 0);
+    CHECK(rpc.call("rpc-test/echo", "x", 1000, nullptr) == -1);
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
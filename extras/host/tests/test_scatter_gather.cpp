@@ -0,0 +1,121 @@
+// Scatter-gather publish() and enqueue(): binary segments containing zero bytes and empty segments arrive as their
+// concatenation, and a handler in the MQTT task publishes segments with its own buffer while another task waits for the
+// esp-mqtt lock with the shared one locked (with a single buffer the two would deadlock).
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+static const int Requests = 50;
+
+static std::string binary(size_t length, uint8_t seed)
+{
+    std::string data(length, '\0');
+    // every third byte is zero
+    for (size_t i = 0; i < length; i++)
+        data[i] = i % 3 == 0 ? 0 : (char)(seed + i);
+    return data;
+}
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTClient client;
+    std::atomic<int> subscribed(0), replyFailures(0), backgroundFailures(0);
+    std::atomic<bool> stopSender(false);
+    std::mutex receivedMutex;
+    std::map<std::string, std::string> received;
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("scatter-gather-test");
+    client.onMqttConnected([&](int sessionPresent) { client.subscribe("gather/#", 1); });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        std::string topicStr(topic, topicLen);
+        {
+            std::lock_guard<std::mutex> lock(receivedMutex);
+            received[topicStr] = std::string(data, dataLen);
+        }
+
+        // runs in the MQTT task, replies with the request and a binary trailer
+        if (topicStr.compare(0, 15, "gather/request/") == 0)
+        {
+            // the MQTT task holds the esp-mqtt lock, by now the other task waits for it with the shared buffer locked
+            delay(2);
+            int index = std::stoi(topicStr.substr(15));
+            std::string replyTopic = "gather/reply/" + std::to_string(index);
+            std::string trailer = binary(index, (uint8_t)index);
+            uint8_t header[2] = { 0, (uint8_t)index };
+            ESP32_MQTTPayloadSegment segments[] = { { header, sizeof(header) }, { data, (size_t)dataLen }, { trailer.data(), trailer.size() } };
+            int result = index % 2 == 0 ? client.publish(replyTopic.c_str(), segments, 3, 1) : client.enqueue(replyTopic.c_str(), segments, 3, 1);
+            if (result < 0)
+                replyFailures++;
+        }
+    });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    auto receivedPayload = [&](const std::string& topic) {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        auto it = received.find(topic);
+        return it != received.end() ? it->second : std::string("<none>");
+    };
+
+    // binary segments with zero bytes, an empty segment in the middle
+    std::string header = binary(7, 1), body = binary(600, 2), crc("\0\0\x12\0", 4);
+    ESP32_MQTTPayloadSegment segments[] = { { header.data(), header.size() }, { nullptr, 0 }, { body.data(), body.size() }, { crc.data(), crc.size() } };
+    CHECK(client.publish("gather/published", segments, 4, 1) > 0);
+    CHECK(waitFor([&]() { return receivedPayload("gather/published") == header + body + crc; }));
+    CHECK(client.enqueue("gather/enqueued", segments, 4, 0) >= 0);
+    CHECK(waitFor([&]() { return receivedPayload("gather/enqueued") == header + body + crc; }));
+
+    // 3 segments after a bigger payload, the buffer is reused
+    std::string a = binary(3, 3), b = binary(1, 4), c = "tail";
+    ESP32_MQTTPayloadSegment three[] = { { a.data(), a.size() }, { b.data(), b.size() }, { c.data(), c.size() } };
+    CHECK(client.publish("gather/three", three, 3, 0) >= 0);
+    CHECK(waitFor([&]() { return receivedPayload("gather/three") == a + b + c; }));
+
+    // another task publishing segments holds the shared buffer while it waits for the MQTT task, not subscribed
+    std::thread sender([&]() {
+        std::string payload = binary(100, 5);
+        while (!stopSender)
+        {
+            ESP32_MQTTPayloadSegment background[] = { { payload.data(), 50 }, { payload.data() + 50, 50 } };
+            if (client.publish("background", background, 2, 0) < 0)
+                backgroundFailures++;
+            delay(1);
+        }
+    });
+    for (int i = 0; i < Requests; i++)
+    {
+        std::string request = binary(20 + i, (uint8_t)i);
+        CHECK(client.publish(("gather/request/" + std::to_string(i)).c_str(), (const uint8_t*)request.data(), request.size(), 0) >= 0);
+        delay(2);
+    }
+
+    bool repliesReceived = waitFor([&]() {
+        std::lock_guard<std::mutex> lock(receivedMutex);
+        for (int i = 0; i < Requests; i++)
+            if (received.count("gather/reply/" + std::to_string(i)) == 0)
+                return false;
+        return true;
+    });
+    stopSender = true;
+    sender.join();
+    CHECK(repliesReceived);
+    for (int i = 0; i < Requests; i++)
+    {
+        std::string expected = std::string(1, '\0') + (char)i + binary(20 + i, (uint8_t)i) + binary(i, (uint8_t)i);
+        CHECK(receivedPayload("gather/reply/" + std::to_string(i)) == expected);
+    }
+    CHECK(replyFailures == 0);
+    CHECK(backgroundFailures == 0);
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
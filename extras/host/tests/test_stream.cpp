@@ -0,0 +1,161 @@
+// Stream subscriptions: a 64 KB message and a 1 MB publishStream() payload reach their sinks in order and complete,
+// the digests match, a rejected or refused stream ends with end(false), and the 1 MB payload isn't buffered anywhere.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTCrc32.h>
+#include <ESP32_MQTTStream.h>
+#include <mbedtls/sha256.h>
+#include <atomic>
+#include <vector>
+
+static const size_t PlainLength = 64 * 1024;
+static const size_t SegmentedLength = 1024 * 1024;
+
+static std::vector<uint8_t> createPayload(size_t length, uint32_t seed)
+{
+    std::vector<uint8_t> payload(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        payload[i] = seed >> 16;
+    }
+    return payload;
+}
+
+// checks the chunks against the expected payload as they come
+struct CheckingSink
+{
+    const std::vector<uint8_t>* expected = nullptr;
+    std::atomic<size_t> received { 0 };
+    std::atomic<int> mismatches { 0 };
+    std::atomic<int> ended { 0 };
+    std::atomic<int> endedOk { 0 };
+    std::atomic<bool> refuse { false };
+
+    ESP32_MQTTCallbackSink sink {
+        [this](const char* topic, int topicLen, size_t totalLength) {
+            received = 0;
+            if (totalLength != expected->size())
+                mismatches++;
+            return true;
+        },
+        [this](const uint8_t* data, size_t length, size_t offset) {
+            if (refuse)
+                return false;
+            if (offset != received || offset + length > expected->size() || memcmp(data, expected->data() + offset, length) != 0)
+                mismatches++;
+            received += length;
+            return true;
+        },
+        [this](bool ok) {
+            ended++;
+            if (ok)
+                endedOk++;
+        }
+    };
+};
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    std::vector<uint8_t> plain = createPayload(PlainLength, 1);
+    std::vector<uint8_t> segmented = createPayload(SegmentedLength, 2);
+    uint8_t plainSha256[32];
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    mbedtls_sha256_update(&sha256, plain.data(), plain.size());
+    mbedtls_sha256_finish(&sha256, plainSha256);
+    mbedtls_sha256_free(&sha256);
+    uint32_t segmentedCrc32 = ESP32_MQTTCrc32(0, segmented.data(), segmented.size());
+
+    CheckingSink plainSink, segmentedSink;
+    plainSink.expected = &plain;
+    segmentedSink.expected = &segmented;
+    const esp_partition_t* partition = ESP32_MQTTHostPartition::create("stream", SegmentedLength);
+    ESP32_MQTTPartitionSink partitionSink(partition);
+    std::atomic<int> digestMatches(0), partitionEnded(0);
+    std::atomic<bool> acceptPlain(true);
+
+    ESP32_MQTTClient receiver;
+    std::atomic<int> subscribed(0);
+    receiver.setBrokerUri(broker.getUri());
+    receiver.setClientName("stream-receiver");
+    receiver.onMqttConnected([&](int sessionPresent) {
+        receiver.subscribeStream("stream/plain", 1, &plainSink.sink, ESP32_MQTTStreamDigest::Sha256, [&](const ESP32_MQTTStreamResult& result) {
+            if (memcmp(result.sha256, plainSha256, sizeof(plainSha256)) == 0)
+                digestMatches++;
+            return result.complete && (bool)acceptPlain;
+        });
+        receiver.subscribeStream("stream/segmented", 1, &segmentedSink.sink, ESP32_MQTTStreamDigest::Crc32, [&](const ESP32_MQTTStreamResult& result) {
+            if (result.crc32 == segmentedCrc32 && result.length == SegmentedLength)
+                digestMatches++;
+            return result.complete;
+        }, true);
+        receiver.subscribeStream("stream/partition", 1, &partitionSink, ESP32_MQTTStreamDigest::None, [&](const ESP32_MQTTStreamResult& result) {
+            partitionEnded++;
+            return result.complete;
+        }, true);
+    });
+    receiver.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    CHECK(receiver.start());
+    CHECK(waitFor([&]() { return subscribed == 3; }));
+
+    ESP32_MQTTClient sender;
+    std::atomic<int> connected(0);
+    sender.setBrokerUri(broker.getUri());
+    sender.setClientName("stream-sender");
+    sender.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(sender.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+    auto readSegmented = [&](uint8_t* buf, size_t length, size_t offset) {
+        size_t count = std::min(length, SegmentedLength - offset);
+        memcpy(buf, segmented.data() + offset, count);
+        return (int)count;
+    };
+
+    // one message, received in chunks of the in buffer
+    CHECK(sender.publish("stream/plain", plain.data(), plain.size(), 1, false) >= 0);
+    CHECK(waitFor([&]() { return plainSink.ended == 1; }));
+    CHECK(plainSink.endedOk == 1);
+    CHECK(plainSink.mismatches == 0);
+    CHECK(plainSink.received == PlainLength);
+
+    // segments joined into one stream, the process heap doesn't grow by the payload
+    size_t heapBefore = ESP32_MQTTHostHeap::getUsedBytes();
+    unsigned long start = millis();
+    CHECK(sender.publishStream("stream/segmented", SegmentedLength, readSegmented, 1) == 0);
+    CHECK(waitFor([&]() { return segmentedSink.ended == 1; }));
+    unsigned long elapsed = std::max(1UL, millis() - start);
+    size_t heapAfter = ESP32_MQTTHostHeap::getUsedBytes();
+    CHECK(segmentedSink.endedOk == 1);
+    CHECK(segmentedSink.mismatches == 0);
+    CHECK(digestMatches == 2);
+    CHECK(heapAfter < heapBefore + SegmentedLength / 4);
+    printf("1 MB publishStream() into a callback sink with CRC-32: %.1f MB/s, heap grew by %ld bytes\n", SegmentedLength / 1024.0 / 1024.0 * 1000.0 / elapsed, (long)heapAfter - (long)heapBefore);
+
+    // the same payload into a flash partition
+    CHECK(sender.publishStream("stream/partition", SegmentedLength, readSegmented, 1) == 0);
+    CHECK(waitFor([&]() { return partitionEnded == 1 && partitionSink.getWrittenLength() == SegmentedLength; }));
+    CHECK(memcmp(ESP32_MQTTHostPartition::getData(partition), segmented.data(), SegmentedLength) == 0);
+
+    // rejected by the verify callback, then refused by the sink
+    unsigned int failedBefore = receiver.getStreamFailedCount();
+    acceptPlain = false;
+    CHECK(sender.publish("stream/plain", plain.data(), plain.size(), 1, false) >= 0);
+    CHECK(waitFor([&]() { return plainSink.ended == 2; }));
+    CHECK(plainSink.endedOk == 1);
+    plainSink.refuse = true;
+    CHECK(sender.publish("stream/plain", plain.data(), plain.size(), 1, false) >= 0);
+    CHECK(waitFor([&]() { return plainSink.ended == 3; }));
+    CHECK(plainSink.endedOk == 1);
+    CHECK(receiver.getStreamFailedCount() == failedBefore + 2);
+
+    CHECK(sender.stop());
+    CHECK(receiver.stop());
+    ESP32_MQTTHostPartition::removeAll();
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,54 @@
+// Configuration strings in the string storage: setting the broker again reuses the uri's slot, and a setter fails and
+// keeps the previous value when the storage is full without taking space for the strings it did store.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string>
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+
+    ESP32_MQTTStaticClient<96> client;
+    // each uri takes about 30 bytes, without reusing the slot the storage would be full after three
+    for (int i = 0; i < 100; i++)
+    {
+        CHECK(client.setBrokerUrl(("10.0.0." + std::to_string(i % 250)).c_str(), 1883));
+        CHECK(client.setBrokerIp(IPAddress(10, 0, 0, i % 250), 1883));
+    }
+    CHECK(client.setBrokerUri(broker.getUri()));
+    CHECK(client.setClientName("storage-test"));
+
+    // doesn't fit, "storage-test" stays
+    std::string longName(80, 'x');
+    CHECK(!client.setClientName(longName.c_str()));
+    CHECK(!client.setLastWillMessage("storage/will", longName.c_str()));
+    CHECK(!client.addBrokerUri(("mqtt://" + longName).c_str()));
+
+    // the first string of a failed setter gives its space back, retrying doesn't fill the storage
+    size_t used = client.getStringStorageUsed();
+    for (int i = 0; i < 20; i++)
+    {
+        CHECK(!client.setCredentials("user", longName.c_str()));
+        CHECK(!client.setLastWillMessage("will", longName.c_str()));
+    }
+    CHECK(client.getStringStorageUsed() == used);
+    CHECK(client.setCredentials("user", "secret"));
+
+    std::atomic<int> connected(0);
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+    CHECK(broker.getConnectionCount() == 1);
+    CHECK(client.stop());
+
+    // a longer uri takes a new slot
+    ESP32_MQTTStaticClient<64> small;
+    CHECK(small.setBrokerUrl("10.0.0.1"));
+    CHECK(small.setBrokerUrl("broker.example.com"));
+    CHECK(!small.setBrokerUrl("a-much-longer-broker-name.example.com"));
+
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,40 @@
+// Topic alias table: an alias is used without the topic only after a publish carrying the topic succeeded, the least
+// recently used alias is reassigned, and a lowered limit or a reset starts over.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTTopicAliasTable.h>
+
+int main()
+{
+    ESP32_MQTTTopicAliasTable table;
+    bool established;
+    CHECK(table.getAlias("a", 1, established) == 0);
+    CHECK(table.init(2));
+
+    CHECK(table.getAlias("a", 1, established) == 1);
+    CHECK(!established);
+    // the first publish failed, the topic is sent again
+    CHECK(table.getAlias("a", 1, established) == 1);
+    CHECK(!established);
+    table.confirm(1);
+    CHECK(table.getAlias("a", 1, established) == 1);
+    CHECK(established);
+    CHECK(table.getHitCount() == 1 && table.getSavedBytes() == 1);
+
+    CHECK(table.getAlias("bb", 2, established) == 2);
+    table.confirm(2);
+    CHECK(table.getAlias("a", 1, established) == 1 && established);
+    // "bb" is the least recently used, its alias now maps to "ccc"
+    CHECK(table.getAlias("ccc", 3, established) == 2);
+    CHECK(!established);
+    CHECK(table.getAlias("ccc", 3, established) == 2);
+    CHECK(!established);
+    table.confirm(2);
+    CHECK(table.getAlias("ccc", 3, established) == 2 && established);
+
+    table.setLimit(0);
+    CHECK(table.getAlias("a", 1, established) == 0);
+    table.reset();
+    CHECK(table.getAlias("a", 1, established) == 1);
+    CHECK(!established);
+    return TEST_RESULT();
+}
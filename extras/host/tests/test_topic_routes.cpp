@@ -0,0 +1,92 @@
+// Topic routes: subscribe() and unsubscribe() from other tasks while the MQTT task dispatches, and restoring the
+// subscriptions with their SUBACK results after a reconnect without a session.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int ChurnTasks = 3;
+static const int ChurnRounds = 2000;
+
+int main()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    broker.setRejectSubscriptions("rejected/");
+
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), restored(0), restoredSubscribed(-1), restoredFailed(-1);
+    std::atomic<int> received(0), unrouted(0);
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("routes-test");
+    client.setReconnectTimeout(100);
+    client.enableAutoResubscribe();
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.onMqttSubscriptionsRestored([&](int subscribedCount, int failedCount) {
+        restoredSubscribed = subscribedCount;
+        restoredFailed = failedCount;
+        restored++;
+    });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) { unrouted++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+
+    // a catch-all handler, so every message is routed whatever the churning tasks do
+    CHECK(client.subscribe("churn/#", 0, [&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        received++;
+    }) > 0);
+    CHECK(waitFor([&]() { return client.getSubscriptionGrantedQos("churn/#") == 0; }));
+
+    // handlers come and go in other tasks while messages to their topics are dispatched
+    std::atomic<bool> churning(true);
+    std::vector<std::thread> tasks;
+    for (int t = 0; t < ChurnTasks; t++)
+    {
+        tasks.emplace_back([&, t]() {
+            for (int round = 0; round < ChurnRounds; round++)
+            {
+                std::string filter = "churn/" + std::to_string(t) + "/" + std::to_string(round % 8) + "/+";
+                client.subscribe(filter.c_str(), 0, [](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {});
+                client.subscribe(filter.c_str(), 1);
+                client.unsubscribe(filter.c_str());
+            }
+        });
+    }
+    std::thread publisher([&]() {
+        int i = 0;
+        while (churning)
+        {
+            std::string topic = "churn/" + std::to_string(i % ChurnTasks) + "/" + std::to_string(i % 8) + "/x";
+            client.publish(topic.c_str(), "x", 0);
+            i++;
+            delay(1);
+        }
+    });
+    for (std::thread& task : tasks)
+        task.join();
+    churning = false;
+    publisher.join();
+    CHECK(waitFor([&]() { return received > 0; }));
+    CHECK(unrouted == 0);
+    CHECK(client.getSubscriptionCount() == 1);
+
+    // restored after a broker restart, refused filters are counted as failed
+    for (int i = 0; i < 40; i++)
+        client.subscribe(("sensors/" + std::to_string(i) + "/+").c_str(), i % 3);
+    client.subscribe("rejected/topic", 1);
+    // the SUBACKs of the churn are still queued, slowly with the sanitizers
+    CHECK(waitFor([&]() { return client.getSubscriptionGrantedQos("rejected/topic") == 0x80; }, 60000));
+    broker.closeConnections();
+    CHECK(waitFor([&]() { return connected == 2 && restored == 1; }));
+    CHECK(restoredSubscribed == 41);
+    CHECK(restoredFailed == 1);
+    for (int i = 0; i < 40; i++)
+        CHECK(client.getSubscriptionGrantedQos(("sensors/" + std::to_string(i) + "/+").c_str()) == i % 3);
+    CHECK(client.getSubscriptionGrantedQos("unknown/topic") == -1);
+
+    CHECK(client.stop());
+    broker.end();
+    return TEST_RESULT();
+}
@@ -0,0 +1,64 @@
+// Wildcard matching, replacement and removal of ESP32_MQTTTopicTrie.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTTopicTrie.h>
+#include <string.h>
+
+static void collect(int routeId, void* context)
+{
+    *(int*)context |= 1 << routeId;
+}
+
+// bit mask of the route ids matching the topic
+static int match(const ESP32_MQTTTopicTrie& trie, const char* topic)
+{
+    int routes = 0;
+    trie.match(topic, strlen(topic), collect, &routes);
+    return routes;
+}
+
+int main()
+{
+    ESP32_MQTTTopicTrie trie;
+    CHECK(trie.insert("a/b", 0));
+    CHECK(trie.insert("a/+", 1));
+    CHECK(trie.insert("a/#", 2));
+    CHECK(trie.insert("#", 3));
+    CHECK(trie.insert("+/+/c", 4));
+    CHECK(!trie.insert("a/b#", 9));
+    CHECK(!trie.insert("a/#/b", 9));
+    CHECK(!trie.insert("a+/b", 9));
+    CHECK(trie.getCount() == 5);
+
+    CHECK(match(trie, "a/b") == 0b01111);
+    CHECK(match(trie, "a") == 0b01100);     // "a/#" matches the parent level too
+    CHECK(match(trie, "x/y/c") == 0b11000);
+    CHECK(match(trie, "a/") == 0b01110);    // an empty level matches '+'
+    CHECK(match(trie, "$SYS/x") == 0);      // wildcards at the first level don't match $ topics
+
+    // the topic of MQTT_EVENT_DATA is not null terminated
+    int routes = 0;
+    CHECK(trie.match("a/bxyz", 3, collect, &routes) == 4);
+    CHECK(routes == 0b01111);
+
+    CHECK(trie.insert("a/b", 5));
+    CHECK(trie.find("a/b") == 5);
+    CHECK(trie.getCount() == 5);
+
+    CHECK(trie.remove("a/+") == 1);
+    CHECK(match(trie, "a/b") == 0b101100);
+    CHECK(trie.remove("a/+") == -1);
+    CHECK(trie.remove("a/b") == 5);
+    CHECK(match(trie, "a/b") == 0b01100);
+    CHECK(trie.find("a/#") == 2);
+    trie.clear();
+    CHECK(trie.getCount() == 0);
+    CHECK(match(trie, "a/b") == 0);
+
+    CHECK(ESP32_MQTTTopicTrie::matches("a/#", "a", 1));
+    CHECK(ESP32_MQTTTopicTrie::matches("a/+/c", "a/x/c", 5));
+    CHECK(!ESP32_MQTTTopicTrie::matches("a/+", "a/x/c", 5));
+    CHECK(!ESP32_MQTTTopicTrie::matches("+/x", "$a/x", 4));
+    CHECK(!ESP32_MQTTTopicTrie::matches("a/b", "a/bc", 4));
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,212 @@
+// Tracing, built with ESP32_MQTTCLIENT_TRACING_ENABLED: the timeline of QoS 1 messages across the producer, the MQTT
+// task and the dispatch task, linked by their flow ids, and the ring overwritten by several writers during dumps.
+#include "ESP32_MQTTHostTest.h"
+#include <ESP32_MQTTClient.h>
+#include <ESP32_MQTTTrace.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TraceEvent
+{
+    std::string name;
+    char phase;
+    long long ts;
+    unsigned int dur;
+    unsigned int tid;
+    int msgId;
+    unsigned int bindId;
+};
+
+struct Trace
+{
+    std::vector<TraceEvent> events;
+    std::map<unsigned int, std::string> threadNames;
+    std::string json;
+    size_t count;
+    bool wellFormed;
+};
+
+static std::string field(const std::string& piece, const char* name)
+{
+    std::string key = std::string("\"") + name + "\":";
+    size_t start = piece.find(key);
+    if (start == std::string::npos)
+        return "";
+    start += key.size();
+    if (piece[start] == '"')
+        return piece.substr(start + 1, piece.find('"', start + 1) - start - 1);
+    return piece.substr(start, piece.find_first_of(",}", start) - start);
+}
+
+static void collect(const char* text, size_t length, void* context)
+{
+    Trace* trace = (Trace*)context;
+    std::string piece(text, length);
+    trace->json += piece;
+    // every record and every thread name is a piece of its own
+    if (piece.size() > 256 || (piece != "]}" && piece[0] != ',' && trace->json.size() != piece.size()))
+        trace->wellFormed = false;
+    if (piece == "]}")
+        return;
+    std::string phase = field(piece, "ph");
+    if (phase == "M")
+    {
+        if (field(piece, "name") == "thread_name")
+            trace->threadNames[strtoul(field(piece, "tid").c_str(), nullptr, 10)] = field(piece, "args\":{\"name");
+        return;
+    }
+    TraceEvent event;
+    event.name = field(piece, "name");
+    event.phase = phase.empty() ? '?' : phase[0];
+    event.ts = strtoll(field(piece, "ts").c_str(), nullptr, 10);
+    event.dur = strtoul(field(piece, "dur").c_str(), nullptr, 10);
+    event.tid = strtoul(field(piece, "tid").c_str(), nullptr, 10);
+    event.msgId = atoi(field(piece, "msg_id").c_str());
+    event.bindId = strtoul(field(piece, "bind_id").c_str(), nullptr, 16);
+    trace->events.push_back(event);
+}
+
+static void dump(Trace& trace)
+{
+    trace.events.clear();
+    trace.threadNames.clear();
+    trace.json.clear();
+    trace.wellFormed = true;
+    trace.count = ESP32_MQTTTrace::dumpChromeJson(collect, &trace);
+}
+
+static const TraceEvent* find(const Trace& trace, const char* name, const char* thread, unsigned int bindId)
+{
+    for (const TraceEvent& event : trace.events)
+    {
+        auto threadName = trace.threadNames.find(event.tid);
+        if (event.name == name && event.bindId == bindId && threadName != trace.threadNames.end() && threadName->second == thread)
+            return &event;
+    }
+    return nullptr;
+}
+
+static void testTimeline()
+{
+    ESP32_MQTTHostBroker broker;
+    CHECK(broker.begin());
+    ESP32_MQTTClient client;
+    std::atomic<int> connected(0), subscribed(0), received(0), confirmed(0);
+    std::atomic<int> receivedMsgIds[10];
+    client.setBrokerUri(broker.getUri());
+    client.setClientName("trace-test");
+    client.enableDispatchTask(64);
+    client.onMqttConnected([&](int sessionPresent) { connected++; });
+    client.onMqttTopicSubscribed([&](int msgId, esp_mqtt_error_type_t errorType, char* data, int dataLen) { subscribed++; });
+    client.onMqttMessageReceived([&](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        if (received < 10)
+            receivedMsgIds[received] = msgId;
+        received++;
+    });
+    client.onMqttMessagePublishConfirmed([&](int msgId) { confirmed++; });
+    CHECK(client.start());
+    CHECK(waitFor([&]() { return connected == 1; }));
+    client.subscribe("trace/#", 1);
+    CHECK(waitFor([&]() { return subscribed == 1; }));
+
+    ESP32_MQTTTrace::clear();
+    ESP32_MQTT_TRACE_TASK_NAME(xTaskGetCurrentTaskHandle(), "producer");
+    int msgIds[10];
+    for (int i = 0; i < 10; i++)
+        msgIds[i] = client.publish("trace/test", "payload", 1, false);
+    CHECK(waitFor([&]() { return received == 10 && confirmed == 10; }));
+    delay(50);      // the callback spans end after the callbacks
+    CHECK(client.stop());
+
+    Trace trace;
+    dump(trace);
+    CHECK(trace.wellFormed);
+    CHECK(trace.json.compare(0, 16, "{\"traceEvents\":[") == 0);
+    CHECK(trace.count == trace.events.size() && trace.count > 0 && trace.count <= ESP32_MQTTTrace::getCapacity());
+
+    int timelines = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        // publish() in the producer -> PUBLISHED (PUBACK) in the MQTT task -> its callback in the dispatch task
+        const TraceEvent* publish = find(trace, "publish", "producer", msgIds[i]);
+        const TraceEvent* acked = find(trace, "PUBLISHED", "mqtt", msgIds[i]);
+        const TraceEvent* callback = find(trace, "PUBLISHED", "dispatch", msgIds[i]);
+        if (publish != nullptr && acked != nullptr && callback != nullptr && publish->phase == 'X' && publish->ts <= acked->ts && acked->ts <= callback->ts)
+            timelines++;
+        // the message coming back: DATA in the MQTT task, queued, the callback in the dispatch task
+        const TraceEvent* data = find(trace, "DATA", "mqtt", 0x10000 | receivedMsgIds[i]);
+        const TraceEvent* dataCallback = find(trace, "DATA", "dispatch", 0x10000 | receivedMsgIds[i]);
+        if (data != nullptr && dataCallback != nullptr && data->ts <= dataCallback->ts)
+            timelines++;
+    }
+    CHECK(timelines == 20);
+    int queued = 0;
+    for (const TraceEvent& event : trace.events)
+    {
+        if (event.name == "queued" && event.phase == 'i')
+            queued++;
+    }
+    CHECK(queued >= 20);
+    broker.end();
+}
+
+static void testRing()
+{
+    Trace trace;
+    ESP32_MQTTTrace::clear();
+    dump(trace);
+    CHECK(trace.count == 0);
+
+    // writers overwrite the ring while it is dumped, records being written or overwritten are left out
+    std::atomic<bool> writing(true);
+    std::vector<std::thread> writers;
+    for (int w = 0; w < 4; w++)
+    {
+        writers.emplace_back([w]() {
+            for (int i = 1; i <= 20000; i++)
+                ESP32_MQTTTrace::record(ESP32_MQTTTraceEvent::Publish, w * 100000 + i, 1, micros(), 3);
+        });
+    }
+    std::thread dumper([&]() {
+        int dumps = 0;
+        while (writing || dumps == 0)
+        {
+            Trace concurrent;
+            dump(concurrent);
+            for (const TraceEvent& event : concurrent.events)
+            {
+                if (event.name != "publish" || event.dur != 3 || event.msgId % 100000 == 0 || event.msgId % 100000 > 20000 || event.bindId != (unsigned int)event.msgId)
+                    trace.wellFormed = false;
+            }
+            if (!concurrent.wellFormed || concurrent.count > ESP32_MQTTTrace::getCapacity())
+                trace.wellFormed = false;
+            dumps++;
+        }
+    });
+    for (std::thread& writer : writers)
+        writer.join();
+    writing = false;
+    dumper.join();
+    CHECK(trace.wellFormed);
+
+    // a writer in the middle of a record when the others lapped the ring costs a record
+    dump(trace);
+    CHECK(trace.count + writers.size() >= ESP32_MQTTTrace::getCapacity() && trace.count <= ESP32_MQTTTrace::getCapacity());
+    // the records of every writer are dumped in the order they were written
+    std::map<int, int> lastByWriter;
+    for (const TraceEvent& event : trace.events)
+    {
+        CHECK(event.msgId % 100000 > lastByWriter[event.msgId / 100000]);
+        lastByWriter[event.msgId / 100000] = event.msgId % 100000;
+    }
+}
+
+int main()
+{
+    testTimeline();
+    testRing();
+    return TEST_RESULT();
+}
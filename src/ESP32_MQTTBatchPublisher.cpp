@@ -0,0 +1,352 @@
+#include "ESP32_MQTTBatchPublisher.h"
+
+ESP32_MQTTBatchPublisher::ESP32_MQTTBatchPublisher(ESP32_MQTTClient& client) : _client(client)
+{
+	_entries = nullptr;
+	_storage = nullptr;
+	_maxMessages = 0;
+	_maxTopicLength = 0;
+	_maxPayloadSize = 0;
+	_count = 0;
+	_windowMs = 0;
+	_flushTimer = nullptr;
+	_flushTask = nullptr;
+	_packTopic = nullptr;
+	_packBufSize = 0;
+	_packBuf = nullptr;
+	_packLength = 0;
+	resetStats();
+}
+
+ESP32_MQTTBatchPublisher::~ESP32_MQTTBatchPublisher()
+{
+	end();
+}
+
+/// <summary>
+/// Non retained QoS 0 values of a batch are sent as one message to topic (several if they don't fit into maxPacketSize).
+/// Each value is a record of topic length and payload length (2 bytes each, little-endian), the topic and the payload.
+/// Values which don't fit into a record or a packet are sent on their own.
+/// </summary>
+void ESP32_MQTTBatchPublisher::enablePacking(const char* topic, size_t maxPacketSize)
+{
+	_packTopic = topic;
+	_packBufSize = maxPacketSize;
+}
+
+bool ESP32_MQTTBatchPublisher::begin(size_t maxMessages, size_t maxTopicLength, size_t maxPayloadSize, unsigned long windowMs, int priority, int coreId, uint32_t stackSize)
+{
+	end();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	size_t entrySize = maxTopicLength + 1 + maxPayloadSize;
+	_storage = (uint8_t*)malloc(maxMessages * entrySize);
+	if (_storage == nullptr)
+	{
+		log_e("Can't allocate batch of %u messages", maxMessages);
+		return false;
+	}
+
+	if (_packTopic != nullptr)
+	{
+		_packBuf = (uint8_t*)malloc(_packBufSize);
+		if (_packBuf == nullptr)
+		{
+			log_e("Can't allocate pack buffer of %u bytes", _packBufSize);
+			free(_storage);
+			_storage = nullptr;
+			return false;
+		}
+	}
+
+	_entries = new Entry[maxMessages];
+	for (size_t i = 0; i < maxMessages; i++)
+	{
+		_entries[i].used = false;
+		_entries[i].topic = (char*)_storage + i * entrySize;
+		_entries[i].payload = _storage + i * entrySize + maxTopicLength + 1;
+	}
+
+	// without the task and the timer, batches are flushed only when they are full or by flush()
+	if (xTaskCreatePinnedToCore(flushTaskStatic, "mqtt_batch", stackSize, this, priority, &_flushTask, coreId) != pdPASS)
+	{
+		log_e("Can't create batch flush task");
+		_flushTask = nullptr;
+	}
+	else
+	{
+		esp_timer_create_args_t timerArgs = {};
+		timerArgs.callback = flushTimerStatic;
+		timerArgs.arg = this;
+		timerArgs.name = "mqtt_batch";
+		if (esp_timer_create(&timerArgs, &_flushTimer) != ESP_OK)
+		{
+			log_e("Can't create batch flush timer");
+			_flushTimer = nullptr;
+		}
+	}
+
+	_maxMessages = maxMessages;
+	_maxTopicLength = maxTopicLength;
+	_maxPayloadSize = maxPayloadSize;
+	_windowMs = windowMs;
+	_count = 0;
+	return true;
+}
+
+void ESP32_MQTTBatchPublisher::end()
+{
+	if (_flushTimer != nullptr)
+	{
+		esp_timer_stop(_flushTimer);
+		esp_timer_delete(_flushTimer);
+		_flushTimer = nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// the task waits for a notification or for the lock, it doesn't hold it
+	if (_flushTask != nullptr)
+	{
+		vTaskDelete(_flushTask);
+		_flushTask = nullptr;
+	}
+
+	if (_entries != nullptr)
+	{
+		flushLocked();
+		delete[] _entries;
+	}
+	if (_storage != nullptr)
+		free(_storage);
+	if (_packBuf != nullptr)
+		free(_packBuf);
+
+	_entries = nullptr;
+	_storage = nullptr;
+	_packBuf = nullptr;
+	_packLength = 0;
+	_maxMessages = 0;
+	_count = 0;
+}
+
+uint32_t ESP32_MQTTBatchPublisher::hashTopic(const char* topic, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)topic[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int ESP32_MQTTBatchPublisher::publish(const char* topic, const char* payload, int qos, bool retain)
+{
+	return publish(topic, (const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), qos, retain);
+}
+
+int ESP32_MQTTBatchPublisher::publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain)
+{
+	size_t topicLen = strlen(topic);
+	if (topicLen > _maxTopicLength || length > _maxPayloadSize)
+		return -1;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_entries == nullptr)
+		return -1;
+
+	_stats.valuesSubmitted++;
+
+	uint32_t hash = hashTopic(topic, topicLen);
+	Entry* entry = nullptr;
+
+	// latest value wins for QoS 0
+	if (qos == 0)
+	{
+		for (size_t i = 0; i < _maxMessages; i++)
+		{
+			Entry& e = _entries[i];
+			if (e.used && e.qos == 0 && e.topicHash == hash && e.topicLen == topicLen && memcmp(e.topic, topic, topicLen) == 0)
+			{
+				entry = &e;
+				_stats.packetsSaved++;
+				break;
+			}
+		}
+	}
+
+	if (entry == nullptr)
+	{
+		if (_count == _maxMessages)
+			flushLocked();
+
+		for (size_t i = 0; i < _maxMessages; i++)
+		{
+			if (!_entries[i].used)
+			{
+				entry = &_entries[i];
+				break;
+			}
+		}
+
+		entry->used = true;
+		entry->topicHash = hash;
+		entry->topicLen = topicLen;
+		memcpy(entry->topic, topic, topicLen);
+		entry->topic[topicLen] = '\0';
+		entry->submittedUs = micros();
+
+		// the window starts with the first value of the batch
+		if (_count++ == 0 && _flushTimer != nullptr)
+			esp_timer_start_once(_flushTimer, (uint64_t)_windowMs * 1000);
+	}
+
+	if (length > 0)
+		memcpy(entry->payload, payload, length);
+	entry->payloadLen = length;
+	entry->qos = qos;
+	entry->retain = retain;
+	return 0;
+}
+
+void ESP32_MQTTBatchPublisher::flush()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	flushLocked();
+}
+
+void ESP32_MQTTBatchPublisher::flushTimerStatic(void* arg)
+{
+	xTaskNotifyGive(static_cast<ESP32_MQTTBatchPublisher*>(arg)->_flushTask);
+}
+
+void ESP32_MQTTBatchPublisher::flushTaskStatic(void* arg)
+{
+	ESP32_MQTTBatchPublisher* batch = static_cast<ESP32_MQTTBatchPublisher*>(arg);
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		batch->flush();
+	}
+}
+
+/// <summary>
+/// Publishes the batch. The values are written to the socket right away, in the flush task or in the task whose
+/// publish() filled the batch. Enqueued messages would wait in the esp-mqtt outbox for the MQTT task, which sends one
+/// of them per loop.
+/// </summary>
+void ESP32_MQTTBatchPublisher::flushLocked()
+{
+	if (_count == 0)
+		return;
+
+	if (_flushTimer != nullptr)
+		esp_timer_stop(_flushTimer);
+
+	unsigned long now = micros();
+	for (size_t i = 0; i < _maxMessages; i++)
+	{
+		Entry& e = _entries[i];
+		if (!e.used)
+			continue;
+
+		if (!pack(e))
+		{
+			int result = _client.publish(e.topic, e.payload, e.payloadLen, e.qos, e.retain);
+			if (result < 0)
+				_stats.enqueueFailures++;
+			else
+				_stats.packetsSent++;
+		}
+
+		_valuesFlushed++;
+		unsigned long latency = now - e.submittedUs;
+		_totalLatencyUs += latency;
+		if (latency > _stats.maxLatencyUs)
+			_stats.maxLatencyUs = latency;
+
+		e.used = false;
+	}
+	sendPack();
+
+	_stats.batches++;
+	_count = 0;
+}
+
+/// <summary>
+/// Appends the value to the pack buffer, sending the buffer first if the value doesn't fit anymore.
+/// </summary>
+/// <returns>false if the value has to be sent on its own</returns>
+bool ESP32_MQTTBatchPublisher::pack(const Entry& entry)
+{
+	size_t recordSize = 4 + entry.topicLen + entry.payloadLen;
+	if (_packBuf == nullptr || entry.qos != 0 || entry.retain || entry.payloadLen > 0xFFFF || recordSize > _packBufSize)
+		return false;
+
+	if (_packLength + recordSize > _packBufSize)
+		sendPack();
+
+	uint8_t* record = _packBuf + _packLength;
+	record[0] = entry.topicLen & 0xFF;
+	record[1] = entry.topicLen >> 8;
+	record[2] = entry.payloadLen & 0xFF;
+	record[3] = entry.payloadLen >> 8;
+	memcpy(record + 4, entry.topic, entry.topicLen);
+	memcpy(record + 4 + entry.topicLen, entry.payload, entry.payloadLen);
+	_packLength += recordSize;
+	_stats.valuesPacked++;
+	return true;
+}
+
+void ESP32_MQTTBatchPublisher::sendPack()
+{
+	if (_packLength == 0)
+		return;
+
+	int result = _client.publish(_packTopic, _packBuf, _packLength, 0, false);
+	if (result < 0)
+		_stats.enqueueFailures++;
+	else
+		_stats.packetsSent++;
+	_packLength = 0;
+}
+
+bool ESP32_MQTTBatchPublisher::unpack(const uint8_t* data, size_t length, ESP32_MQTTCallbacks::OnMqttUnpackedValueCallback visitor)
+{
+	size_t offset = 0;
+	while (offset < length)
+	{
+		if (length - offset < 4)
+			return false;
+		size_t topicLen = data[offset] | (data[offset + 1] << 8);
+		size_t payloadLen = data[offset + 2] | (data[offset + 3] << 8);
+		offset += 4;
+		if (length - offset < topicLen + payloadLen)
+			return false;
+		visitor((const char*)data + offset, topicLen, data + offset + topicLen, payloadLen);
+		offset += topicLen + payloadLen;
+	}
+	return true;
+}
+
+ESP32_MQTTBatchStats ESP32_MQTTBatchPublisher::getStats()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	ESP32_MQTTBatchStats stats = _stats;
+	stats.averageBatchSize = stats.batches > 0 ? (float)_valuesFlushed / stats.batches : 0;
+	stats.averageLatencyUs = _valuesFlushed > 0 ? _totalLatencyUs / _valuesFlushed : 0;
+	return stats;
+}
+
+void ESP32_MQTTBatchPublisher::resetStats()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_stats = {};
+	_valuesFlushed = 0;
+	_totalLatencyUs = 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ESP32_MQTTClient.h"
+
+struct ESP32_MQTTBatchStats
+{
+    unsigned long valuesSubmitted;      // publish() calls
+    unsigned long packetsSent;          // messages published
+    unsigned long packetsSaved;         // values overwritten by a newer value of the same topic before the flush
+    unsigned long valuesPacked;         // values sent inside a packed message, see enablePacking()
+    unsigned long batches;              // flushes which sent at least one message
+    unsigned long enqueueFailures;      // messages ESP32_MQTTClient::publish() failed for
+    float averageBatchSize;
+    unsigned long averageLatencyUs;     // time from publish() to the flush, averaged over sent values
+    unsigned long maxLatencyUs;
+};
+
+namespace ESP32_MQTTCallbacks
+{
+    typedef std::function<void(const char* topic, size_t topicLen, const uint8_t* payload, size_t length)> OnMqttUnpackedValueCallback;
+}
+
+// Collects values published within a time window and publishes them in one burst from a flush task.
+// Repeated QoS 0 values of the same topic are coalesced, only the latest value is sent. QoS 1 and 2 values are never coalesced.
+// With enablePacking() the QoS 0 values of a batch travel as one message. All memory is allocated in begin().
+class ESP32_MQTTBatchPublisher
+{
+public:
+    ESP32_MQTTBatchPublisher(ESP32_MQTTClient& client);
+    ~ESP32_MQTTBatchPublisher();
+
+    bool begin(size_t maxMessages, size_t maxTopicLength, size_t maxPayloadSize, unsigned long windowMs, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 3072); // batch is flushed windowMs after its first value or when maxMessages are collected, by a task with the given priority, core and stack size
+    void end();     // flushes the pending values and frees the memory
+    void enablePacking(const char* topic, size_t maxPacketSize); // Must be called before begin(). Non retained QoS 0 values of a batch are sent as messages of up to maxPacketSize bytes to topic, unpack() splits them on the receiving side.
+
+    static bool unpack(const uint8_t* data, size_t length, ESP32_MQTTCallbacks::OnMqttUnpackedValueCallback visitor); // calls visitor for each value of a packed message, false if the message is malformed
+
+    int publish(const char* topic, const char* payload, int qos = 0, bool retain = false);
+    int publish(const char* topic, const uint8_t* payload, size_t length, int qos = 0, bool retain = false); // returns 0 on success, -1 if the topic or payload is too long
+    void flush();
+
+    ESP32_MQTTBatchStats getStats();
+    void resetStats();
+
+private:
+    struct Entry
+    {
+        bool used;
+        uint32_t topicHash;
+        uint16_t topicLen;
+        uint32_t payloadLen;
+        uint8_t qos;
+        bool retain;
+        unsigned long submittedUs;
+        char* topic;
+        uint8_t* payload;
+    };
+
+    ESP32_MQTTClient& _client;
+    Entry* _entries;
+    uint8_t* _storage;
+    size_t _maxMessages;
+    size_t _maxTopicLength;
+    size_t _maxPayloadSize;
+    size_t _count;
+    unsigned long _windowMs;
+    esp_timer_handle_t _flushTimer;     // only notifies _flushTask, publishing may block the esp_timer task
+    TaskHandle_t _flushTask;
+    std::mutex _mutex;
+
+    const char* _packTopic;
+    size_t _packBufSize;
+    uint8_t* _packBuf;
+    size_t _packLength;
+
+    ESP32_MQTTBatchStats _stats;
+    unsigned long _valuesFlushed;
+    unsigned long long _totalLatencyUs;
+
+    static uint32_t hashTopic(const char* topic, size_t len);
+    static void flushTimerStatic(void* arg);
+    static void flushTaskStatic(void* arg);
+    void flushLocked();
+    bool pack(const Entry& entry);
+    void sendPack();
+};
@@ -0,0 +1,82 @@
+#include "ESP32_MQTTBufferPool.h"
+
+ESP32_MQTTBufferPool::ESP32_MQTTBufferPool()
+{
+	_memory = nullptr;
+	_inUse = nullptr;
+	_bufferSize = 0;
+	_bufferCount = 0;
+}
+
+ESP32_MQTTBufferPool::~ESP32_MQTTBufferPool()
+{
+	deinit();
+}
+
+bool ESP32_MQTTBufferPool::init(size_t bufferSize, size_t bufferCount)
+{
+	deinit();
+
+	if (bufferSize == 0 || bufferCount == 0)
+		return false;
+
+	_memory = (uint8_t*)malloc(bufferSize * bufferCount);
+	if (_memory == nullptr)
+	{
+		log_e("Can't allocate buffer pool of %u x %u bytes", bufferCount, bufferSize);
+		return false;
+	}
+
+	_inUse = new std::atomic<bool>[bufferCount];
+	for (size_t i = 0; i < bufferCount; i++)
+		_inUse[i].store(false, std::memory_order_relaxed);
+
+	_bufferSize = bufferSize;
+	_bufferCount = bufferCount;
+	return true;
+}
+
+void ESP32_MQTTBufferPool::deinit()
+{
+	if (_memory != nullptr)
+		free(_memory);
+	if (_inUse != nullptr)
+		delete[] _inUse;
+
+	_memory = nullptr;
+	_inUse = nullptr;
+	_bufferSize = 0;
+	_bufferCount = 0;
+}
+
+uint8_t* ESP32_MQTTBufferPool::acquire()
+{
+	for (size_t i = 0; i < _bufferCount; i++)
+	{
+		bool expected = false;
+		if (_inUse[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+			return _memory + i * _bufferSize;
+	}
+	return nullptr;
+}
+
+void ESP32_MQTTBufferPool::release(uint8_t* buffer)
+{
+	if (buffer == nullptr || buffer < _memory)
+		return;
+
+	size_t index = (buffer - _memory) / _bufferSize;
+	if (index < _bufferCount)
+		_inUse[index].store(false, std::memory_order_release);
+}
+
+size_t ESP32_MQTTBufferPool::getFreeCount()
+{
+	size_t count = 0;
+	for (size_t i = 0; i < _bufferCount; i++)
+	{
+		if (!_inUse[i].load(std::memory_order_relaxed))
+			count++;
+	}
+	return count;
+}
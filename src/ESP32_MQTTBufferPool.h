@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+
+// Fixed number of equally sized buffers allocated in one block. acquire() and release() are lock-free,
+// so a buffer can be acquired in the MQTT task and released in another task.
+class ESP32_MQTTBufferPool
+{
+public:
+    ESP32_MQTTBufferPool();
+    ~ESP32_MQTTBufferPool();
+
+    bool init(size_t bufferSize, size_t bufferCount);
+    void deinit();
+
+    uint8_t* acquire();             // returns nullptr when all buffers are in use
+    void release(uint8_t* buffer);
+
+    inline bool isInitialized() { return _memory != nullptr; }
+    inline size_t getBufferSize() { return _bufferSize; }
+    inline size_t getBufferCount() { return _bufferCount; }
+    size_t getFreeCount();
+
+private:
+    uint8_t* _memory;
+    std::atomic<bool>* _inUse;
+    size_t _bufferSize;
+    size_t _bufferCount;
+};
@@ -1,17 +1,138 @@
 #include "ESP32_MQTTClient.h"
+#include "ESP32_MQTTCrc32.h"
 
 ESP32_MQTTClient::ESP32_MQTTClient()
 {
+	// zeroed explicitly, a client created with new (e.g. by ESP32_MQTTConnectionManager) isn't zero initialized like a global one
+	_mqttConfig = {};
+	_mqttClient = nullptr;
+	_uriBuf = nullptr;
+	_uriSlot = nullptr;
+	_uriSlotSize = 0;
+	_mqttUri = nullptr;
+	_mqttUsername = nullptr;
+	_mqttClientName = nullptr;
 	_isConnected = false;
+	_nextMqttConnectionAttemptMillis = 0;
+	_mqttReconnectionAttemptDelay = 0;
+	_reconnectPolicy = nullptr;
+	_reconnectScheduled = false;
+	_dispatchTopicBuf = nullptr;
+	_dispatchTopicBufSize = 0;
+	_dispatchTopicLen = 0;
+	_gatherBuf = nullptr;
+	_gatherBufSize = 0;
+	_mqttTaskGatherBuf = nullptr;
+	_mqttTaskGatherBufSize = 0;
+	_reassemblyPool = &_reassemblyPoolStorage;
+	_reassemblyMaxMessageSize = 0;
+	_reassemblyBufferCount = 0;
+	_reassemblyDropPolicy = ESP32_MQTTReassemblyDropPolicy::DropMessage;
+	_reassembly = {};
+	_reassemblyDropCount = 0;
+	_stream = {};
+	_topicRoutes = std::make_shared<TopicRouteTable>();
+	_streamRouteCount = 0;
+	_streamFailedCount = 0;
+	_streamPublishTask = nullptr;
+	_dispatchQueueCapacity = 0;
+	_dispatchQueueSlotSize = 0;
+	_dispatchTaskPriority = 1;
+	_dispatchTaskCoreId = tskNO_AFFINITY;
+	_dispatchTaskStackSize = 4096;
+	_dispatchTask = nullptr;
+	_dispatchTaskShared = false;
+	_publishClassCount = 1;
+	_publishClasses[0].queueCapacity = 0;
+	_publishClasses[0].weight = 1;
+	_publishClasses[0].credit = 0;
+	_publishQueueSlotSize = 0;
+	_publishQueueFullPolicy = ESP32_MQTTQueueFullPolicy::FailFast;
+	_publishQueueBlockTimeoutMs = 0;
+	_publishTaskPriority = 1;
+	_publishTaskCoreId = tskNO_AFFINITY;
+	_publishTaskStackSize = 4096;
+	_publishTask = nullptr;
+	_metricsTopic = nullptr;
+	_metricsIntervalMs = 0;
+	_nextMetricsPublishMillis = 0;
+	_housekeepingTimer = nullptr;
+	_housekeepingTask = nullptr;
+	_housekeepingTaskPriority = 1;
+	_housekeepingTaskCoreId = tskNO_AFFINITY;
+	_housekeepingTaskStackSize = 4096;
+	_inflightCapacity = 0;
+	_persistentOutbox = nullptr;
+	_outboxReplayRate = 0;
+	_healthProbeTopic = nullptr;
+	_healthProbeTopicLen = 0;
+	_healthProbeSubscribeMsgId = -1;
+	_healthTaskPriority = 1;
+	_healthTaskCoreId = tskNO_AFFINITY;
+	_healthTaskStackSize = 3072;
+	_healthTask = nullptr;
+	_reportedHealth = ESP32_MQTTLinkHealth::Unknown;
+	_connectionEstablished = false;
+	_healthFailoverPending = false;
+	_failoverCount = 0;
+	_stringStorage = nullptr;
+	_stringStorageSize = 0;
+	_stringStorageUsed = 0;
+	_outboxReplayCredit = 0;
+	_lastOutboxReplayMillis = 0;
+	_outboxLiveCount = 0;
+	_autoResubscribe = false;
+	_topicAliasReset = false;
+	_mqttTask = nullptr;
+	_currentMessage = nullptr;
+	_pendingResubscribeAcks = 0;
+	_subscribesInProgress = 0;
+	_earlySubscribeAckCount = 0;
+	_resubscribeFailedCount = 0;
+	_compressionMaxMessageSize = 0;
+	_compressBuf = nullptr;
+	_compressBufSize = 0;
+	_decompressBuf = nullptr;
+	_decompressingMessage = false;
+	_compressionInputBytes = 0;
+	_compressionOutputBytes = 0;
+	_decompressionDropCount = 0;
+	_retainedCacheCapacity = 0;
+	_retainedRefreshIntervalMs = 0;
+	_retainedStoreCapacity = 0;
+	_retainedStoreMaxMessageSize = 0;
 	setKeepAlive(30);
 	setMaxPacketSize(1024);
 }
 
 ESP32_MQTTClient::~ESP32_MQTTClient()
 {
+	if (_housekeepingTimer != nullptr)
+	{
+		esp_timer_stop(_housekeepingTimer);
+		esp_timer_delete(_housekeepingTimer);
+	}
+	if (_housekeepingTask != nullptr)
+		vTaskDelete(_housekeepingTask);
+	if (_dispatchTask != nullptr && !_dispatchTaskShared)
+		vTaskDelete(_dispatchTask);
+	if (_publishTask != nullptr)
+		vTaskDelete(_publishTask);
+	if (_healthTask != nullptr)
+		vTaskDelete(_healthTask);
 	esp_mqtt_client_destroy(_mqttClient);
 	if (_uriBuf != nullptr)
 		free(_uriBuf);
+	if (_dispatchTopicBuf != nullptr)
+		free(_dispatchTopicBuf);
+	if (_gatherBuf != nullptr)
+		free(_gatherBuf);
+	if (_mqttTaskGatherBuf != nullptr)
+		free(_mqttTaskGatherBuf);
+	if (_compressBuf != nullptr)
+		free(_compressBuf);
+	if (_decompressBuf != nullptr)
+		free(_decompressBuf);
 }
 
 void ESP32_MQTTClient::onMqttBeforeConnect(ESP32_MQTTCallbacks::OnMqttBeforeConnectCallback callback) {
@@ -54,58 +175,261 @@ void ESP32_MQTTClient::onMqttCustomEvent(ESP32_MQTTCallbacks::OnMqttCustomEventC
 	_onMqttCustomEventCallback = callback;
 }
 
-void ESP32_MQTTClient::setBrokerUri(const char* uri)
+void ESP32_MQTTClient::onMqttSubscriptionsRestored(ESP32_MQTTCallbacks::OnMqttSubscriptionsRestoredCallback callback) {
+	_onMqttSubscriptionsRestoredCallback = callback;
+}
+
+void ESP32_MQTTClient::onMqttHealthChanged(ESP32_MQTTCallbacks::OnMqttHealthChangedCallback callback) {
+	_onMqttHealthChangedCallback = callback;
+}
+
+bool ESP32_MQTTClient::setBrokerUri(const char* uri)
 {
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT uri %s\n", uri);
+	ESP32_MQTT_LOG(Connection, Debug, "MQTT uri %s", uri);
+
+	// formatted by setBrokerUrl() or setBrokerIp() into the slot already
+	if (_stringStorage != nullptr && uri != _uriSlot)
+	{
+		size_t size = strlen(uri) + 1;
+		char* copy = allocUri(size);
+		if (copy == nullptr)
+			return false;
+		memcpy(copy, uri, size);
+		uri = copy;
+	}
 	_mqttUri = uri;
 	_mqttConfig.broker.address.uri = _mqttUri;
+	return true;
 };
 
-void ESP32_MQTTClient::setBrokerUrl(const char* url, const int port, const char* scheme)
+bool ESP32_MQTTClient::setBrokerUrl(const char* url, const int port, const char* scheme)
 {
-	if (_uriBuf != nullptr)
-		free(_uriBuf);
-	_uriBuf = (char*)malloc(strlen(scheme) + strlen(url) + 10);
-	sprintf(_uriBuf, "%s://%s:%u", scheme, url, port);
-	setBrokerUri(_uriBuf);
+	size_t size = strlen(scheme) + strlen(url) + 10;
+	char* uri = allocUri(size);
+	if (uri == nullptr)
+		return false;
+	snprintf(uri, size, "%s://%s:%u", scheme, url, port);
+	return setBrokerUri(uri);
 };
 
-void ESP32_MQTTClient::setBrokerIp(const IPAddress ipAddress, const int port, const char* scheme)
+bool ESP32_MQTTClient::setBrokerIp(const IPAddress ipAddress, const int port, const char* scheme)
 {
-	if (_uriBuf != nullptr)
-		free(_uriBuf);
-	_uriBuf = (char*)malloc(strlen(scheme) + 25);
-	sprintf(_uriBuf, "%s://%d.%d.%d.%d:%d", scheme, ipAddress[0], ipAddress[1], ipAddress[2], ipAddress[3], port);
-	setBrokerUri(_uriBuf);
+	size_t size = strlen(scheme) + 25;
+	char* uri = allocUri(size);
+	if (uri == nullptr)
+		return false;
+	snprintf(uri, size, "%s://%d.%d.%d.%d:%d", scheme, ipAddress[0], ipAddress[1], ipAddress[2], ipAddress[3], port);
+	return setBrokerUri(uri);
 };
 
-void ESP32_MQTTClient::setClientName(const char* name)
+/// <summary>
+/// Buffer for the broker uri. In the string storage the uri keeps its slot, a new uri reuses it when it fits and takes
+/// a bigger slot otherwise, so setting the broker again doesn't use up the storage. Without string storage it's a heap buffer.
+/// </summary>
+/// <returns>nullptr if the string storage is full or the buffer couldn't be allocated</returns>
+char* ESP32_MQTTClient::allocUri(size_t size)
+{
+	if (_stringStorage == nullptr)
+	{
+		if (_uriBuf != nullptr)
+			free(_uriBuf);
+		_uriBuf = (char*)malloc(size);
+		return _uriBuf;
+	}
+
+	if (_uriSlot == nullptr || _uriSlotSize < size)
+	{
+		char* slot = allocString(size);
+		if (slot == nullptr)
+			return nullptr;
+		_uriSlot = slot;
+		_uriSlotSize = size;
+	}
+	return _uriSlot;
+}
+
+/// <summary>
+/// Adds a broker to fail over to. The uri set before becomes the first of the list and the one connected to first.
+/// </summary>
+/// <returns>false if no broker uri was set or the list is full</returns>
+bool ESP32_MQTTClient::addBrokerUri(const char* uri)
+{
+	if (_health.getUriCount() == 0)
+	{
+		if (_mqttUri == nullptr)
+		{
+			log_e("Set the broker uri before adding alternatives");
+			return false;
+		}
+		_health.addUri(_mqttUri);
+	}
+	const char* stored = storeString(uri);
+	return stored != nullptr && _health.addUri(stored) >= 0;
+}
+
+/// <summary>
+/// A broker is given up on after afterFailedAttempts connection attempts to it failed in a row, or when the health monitor
+/// finds the link dead. It isn't tried again for cooldownMs unless all brokers are cooling down, of the others the one
+/// with the lowest RTT measured while connected to it is preferred. Up to ESP32_MQTT_HEALTH_MAX_URIS brokers including
+/// the first one.
+/// </summary>
+void ESP32_MQTTClient::setFailover(unsigned int afterFailedAttempts, unsigned long cooldownMs)
+{
+	_health.setFailover(afterFailedAttempts, cooldownMs);
+}
+
+bool ESP32_MQTTClient::setClientName(const char* name)
 {
-	_mqttClientName = name;
+	const char* stored = storeString(name);
+	if (stored == nullptr && name != nullptr)
+		return false;
+	_mqttClientName = stored;
 	_mqttConfig.credentials.client_id = _mqttClientName;
+	return true;
 }
 
-void ESP32_MQTTClient::setCredentials(const char* username, const char* password)
+bool ESP32_MQTTClient::setCredentials(const char* username, const char* password)
 {
-	_mqttUsername = username;
-	_mqttConfig.credentials.username = username;
-	_mqttConfig.credentials.authentication.password = password;
+	// the space of the username is given back if the password doesn't fit
+	size_t stringStorageUsed = _stringStorageUsed;
+	const char* storedUsername = storeString(username);
+	const char* storedPassword = storeString(password);
+	if ((storedUsername == nullptr && username != nullptr) || (storedPassword == nullptr && password != nullptr))
+	{
+		_stringStorageUsed = stringStorageUsed;
+		return false;
+	}
+	_mqttUsername = storedUsername;
+	_mqttConfig.credentials.username = _mqttUsername;
+	_mqttConfig.credentials.authentication.password = storedPassword;
+	return true;
 };
 
-void ESP32_MQTTClient::setClientCert(const char* clientCert)
+bool ESP32_MQTTClient::setClientCert(const char* clientCert)
+{
+	const char* stored = storeString(clientCert);
+	if (stored == nullptr && clientCert != nullptr)
+		return false;
+	_mqttConfig.credentials.authentication.certificate = stored;
+	return true;
+}
+
+bool ESP32_MQTTClient::setCaCert(const char* caCert)
+{
+	const char* stored = storeString(caCert);
+	if (stored == nullptr && caCert != nullptr)
+		return false;
+	_mqttConfig.broker.verification.certificate = stored;
+	return true;
+}
+
+bool ESP32_MQTTClient::setAuthKey(const char* clientKey)
+{
+	const char* stored = storeString(clientKey);
+	if (stored == nullptr && clientKey != nullptr)
+		return false;
+	_mqttConfig.credentials.authentication.key = stored;
+	return true;
+}
+
+/// <summary>
+/// Strings passed to the setters are copied into the buffer instead of being referenced. The buffer is used as an arena,
+/// so setting a value again takes new space, except for the broker uri which reuses its slot. When the buffer is full
+/// the setters fail and keep the previous value, a setter of two strings takes no space if the second one doesn't fit.
+/// </summary>
+void ESP32_MQTTClient::setStringStorage(char* buffer, size_t size)
+{
+	_stringStorage = buffer;
+	_stringStorageSize = size;
+	_stringStorageUsed = 0;
+}
+
+char* ESP32_MQTTClient::allocString(size_t size)
 {
-	_mqttConfig.credentials.authentication.certificate = clientCert;
+	if (_stringStorage == nullptr)
+		return nullptr;
+
+	if (_stringStorageUsed + size > _stringStorageSize)
+	{
+		log_e("Configuration string storage is full, %u bytes needed", _stringStorageUsed + size);
+		return nullptr;
+	}
+
+	char* str = _stringStorage + _stringStorageUsed;
+	_stringStorageUsed += size;
+	return str;
 }
 
-void ESP32_MQTTClient::setCaCert(const char* caCert)
+/// <summary>
+/// Copies the string into the string storage. Without string storage the string is referenced.
+/// </summary>
+/// <returns>the stored string, nullptr if str is nullptr or the string storage is full</returns>
+const char* ESP32_MQTTClient::storeString(const char* str)
 {
-	_mqttConfig.broker.verification.certificate = caCert;
+	// already stored (e.g. the broker uri added by addBrokerUri)
+	if (str == nullptr || _stringStorage == nullptr || (str >= _stringStorage && str < _stringStorage + _stringStorageSize))
+		return str;
+
+	size_t size = strlen(str) + 1;
+	char* copy = allocString(size);
+	if (copy == nullptr)
+		return nullptr;
+
+	memcpy(copy, str, size);
+	return copy;
 }
 
-void ESP32_MQTTClient::setAuthKey(const char* clientKey)
+/// <summary>
+/// Applies a compile time configuration. Its strings are referenced without copying, they have static storage.
+/// </summary>
+void ESP32_MQTTClient::applyConfig(const ESP32_MQTTStaticConfig& config)
 {
-	_mqttConfig.credentials.authentication.key = clientKey;
+	if (config.uri != nullptr)
+	{
+		_mqttUri = config.uri;
+		_mqttConfig.broker.address.uri = config.uri;
+	}
+	if (config.name != nullptr)
+	{
+		_mqttClientName = config.name;
+		_mqttConfig.credentials.client_id = config.name;
+	}
+	if (config.username != nullptr)
+	{
+		_mqttUsername = config.username;
+		_mqttConfig.credentials.username = config.username;
+		_mqttConfig.credentials.authentication.password = config.password;
+	}
+	if (config.clientCertificate != nullptr)
+		_mqttConfig.credentials.authentication.certificate = config.clientCertificate;
+	if (config.caCertificate != nullptr)
+		_mqttConfig.broker.verification.certificate = config.caCertificate;
+	if (config.clientKey != nullptr)
+		_mqttConfig.credentials.authentication.key = config.clientKey;
+	if (config.lastWillTopic != nullptr)
+	{
+		_mqttConfig.session.last_will.topic = config.lastWillTopic;
+		_mqttConfig.session.last_will.msg = config.lastWillMessage;
+		_mqttConfig.session.last_will.qos = config.lastWillQos;
+		_mqttConfig.session.last_will.retain = config.lastWillRetain;
+		_mqttConfig.session.last_will.msg_len = config.lastWillMessage != nullptr ? strlen(config.lastWillMessage) : 0;
+	}
+	if (config.keepAliveSeconds > 0)
+		setKeepAlive(config.keepAliveSeconds);
+	if (config.maxInPacketSize > 0)
+		setMaxInPacketSize(config.maxInPacketSize);
+	if (config.maxOutPacketSize > 0)
+		setMaxOutPacketSize(config.maxOutPacketSize);
+	if (config.taskPriority > 0)
+		setTaskPriority(config.taskPriority);
+	if (config.reconnectTimeoutMs > 0)
+		setReconnectTimeout(config.reconnectTimeoutMs);
+	if (config.networkOperationTimeoutMs > 0)
+		setNetowrkOperationTimeout(config.networkOperationTimeoutMs);
+	if (config.cleanSessionDisabled)
+		disableCleanSession();
+	if (config.autoReconnectDisabled)
+		disableAutoReconnect();
 }
 
 void ESP32_MQTTClient::setTaskPriority(int priority)
@@ -113,6 +437,11 @@ void ESP32_MQTTClient::setTaskPriority(int priority)
 	_mqttConfig.task.priority = priority;
 }
 
+void ESP32_MQTTClient::setTaskStackSize(int stackSize)
+{
+	_mqttConfig.task.stack_size = stackSize;
+}
+
 void ESP32_MQTTClient::setMaxInPacketSize(const int size)
 {
 	_mqttMaxInPacketSize = size;
@@ -145,13 +474,22 @@ void ESP32_MQTTClient::setNetowrkOperationTimeout(int networkOperationTimeoutMs)
 	_mqttConfig.network.timeout_ms = networkOperationTimeoutMs;
 }
 
-void ESP32_MQTTClient::setLastWillMessage(const char* topic, const char* message, const int qos, const bool retain)
+bool ESP32_MQTTClient::setLastWillMessage(const char* topic, const char* message, const int qos, const bool retain)
 {
-	_mqttConfig.session.last_will.topic = topic;
-	_mqttConfig.session.last_will.msg = message;
+	size_t stringStorageUsed = _stringStorageUsed;
+	const char* storedTopic = storeString(topic);
+	const char* storedMessage = storeString(message);
+	if (storedTopic == nullptr || storedMessage == nullptr)
+	{
+		_stringStorageUsed = stringStorageUsed;
+		return false;
+	}
+	_mqttConfig.session.last_will.topic = storedTopic;
+	_mqttConfig.session.last_will.msg = storedMessage;
 	_mqttConfig.session.last_will.qos = qos;
 	_mqttConfig.session.last_will.retain = retain;
 	_mqttConfig.session.last_will.msg_len = strlen(message);
+	return true;
 }
 
 void ESP32_MQTTClient::disableCleanSession()
@@ -165,375 +503,2460 @@ void ESP32_MQTTClient::disableAutoReconnect()
 }
 
 /// <summary>
-/// Publishes message to broker
+/// Reconnection attempts are scheduled by the policy and started from the housekeeping timer.
 /// </summary>
-/// <returns>message_id of the publish message (for QoS 0 message_id will always be zero) on success. -1 on failure, -2 in case of full outbox.</returns>
-int ESP32_MQTTClient::publish(const char* topic, const char* payload, int qos, bool retain)
+void ESP32_MQTTClient::setReconnectPolicy(ESP32_MQTTReconnectPolicy* policy)
 {
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
+	_reconnectPolicy = policy;
+	if (policy != nullptr)
 	{
-		log_d("Publishing message with topic: %s, payload: %s, qos:%d, retain: %d", topic, payload == NULL ? "NULL" : payload, qos, retain);
+		disableAutoReconnect();
+		startHousekeeping();
 	}
+}
 
-	if (!_isConnected)
+void ESP32_MQTTClient::setPublishRateLimit(unsigned int messagesPerSecond, unsigned int burst)
+{
+	_publishRateLimit.init(messagesPerSecond, burst);
+}
+
+void ESP32_MQTTClient::setProtocolVersion(int version)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	_mqttConfig.session.protocol_ver = version == 5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+#else
+	if (version == 5)
+		log_e("MQTT 5 is not enabled in esp-mqtt (CONFIG_MQTT_PROTOCOL_5)");
+	_mqttConfig.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+#endif
+}
+
+/// <summary>
+/// Repeated QoS 0 publishes to the same topic send a 2 byte alias instead of the topic. maxAliases should not exceed the broker's
+/// Topic Alias Maximum, it is lowered for the current connection when esp-mqtt rejects an alias.
+/// </summary>
+void ESP32_MQTTClient::enableTopicAliases(uint16_t maxAliases)
+{
+	std::lock_guard<std::mutex> lock(_publishPropertyMutex);
+	_topicAliases.init(maxAliases);
+}
+
+/// <summary>
+/// Subscribed topic filters are remembered and restored when the client connects without a session present,
+/// the application doesn't need to subscribe again in the onMqttConnected callback.
+/// </summary>
+void ESP32_MQTTClient::enableAutoResubscribe()
+{
+	_autoResubscribe = true;
+}
+
+void ESP32_MQTTClient::enableInflightTracking(size_t capacity)
+{
+	_inflightCapacity = capacity;
+}
+
+void ESP32_MQTTClient::setMessageRetransmitTimeout(int retransmitTimeoutMs)
+{
+	_mqttConfig.session.message_retransmit_timeout = retransmitTimeoutMs;
+}
+
+void ESP32_MQTTClient::setPersistentOutbox(ESP32_MQTTPersistentOutbox* outbox, unsigned int replayMessagesPerSecond)
+{
+	_persistentOutbox = outbox;
+	_outboxReplayRate = replayMessagesPerSecond;
+	if (outbox != nullptr)
+		startHousekeeping();
+}
+
+void ESP32_MQTTClient::enableMessageReassembly(size_t maxMessageSize, size_t bufferCount, ESP32_MQTTReassemblyDropPolicy dropPolicy)
+{
+	_reassemblyMaxMessageSize = maxMessageSize;
+	_reassemblyBufferCount = bufferCount;
+	_reassemblyDropPolicy = dropPolicy;
+}
+
+/// <summary>
+/// Enables compression for the topics matching the filter. The payload gets a small header with the method and the original
+/// length, payloads which don't get smaller are sent as they are behind the header. Received messages are decompressed before
+/// they reach the callbacks, messages bigger than the in buffer need enableMessageReassembly() and with enableDispatchTask()
+/// the decompressed message must fit a queue slot.
+/// </summary>
+/// <returns>false for an invalid topic filter</returns>
+bool ESP32_MQTTClient::enableCompression(const char* topicFilter, size_t maxMessageSize)
+{
+	if (!_compressionTrie.insert(topicFilter, 0))
 	{
-		log_w("MQTT client is not connected, the message won't publish");
+		log_e("Invalid topic filter '%s'", topicFilter);
+		return false;
 	}
+	if (maxMessageSize > _compressionMaxMessageSize)
+		_compressionMaxMessageSize = maxMessageSize;
+	return true;
+}
 
-	int result = esp_mqtt_client_publish(_mqttClient, topic, payload, 0, qos, retain);
+void ESP32_MQTTClient::enableRetainedCache(size_t capacity, unsigned long refreshIntervalMs)
+{
+	_retainedCacheCapacity = capacity;
+	_retainedRefreshIntervalMs = refreshIntervalMs;
+}
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
+bool ESP32_MQTTClient::setRetainedDeadband(const char* topicFilter, float deadband)
+{
+	int index = _retainedDeadbandTrie.find(topicFilter);
+	if (index < 0)
 	{
-		if (result >= 0)	// message_id
+		index = _retainedDeadbands.size();
+		if (!_retainedDeadbandTrie.insert(topicFilter, index))
 		{
-			log_d("Publish successful");
-		}
-		else if (result == -1) {
-			log_e("Publish failed");
-		}
-		else if (result == -2) {
-			log_e("Publish failed, out buffer full");
+			log_e("Invalid topic filter '%s'", topicFilter);
+			return false;
 		}
+		_retainedDeadbands.push_back(deadband);
 	}
+	_retainedDeadbands[index] = deadband;
+	return true;
+}
 
-	return result;
+void ESP32_MQTTClient::enableRetainedStore(size_t capacity, size_t maxMessageSize)
+{
+	_retainedStoreCapacity = capacity;
+	_retainedStoreMaxMessageSize = maxMessageSize;
+}
+
+void ESP32_MQTTClient::setHousekeepingTask(int priority, int coreId, uint32_t stackSize)
+{
+	_housekeepingTaskPriority = priority;
+	_housekeepingTaskCoreId = coreId;
+	_housekeepingTaskStackSize = stackSize;
 }
 
 /// <summary>
-/// Enqueue a message to the outbox, to be sent later. Typically used for messages with qos>0, but could be also used for qos=0 messages if store=true.
-/// This API generatesand stores the publish message into the internal outboxand the actual sending to the network is performed in the mqtt - task 
-/// context(in contrast to the esp_mqtt_client_publish() which sends the publish message immediately in the user task's context). Thus, it could be 
-/// used as a non blocking version of esp_mqtt_client_publish().
+/// Starts a task with the client that publishes a probe to probeTopic every probeIntervalMs and times its echo, the RTT
+/// and jitter give the health. The probes and their subscription are handled in the MQTT task and don't reach the callbacks.
+/// A lost probe is retried right away, after deadAfterLosses lost in a row the link is dead and the client fails over
+/// and reconnects. The topic must be private to this client.
 /// </summary>
-/// <returns></returns>
-int ESP32_MQTTClient::enqueue(const char* topic, const char* payload, int qos, bool retain, bool store)
+void ESP32_MQTTClient::enableHealthMonitor(const char* probeTopic, unsigned long probeIntervalMs, unsigned long probeTimeoutMs, unsigned int deadAfterLosses, int priority, int coreId, uint32_t stackSize)
 {
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
+	const char* stored = storeString(probeTopic);
+	if (stored == nullptr)
 	{
-		log_d("Enqueueing message with topic: %s, payload: %s, qos:%d, retain: %d", topic, payload == NULL ? "NULL" : payload, qos, retain);
+		log_e("Can't store the health probe topic, the health monitor is not enabled");
+		return;
 	}
+	_healthProbeTopic = stored;
+	_healthProbeTopicLen = strlen(probeTopic);
+	_health.setProbing(probeIntervalMs, probeTimeoutMs, deadAfterLosses);
+	_healthTaskPriority = priority;
+	_healthTaskCoreId = coreId;
+	_healthTaskStackSize = stackSize;
+}
 
-	int enqueueResult = esp_mqtt_client_enqueue(_mqttClient, topic, payload, 0, qos, retain, store);
+void ESP32_MQTTClient::setHealthThresholds(unsigned long degradedRttMs, unsigned long degradedJitterMs)
+{
+	_health.setThresholds(degradedRttMs, degradedJitterMs);
+}
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-	{
-		if (enqueueResult >= 0)		// message_id
-		{
-			log_d("Enqueue successful");
-		}
-		else if (enqueueResult == -1) {
-			log_e("Enqueue failed");
-		}
-		else if (enqueueResult == -2) {
-			log_e("Enqueue failed, out buffer full");
-		}
-	}
+void ESP32_MQTTClient::enableDispatchTask(size_t queueCapacity, int priority, int coreId, uint32_t stackSize, size_t maxEventDataSize)
+{
+	_dispatchQueueCapacity = queueCapacity;
+	_dispatchQueueSlotSize = maxEventDataSize;
+	_dispatchTaskPriority = priority;
+	_dispatchTaskCoreId = coreId;
+	_dispatchTaskStackSize = stackSize;
+}
 
-	return enqueueResult;
+void ESP32_MQTTClient::enableAsyncPublish(size_t queueCapacity, size_t maxMessageSize, ESP32_MQTTQueueFullPolicy fullPolicy, unsigned long blockTimeoutMs, int priority, int coreId, uint32_t stackSize)
+{
+	_publishClasses[0].queueCapacity = queueCapacity;
+	_publishQueueSlotSize = maxMessageSize;
+	_publishQueueFullPolicy = fullPolicy;
+	_publishQueueBlockTimeoutMs = blockTimeoutMs;
+	_publishTaskPriority = priority;
+	_publishTaskCoreId = coreId;
+	_publishTaskStackSize = stackSize;
 }
 
-int ESP32_MQTTClient::subscribe(const char* topic, int qos)
+/// <summary>
+/// Adds a traffic class for publishAsync(). The publish task takes messages from the classes in proportion to their weights,
+/// e.g. with weights 8 (alarms), 2 (telemetry) and 1 (default) alarms get 8 of every 11 sends however long the other queues
+/// are. A class over its rate limit is skipped until it has a token again, setPublishRateLimit() limits all of them.
+/// </summary>
+/// <returns>class id for addPublishClassTopic(), -1 if there are already ESP32_MQTTCLIENT_MAX_PUBLISH_CLASSES classes</returns>
+int ESP32_MQTTClient::addPublishClass(uint8_t weight, size_t queueCapacity, unsigned int messagesPerSecond, unsigned int burst)
 {
-	if (_mqttClient == NULL) {
-		if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			log_e("MQTT client is null, can't subscribe, use createClient() to create a client first");
+	if (_publishClassCount == ESP32_MQTTCLIENT_MAX_PUBLISH_CLASSES || weight == 0)
+	{
+		log_e("Can't add publish class");
 		return -1;
 	}
-	else if (ESP32_MQTTCLIENT_LOGGING_ENABLED) {
-		log_d("Subscribing to topic '%s', qos: %d", topic, qos);
-	}
 
-	int result = esp_mqtt_client_subscribe(_mqttClient, topic, qos);
-	
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
+	PublishClass& publishClass = _publishClasses[_publishClassCount];
+	publishClass.queueCapacity = queueCapacity;
+	publishClass.weight = weight;
+	publishClass.credit = 0;
+	publishClass.rateLimit.init(messagesPerSecond, burst);
+	return _publishClassCount++;
+}
+
+bool ESP32_MQTTClient::addPublishClassTopic(int classId, const char* topicFilter)
+{
+	if (classId <= 0 || classId >= (int)_publishClassCount || !_publishClassTrie.insert(topicFilter, classId))
 	{
-		if (result >= 0)
-			log_d("Subscribed to topic: %s, qos: %d", topic, qos);
-		else if(result == -1)
-			log_e("Subscribe failed");
-		else if (result == -2)
-			log_e("Subscribe failed, out buffer full");
+		log_e("Invalid publish class %d or topic filter '%s'", classId, topicFilter);
+		return false;
 	}
+	return true;
+}
 
-	return result;
+/// <summary>
+/// Publishes message to broker
+/// </summary>
+/// <returns>message_id of the publish message (for QoS 0 message_id will always be zero) on success. -1 on failure, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::publish(const char* topic, const char* payload, int qos, bool retain)
+{
+	return publish(topic, (const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), qos, retain);
 }
 
-int ESP32_MQTTClient::unsubscribe(const char* topic)
+/// <summary>
+/// Publishes binary message of the given length to broker
+/// </summary>
+/// <returns>message_id of the publish message (for QoS 0 message_id will always be zero) on success. -1 on failure, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain)
 {
-	if (_mqttClient == NULL) {
-		if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			log_e("MQTT client is null, can't unsubscribe, use createClient() to create a client first");
+	return publishMessage(topic, payload, length, qos, retain, nullptr);
+}
+
+int ESP32_MQTTClient::publishAsync(const char* topic, const char* payload, int qos, bool retain)
+{
+	return publishAsync(topic, (const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), qos, retain);
+}
+
+/// <summary>
+/// Copies the message into the publish queue and returns, the publish task passes it to publish() in the queue order. The
+/// caller never waits for the esp-mqtt lock or the socket, only for a free slot with ESP32_MQTTQueueFullPolicy::Block.
+/// </summary>
+/// <returns>0 if the message was queued, -1 if it doesn't fit a slot or enableAsyncPublish() wasn't called, -2 if the queue is full</returns>
+int ESP32_MQTTClient::publishAsync(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain)
+{
+	if (!_publishClasses[0].queue.isInitialized())
+	{
+		log_e("Async publish is not enabled, use enableAsyncPublish() before createClient()");
 		return -1;
 	}
-	else if (ESP32_MQTTCLIENT_LOGGING_ENABLED) {
-		log_d("Unsubscribing from topic '%s'", topic);
-	}
-
-	int result = esp_mqtt_client_unsubscribe(_mqttClient, topic);
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
+	int classId = 0;
+	if (_publishClassTrie.getCount() > 0 && topic != nullptr)
 	{
-		if (result >= 0)
-			log_d("Unsubscribed from topic: %s", topic);
-		else if (result == -1)
-			log_e("Unsubscribe failed");
-		else if (result == -2)
-			log_e("Unsubscribe failed, out buffer full");
+		_publishClassTrie.match(topic, strlen(topic), [](int routeId, void* context) {
+			int& classId = *static_cast<int*>(context);
+			if (classId == 0 || routeId < classId)
+				classId = routeId;
+		}, &classId);
 	}
 
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	int result = _publishClasses[classId].queue.push(topic, payload, length, qos, retain, _publishQueueFullPolicy, _publishQueueBlockTimeoutMs);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::PublishAsync, result, classId, traceStartUs);
+	if (result == 0)
+		xTaskNotifyGive(_publishTask);
+	else if (result == -2)
+		ESP32_MQTT_LOG(Publish, Warning, "Publish queue full");
 	return result;
 }
 
-void ESP32_MQTTClient::printError(esp_mqtt_error_codes_t* error_handle)
+void ESP32_MQTTClient::publishTaskStatic(void* arg)
 {
-	switch (error_handle->error_type)
+	ESP32_MQTTClient* client = static_cast<ESP32_MQTTClient*>(arg);
+	while (true)
 	{
-	case MQTT_ERROR_TYPE_NONE:
-		log_d("Error Type: MQTT_ERROR_TYPE_NONE");
-		break;
+		// messages held back by a rate limit are sent once there is a token
+		ulTaskNotifyTake(pdTRUE, client->hasQueuedMessages() ? pdMS_TO_TICKS(ESP32_MQTTCLIENT_PUBLISH_THROTTLE_MS) : portMAX_DELAY);
+		client->sendQueuedMessages();
+	}
+}
 
-	case MQTT_ERROR_TYPE_TCP_TRANSPORT:
+bool ESP32_MQTTClient::hasQueuedMessages()
+{
+	for (size_t i = 0; i < _publishClassCount; i++)
 	{
-		auto espTransportSockErrNoToStr = [](int espTransportSockErrNo) -> const char* {
-			switch (espTransportSockErrNo) {
-			case MQTT_ERROR_TYPE_NONE:
-				return "MQTT_ERROR_TYPE_NONE";
-			case MQTT_ERROR_TYPE_TCP_TRANSPORT:
-				return "MQTT_ERROR_TYPE_TCP_TRANSPORT";
-			case MQTT_ERROR_TYPE_CONNECTION_REFUSED:
-				return "MQTT_ERROR_TYPE_CONNECTION_REFUSED";
-			default:
-				return "Unknown esp transport sock err no";
-			}
-		};
-
-		log_d("Error Type: MQTT_ERROR_TYPE_TCP_TRANSPORT");
-		log_d("Last error code reported from esp-tls: %s (0x%x)", esp_err_to_name(error_handle->esp_tls_last_esp_err), error_handle->esp_tls_last_esp_err);
-		log_d("Last tls stack error number: 0x%x (%s)", error_handle->esp_tls_stack_err, strerror(error_handle->esp_tls_stack_err));
-		log_d("Last captured esp transport sock errno : %s (%d) (%s)", espTransportSockErrNoToStr(error_handle->esp_transport_sock_errno), error_handle->esp_transport_sock_errno, strerror(error_handle->esp_transport_sock_errno));
-		break;
+		if (_publishClasses[i].queue.getSize() > 0)
+			return true;
 	}
+	return false;
+}
 
-	case MQTT_ERROR_TYPE_CONNECTION_REFUSED:
+/// <summary>
+/// Smooth weighted round robin over the classes with a queued message and a token: every pick adds the candidates' weights
+/// to their credits, the highest credit wins and pays the sum of the weights. A class gets weight of every total weight
+/// messages, spread evenly instead of in bursts.
+/// </summary>
+/// <returns>the class to send from, nullptr if none can send now</returns>
+ESP32_MQTTClient::PublishClass* ESP32_MQTTClient::nextPublishClass()
+{
+	PublishClass* next = nullptr;
+	int totalWeight = 0;
+	for (size_t i = 0; i < _publishClassCount; i++)
 	{
+		PublishClass& publishClass = _publishClasses[i];
+		if (publishClass.queue.getSize() == 0)
+		{
+			// an idle class doesn't save up credit
+			publishClass.credit = 0;
+			continue;
+		}
+		if (publishClass.rateLimit.isEnabled() && publishClass.rateLimit.getAvailable() == 0)
+			continue;
 
-		auto connectReturnCodeToStr = [](int connectReturnCode) -> const char* {
-			switch (connectReturnCode)
-			{
-			case MQTT_CONNECTION_ACCEPTED:
-				return "MQTT_CONNECTION_ACCEPTED";
-			case MQTT_CONNECTION_REFUSE_PROTOCOL:
-				return "MQTT_CONNECTION_REFUSE_PROTOCOL";
-			case MQTT_CONNECTION_REFUSE_ID_REJECTED:
-				return "MQTT_CONNECTION_REFUSE_ID_REJECTED";
-			case MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE:
-				return "MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE";
-			case MQTT_CONNECTION_REFUSE_BAD_USERNAME:
-				return "MQTT_CONNECTION_REFUSE_BAD_USERNAME";
-			case MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED:
-				return "MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED";
-			default:
-				return "Unknown connect return code";
-			}
-		};
-
-		log_d("Error type: MQTT_ERROR_TYPE_CONNECTION_REFUSED");
-		log_d("Connection refused error: %s (0x%x)", connectReturnCodeToStr(error_handle->connect_return_code), error_handle->connect_return_code);
-		break;
+		publishClass.credit += publishClass.weight;
+		totalWeight += publishClass.weight;
+		if (next == nullptr || publishClass.credit > next->credit)
+			next = &publishClass;
 	}
 
-	default:
-		log_d("Error type: Unknown (0x%x)", error_handle->error_type);
-		break;
-	}
+	if (next != nullptr)
+		next->credit -= totalWeight;
+	return next;
 }
 
-bool ESP32_MQTTClient::createClient()
+/// <summary>
+/// Publishes the queued messages. A message refused by the rate limit or a full esp-mqtt outbox keeps its slot and is retried,
+/// so a slow connection fills the queue and the producers get the back-pressure of the full policy.
+/// </summary>
+void ESP32_MQTTClient::sendQueuedMessages()
 {
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client init");
-
-	esp_err_t result;
-
-	if (_mqttUri == nullptr)
+	ESP32_MQTTQueuedMessage message;
+	// the overall rate limit is checked before a class is picked, a message waiting for it would hold back the other classes
+	while (!_publishRateLimit.isEnabled() || _publishRateLimit.getAvailable() > 0)
 	{
-		if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			log_e("MQTT Broker server URI is not set, aborting connect");
+		PublishClass* publishClass = nextPublishClass();
+		if (publishClass == nullptr)
+			return;
+		// a DropOldest producer may have emptied the queue meanwhile
+		if (!publishClass->queue.claim(message))
+			continue;
+
+		publishClass->rateLimit.tryConsume();
+		while (publishMessage(message.topic, message.payload, message.length, message.qos, message.retain, nullptr) == -2)
+			vTaskDelay(pdMS_TO_TICKS(ESP32_MQTTCLIENT_PUBLISH_RETRY_MS));
+		publishClass->queue.release();
+	}
+}
+
+/// <summary>
+/// Publishes binary message with MQTT 5 properties, requires setProtocolVersion(5). The properties are not kept when the message
+/// goes to the persistent outbox.
+/// </summary>
+/// <returns>message_id of the publish message (for QoS 0 message_id will always be zero) on success. -1 on failure, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, const ESP32_MQTTPublishProperties& properties)
+{
+	return publishMessage(topic, payload, length, qos, retain, &properties);
+}
+
+int ESP32_MQTTClient::publishMessage(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, const ESP32_MQTTPublishProperties* properties)
+{
+	ESP32_MQTT_LOG(Publish, Debug, "Publishing message with topic: %s, payload length: %u, qos:%d, retain: %d", topic, (unsigned int)length, qos, (int)retain);
+
+	bool retainedChecked = retain && _retainedCache.isInitialized();
+	if (retainedChecked && !_retainedCache.check(topic, payload, length, getRetainedDeadband(topic)))
+	{
+		ESP32_MQTT_LOG(Publish, Debug, "Retained value on topic %s unchanged, not published", topic);
+		return 0;
+	}
+
+	// while the stored messages are replayed, new ones are queued behind them to keep the order
+	if (_persistentOutbox != nullptr && (!_isConnected || _persistentOutbox->getCount() > 0))
+	{
+		bool stored = _persistentOutbox->append(topic, payload, length, qos, retain);
+		if (stored && _isConnected)
+		{
+			// replayed right away instead of on the next tick
+			_outboxLiveCount++;
+			if (_housekeepingTask != nullptr)
+				xTaskNotifyGive(_housekeepingTask);
+		}
+		ESP32_MQTT_LOG(Publish, Debug, stored ? "Message stored in the persistent outbox" : "Message can't be stored in the persistent outbox");
+		if (retainedChecked && !stored)
+			_retainedCache.forget(topic);
+		return stored ? 0 : -1;
+	}
+
+	if (!_isConnected)
+	{
+		log_w("MQTT client is not connected, the message won't publish");
+	}
+
+	if (!_publishRateLimit.tryConsume())
+	{
+		ESP32_MQTT_LOG(Publish, Warning, "Publish rate limit exceeded");
+		if (retainedChecked)
+			_retainedCache.forget(topic);
+		return -2;
+	}
+
+	// explicit length, esp-mqtt would call strlen() on the payload for length 0
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	uint32_t sendStartUs = micros();
+	int result = sendPublish(topic, payload, length, qos, retain, false, false, properties);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Publish, result, qos, traceStartUs);
+	_metrics.recordPublish(result, strlen(topic) + length, qos, sendStartUs);
+	// the value wasn't sent, the next one goes out even if it's the same
+	if (retainedChecked && result < 0)
+		_retainedCache.forget(topic);
+
+	if (result >= 0)	// message_id
+		ESP32_MQTT_LOG(Publish, Debug, "Publish successful, msg_id: %d", result);
+	else if (result == -1)
+		ESP32_MQTT_LOG(Publish, Error, "Publish failed");
+	else if (result == -2)
+		ESP32_MQTT_LOG(Publish, Error, "Publish failed, out buffer full");
+
+	return result;
+}
+
+/// <summary>
+/// Publishes message whose payload is the concatenation of the segments. The segments are copied into a buffer owned by the client
+/// which is reused by the following calls, so no allocation happens once the buffer has grown to the largest payload.
+/// The MQTT task has a buffer of its own: it holds the esp-mqtt lock during the event handlers, and another task publishing
+/// segments holds _gatherBufMutex while it waits for that lock, e.g. an RPC server replying while the RPC client calls.
+/// </summary>
+/// <returns>message_id of the publish message (for QoS 0 message_id will always be zero) on success. -1 on failure, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::publish(const char* topic, const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, int qos, bool retain)
+{
+	if (xTaskGetCurrentTaskHandle() == _mqttTask)
+	{
+		size_t length = gatherPayload(segments, segmentCount, _mqttTaskGatherBuf, _mqttTaskGatherBufSize);
+		if (length == (size_t)-1)
+			return -1;
+		return publish(topic, _mqttTaskGatherBuf, length, qos, retain);
+	}
+
+	std::lock_guard<std::mutex> lock(_gatherBufMutex);
+
+	size_t length = gatherPayload(segments, segmentCount, _gatherBuf, _gatherBufSize);
+	if (length == (size_t)-1)
+		return -1;
+
+	return publish(topic, _gatherBuf, length, qos, retain);
+}
+
+int ESP32_MQTTClient::publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler)
+{
+	return publishTracked(topic, payload, length, qos, retain, timeoutMs, handler, nullptr);
+}
+
+int ESP32_MQTTClient::publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTPublishToken& token)
+{
+	token.reset(&_inflight);
+	return publishTracked(topic, payload, length, qos, retain, timeoutMs, nullptr, &token);
+}
+
+/// <summary>
+/// Publishes a payload of totalLength bytes without having it in RAM. It is read from reader piece by piece and sent as
+/// a series of messages to the topic, each filling the out buffer: ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE bytes of
+/// offset and total length followed by the data. With QoS 1/2 at most ESP32_MQTT_STREAM_WINDOW_SEGMENTS segments
+/// wait for their acknowledgement in the esp-mqtt outbox, so RAM use doesn't grow with the payload, timeoutMs limits
+/// the wait for one window. Streams published from several tasks are sent one after the other.
+/// The segments go to esp-mqtt directly and skip what publish() does with a message: they are not compressed (a segment
+/// must fit the out buffer as it is, and the receiver joins raw segments), not kept in the retained cache (segments are
+/// never retained), not stored in the persistent outbox (the reader can't be replayed after a reboot, so the
+/// stream fails when the connection is lost) and they don't use topic aliases or the in-flight table.
+/// </summary>
+/// <returns>0 on success. -1 on failure (reader error, disconnect, called from the MQTT task), -2 if the outbox didn't drain within timeoutMs.</returns>
+int ESP32_MQTTClient::publishStream(const char* topic, size_t totalLength, ESP32_MQTTCallbacks::OnMqttStreamReadCallback reader, int qos, unsigned long timeoutMs)
+{
+	if (_mqttClient == nullptr || topic == nullptr || !reader || totalLength > UINT32_MAX)
+		return -1;
+	if (xTaskGetCurrentTaskHandle() == _mqttTask)
+	{
+		// the acknowledgements are processed by the MQTT task
+		log_e("Can't publish a stream from the MQTT task, use enableDispatchTask()");
+		return -1;
+	}
+
+	// fixed header (up to 5 bytes) + topic length prefix + topic + packet identifier + MQTT 5 property length
+	int packetOverhead = 5 + 2 + strlen(topic) + 2 + 1;
+	int segmentCapacity = _mqttMaxOutPacketSize - packetOverhead - ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE;
+	if (segmentCapacity <= 0)
+	{
+		log_e("Out packet size of %d bytes is too small for a stream to topic %s", _mqttMaxOutPacketSize, topic);
+		return -1;
+	}
+
+	uint8_t* segment = (uint8_t*)malloc(ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE + segmentCapacity);
+	if (segment == nullptr)
+		return -1;
+
+	std::lock_guard<std::mutex> lock(_streamPublishMutex);
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	_streamPublishTask = xTaskGetCurrentTaskHandle();
+	int windowBytes = ESP32_MQTT_STREAM_WINDOW_SEGMENTS * _mqttMaxOutPacketSize;
+	int result = 0;
+	size_t offset = 0;
+	do
+	{
+		size_t segmentLength = std::min(totalLength - offset, (size_t)segmentCapacity);
+		for (size_t filled = 0; filled < segmentLength && result == 0; )
+		{
+			int read = reader(segment + ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE + filled, segmentLength - filled, offset + filled);
+			if (read <= 0 || (size_t)read > segmentLength - filled)
+			{
+				log_e("Stream to topic %s aborted by the reader at %u of %u bytes", topic, offset + filled, totalLength);
+				result = -1;
+			}
+			else
+			{
+				filled += read;
+			}
+		}
+		if (result != 0)
+			break;
+
+		segment[0] = offset >> 24;
+		segment[1] = offset >> 16;
+		segment[2] = offset >> 8;
+		segment[3] = offset;
+		segment[4] = totalLength >> 24;
+		segment[5] = totalLength >> 16;
+		segment[6] = totalLength >> 8;
+		segment[7] = totalLength;
+
+		// PUBLISHED events wake the task up, the timeout covers a missed notification
+		unsigned long startMillis = millis();
+		while (qos > 0 && getOutboxBufferSize() > windowBytes && result == 0)
+		{
+			if (!_isConnected)
+				result = -1;
+			else if (millis() - startMillis >= timeoutMs)
+				result = -2;
+			else
+				ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ESP32_MQTTCLIENT_PUBLISH_RETRY_MS));
+		}
+		if (!_isConnected)
+			result = -1;
+		if (result != 0)
+		{
+			log_e("Stream to topic %s aborted at %u of %u bytes, %s", topic, offset, totalLength, result == -1 ? "not connected" : "no acknowledgements");
+			break;
+		}
+
+		// retried after the rate limit or a full outbox like in the publish task
+		int msgId;
+		uint32_t sendStartUs = micros();
+		while (true)
+		{
+			msgId = _publishRateLimit.tryConsume() ? sendPublishPacket(topic, segment, ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE + segmentLength, qos, false, false, false, nullptr) : -2;
+			if (msgId != -2 || !_isConnected)
+				break;
+			vTaskDelay(pdMS_TO_TICKS(ESP32_MQTTCLIENT_PUBLISH_RETRY_MS));
+		}
+		_metrics.recordPublish(msgId, strlen(topic) + ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE + segmentLength, qos, sendStartUs);
+		if (msgId < 0)
+		{
+			log_e("Stream to topic %s failed at %u of %u bytes", topic, offset, totalLength);
+			result = -1;
+			break;
+		}
+		offset += segmentLength;
+	} while (offset < totalLength);
+
+	_streamPublishTask = nullptr;
+	free(segment);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::PublishStream, result, qos, traceStartUs);
+	return result;
+}
+
+/// <summary>
+/// Publishes message and tracks its completion in the in-flight table. QoS 0 messages are completed right after they are sent.
+/// A timed out message is reported with TimedOut and not published again: esp-mqtt keeps it in its outbox and retransmits it
+/// with the DUP flag (setMessageRetransmitTimeout(), and after a reconnect), a new publish would be another message with another
+/// msg_id that the subscribers receive twice. The handler can still publish again if a duplicate is acceptable.
+/// </summary>
+/// <returns>message_id of the publish message on success. -1 on failure, -2 in case of full outbox or full in-flight table.</returns>
+int ESP32_MQTTClient::publishTracked(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler, ESP32_MQTTPublishToken* token)
+{
+	if (!_inflight.isInitialized())
+	{
+		log_e("In-flight tracking is not enabled, use enableInflightTracking() before createClient()");
+		if (token != nullptr)
+			token->complete(ESP32_MQTTPublishStatus::Failed, 0);
+		return -1;
+	}
+
+	uint32_t ticket = qos > 0 ? _inflight.reserve() : 0;
+	if (qos > 0 && ticket == 0)
+	{
+		ESP32_MQTT_LOG(Publish, Warning, "Too many messages in flight");
+		if (token != nullptr)
+			token->complete(ESP32_MQTTPublishStatus::Failed, 0);
+		return -2;
+	}
+
+	bool stored = _persistentOutbox != nullptr && (!_isConnected || _persistentOutbox->getCount() > 0);
+	int result = publish(topic, payload, length, qos, retain);
+
+	if (qos > 0 && result > 0)
+	{
+		_inflight.add(ticket, result, timeoutMs, handler, token);
+		return result;
+	}
+
+	if (qos > 0)
+		_inflight.cancelReservation(ticket);
+
+	if (result == 0)
+	{
+		// QoS 0 message was sent or any message was stored in the persistent outbox
+		ESP32_MQTTPublishStatus status = stored ? ESP32_MQTTPublishStatus::Stored : ESP32_MQTTPublishStatus::Confirmed;
+		if (token != nullptr)
+			token->complete(status, 0);
+		if (handler)
+			handler(0, status, 0);
+	}
+
+	// handler is not called for a message which wasn't published, the caller gets the error code
+	if (result < 0 && token != nullptr)
+		token->complete(ESP32_MQTTPublishStatus::Failed, 0);
+
+	return result;
+}
+
+/// <summary>
+/// Enqueue a message to the outbox, to be sent later. Typically used for messages with qos>0, but could be also used for qos=0 messages if store=true.
+/// This API generatesand stores the publish message into the internal outboxand the actual sending to the network is performed in the mqtt - task 
+/// context(in contrast to the esp_mqtt_client_publish() which sends the publish message immediately in the user task's context). Thus, it could be 
+/// used as a non blocking version of esp_mqtt_client_publish().
+/// </summary>
+/// <returns></returns>
+int ESP32_MQTTClient::enqueue(const char* topic, const char* payload, int qos, bool retain, bool store)
+{
+	return enqueue(topic, (const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), qos, retain, store);
+}
+
+int ESP32_MQTTClient::enqueue(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool store)
+{
+	ESP32_MQTT_LOG(Publish, Debug, "Enqueueing message with topic: %s, payload length: %u, qos:%d, retain: %d", topic, (unsigned int)length, qos, (int)retain);
+
+	if (!_publishRateLimit.tryConsume())
+	{
+		ESP32_MQTT_LOG(Publish, Warning, "Publish rate limit exceeded");
+		return -2;
+	}
+
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	uint32_t sendStartUs = micros();
+	int enqueueResult = sendPublish(topic, payload, length, qos, retain, true, store, nullptr);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Enqueue, enqueueResult, qos, traceStartUs);
+	_metrics.recordEnqueue(enqueueResult, strlen(topic) + length, qos, sendStartUs);
+
+	if (enqueueResult >= 0)		// message_id
+		ESP32_MQTT_LOG(Publish, Debug, "Enqueue successful, msg_id: %d", enqueueResult);
+	else if (enqueueResult == -1)
+		ESP32_MQTT_LOG(Publish, Error, "Enqueue failed");
+	else if (enqueueResult == -2)
+		ESP32_MQTT_LOG(Publish, Error, "Enqueue failed, out buffer full");
+
+	return enqueueResult;
+}
+
+int ESP32_MQTTClient::sendPublish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties)
+{
+	if (_compressBuf != nullptr && isCompressedTopic(topic, strlen(topic)))
+		return sendCompressed(topic, payload, length, qos, retain, enqueue, store, properties);
+	return sendPublishPacket(topic, payload, length, qos, retain, enqueue, store, properties);
+}
+
+int ESP32_MQTTClient::sendPublishPacket(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	if (_mqttConfig.session.protocol_ver == MQTT_PROTOCOL_V_5)
+		return sendPublishV5(topic, payload, length, qos, retain, enqueue, store, properties);
+#endif
+	if (properties != nullptr)
+	{
+		log_e("Publish properties require MQTT 5, use setProtocolVersion(5)");
+		return -1;
+	}
+
+	if (enqueue)
+		return esp_mqtt_client_enqueue(_mqttClient, topic, (const char*)payload, length, qos, retain, store);
+	return esp_mqtt_client_publish(_mqttClient, topic, (const char*)payload, length, qos, retain);
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/// <summary>
+/// esp-mqtt keeps the publish properties in the client until they are changed, so setting them and publishing is done under
+/// a lock and they are cleared afterwards. Topic aliases are used only for QoS 0 messages sent right away, QoS 1/2 and enqueued
+/// messages can be resent on a new connection where the alias is unknown.
+/// </summary>
+int ESP32_MQTTClient::sendPublishV5(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties)
+{
+	std::unique_lock<std::mutex> lock(_publishPropertyMutex, std::defer_lock);
+	if (xTaskGetCurrentTaskHandle() == _mqttTask)
+	{
+		// the MQTT task holds the esp-mqtt lock while it runs the callbacks, waiting here for a task which waits for
+		// the esp-mqtt lock would deadlock
+		if (!lock.try_lock())
+		{
+			log_w("Can't publish from the MQTT task while another task publishes, use enableDispatchTask()");
+			return -1;
+		}
+	}
+	else
+	{
+		lock.lock();
+	}
+
+	if (_topicAliasReset.exchange(false))
+		_topicAliases.reset();
+
+	esp_mqtt5_publish_property_config_t config = {};
+	mqtt5_user_property_handle_t userProperty = nullptr;
+	if (properties != nullptr)
+	{
+		config.payload_format_indicator = properties->payloadIsUtf8;
+		config.message_expiry_interval = properties->messageExpirySeconds;
+		config.response_topic = properties->responseTopic;
+		config.correlation_data = (const char*)properties->correlationData;
+		config.correlation_data_len = properties->correlationDataLen;
+		config.content_type = properties->contentType;
+		if (properties->userPropertyCount > 0)
+		{
+			// esp-mqtt copies the items into a list owned by the caller
+			static_assert(sizeof(ESP32_MQTTUserProperty) == sizeof(esp_mqtt5_user_property_item_t), "user property layout");
+			esp_mqtt5_client_set_user_property(&userProperty, (esp_mqtt5_user_property_item_t*)properties->userProperties, properties->userPropertyCount);
+			config.user_property = userProperty;
+		}
+	}
+
+	const char* sendTopic = topic;
+	if (_topicAliases.isInitialized() && qos == 0 && !enqueue && _isConnected)
+	{
+		size_t topicLen = strlen(topic);
+		bool established;
+		config.topic_alias = _topicAliases.getAlias(topic, topicLen, established);
+		if (established)
+			sendTopic = "";
+	}
+
+	bool hasProperties = properties != nullptr || config.topic_alias != 0;
+	int result = 0;
+	if (hasProperties && esp_mqtt5_client_set_publish_property(_mqttClient, &config) != ESP_OK)
+	{
+		result = -1;
+		if (config.topic_alias != 0)
+		{
+			// esp-mqtt rejects aliases above the broker's Topic Alias Maximum
+			ESP32_MQTT_LOG(Publish, Debug, "Topic alias %u rejected, limiting aliases to %u", (unsigned int)config.topic_alias, (unsigned int)config.topic_alias - 1);
+			_topicAliases.setLimit(config.topic_alias - 1);
+			config.topic_alias = 0;
+			sendTopic = topic;
+			hasProperties = properties != nullptr;
+			result = !hasProperties || esp_mqtt5_client_set_publish_property(_mqttClient, &config) == ESP_OK ? 0 : -1;
+		}
+	}
+
+	if (result == 0)
+	{
+		if (enqueue)
+			result = esp_mqtt_client_enqueue(_mqttClient, sendTopic, (const char*)payload, length, qos, retain, store);
+		else
+			result = esp_mqtt_client_publish(_mqttClient, sendTopic, (const char*)payload, length, qos, retain);
+	}
+	// a message which wasn't sent didn't tell the broker the alias
+	if (config.topic_alias != 0 && result >= 0)
+		_topicAliases.confirm(config.topic_alias);
+
+	if (hasProperties)
+	{
+		esp_mqtt5_publish_property_config_t empty = {};
+		esp_mqtt5_client_set_publish_property(_mqttClient, &empty);
+	}
+	if (userProperty != nullptr)
+		esp_mqtt5_client_delete_user_property(userProperty);
+	return result;
+}
+#endif
+
+bool ESP32_MQTTClient::isCompressedTopic(const char* topic, int topicLen)
+{
+	return topic != nullptr && _compressionTrie.match(topic, topicLen, [](int routeId, void* context) {}, nullptr) > 0;
+}
+
+/// <summary>
+/// Compresses the payload into _compressBuf and publishes it. The buffer stays locked until esp-mqtt has copied the message,
+/// the MQTT task only tries the lock for the same reason as in sendPublishV5().
+/// </summary>
+int ESP32_MQTTClient::sendCompressed(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties)
+{
+	if (length > _compressionMaxMessageSize)
+	{
+		log_e("Message of %u bytes is bigger than the compression limit of %u bytes", length, _compressionMaxMessageSize);
+		return -1;
+	}
+
+	std::unique_lock<std::mutex> lock(_compressMutex, std::defer_lock);
+	if (xTaskGetCurrentTaskHandle() == _mqttTask)
+	{
+		if (!lock.try_lock())
+		{
+			log_w("Can't publish from the MQTT task while another task publishes, use enableDispatchTask()");
+			return -1;
+		}
+	}
+	else
+	{
+		lock.lock();
+	}
+
+	size_t compressedLen = _compressor.compress(payload, length, _compressBuf, _compressBufSize);
+	_compressionInputBytes += length;
+	_compressionOutputBytes += compressedLen;
+	ESP32_MQTT_LOG(Publish, Verbose, "Payload compressed from %u to %u bytes", (unsigned int)length, (unsigned int)compressedLen);
+
+	return sendPublishPacket(topic, _compressBuf, compressedLen, qos, retain, enqueue, store, properties);
+}
+
+int ESP32_MQTTClient::enqueue(const char* topic, const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, int qos, bool retain, bool store)
+{
+	if (xTaskGetCurrentTaskHandle() == _mqttTask)
+	{
+		size_t length = gatherPayload(segments, segmentCount, _mqttTaskGatherBuf, _mqttTaskGatherBufSize);
+		if (length == (size_t)-1)
+			return -1;
+		return enqueue(topic, _mqttTaskGatherBuf, length, qos, retain, store);
+	}
+
+	std::lock_guard<std::mutex> lock(_gatherBufMutex);
+
+	size_t length = gatherPayload(segments, segmentCount, _gatherBuf, _gatherBufSize);
+	if (length == (size_t)-1)
+		return -1;
+
+	return enqueue(topic, _gatherBuf, length, qos, retain, store);
+}
+
+/// <summary>
+/// Copies the segments into the buffer, grows it if needed. _gatherBuf must be used with _gatherBufMutex locked.
+/// </summary>
+/// <returns>total payload length, (size_t)-1 if the buffer couldn't be allocated</returns>
+size_t ESP32_MQTTClient::gatherPayload(const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, uint8_t*& buf, size_t& bufSize)
+{
+	size_t length = 0;
+	for (size_t i = 0; i < segmentCount; i++)
+		length += segments[i].length;
+
+	if (length > bufSize)
+	{
+		uint8_t* grown = (uint8_t*)realloc(buf, length);
+		if (grown == nullptr)
+		{
+			log_e("Can't allocate %u bytes for the payload", length);
+			return (size_t)-1;
+		}
+		buf = grown;
+		bufSize = length;
+	}
+
+	size_t offset = 0;
+	for (size_t i = 0; i < segmentCount; i++)
+	{
+		if (segments[i].length > 0)
+			memcpy(buf + offset, segments[i].data, segments[i].length);
+		offset += segments[i].length;
+	}
+	return length;
+}
+
+/// <summary>
+/// Subscribes to the topic filter. The filter is remembered for enableAutoResubscribe(), a handler registered for it
+/// by subscribe(topic, qos, handler) is kept.
+/// </summary>
+/// <returns>message_id of the subscribe message on success. -1 on failure, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::subscribe(const char* topic, int qos)
+{
+	std::shared_ptr<TopicRoute> route = createTopicRoute(topic, qos);
+	if (route)
+		setTopicRoute(route, true);
+
+	return sendSubscribe(topic, qos);
+}
+
+int ESP32_MQTTClient::sendSubscribe(const char* topic, int qos)
+{
+	if (_mqttClient == NULL) {
+		ESP32_MQTT_LOG(Subscribe, Error, "MQTT client is null, can't subscribe, use createClient() to create a client first");
+		return -1;
+	}
+	ESP32_MQTT_LOG(Subscribe, Debug, "Subscribing to topic '%s', qos: %d", topic, qos);
+
+	{
+		std::lock_guard<std::mutex> lock(_subscribeAckMutex);
+		_subscribesInProgress++;
+	}
+
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	int result = esp_mqtt_client_subscribe(_mqttClient, topic, qos);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Subscribe, result, qos, traceStartUs);
+	_metrics.recordSubscribe(result);
+
+	{
+		// the MQTT task may have handled the SUBACK before esp_mqtt_client_subscribe() returned the msg_id
+		std::lock_guard<std::mutex> lock(_subscribeAckMutex);
+		int grantedQos = -1;
+		for (size_t i = 0; i < _earlySubscribeAckCount && result >= 0; i++)
+		{
+			if (_earlySubscribeAcks[i].msgId == result)
+				grantedQos = _earlySubscribeAcks[i].grantedQos;
+		}
+
+		TopicRouteTablePtr table = loadTopicRoutes();
+		int routeId = table->trie.find(topic);
+		if (routeId >= 0)
+		{
+			TopicRoute& route = *table->routes[routeId];
+			route.subscribeMsgId = result;
+			route.subscribeIndex = 0;
+			route.grantedQos = grantedQos;
+		}
+
+		if (--_subscribesInProgress == 0)
+			_earlySubscribeAckCount = 0;
+	}
+
+	if (result >= 0)
+		ESP32_MQTT_LOG(Subscribe, Debug, "Subscribed to topic: %s, qos: %d", topic, qos);
+	else if (result == -1)
+		ESP32_MQTT_LOG(Subscribe, Error, "Subscribe failed");
+	else if (result == -2)
+		ESP32_MQTT_LOG(Subscribe, Error, "Subscribe failed, out buffer full");
+
+	return result;
+}
+
+/// <summary>
+/// Subscribes to the topic filter and routes the matching messages to the handler. Messages which don't match any
+/// filter subscribed with a handler are passed to the onMqttMessageReceived callback.
+/// The handler stays registered even if the subscribe message couldn't be sent.
+/// </summary>
+/// <returns>message_id of the subscribe message on success. -1 on failure or invalid filter, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::subscribe(const char* topic, int qos, ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback handler)
+{
+	std::shared_ptr<TopicRoute> route = createTopicRoute(topic, qos);
+	if (!route)
+	{
+		ESP32_MQTT_LOG(Subscribe, Error, "Invalid topic filter '%s'", topic);
+		return -1;
+	}
+	route->handler = handler;
+	setTopicRoute(route, false);
+
+	if (_retainedStore.getCount() > 0)
+		replayRetainedMessages(topic, handler);
+	return sendSubscribe(topic, qos);
+}
+
+/// <summary>
+/// Subscribes to the topic filter and passes the matching messages to the sink as they arrive: begin() with the total
+/// length, write() for every chunk esp-mqtt receives (up to the in packet size), end() once the message is complete.
+/// The sink is called from the MQTT task, the messages skip reassembly, decompression and the dispatch queue. The
+/// digest is computed over the chunks on the way, verify decides with it whether the sink ends with ok. Nothing is
+/// buffered, so the message size is only limited by the sink, which must stay valid as long as the subscription.
+/// A segmented subscription joins the segments of publishStream() into one stream, messages to other topics may come
+/// between them.
+/// </summary>
+/// <returns>message_id of the subscribe message on success. -1 on failure or invalid filter, -2 in case of full outbox.</returns>
+int ESP32_MQTTClient::subscribeStream(const char* topic, int qos, ESP32_MQTTStreamSink* sink, ESP32_MQTTStreamDigest digest, ESP32_MQTTCallbacks::OnMqttStreamVerifyCallback verify, bool segmented)
+{
+	std::shared_ptr<TopicRoute> route = sink != nullptr ? createTopicRoute(topic, qos) : nullptr;
+	if (!route)
+	{
+		ESP32_MQTT_LOG(Subscribe, Error, "Invalid topic filter '%s' or no sink", topic);
+		return -1;
+	}
+
+	route->streamSink = sink;
+	route->streamDigest = digest;
+	route->streamVerify = verify;
+	route->streamSegmented = segmented;
+	setTopicRoute(route, false);
+	return sendSubscribe(topic, qos);
+}
+
+/// <summary>
+/// Delivers the stored retained messages matching the topic filter to a new handler, in the calling task. The broker
+/// sends them again after the SUBSCRIBE, so the handler may get a value twice.
+/// </summary>
+void ESP32_MQTTClient::replayRetainedMessages(const char* topicFilter, ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback& handler)
+{
+	// subscribe() may be called from several tasks, each replay gets its own buffer
+	uint8_t* buf = (uint8_t*)malloc(_retainedStore.getMaxMessageSize() + 1);
+	if (buf == nullptr)
+		return;
+	_retainedStore.forEachMatching(topicFilter, buf, replayRetainedMessageStatic, &handler);
+	free(buf);
+}
+
+void ESP32_MQTTClient::replayRetainedMessageStatic(char* topic, int topicLen, char* payload, int length, void* context)
+{
+	ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback& handler = *static_cast<ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback*>(context);
+	handler(0, topic, topicLen, payload, length, 0, length, true, 0, false);
+}
+
+int ESP32_MQTTClient::getRetainedMessage(const char* topic, uint8_t* buf, size_t bufSize)
+{
+	return _retainedStore.get(topic, buf, bufSize);
+}
+
+/// <summary>
+/// Deadband of the first filter set with setRetainedDeadband() matching the topic.
+/// </summary>
+/// <returns>the deadband, 0 if no filter matches</returns>
+float ESP32_MQTTClient::getRetainedDeadband(const char* topic)
+{
+	if (_retainedDeadbandTrie.getCount() == 0)
+		return 0;
+
+	int index = -1;
+	_retainedDeadbandTrie.match(topic, strlen(topic), [](int routeId, void* context) {
+		int& index = *static_cast<int*>(context);
+		if (index < 0 || routeId < index)
+			index = routeId;
+	}, &index);
+	return index >= 0 ? _retainedDeadbands[index] : 0;
+}
+
+int ESP32_MQTTClient::unsubscribe(const char* topic)
+{
+	removeTopicRoute(topic);
+
+	if (_mqttClient == NULL) {
+		ESP32_MQTT_LOG(Subscribe, Error, "MQTT client is null, can't unsubscribe, use createClient() to create a client first");
+		return -1;
+	}
+	ESP32_MQTT_LOG(Subscribe, Debug, "Unsubscribing from topic '%s'", topic);
+
+	ESP32_MQTT_TRACE_START(traceStartUs);
+	int result = esp_mqtt_client_unsubscribe(_mqttClient, topic);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Unsubscribe, result, 0, traceStartUs);
+
+	if (result >= 0)
+		ESP32_MQTT_LOG(Subscribe, Debug, "Unsubscribed from topic: %s", topic);
+	else if (result == -1)
+		ESP32_MQTT_LOG(Subscribe, Error, "Unsubscribe failed");
+	else if (result == -2)
+		ESP32_MQTT_LOG(Subscribe, Error, "Unsubscribe failed, out buffer full");
+
+	return result;
+}
+
+ESP32_MQTTMetricsSnapshot ESP32_MQTTClient::getMetrics()
+{
+	ESP32_MQTTMetricsSnapshot snapshot;
+	_metrics.snapshot(snapshot);
+	snapshot.outboxSize = getOutboxBufferSize();
+	return snapshot;
+}
+
+void ESP32_MQTTClient::resetMetrics()
+{
+	_metrics.reset();
+}
+
+void ESP32_MQTTClient::enableMetricsPublishing(const char* topic, unsigned long intervalMs)
+{
+	const char* stored = storeString(topic);
+	if (stored == nullptr)
+	{
+		log_e("Can't store the metrics topic, metrics are not published");
+		return;
+	}
+	_metricsTopic = stored;
+	_metricsIntervalMs = intervalMs;
+	_nextMetricsPublishMillis = millis() + intervalMs;
+	startHousekeeping();
+}
+
+void ESP32_MQTTClient::publishMetrics()
+{
+	const size_t bufSize = 1024;
+	char* buf = (char*)malloc(bufSize);
+	if (buf == nullptr)
+		return;
+
+	ESP32_MQTTMetricsSnapshot snapshot = getMetrics();
+	int len = ESP32_MQTTMetrics::toJson(snapshot, buf, bufSize);
+	if (len > 0 && (size_t)len < bufSize)
+		enqueue(_metricsTopic, (const uint8_t*)buf, len, 0, false, true);
+	free(buf);
+}
+
+/// <summary>
+/// Starts the periodic timer which drives the periodic work (metrics publishing, ...). It runs in the esp_timer task.
+/// </summary>
+bool ESP32_MQTTClient::startHousekeeping()
+{
+	if (_housekeepingTimer != nullptr)
+		return true;
+
+	if (xTaskCreatePinnedToCore(housekeepingTaskStatic, "mqtt_housekeeping", _housekeepingTaskStackSize, this, _housekeepingTaskPriority, &_housekeepingTask, _housekeepingTaskCoreId) != pdPASS)
+	{
+		log_e("Can't create MQTT housekeeping task");
+		_housekeepingTask = nullptr;
+		return false;
+	}
+	ESP32_MQTT_TRACE_TASK_NAME(_housekeepingTask, "housekeeping");
+
+	esp_timer_create_args_t timerArgs = {};
+	timerArgs.callback = housekeepingTimerStatic;
+	timerArgs.arg = this;
+	timerArgs.name = "mqtt_housekeeping";
+	if (esp_timer_create(&timerArgs, &_housekeepingTimer) != ESP_OK)
+	{
+		log_e("Can't create MQTT housekeeping timer");
+		_housekeepingTimer = nullptr;
+		vTaskDelete(_housekeepingTask);
+		_housekeepingTask = nullptr;
+		return false;
+	}
+
+	esp_timer_start_periodic(_housekeepingTimer, ESP32_MQTTCLIENT_HOUSEKEEPING_INTERVAL_MS * 1000);
+	return true;
+}
+
+/// <summary>
+/// Moves stored messages to the esp-mqtt outbox, at most _outboxReplayRate messages per second so reconnect doesn't flood the socket.
+/// Messages published while connected are stored behind the backlog to keep the order. They don't count against the rate,
+/// otherwise live traffic would stay in the log as long as anything is published. An append() with DropOldest may evict
+/// the peeked message while it is enqueued, popIfHead() then leaves the next one in the log.
+/// </summary>
+void ESP32_MQTTClient::replayPersistentOutbox(unsigned long now)
+{
+	unsigned long elapsed = now - _lastOutboxReplayMillis;
+	_lastOutboxReplayMillis = now;
+
+	if (!_isConnected || _persistentOutbox->getCount() == 0)
+	{
+		_outboxReplayCredit = 0;
+		_outboxLiveCount = 0;
+		return;
+	}
+
+	// burst of at most one second worth of messages
+	_outboxReplayCredit += elapsed * _outboxReplayRate;
+	if (_outboxReplayCredit > _outboxReplayRate * 1000UL)
+		_outboxReplayCredit = _outboxReplayRate * 1000UL;
+
+	ESP32_MQTTStoredMessage message;
+	while ((_outboxReplayCredit >= 1000 || _outboxLiveCount > 0) && _persistentOutbox->peek(message))
+	{
+		if (enqueue(message.topic, message.payload, message.length, message.qos, message.retain, true) < 0)
+			break;	// outbox full, try again later
+		_persistentOutbox->popIfHead(message.sequence);
+		if (_outboxLiveCount > 0)
+			_outboxLiveCount--;
+		else
+			_outboxReplayCredit -= 1000;
+	}
+}
+
+/// <summary>
+/// Schedules the next connection attempt after a disconnect or a failed attempt, esp-mqtt reports both as MQTT_EVENT_DISCONNECTED.
+/// </summary>
+void ESP32_MQTTClient::scheduleReconnect()
+{
+	unsigned long now = millis();
+	_mqttReconnectionAttemptDelay = _reconnectPolicy->nextDelay(now);
+	_nextMqttConnectionAttemptMillis = now + _mqttReconnectionAttemptDelay;
+	_reconnectScheduled.store(true, std::memory_order_release);
+
+	ESP32_MQTT_LOG(Connection, Info, "Reconnecting in %u ms (attempt %u)", (unsigned int)_mqttReconnectionAttemptDelay, (unsigned int)_reconnectPolicy->getAttemptCount());
+}
+
+void ESP32_MQTTClient::housekeepingTimerStatic(void* arg)
+{
+	xTaskNotifyGive(static_cast<ESP32_MQTTClient*>(arg)->_housekeepingTask);
+}
+
+void ESP32_MQTTClient::housekeepingTaskStatic(void* arg)
+{
+	ESP32_MQTTClient* client = static_cast<ESP32_MQTTClient*>(arg);
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		client->housekeeping();
+	}
+}
+
+/// <summary>
+/// Periodic work, run by the housekeeping task: it reconnects, calls the handlers of expired in-flight publishes,
+/// writes to the flash and the esp-mqtt outbox, all of which may block or take long in the esp_timer task.
+/// </summary>
+void ESP32_MQTTClient::housekeeping()
+{
+	unsigned long now = millis();
+
+	if (_reconnectScheduled.load(std::memory_order_acquire) && (long)(now - _nextMqttConnectionAttemptMillis) >= 0)
+	{
+		_reconnectScheduled = false;
+		reconnect();
+	}
+
+	if (_inflight.getCount() > 0)
+		_inflight.expire();
+
+	if (_persistentOutbox != nullptr)
+		replayPersistentOutbox(now);
+
+	if (_metricsTopic != nullptr && (long)(now - _nextMetricsPublishMillis) >= 0)
+	{
+		_nextMetricsPublishMillis = now + _metricsIntervalMs;
+		if (_isConnected)
+			publishMetrics();
+	}
+}
+
+void ESP32_MQTTClient::healthTaskStatic(void* arg)
+{
+	static_cast<ESP32_MQTTClient*>(arg)->healthTask();
+}
+
+/// <summary>
+/// Publishes a probe and waits for its echo, the MQTT task notifies this task when it arrives. The publish may block
+/// on a stalled socket, that time counts towards the timeout. A lost probe is followed by the next one right away, so
+/// a dead link is found within about deadAfterLosses probe timeouts. The link is then given up on: the client disconnects
+/// and fails over to the next broker uri, if any, on the DISCONNECTED event, the reconnect follows the usual path.
+/// The failover is left to the MQTT task, the only one changing the uri while the client runs.
+/// </summary>
+void ESP32_MQTTClient::healthTask()
+{
+	while (true)
+	{
+		if (!_isConnected)
+		{
+			// woken up on MQTT_EVENT_CONNECTED
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_health.getProbeInterval()));
+			continue;
+		}
+
+		uint8_t probe[ESP32_MQTT_HEALTH_PROBE_SIZE];
+		unsigned long startMillis = millis();
+		ulTaskNotifyTake(pdTRUE, 0);
+		_health.startProbe(micros(), probe);
+		if (esp_mqtt_client_publish(_mqttClient, _healthProbeTopic, (const char*)probe, sizeof(probe), 0, 0) < 0 && !_isConnected)
+		{
+			_health.cancelProbe();
+			continue;
+		}
+
+		unsigned long elapsed;
+		while (_health.isProbeOutstanding() && (elapsed = millis() - startMillis) < _health.getProbeTimeout())
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_health.getProbeTimeout() - elapsed));
+		bool lost = _health.probeTimedOut();
+
+		ESP32_MQTTLinkHealth health = _health.getHealth();
+		if (health != _reportedHealth)
+		{
+			_reportedHealth = health;
+			ESP32_MQTT_LOG(Connection, Info, "Link health %d, rtt %u ms, rttvar %u ms, %u probes lost", (int)health, (unsigned int)(_health.getSmoothedRttUs() / 1000), (unsigned int)(_health.getRttVarianceUs() / 1000), _health.getConsecutiveLostProbes());
+			if (_onMqttHealthChangedCallback)
+				_onMqttHealthChangedCallback(health, _health.getSmoothedRttUs() / 1000);
+		}
+
+		if (health == ESP32_MQTTLinkHealth::Dead && _isConnected)
+		{
+			ESP32_MQTT_LOG(Connection, Warning, "No probe answered in %u ms, dropping the connection", (unsigned int)(millis() - startMillis));
+			_healthFailoverPending = true;
+			esp_mqtt_client_disconnect(_mqttClient);
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_health.getProbeInterval()));
+			continue;
+		}
+
+		if (!lost)
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_health.getProbeInterval()));
+	}
+}
+
+bool ESP32_MQTTClient::isHealthProbe(const esp_mqtt_event_t* event)
+{
+	return event->topic_len == (int)_healthProbeTopicLen && memcmp(event->topic, _healthProbeTopic, _healthProbeTopicLen) == 0;
+}
+
+/// <summary>
+/// Switches to the best other broker uri, which is used from the next connection attempt on.
+/// </summary>
+/// <returns>false if there is no other broker uri</returns>
+bool ESP32_MQTTClient::failover()
+{
+	int index = _health.selectFailover(millis());
+	if (index < 0)
+		return false;
+
+	_mqttUri = _health.getUri(index);
+	_mqttConfig.broker.address.uri = _mqttUri;
+	if (_mqttClient != nullptr)
+		esp_mqtt_client_set_uri(_mqttClient, _mqttUri);
+	_failoverCount++;
+	ESP32_MQTT_LOG(Connection, Warning, "Failing over to %s, rtt measured before: %u ms", _mqttUri, (unsigned int)(_health.getUriRttUs(index) / 1000));
+	return true;
+}
+
+void ESP32_MQTTClient::printError(esp_mqtt_error_codes_t* error_handle)
+{
+	switch (error_handle->error_type)
+	{
+	case MQTT_ERROR_TYPE_NONE:
+		ESP32_MQTT_LOG(Connection, Debug, "Error Type: MQTT_ERROR_TYPE_NONE");
+		break;
+
+	case MQTT_ERROR_TYPE_TCP_TRANSPORT:
+	{
+		auto espTransportSockErrNoToStr = [](int espTransportSockErrNo) -> const char* {
+			switch (espTransportSockErrNo) {
+			case MQTT_ERROR_TYPE_NONE:
+				return "MQTT_ERROR_TYPE_NONE";
+			case MQTT_ERROR_TYPE_TCP_TRANSPORT:
+				return "MQTT_ERROR_TYPE_TCP_TRANSPORT";
+			case MQTT_ERROR_TYPE_CONNECTION_REFUSED:
+				return "MQTT_ERROR_TYPE_CONNECTION_REFUSED";
+			default:
+				return "Unknown esp transport sock err no";
+			}
+		};
+
+		ESP32_MQTT_LOG(Connection, Debug, "Error Type: MQTT_ERROR_TYPE_TCP_TRANSPORT");
+		ESP32_MQTT_LOG(Connection, Debug, "Last error code reported from esp-tls: %s (0x%x)", esp_err_to_name(error_handle->esp_tls_last_esp_err), error_handle->esp_tls_last_esp_err);
+		ESP32_MQTT_LOG(Connection, Debug, "Last tls stack error number: 0x%x (%s)", error_handle->esp_tls_stack_err, strerror(error_handle->esp_tls_stack_err));
+		ESP32_MQTT_LOG(Connection, Debug, "Last captured esp transport sock errno : %s (%d) (%s)", espTransportSockErrNoToStr(error_handle->esp_transport_sock_errno), error_handle->esp_transport_sock_errno, strerror(error_handle->esp_transport_sock_errno));
+		break;
+	}
+
+	case MQTT_ERROR_TYPE_CONNECTION_REFUSED:
+	{
+
+		auto connectReturnCodeToStr = [](int connectReturnCode) -> const char* {
+			switch (connectReturnCode)
+			{
+			case MQTT_CONNECTION_ACCEPTED:
+				return "MQTT_CONNECTION_ACCEPTED";
+			case MQTT_CONNECTION_REFUSE_PROTOCOL:
+				return "MQTT_CONNECTION_REFUSE_PROTOCOL";
+			case MQTT_CONNECTION_REFUSE_ID_REJECTED:
+				return "MQTT_CONNECTION_REFUSE_ID_REJECTED";
+			case MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE:
+				return "MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE";
+			case MQTT_CONNECTION_REFUSE_BAD_USERNAME:
+				return "MQTT_CONNECTION_REFUSE_BAD_USERNAME";
+			case MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED:
+				return "MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED";
+			default:
+				return "Unknown connect return code";
+			}
+		};
+
+		ESP32_MQTT_LOG(Connection, Debug, "Error type: MQTT_ERROR_TYPE_CONNECTION_REFUSED");
+		ESP32_MQTT_LOG(Connection, Debug, "Connection refused error: %s (0x%x)", connectReturnCodeToStr(error_handle->connect_return_code), error_handle->connect_return_code);
+		break;
+	}
+
+	default:
+		ESP32_MQTT_LOG(Connection, Debug, "Error type: Unknown (0x%x)", error_handle->error_type);
+		break;
+	}
+}
+
+bool ESP32_MQTTClient::createClient()
+{
+	ESP32_MQTT_LOG(Connection, Debug, "MQTT client init");
+
+	esp_err_t result;
+
+	if (_mqttUri == nullptr)
+	{
+		ESP32_MQTT_LOG(Connection, Error, "MQTT Broker server URI is not set, aborting connect");
+		return false;
+	}
+
+	if (_reassemblyMaxMessageSize > 0 && !_reassemblyPool->isInitialized())
+	{
+		if (!_reassemblyPool->init(_reassemblyMaxMessageSize, _reassemblyBufferCount))
+			return false;
+	}
+
+	if (_inflightCapacity > 0 && !_inflight.isInitialized())
+	{
+		if (!_inflight.init(_inflightCapacity) || !startHousekeeping())
+			return false;
+	}
+
+	if (_compressionTrie.getCount() > 0 && _compressBuf == nullptr)
+	{
+		_compressBufSize = ESP32_MQTTCompressor::getMaxCompressedSize(_compressionMaxMessageSize);
+		_compressBuf = (uint8_t*)malloc(_compressBufSize);
+		_decompressBuf = (uint8_t*)malloc(_compressionMaxMessageSize);
+		if (_compressBuf == nullptr || _decompressBuf == nullptr || !_compressor.init())
+		{
+			log_e("Can't allocate compression buffers for messages of %u bytes", _compressionMaxMessageSize);
+			free(_compressBuf);
+			free(_decompressBuf);
+			_compressBuf = nullptr;
+			_decompressBuf = nullptr;
+			return false;
+		}
+	}
+
+	if (_retainedCacheCapacity > 0 && !_retainedCache.isInitialized())
+	{
+		if (!_retainedCache.init(_retainedCacheCapacity, _retainedRefreshIntervalMs))
+			return false;
+	}
+
+	if (_retainedStoreCapacity > 0 && !_retainedStore.isInitialized())
+	{
+		if (!_retainedStore.init(_retainedStoreCapacity, _retainedStoreMaxMessageSize))
+			return false;
+	}
+
+	if (_publishClasses[0].queueCapacity > 0 && _publishTask == nullptr)
+	{
+		for (size_t i = 0; i < _publishClassCount; i++)
+		{
+			if (!_publishClasses[i].queue.init(_publishClasses[i].queueCapacity, _publishQueueSlotSize))
+				return false;
+		}
+
+		if (xTaskCreatePinnedToCore(publishTaskStatic, "mqtt_publish", _publishTaskStackSize, this, _publishTaskPriority, &_publishTask, _publishTaskCoreId) != pdPASS)
+		{
+			log_e("Can't create MQTT publish task");
+			_publishTask = nullptr;
+			for (size_t i = 0; i < _publishClassCount; i++)
+				_publishClasses[i].queue.deinit();
+			return false;
+		}
+		ESP32_MQTT_TRACE_TASK_NAME(_publishTask, "publish");
+	}
+
+	if (_dispatchQueueCapacity > 0 && !_eventQueue.isInitialized())
+	{
+		// topic and data of one event fit into the in buffer
+		size_t slotSize = _dispatchQueueSlotSize > 0 ? _dispatchQueueSlotSize : _mqttMaxInPacketSize;
+		if (!_eventQueue.init(_dispatchQueueCapacity, slotSize))
+			return false;
+
+		// the dispatch task of a connection manager is set already
+		if (!_dispatchTaskShared && xTaskCreatePinnedToCore(dispatchTaskStatic, "mqtt_dispatch", _dispatchTaskStackSize, this, _dispatchTaskPriority, &_dispatchTask, _dispatchTaskCoreId) != pdPASS)
+		{
+			log_e("Can't create MQTT dispatch task");
+			_dispatchTask = nullptr;
+			_eventQueue.deinit();
+			return false;
+		}
+		if (!_dispatchTaskShared)
+			ESP32_MQTT_TRACE_TASK_NAME(_dispatchTask, "dispatch");
+	}
+
+	if (_healthProbeTopic != nullptr && _healthTask == nullptr)
+	{
+		if (xTaskCreatePinnedToCore(healthTaskStatic, "mqtt_health", _healthTaskStackSize, this, _healthTaskPriority, &_healthTask, _healthTaskCoreId) != pdPASS)
+		{
+			log_e("Can't create MQTT health monitor task");
+			_healthTask = nullptr;
+			return false;
+		}
+		ESP32_MQTT_TRACE_TASK_NAME(_healthTask, "health");
+	}
+
+	// get client from IDF mqtt_client lib
+	_mqttClient = esp_mqtt_client_init(&_mqttConfig);
+
+	if (_mqttClient == NULL) {
+		ESP32_MQTT_LOG(Connection, Error, "MQTT client init failed");
+		return false;
+	}
+
+	ESP32_MQTT_LOG(Connection, Debug, "MQTT client register events");
+
+	// register callback to handle events from client
+	result = esp_mqtt_client_register_event(_mqttClient, MQTT_EVENT_ANY, ESP32_MQTTClient::handleMqttEventStatic, this);
+	ESP32_MQTT_LOG(Connection, Debug, "MQTT client register events result: %d (%s)", (int)result, esp_err_to_name(result));
+
+	return result == ESP_OK;
+}
+
+bool ESP32_MQTTClient::start()
+{
+	if (_mqttClient == NULL) {
+		ESP32_MQTT_LOG(Connection, Debug, "MQTT client is null, creating new client");
+		if (!createClient()) {
+			return false;
+		}
+	}
+
+	// start the client and it's loop
+	ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::Start, 0, 0);
+	esp_err_t result = esp_mqtt_client_start(_mqttClient);
+
+	ESP32_MQTT_LOG(Connection, Info, "MQTT client start result: %d (%s)", (int)result, esp_err_to_name(result));
+	
+	return result == ESP_OK;
+}
+
+bool ESP32_MQTTClient::reconnect() {
+	if (_mqttClient == NULL) {
+		log_e("MQTT client is null, can't reconnect, use createClient() to create a client first");
+		return false;
+	}
+
+	ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::Reconnect, 0, 0);
+	esp_err_t result = esp_mqtt_client_reconnect(_mqttClient);
+
+	ESP32_MQTT_LOG(Connection, Info, "MQTT client reconnect result: %d (%s)", (int)result, esp_err_to_name(result));
+
+	return result == ESP_OK;
+}
+
+bool ESP32_MQTTClient::stop() {
+	if (_mqttClient == NULL) {
+		log_e("MQTT client is null, can't stop, use createClient() to create a client first");
+		return false;
+	}
+
+	_reconnectScheduled = false;
+	ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::Stop, 0, 0);
+	esp_err_t result = esp_mqtt_client_stop(_mqttClient);
+	ESP32_MQTT_LOG(Connection, Info, "MQTT client stop result: %d (%s)", (int)result, esp_err_to_name(result));
+
+	return result == ESP_OK;
+}
+
+bool ESP32_MQTTClient::disconnect() {
+	if (_mqttClient == NULL) {
+		log_e("MQTT client is null, can't disconnect, use createClient() to create a client first");
+		return false;
+	}
+
+	ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::Disconnect, 0, 0);
+	esp_err_t result = esp_mqtt_client_disconnect(_mqttClient);
+	
+	ESP32_MQTT_LOG(Connection, Info, "MQTT client disconnect result: %d (%s)", (int)result, esp_err_to_name(result));
+	
+	return result == ESP_OK;
+}
+
+ESP32_MQTTClient::TopicRoute::TopicRoute(const char* filter, int qos)
+{
+	this->filter = strdup(filter);
+	this->qos = qos;
+	handler = nullptr;
+	subscribeMsgId = -1;
+	subscribeIndex = 0;
+	grantedQos = -1;
+	streamSink = nullptr;
+	streamDigest = ESP32_MQTTStreamDigest::None;
+	streamVerify = nullptr;
+	streamSegmented = false;
+}
+
+ESP32_MQTTClient::TopicRoute::~TopicRoute()
+{
+	free(filter);
+}
+
+/// <summary>
+/// Creates a route for the topic filter, to be filled in and passed to setTopicRoute().
+/// </summary>
+/// <returns>the route, nullptr for an invalid filter or when out of memory</returns>
+std::shared_ptr<ESP32_MQTTClient::TopicRoute> ESP32_MQTTClient::createTopicRoute(const char* filter, int qos)
+{
+	if (filter == nullptr || !ESP32_MQTTTopicTrie::isValidFilter(filter))
+		return nullptr;
+	std::shared_ptr<TopicRoute> route = std::make_shared<TopicRoute>(filter, qos);
+	return route->filter != nullptr ? route : nullptr;
+}
+
+/// <summary>
+/// Adds the route or replaces the one of the same filter by publishing a new route table. The subscription state of a
+/// replaced route is carried over, keepHandler also keeps its handler and stream sink (subscribe() without a handler).
+/// Messages being dispatched finish with the table they started with.
+/// </summary>
+void ESP32_MQTTClient::setTopicRoute(const std::shared_ptr<TopicRoute>& route, bool keepHandler)
+{
+	std::lock_guard<std::mutex> lock(_topicRouteMutex);
+	TopicRouteTablePtr current = loadTopicRoutes();
+	std::shared_ptr<TopicRouteTable> table = std::make_shared<TopicRouteTable>();
+	table->routes.reserve(current->routes.size() + 1);
+	bool replaced = false;
+	for (const std::shared_ptr<TopicRoute>& existing : current->routes)
+	{
+		if (strcmp(existing->filter, route->filter) != 0)
+		{
+			table->routes.push_back(existing);
+			continue;
+		}
+		// in its old place, the route found first by findStreamRoute() stays the same
+		table->routes.push_back(route);
+		replaced = true;
+		route->subscribeMsgId = existing->subscribeMsgId.load();
+		route->subscribeIndex = existing->subscribeIndex.load();
+		route->grantedQos = existing->grantedQos.load();
+		if (keepHandler)
+		{
+			route->handler = existing->handler;
+			route->streamSink = existing->streamSink;
+			route->streamDigest = existing->streamDigest;
+			route->streamVerify = existing->streamVerify;
+			route->streamSegmented = existing->streamSegmented;
+		}
+	}
+	if (!replaced)
+		table->routes.push_back(route);
+	publishTopicRoutes(table);
+}
+
+void ESP32_MQTTClient::removeTopicRoute(const char* filter)
+{
+	std::lock_guard<std::mutex> lock(_topicRouteMutex);
+	TopicRouteTablePtr current = loadTopicRoutes();
+	if (current->trie.find(filter) < 0)
+		return;
+
+	std::shared_ptr<TopicRouteTable> table = std::make_shared<TopicRouteTable>();
+	table->routes.reserve(current->routes.size());
+	for (const std::shared_ptr<TopicRoute>& existing : current->routes)
+	{
+		if (strcmp(existing->filter, filter) != 0)
+			table->routes.push_back(existing);
+	}
+	publishTopicRoutes(table);
+}
+
+/// <summary>
+/// Indexes the routes of a new table and makes it the current one. The replaced table (and a removed route) is freed
+/// when the last task matching against it lets go of it.
+/// </summary>
+void ESP32_MQTTClient::publishTopicRoutes(const std::shared_ptr<TopicRouteTable>& table)
+{
+	table->streamRouteCount = 0;
+	for (size_t routeId = 0; routeId < table->routes.size(); routeId++)
+	{
+		table->trie.insert(table->routes[routeId]->filter, routeId);
+		if (table->routes[routeId]->streamSink != nullptr)
+			table->streamRouteCount++;
+	}
+	_streamRouteCount = table->streamRouteCount;
+	std::atomic_store(&_topicRoutes, TopicRouteTablePtr(table));
+}
+
+void ESP32_MQTTClient::dispatchTopicRouteStatic(int routeId, void* context)
+{
+	TopicRouteDispatch* dispatch = static_cast<TopicRouteDispatch*>(context);
+	const esp_mqtt_event_t* event = dispatch->event;
+	const TopicRoute& route = *dispatch->table->routes[routeId];
+	if (route.handler) {
+		dispatch->handled++;
+		route.handler(event->msg_id, dispatch->topic, dispatch->topicLen, event->data, event->data_len, event->current_data_offset, event->total_data_len, event->retain, event->qos, event->dup);
+	}
+}
+
+/// <summary>
+/// Passes the received message (chunk) to the handlers of all matching topic filters.
+/// </summary>
+/// <returns>true if at least one handler was called</returns>
+bool ESP32_MQTTClient::dispatchTopicRoutes(const esp_mqtt_event_t* event)
+{
+	// the table stays valid while the handlers run, even if one of them unsubscribes
+	TopicRouteTablePtr table = loadTopicRoutes();
+	if (table->routes.empty())
+		return false;
+
+	// only the first chunk of a fragmented message carries the topic, remember it for the following chunks
+	if (event->topic != nullptr && event->topic_len > 0)
+	{
+		if (event->topic_len >= _dispatchTopicBufSize)
+		{
+			char* buf = (char*)realloc(_dispatchTopicBuf, event->topic_len + 1);
+			if (buf == nullptr)
+				return false;
+			_dispatchTopicBuf = buf;
+			_dispatchTopicBufSize = event->topic_len + 1;
+		}
+		memcpy(_dispatchTopicBuf, event->topic, event->topic_len);
+		_dispatchTopicBuf[event->topic_len] = '\0';
+		_dispatchTopicLen = event->topic_len;
+	}
+	else if (event->current_data_offset == 0)
+	{
+		_dispatchTopicLen = 0;
+	}
+
+	if (_dispatchTopicLen == 0)
 		return false;
+
+	TopicRouteDispatch dispatch = { table.get(), event, _dispatchTopicBuf, _dispatchTopicLen, 0 };
+	table->trie.match(_dispatchTopicBuf, _dispatchTopicLen, dispatchTopicRouteStatic, &dispatch);
+	return dispatch.handled > 0;
+}
+
+/// <summary>
+/// Subscribes to all remembered topic filters, packing as many filters into one SUBSCRIBE packet as the out buffer allows.
+/// </summary>
+void ESP32_MQTTClient::restoreSubscriptions()
+{
+	_pendingResubscribeAcks = 0;
+	_resubscribeFailedCount = 0;
+	// the filters of the table stay valid while they are being subscribed, even if another task unsubscribes
+	TopicRouteTablePtr table = loadTopicRoutes();
+	if (table->routes.empty())
+		return;
+
+	ESP32_MQTT_LOG(Subscribe, Info, "Restoring %u subscriptions", (unsigned int)table->routes.size());
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+	// fixed header (up to 5 bytes) + packet identifier
+	const int packetOverhead = 7;
+	size_t routeIndex = 0;
+	while (routeIndex < table->routes.size())
+	{
+		_resubscribeTopics.clear();
+		size_t firstRouteIndex = routeIndex;
+		int packetSize = packetOverhead;
+		for (; routeIndex < table->routes.size(); routeIndex++)
+		{
+			TopicRoute& route = *table->routes[routeIndex];
+
+			// length prefix + filter + requested qos
+			int filterSize = 2 + strlen(route.filter) + 1;
+			if (!_resubscribeTopics.empty() && packetSize + filterSize > _mqttMaxOutPacketSize)
+				break;
+
+			packetSize += filterSize;
+			route.subscribeIndex = _resubscribeTopics.size();
+			route.grantedQos = -1;
+			_resubscribeTopics.push_back({ route.filter, route.qos });
+		}
+
+		if (_resubscribeTopics.empty())
+			break;
+
+		int result = esp_mqtt_client_subscribe_multiple(_mqttClient, _resubscribeTopics.data(), _resubscribeTopics.size());
+		_metrics.recordSubscribe(result);
+		ESP32_MQTT_LOG(Subscribe, Debug, "Resubscribe of %u topics, %d bytes, result: %d", (unsigned int)_resubscribeTopics.size(), packetSize, result);
+
+		for (size_t i = firstRouteIndex; i < routeIndex; i++)
+			table->routes[i]->subscribeMsgId = result;
+		if (result >= 0)
+			_pendingResubscribeAcks++;
+		else
+			_resubscribeFailedCount += _resubscribeTopics.size();
+	}
+#else
+	// esp-mqtt before ESP-IDF 5.1 sends only single topic SUBSCRIBE packets
+	for (const std::shared_ptr<TopicRoute>& route : table->routes)
+	{
+		int result = sendSubscribe(route->filter, route->qos);
+		if (result >= 0)
+			_pendingResubscribeAcks++;
+		else
+			_resubscribeFailedCount++;
 	}
+#endif
+
+	if (_pendingResubscribeAcks == 0 && _onMqttSubscriptionsRestoredCallback)
+		_onMqttSubscriptionsRestoredCallback(0, _resubscribeFailedCount);
+}
 
-	// get client from IDF mqtt_client lib
-	_mqttClient = esp_mqtt_client_init(&_mqttConfig);
+/// <summary>
+/// Stores the return codes of a SUBACK to the subscribed filters and reports when all restored subscriptions were acknowledged.
+/// </summary>
+void ESP32_MQTTClient::handleSubscribeAck(const esp_mqtt_event_t* event)
+{
+	TopicRouteTablePtr table = loadTopicRoutes();
+	bool isKnownPacket = false;
+	int failedCount = 0;
+	std::unique_lock<std::mutex> lock(_subscribeAckMutex);
+	for (const std::shared_ptr<TopicRoute>& route : table->routes)
+	{
+		if (route->subscribeMsgId != event->msg_id)
+			continue;
+
+		isKnownPacket = true;
+		// the SUBACK payload holds one return code per filter, 0x80 (MQTT 3.1.1) or >= 0x80 (MQTT 5) is a failure
+		int subscribeIndex = route->subscribeIndex;
+		int grantedQos = event->data != nullptr && subscribeIndex < event->data_len ? (uint8_t)event->data[subscribeIndex] : 0x80;
+		route->grantedQos = grantedQos;
+		if (grantedQos >= 0x80)
+			failedCount++;
+	}
 
-	if (_mqttClient == NULL) {
-		if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			log_d("MQTT client init failed");
-		return false;
+	// kept only while a sendSubscribe() waits for its msg_id, so a stale entry can't match a reused msg_id later
+	if (!isKnownPacket && _subscribesInProgress > 0 && _earlySubscribeAckCount < MaxEarlySubscribeAcks)
+	{
+		int grantedQos = event->data != nullptr && event->data_len > 0 ? (uint8_t)event->data[0] : 0x80;
+		_earlySubscribeAcks[_earlySubscribeAckCount++] = { event->msg_id, grantedQos };
 	}
+	lock.unlock();
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client register events");
+	if (!isKnownPacket || _pendingResubscribeAcks == 0)
+		return;
 
-	// register callback to handle events from client
-	result = esp_mqtt_client_register_event(_mqttClient, MQTT_EVENT_ANY, ESP32_MQTTClient::handleMqttEventStatic, this);
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client register events result: %d (%s)", result, esp_err_to_name(result));
+	_resubscribeFailedCount += failedCount;
+	if (--_pendingResubscribeAcks == 0)
+	{
+		failedCount = _resubscribeFailedCount;
+		int subscribedCount = 0;
+		for (const std::shared_ptr<TopicRoute>& route : table->routes)
+		{
+			int grantedQos = route->grantedQos;
+			if (grantedQos >= 0 && grantedQos < 0x80)
+				subscribedCount++;
+		}
 
-	return result == ESP_OK;
+		ESP32_MQTT_LOG(Subscribe, Info, "Subscriptions restored: %d, failed: %d", subscribedCount, failedCount);
+		if (_onMqttSubscriptionsRestoredCallback)
+			_onMqttSubscriptionsRestoredCallback(subscribedCount, failedCount);
+	}
 }
 
-bool ESP32_MQTTClient::start()
+/// <summary>
+/// Return code of the SUBACK for the topic filter.
+/// </summary>
+/// <returns>the granted qos, 0x80 on failure, -1 if not subscribed or not acknowledged (yet)</returns>
+int ESP32_MQTTClient::getSubscriptionGrantedQos(const char* topic)
 {
-	if (_mqttClient == NULL) {
-		if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			log_d("MQTT client is null, creating new client");
-		if (!createClient()) {
-			return false;
+	TopicRouteTablePtr table = loadTopicRoutes();
+	int routeId = table->trie.find(topic);
+	return routeId >= 0 ? table->routes[routeId]->grantedQos.load() : -1;
+}
+
+/// <summary>
+/// Collects the chunks of a message bigger than the in buffer into a pool buffer and delivers the complete message.
+/// </summary>
+/// <returns>true if the event was consumed, false if it should be delivered as a fragment</returns>
+bool ESP32_MQTTClient::reassembleMessage(const esp_mqtt_event_t* event)
+{
+	MessageReassembly& r = _reassembly;
+
+	if (event->current_data_offset == 0)
+	{
+		// previous message was not completed
+		if (r.buffer != nullptr)
+			_reassemblyPool->release(r.buffer);
+
+		r = {};
+		if ((size_t)event->topic_len + event->total_data_len <= _reassemblyPool->getBufferSize())
+			r.buffer = _reassemblyPool->acquire();
+
+		if (r.buffer == nullptr)
+		{
+			ESP32_MQTT_LOG(Data, Warning, "Can't reassemble message of %d bytes, %s", event->total_data_len, _reassemblyPool->getFreeCount() == 0 ? "no free buffer" : "message too big");
+
+			if (_reassemblyDropPolicy == ESP32_MQTTReassemblyDropPolicy::DeliverFragments)
+			{
+				r.passthrough = true;
+				return false;
+			}
+			r.dropping = true;
+			_reassemblyDropCount++;
+			return true;
 		}
+
+		memcpy(r.buffer, event->topic, event->topic_len);
+		r.topicLen = event->topic_len;
 	}
 
-	// start the client and it's loop
-	esp_err_t result = esp_mqtt_client_start(_mqttClient);
+	if (r.dropping)
+		return true;
+	if (r.passthrough || r.buffer == nullptr)
+		return false;
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client start result: %d (%s)", result, esp_err_to_name(result));
-	
-	return result == ESP_OK;
+	if (event->current_data_offset + event->data_len > event->total_data_len)
+	{
+		_reassemblyPool->release(r.buffer);
+		r.buffer = nullptr;
+		r.dropping = true;
+		_reassemblyDropCount++;
+		return true;
+	}
+
+	memcpy(r.buffer + r.topicLen + event->current_data_offset, event->data, event->data_len);
+	r.receivedLen += event->data_len;
+
+	if (r.receivedLen >= event->total_data_len)
+	{
+		esp_mqtt_event_t message = *event;
+		message.topic = (char*)r.buffer;
+		message.topic_len = r.topicLen;
+		message.data = (char*)r.buffer + r.topicLen;
+		message.data_len = event->total_data_len;
+		message.current_data_offset = 0;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		message.property = nullptr;	// properties came with the first chunk and are gone
+#endif
+
+		// the buffer is released after the message is processed
+		forwardMessage(&message, r.buffer);
+		r.buffer = nullptr;
+	}
+	return true;
 }
 
-bool ESP32_MQTTClient::reconnect() {
-	if (_mqttClient == NULL) {
-		log_e("MQTT client is null, can't reconnect, use createClient() to create a client first");
+/// <summary>
+/// First filter subscribed with subscribeStream() matching the topic.
+/// </summary>
+/// <returns>route id, -1 if none matches</returns>
+std::shared_ptr<ESP32_MQTTClient::TopicRoute> ESP32_MQTTClient::findStreamRoute(const char* topic, int topicLen)
+{
+	if (_streamRouteCount == 0 || topic == nullptr || topicLen <= 0)
+		return nullptr;
+
+	TopicRouteTablePtr table = loadTopicRoutes();
+	std::pair<const TopicRouteTable*, int> found(table.get(), -1);
+	table->trie.match(topic, topicLen, [](int routeId, void* context) {
+		std::pair<const TopicRouteTable*, int>& found = *static_cast<std::pair<const TopicRouteTable*, int>*>(context);
+		if (found.first->routes[routeId]->streamSink != nullptr && (found.second < 0 || routeId < found.second))
+			found.second = routeId;
+	}, &found);
+	return found.second >= 0 ? table->routes[found.second] : nullptr;
+}
+
+void ESP32_MQTTClient::beginStream(const std::shared_ptr<TopicRoute>& route, const char* topic, int topicLen, size_t totalLength)
+{
+	StreamReception& s = _stream;
+	s.sink = route->streamSink;
+	s.route = route;
+	s.totalLength = totalLength;
+	s.receivedLength = 0;
+	s.segmented = route->streamSegmented;
+	s.digest = route->streamDigest;
+	s.crc32 = 0;
+	if (s.digest == ESP32_MQTTStreamDigest::Sha256)
+	{
+		mbedtls_sha256_init(&s.sha256);
+		mbedtls_sha256_starts(&s.sha256, 0);
+	}
+	s.begun = s.sink->begin(topic, topicLen, totalLength);
+	if (!s.begun)
+		finishStream(false);
+}
+
+/// <summary>
+/// Passes a chunk of a message to the sink of a stream subscription. The first chunk picks the sink of the first
+/// matching filter subscribed with subscribeStream() and opens the stream, or for a segmented stream continues it.
+/// The stream is finished with its last byte. A failed stream is finished right away and the rest of its message
+/// is consumed without calling the sink.
+/// </summary>
+/// <returns>true if the chunk belongs to a stream subscription</returns>
+bool ESP32_MQTTClient::receiveStream(const esp_mqtt_event_t* event)
+{
+	StreamReception& s = _stream;
+	const uint8_t* data = (const uint8_t*)event->data;
+	size_t length = event->data_len;
+
+	if (event->current_data_offset == 0)
+	{
+		std::shared_ptr<TopicRoute> route = findStreamRoute(event->topic, event->topic_len);
+		// a plain stream is one message, the next one means it was cut off. Other messages may come between the
+		// segments of a segmented stream.
+		if (s.sink != nullptr && (!s.segmented || (route && route != s.route)))
+			finishStream(false);
+
+		s.messageRemaining = 0;
+		if (!route)
+			return false;
+		s.messageRemaining = event->total_data_len;
+		s.skipMessage = false;
+
+		if (!route->streamSegmented)
+		{
+			beginStream(route, event->topic, event->topic_len, event->total_data_len);
+		}
+		else
+		{
+			uint32_t segmentOffset = 0;
+			uint32_t totalLength = 0;
+			size_t segmentLength = 0;
+			bool valid = length >= ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE;
+			if (valid)
+			{
+				segmentOffset = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+				totalLength = (uint32_t)data[4] << 24 | (uint32_t)data[5] << 16 | (uint32_t)data[6] << 8 | data[7];
+				data += ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE;
+				length -= ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE;
+				segmentLength = event->total_data_len - ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE;
+				valid = (size_t)segmentOffset + segmentLength <= totalLength;
+			}
+
+			if (valid && segmentOffset == 0)
+			{
+				if (s.sink != nullptr)
+					finishStream(false);
+				beginStream(route, event->topic, event->topic_len, totalLength);
+			}
+			else if (!valid || s.sink == nullptr || totalLength != s.totalLength)
+			{
+				// the start was missed (subscribed in the middle, the stream failed or the connection dropped), the
+				// following segments are skipped until the next stream starts
+				if (s.sink != nullptr)
+					finishStream(false);
+				s.skipMessage = true;
+			}
+			else if (segmentOffset + segmentLength <= s.receivedLength)
+			{
+				// QoS 1 redelivery
+				s.skipMessage = true;
+			}
+			else if (segmentOffset != s.receivedLength)
+			{
+				ESP32_MQTT_LOG(Data, Warning, "Stream segment missing, %u bytes received, next segment at %u", (unsigned int)s.receivedLength, (unsigned int)segmentOffset);
+				finishStream(false);
+				s.skipMessage = true;
+			}
+		}
+	}
+	else if (s.messageRemaining == 0)
+	{
 		return false;
 	}
+	else if ((size_t)event->current_data_offset + s.messageRemaining != (size_t)event->total_data_len)
+	{
+		ESP32_MQTT_LOG(Data, Warning, "Unexpected chunk at %d of a streamed message", event->current_data_offset);
+		if (s.sink != nullptr)
+			finishStream(false);
+		s.skipMessage = true;
+	}
 
-	esp_err_t result = esp_mqtt_client_reconnect(_mqttClient);
+	s.messageRemaining -= std::min(s.messageRemaining, (size_t)event->data_len);
+	if (s.sink == nullptr || s.skipMessage)
+		return true;
+
+	if (length > 0)
+	{
+		if (s.receivedLength + length > s.totalLength)
+		{
+			finishStream(false);
+			return true;
+		}
 
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client reconnect result: %d (%s)", result, esp_err_to_name(result));
+		if (s.digest == ESP32_MQTTStreamDigest::Crc32)
+			s.crc32 = ESP32_MQTTCrc32(s.crc32, data, length);
+		else if (s.digest == ESP32_MQTTStreamDigest::Sha256)
+			mbedtls_sha256_update(&s.sha256, data, length);
 
-	return result == ESP_OK;
+		if (!s.sink->write(data, length, s.receivedLength))
+		{
+			finishStream(false);
+			return true;
+		}
+		s.receivedLength += length;
+	}
+
+	if (s.messageRemaining == 0 && (s.receivedLength == s.totalLength || !s.segmented))
+		finishStream(s.receivedLength == s.totalLength);
+	return true;
 }
 
-bool ESP32_MQTTClient::stop() {
-	if (_mqttClient == NULL) {
-		log_e("MQTT client is null, can't stop, use createClient() to create a client first");
-		return false;
+/// <summary>
+/// Ends the stream: completes the digest, lets the verify callback of the subscription check it and calls end() of
+/// the sink with the outcome.
+/// </summary>
+void ESP32_MQTTClient::finishStream(bool complete)
+{
+	StreamReception& s = _stream;
+
+	ESP32_MQTTStreamResult result = {};
+	result.complete = complete;
+	result.length = s.receivedLength;
+	result.crc32 = s.crc32;
+	if (s.digest == ESP32_MQTTStreamDigest::Sha256)
+	{
+		mbedtls_sha256_finish(&s.sha256, result.sha256);
+		mbedtls_sha256_free(&s.sha256);
 	}
 
-	esp_err_t result = esp_mqtt_client_stop(_mqttClient);
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client stop result: %d (%s)", result, esp_err_to_name(result));
+	bool ok = complete;
+	// the route is kept alive by the stream even if the subscription is gone or replaced by now
+	if (ok && s.begun && s.route->streamVerify)
+		ok = s.route->streamVerify(result);
 
-	return result == ESP_OK;
+	if (s.begun)
+		s.sink->end(ok);
+	if (!ok)
+	{
+		_streamFailedCount++;
+		ESP32_MQTT_LOG(Data, Warning, "Stream failed after %u of %u bytes", (unsigned int)s.receivedLength, (unsigned int)s.totalLength);
+	}
+	s.sink = nullptr;
+	s.route = nullptr;
+	s.begun = false;
 }
 
-bool ESP32_MQTTClient::disconnect() {
-	if (_mqttClient == NULL) {
-		log_e("MQTT client is null, can't disconnect, use createClient() to create a client first");
-		return false;
+void ESP32_MQTTClient::deliverMessage(const esp_mqtt_event_t* event)
+{
+	if (dispatchTopicRoutes(event))
+		return;
+	if (_onMqttMessageReceivedCallback) {
+		_onMqttMessageReceivedCallback(event->msg_id, event->topic, event->topic_len, event->data, event->data_len, event->current_data_offset, event->total_data_len, event->retain, event->qos, event->dup);
 	}
+}
 
-	esp_err_t result = esp_mqtt_client_disconnect(_mqttClient);
-	
-	if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-		log_d("MQTT client disconnect result: %d (%s)", result, esp_err_to_name(result));
-	
-	return result == ESP_OK;
+/// <summary>
+/// MQTT 5 properties of the message being delivered, call it from onMqttMessageReceived or a topic handler.
+/// </summary>
+/// <returns>false outside of a message callback or if the message has no properties</returns>
+bool ESP32_MQTTClient::getMessageProperties(ESP32_MQTTMessageProperties& properties)
+{
+	properties = {};
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	if (_currentMessage == nullptr || _currentMessage->property == nullptr)
+		return false;
+
+	const esp_mqtt5_event_property_t* property = _currentMessage->property;
+	properties.responseTopic = property->response_topic;
+	properties.responseTopicLen = property->response_topic != nullptr ? property->response_topic_len : 0;
+	properties.correlationData = (const uint8_t*)property->correlation_data;
+	properties.correlationDataLen = property->correlation_data != nullptr ? property->correlation_data_len : 0;
+	properties.contentType = property->content_type;
+	properties.contentTypeLen = property->content_type != nullptr ? property->content_type_len : 0;
+	properties.payloadIsUtf8 = property->payload_format_indicator;
+	properties.subscriptionId = property->subscribe_id;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/// <summary>
+/// Calls the visitor with every MQTT 5 user property of the message being delivered, call it from onMqttMessageReceived or a topic handler.
+/// </summary>
+void ESP32_MQTTClient::forEachMessageUserProperty(std::function<void(const char* key, const char* value)> visitor)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	if (_currentMessage == nullptr || _currentMessage->property == nullptr || _currentMessage->property->user_property == nullptr)
+		return;
+
+	mqtt5_user_property_handle_t userProperty = _currentMessage->property->user_property;
+	uint8_t count = esp_mqtt5_client_get_user_property_count(userProperty);
+	if (count == 0)
+		return;
+
+	// esp-mqtt returns copies of the keys and values which have to be freed
+	esp_mqtt5_user_property_item_t* items = (esp_mqtt5_user_property_item_t*)calloc(count, sizeof(esp_mqtt5_user_property_item_t));
+	if (items == nullptr)
+		return;
+	if (esp_mqtt5_client_get_user_property(userProperty, items, &count) == ESP_OK)
+	{
+		for (uint8_t i = 0; i < count; i++)
+		{
+			visitor(items[i].key, items[i].value);
+			free((char*)items[i].key);
+			free((char*)items[i].value);
+		}
+	}
+	free(items);
+#endif
 }
 
 void ESP32_MQTTClient::handleMqttEventStatic(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
+	ESP32_MQTT_TRACE_START(traceStartUs);
 	static_cast<ESP32_MQTTClient*>(event_handler_arg)->handleMqttEvent(event_base, event_id, event_data);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::MqttEvent, esp_mqtt_event_handle_t(event_data)->msg_id, event_id, traceStartUs);
 }
 
 void ESP32_MQTTClient::handleMqttEvent(esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
 	const esp_mqtt_event_t* event = esp_mqtt_event_handle_t(event_data);
 	// your_context_t *context = event->context;
-	if (event->client == _mqttClient)
+	if (event->client != _mqttClient)
+		return;
+
+	_metrics.recordEvent(event_id, event);
+	TaskHandle_t mqttTask = xTaskGetCurrentTaskHandle();
+	if (mqttTask != _mqttTask)
 	{
-		switch (event_id) {
-		case MQTT_EVENT_BEFORE_CONNECT:
-			
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED)
-			{
-				log_d("MQTT_EVENT_BEFORE_CONNECT");
+		_mqttTask = mqttTask;
+		ESP32_MQTT_TRACE_TASK_NAME(mqttTask, "mqtt");
+	}
 
-				if (_mqttUsername)
-					log_d("Connecting to MQTT broker '%s' with client name '%s' and username '%s'...", _mqttUri, _mqttClientName, _mqttUsername);
-				else
-					log_d("Connecting to MQTT broker '%s' with client name '%s'...", _mqttUri, _mqttClientName);
-			}
+	// connection state is updated right away, even if the callbacks run in the dispatch task
+	if (event_id == MQTT_EVENT_CONNECTED || event_id == MQTT_EVENT_DISCONNECTED)
+		_topicAliasReset = true;	// aliases are valid for one connection
+	if (event_id == MQTT_EVENT_CONNECTED)
+	{
+		_isConnected = true;
+		_connectionEstablished = true;
+		if (_reconnectPolicy != nullptr)
+			_reconnectPolicy->connected(millis());
+		_health.connected();
+		if (_healthTask != nullptr)
+		{
+			// the event handler holds the esp-mqtt lock, the SUBACK can't be handled before the msg_id is stored
+			_healthProbeSubscribeMsgId = esp_mqtt_client_subscribe(_mqttClient, _healthProbeTopic, 0);
+			xTaskNotifyGive(_healthTask);
+		}
+	}
+	else if (event_id == MQTT_EVENT_DISCONNECTED)
+	{
+		_isConnected = false;
+		// the next attempt goes to the new uri, a connection dropped by the health task doesn't count as a failed attempt
+		if (_healthFailoverPending.exchange(false) || (!_connectionEstablished && _health.connectFailed()))
+			failover();
+		_connectionEstablished = false;
+		if (_reconnectPolicy != nullptr)
+			scheduleReconnect();
+		// the rest of a streamed message won't come, a QoS 1/2 message is sent again from the start
+		if (_stream.sink != nullptr)
+			finishStream(false);
+		_stream.messageRemaining = 0;
+	}
 
-			if (_onMqttBeforeConnectCallback) {
-				_onMqttBeforeConnectCallback();
-			}
-			break;
-		case MQTT_EVENT_CONNECTED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) {
-				log_d("MQTT_EVENT_CONNECTED");
-				log_d("MQTT broker connected");
-			}
-			_isConnected = true;
-			if (_onMqttConnectedCallback) {
-				_onMqttConnectedCallback(event->session_present);
-			}
-			break;
-		case MQTT_EVENT_DISCONNECTED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) {
-				log_d("MQTT_EVENT_DISCONNECTED");
-				log_d("MQTT broker disconnected");
-			}
-			_isConnected = false;
-			if (_onMqttDisconnectedCallback) {
-				_onMqttDisconnectedCallback();
-			}
-			break;
-		case MQTT_EVENT_SUBSCRIBED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("MQTT_EVENT_SUBSCRIBED");
-			if (_onMqttTopicSubscribedCallback) {
-				_onMqttTopicSubscribedCallback(event->msg_id, event->error_handle->error_type, event->data, event->data_len);
-			}
-			break;
-		case MQTT_EVENT_UNSUBSCRIBED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-			if (_onMqttTopicUnsubscribedCallback) {
-				_onMqttTopicUnsubscribedCallback(event->msg_id);
-			}
-			break;
-		case MQTT_EVENT_PUBLISHED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-			if (_onMqttMessagePublishConfirmedCallback) {
-				_onMqttMessagePublishConfirmedCallback(event->msg_id);
-			}
-			break;
-		case MQTT_EVENT_DATA:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("MQTT_EVENT_DATA, msg_id: %d, topic: %.*s, data: %.*s", event->msg_id, event->topic_len, event->topic, event->data_len, event->data);
-			if (_onMqttMessageReceivedCallback) {
-				_onMqttMessageReceivedCallback(event->msg_id, event->topic, event->topic_len, event->data, event->data_len, event->current_data_offset, event->total_data_len, event->retain, event->qos, event->dup);
-			}
-			break;
-		case MQTT_EVENT_ERROR:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) {
-				log_d("MQTT_EVENT_ERROR");
-				printError(event->error_handle);
-			}
-			if (_onMqttErrorCallback)
-				_onMqttErrorCallback(event->error_handle);
-			break;
+	// echoed probes are answered here, they don't reach the callbacks or the dispatch queue
+	if (event_id == MQTT_EVENT_DATA && _healthTask != nullptr && isHealthProbe(event))
+	{
+		if (_health.probeReceived((const uint8_t*)event->data, event->data_len, micros()))
+			xTaskNotifyGive(_healthTask);
+		return;
+	}
+
+	// and so is the SUBACK of the probe subscription
+	if (event_id == MQTT_EVENT_SUBSCRIBED && _healthTask != nullptr && event->msg_id == _healthProbeSubscribeMsgId)
+	{
+		_healthProbeSubscribeMsgId = -1;
+		if (event->data == nullptr || event->data_len < 1 || (uint8_t)event->data[0] >= 0x80)
+			ESP32_MQTT_LOG(Connection, Warning, "Health probe subscription rejected, probes will be lost");
+		return;
+	}
+
+	// an acknowledgement frees a segment of the window of publishStream()
+	if (event_id == MQTT_EVENT_PUBLISHED || event_id == MQTT_EVENT_DISCONNECTED)
+	{
+		TaskHandle_t streamPublishTask = _streamPublishTask;
+		if (streamPublishTask != nullptr)
+			xTaskNotifyGive(streamPublishTask);
+	}
+
+	// streamed messages go to their sink from the MQTT task, a slow sink holds back reading the socket
+	if (event_id == MQTT_EVENT_DATA && (_streamRouteCount > 0 || _stream.sink != nullptr || _stream.messageRemaining > 0) && receiveStream(event))
+		return;
+
+	if (event_id == MQTT_EVENT_DATA && _reassemblyPool->isInitialized() && event->data_len < event->total_data_len && reassembleMessage(event))
+		return;
+
+	if (event_id == MQTT_EVENT_DATA)
+		forwardMessage(event, nullptr);
+	else
+		forwardEvent(event_id, event, nullptr);
+}
+
+/// <summary>
+/// Forwards a received message or chunk, decompressing it first if its topic has compression enabled. poolBuffer (if any) is
+/// released once the message is processed.
+/// </summary>
+void ESP32_MQTTClient::forwardMessage(const esp_mqtt_event_t* event, uint8_t* poolBuffer)
+{
+	// esp-mqtt sends the topic only with the first chunk
+	if (event->current_data_offset == 0)
+		_decompressingMessage = _decompressBuf != nullptr && isCompressedTopic(event->topic, event->topic_len);
+	if (!_decompressingMessage)
+	{
+		forwardEvent(MQTT_EVENT_DATA, event, poolBuffer);
+		return;
+	}
+
+	// the topic goes in front of the payload like in the reassembly buffers, chunks can't be decompressed
+	int length = -1;
+	if (event->data_len == event->total_data_len && (size_t)event->topic_len <= _compressionMaxMessageSize)
+	{
+		memcpy(_decompressBuf, event->topic, event->topic_len);
+		length = ESP32_MQTTCompressor::decompress((const uint8_t*)event->data, event->data_len, _decompressBuf + event->topic_len, _compressionMaxMessageSize - event->topic_len);
+	}
+
+	if (length < 0)
+	{
+		if (event->current_data_offset == 0)
+		{
+			_decompressionDropCount++;
+			ESP32_MQTT_LOG(Data, Warning, "Can't decompress message of %d bytes on topic %s", event->total_data_len, ESP32_MQTTLogText(event->topic, event->topic_len));
+		}
+		_reassemblyPool->release(poolBuffer);
+		return;
+	}
+
+	esp_mqtt_event_t message = *event;
+	message.topic = (char*)_decompressBuf;
+	message.data = (char*)_decompressBuf + event->topic_len;
+	message.data_len = length;
+	message.total_data_len = length;
+	message.current_data_offset = 0;
+
+	// the dispatch queue copies the message out of _decompressBuf
+	_reassemblyPool->release(poolBuffer);
+	forwardEvent(MQTT_EVENT_DATA, &message, nullptr);
+}
+
+/// <summary>
+/// Processes the event in the current task or passes it to the dispatch task. poolBuffer (if any) is released once the event is processed.
+/// </summary>
+void ESP32_MQTTClient::forwardEvent(int32_t event_id, const esp_mqtt_event_t* event, uint8_t* poolBuffer)
+{
+	trackEvent(event_id, event);
+
+	if (_eventQueue.isInitialized())
+	{
+		if (_eventQueue.push(event_id, event, poolBuffer))
+		{
+			ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::Queued, event->msg_id, event_id);
+			xTaskNotifyGive(_dispatchTask);
+		}
+		else
+		{
+			ESP32_MQTT_TRACE_INSTANT(ESP32_MQTTTraceEvent::QueueDrop, event->msg_id, event_id);
+			ESP32_MQTT_LOG(Data, Warning, "Dispatch queue full, event %d dropped", (int)event_id);
+			_reassemblyPool->release(poolBuffer);
+		}
+		return;
+	}
+
+	unsigned long startUs = micros();
+	processEvent(event_id, event);
+	_metrics.recordCallbackTime(micros() - startUs);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Callback, event->msg_id, event_id, startUs);
+	_reassemblyPool->release(poolBuffer);
+}
+
+/// <summary>
+/// The client's own handling of an event, done in the MQTT task before the event is queued. A full dispatch queue then drops
+/// only callbacks and messages, never an in-flight completion, the restoring of the subscriptions or a SUBACK return code.
+/// </summary>
+void ESP32_MQTTClient::trackEvent(int32_t event_id, const esp_mqtt_event_t* event)
+{
+	switch (event_id) {
+	case MQTT_EVENT_CONNECTED:
+		if (_autoResubscribe && !event->session_present)
+			restoreSubscriptions();
+		break;
+	case MQTT_EVENT_SUBSCRIBED:
+		handleSubscribeAck(event);
+		break;
+	case MQTT_EVENT_PUBLISHED:
+		_inflight.complete(event->msg_id, ESP32_MQTTPublishStatus::Confirmed);
+		break;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
-		case MQTT_EVENT_DELETED:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
-			if (_onMqttMessageDeletedCallback)
-				_onMqttMessageDeletedCallback(event->msg_id);
-			break;
+	case MQTT_EVENT_DELETED:
+		_inflight.complete(event->msg_id, ESP32_MQTTPublishStatus::Deleted);
+		break;
 #endif
-		default:
-			if (ESP32_MQTTCLIENT_LOGGING_ENABLED) log_d("Other event id: %d", event_id);
-			if (_onMqttCustomEventCallback)
-				_onMqttCustomEventCallback(event);
-			break;
+	default:
+		break;
+	}
+}
+
+void ESP32_MQTTClient::dispatchTaskStatic(void* arg)
+{
+	ESP32_MQTTClient* client = static_cast<ESP32_MQTTClient*>(arg);
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		while (client->dispatchQueuedEvent())
+			;
+	}
+}
+
+/// <summary>
+/// Processes the oldest event of the dispatch queue, in the dispatch task.
+/// </summary>
+/// <returns>false if the queue was empty</returns>
+bool ESP32_MQTTClient::dispatchQueuedEvent()
+{
+	ESP32_MQTTQueuedEvent* queued = _eventQueue.front();
+	if (queued == nullptr)
+		return false;
+
+	unsigned long startUs = micros();
+	processEvent(queued->eventId, &queued->event);
+	_metrics.recordCallbackTime(micros() - startUs);
+	ESP32_MQTT_TRACE_SPAN(ESP32_MQTTTraceEvent::Callback, queued->event.msg_id, queued->eventId, startUs);
+	_reassemblyPool->release(queued->poolBuffer);
+	_eventQueue.pop();
+	return true;
+}
+
+void ESP32_MQTTClient::processEvent(int32_t event_id, const esp_mqtt_event_t* event)
+{
+	switch (event_id) {
+	case MQTT_EVENT_BEFORE_CONNECT:
+		if (_mqttUsername)
+			ESP32_MQTT_LOG(Connection, Debug, "Connecting to MQTT broker '%s' with client name '%s' and username '%s'...", _mqttUri, _mqttClientName, _mqttUsername);
+		else
+			ESP32_MQTT_LOG(Connection, Debug, "Connecting to MQTT broker '%s' with client name '%s'...", _mqttUri, _mqttClientName);
+
+		if (_onMqttBeforeConnectCallback) {
+			_onMqttBeforeConnectCallback();
+		}
+		break;
+	case MQTT_EVENT_CONNECTED:
+		ESP32_MQTT_LOG(Connection, Info, "MQTT broker connected, session present: %d", event->session_present);
+		if (_onMqttConnectedCallback) {
+			_onMqttConnectedCallback(event->session_present);
+		}
+		break;
+	case MQTT_EVENT_DISCONNECTED:
+		ESP32_MQTT_LOG(Connection, Info, "MQTT broker disconnected");
+		if (_onMqttDisconnectedCallback) {
+			_onMqttDisconnectedCallback();
+		}
+		break;
+	case MQTT_EVENT_SUBSCRIBED:
+		ESP32_MQTT_LOG(Subscribe, Debug, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+		if (_onMqttTopicSubscribedCallback) {
+			_onMqttTopicSubscribedCallback(event->msg_id, event->error_handle->error_type, event->data, event->data_len);
+		}
+		break;
+	case MQTT_EVENT_UNSUBSCRIBED:
+		ESP32_MQTT_LOG(Subscribe, Debug, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+		if (_onMqttTopicUnsubscribedCallback) {
+			_onMqttTopicUnsubscribedCallback(event->msg_id);
+		}
+		break;
+	case MQTT_EVENT_PUBLISHED:
+		ESP32_MQTT_LOG(Publish, Debug, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+		if (_onMqttMessagePublishConfirmedCallback) {
+			_onMqttMessagePublishConfirmedCallback(event->msg_id);
 		}
+		break;
+	case MQTT_EVENT_DATA:
+		// the payload only at Verbose, cut and sampled, a full one on every message would flood the log task
+		if (ESP32_MQTTLog::isPayloadSampled())
+			ESP32_MQTTLog::write(ESP32_MQTTLogCategory::Data, ESP32_MQTTLogLevel::Verbose, "MQTT_EVENT_DATA, msg_id: %d, topic: %s, %d bytes: %s", event->msg_id, ESP32_MQTTLogText(event->topic, event->topic_len), event->total_data_len, ESP32_MQTTLog::payloadText(event->data, event->data_len));
+		else
+			ESP32_MQTT_LOG(Data, Debug, "MQTT_EVENT_DATA, msg_id: %d, topic: %s, %d bytes", event->msg_id, ESP32_MQTTLogText(event->topic, event->topic_len), event->total_data_len);
+		// chunks of a message too big for the in buffer are not stored
+		if (_retainedStore.isInitialized() && event->current_data_offset == 0 && event->data_len == event->total_data_len)
+			_retainedStore.store(event->topic, event->topic_len, (const uint8_t*)event->data, event->data_len, event->retain);
+		_currentMessage = event;
+		deliverMessage(event);
+		_currentMessage = nullptr;
+		break;
+	case MQTT_EVENT_ERROR:
+		ESP32_MQTT_LOG(Connection, Error, "MQTT_EVENT_ERROR, type: %d, esp-tls error: 0x%x, tls stack error: 0x%x, socket errno: %d, connect return code: %d", (int)event->error_handle->error_type,
+			(unsigned int)event->error_handle->esp_tls_last_esp_err, (unsigned int)event->error_handle->esp_tls_stack_err, event->error_handle->esp_transport_sock_errno, (int)event->error_handle->connect_return_code);
+		if (ESP32_MQTTLog::isEnabled(ESP32_MQTTLogCategory::Connection, ESP32_MQTTLogLevel::Debug))
+			printError(event->error_handle);
+		if (_onMqttErrorCallback)
+			_onMqttErrorCallback(event->error_handle);
+		break;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+	case MQTT_EVENT_DELETED:
+		ESP32_MQTT_LOG(Publish, Warning, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+		if (_onMqttMessageDeletedCallback)
+			_onMqttMessageDeletedCallback(event->msg_id);
+		break;
+#endif
+	default:
+		ESP32_MQTT_LOG(Connection, Debug, "Other event id: %d", (int)event_id);
+		if (_onMqttCustomEventCallback)
+			_onMqttCustomEventCallback(event);
+		break;
 	}
+
 }
@@ -1,9 +1,33 @@
 #pragma once
 
-#include <Arduino.h>
-#include <mqtt_client.h>
+#include "ESP32_MQTTPlatform.h"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "ESP32_MQTTTopicTrie.h"
+#include "ESP32_MQTTBufferPool.h"
+#include "ESP32_MQTTEventQueue.h"
+#include "ESP32_MQTTMetrics.h"
+#include "ESP32_MQTTInflightTable.h"
+#include "ESP32_MQTTPersistentOutbox.h"
+#include "ESP32_MQTTStaticConfig.h"
+#include "ESP32_MQTTReconnectPolicy.h"
+#include "ESP32_MQTTTokenBucket.h"
+#include "ESP32_MQTTCodecs.h"
+#include "ESP32_MQTTTopicAliasTable.h"
+#include "ESP32_MQTTCompressor.h"
+#include "ESP32_MQTTPublishQueue.h"
+#include "ESP32_MQTTRetainedCache.h"
+#include "ESP32_MQTTStream.h"
+#include "ESP32_MQTTTrace.h"
+#include "ESP32_MQTTLog.h"
+#include "ESP32_MQTTHealthMonitor.h"
 
-#define ESP32_MQTTCLIENT_LOGGING_ENABLED false
+#define ESP32_MQTTCLIENT_HOUSEKEEPING_INTERVAL_MS 100     // period of the timer driving metrics publishing and other periodic work
+#define ESP32_MQTTCLIENT_PUBLISH_RETRY_MS 50              // the publish task retries a message after the rate limit or a full esp-mqtt outbox
+#define ESP32_MQTTCLIENT_PUBLISH_THROTTLE_MS 10           // the publish task checks the rate limits of held back classes this often
+#define ESP32_MQTTCLIENT_MAX_PUBLISH_CLASSES 8            // traffic classes of publishAsync(), including the default one
 
 namespace ESP32_MQTTCallbacks
 {
@@ -17,8 +41,57 @@ namespace ESP32_MQTTCallbacks
     typedef std::function<void(int msgId)> OnMqttMessageDeletedCallback;
     typedef std::function<void(esp_mqtt_error_codes_t* error)> OnMqttErrorCallback;
     typedef std::function<void(const esp_mqtt_event_t* event)> OnMqttCustomEventCallback;
+    typedef std::function<void(int subscribedCount, int failedCount)> OnMqttSubscriptionsRestoredCallback;
+    typedef std::function<void(ESP32_MQTTLinkHealth health, uint32_t rttMs)> OnMqttHealthChangedCallback;
 }
 
+// what happens with a fragmented message which can't be reassembled (too big or all pool buffers in use)
+enum class ESP32_MQTTReassemblyDropPolicy
+{
+    DropMessage,        // the message is dropped and counted in getReassemblyDropCount()
+    DeliverFragments    // the message is delivered in chunks as if the reassembly was disabled
+};
+
+// one part of a payload published with the scatter-gather publish() / enqueue()
+struct ESP32_MQTTPayloadSegment
+{
+    const void* data;
+    size_t length;
+};
+
+// MQTT 5 user property, null terminated key and value
+struct ESP32_MQTTUserProperty
+{
+    const char* key;
+    const char* value;
+};
+
+// MQTT 5 properties of a published message, zero and nullptr fields are not sent. The pointers must be valid until publish() returns.
+struct ESP32_MQTTPublishProperties
+{
+    uint32_t messageExpirySeconds = 0;
+    const char* responseTopic = nullptr;
+    const uint8_t* correlationData = nullptr;
+    uint16_t correlationDataLen = 0;
+    const char* contentType = nullptr;
+    bool payloadIsUtf8 = false;
+    const ESP32_MQTTUserProperty* userProperties = nullptr;
+    uint8_t userPropertyCount = 0;
+};
+
+// MQTT 5 properties of a received message, the strings are not null terminated and valid only in the message callback.
+// esp-mqtt doesn't report the message expiry interval of received messages.
+struct ESP32_MQTTMessageProperties
+{
+    const char* responseTopic;
+    int responseTopicLen;
+    const uint8_t* correlationData;
+    int correlationDataLen;
+    const char* contentType;
+    int contentTypeLen;
+    bool payloadIsUtf8;
+    uint16_t subscriptionId;
+};
 
 class ESP32_MQTTClient
 {
@@ -36,39 +109,118 @@ public:
     void onMqttMessageDeleted(ESP32_MQTTCallbacks::OnMqttMessageDeletedCallback callback);
     void onMqttError(ESP32_MQTTCallbacks::OnMqttErrorCallback callback);
     void onMqttCustomEvent(ESP32_MQTTCallbacks::OnMqttCustomEventCallback callback);
+    void onMqttSubscriptionsRestored(ESP32_MQTTCallbacks::OnMqttSubscriptionsRestoredCallback callback); // all subscriptions restored by enableAutoResubscribe() were acknowledged
+    void onMqttHealthChanged(ESP32_MQTTCallbacks::OnMqttHealthChangedCallback callback); // called from the health monitor task, rttMs is the smoothed RTT
 
 
     // three ways to set broker uri
-    void setBrokerUri(const char* uri);   // setURI("mqtt://192.168.1.100:1883");
-    void setBrokerUrl(const char* url, const int port = 1883, const char* scheme = "mqtt"); // setBrokerURL("192.168.1.100"); scheme can be mqtt, mqtts, ws, wss
-    void setBrokerIp(const IPAddress ipAddress, const int port = 1883, const char* scheme = "mqtt"); // IPAddress mqttBrokerIP(192, 168, 1, 100); setBrokerIP(mqttBrokerIP); scheme can be mqtt, mqtts, ws, wss
-    void setClientName(const char* name); // Allow to set client name manually (must be done in setup(), else it will not work.)
-    void setCredentials(const char* username, const char* password);
-    void setClientCert(const char* clientCert);
-    void setCaCert(const char* caCert);
-    void setAuthKey(const char* clientKey);
+    // the setters of strings return false if the string storage (setStringStorage()) is full, the previous value is kept
+    bool setBrokerUri(const char* uri);   // setURI("mqtt://192.168.1.100:1883");
+    bool setBrokerUrl(const char* url, const int port = 1883, const char* scheme = "mqtt"); // setBrokerURL("192.168.1.100"); scheme can be mqtt, mqtts, ws, wss
+    bool setBrokerIp(const IPAddress ipAddress, const int port = 1883, const char* scheme = "mqtt"); // IPAddress mqttBrokerIP(192, 168, 1, 100); setBrokerIP(mqttBrokerIP); scheme can be mqtt, mqtts, ws, wss
+    bool addBrokerUri(const char* uri);   // alternative broker to fail over to, call it after setting the broker uri
+    void setFailover(unsigned int afterFailedAttempts, unsigned long cooldownMs = 60000);    // fails over after afterFailedAttempts failed connection attempts in a row (default 2)
+    bool setClientName(const char* name); // Allow to set client name manually (must be done in setup(), else it will not work.)
+    bool setCredentials(const char* username, const char* password);
+    bool setClientCert(const char* clientCert);
+    bool setCaCert(const char* caCert);
+    bool setAuthKey(const char* clientKey);
     void setTaskPriority(int priority);
+    void setTaskStackSize(int stackSize);   // stack of the esp-mqtt task, it can be smaller when the callbacks run in a dispatch task
+    void setStringStorage(char* buffer, size_t size);   // strings passed to the setters are copied into the buffer, see ESP32_MQTTStaticClient
+    void applyConfig(const ESP32_MQTTStaticConfig& config); // applies a compile time configuration, its strings are not copied
     void setMaxPacketSize(const int size); // override the default value of 1024
     void setMaxInPacketSize(const int size); // override the default value of 1024
     void setMaxOutPacketSize(const int size); // override the default value of 1024
     void setKeepAlive(const int keepAliveSeconds); // Change the keepalive interval (30 seconds by default), when configuring this value, keep in mind that the client attempts to communicate with the broker at half the interval that is actually set. This conservative approach allows for more attempts before the broker's timeout occurs
     void setReconnectTimeout(int reconnectTimeoutMs);   // Reconnect to the broker after this value in miliseconds if auto reconnect is not disabled (defaults to 10s)
     void setNetowrkOperationTimeout(int networkOperationTimeoutMs);   // Abort network operation if it is not completed after this value, in milliseconds (defaults to 10s).
-    void setLastWillMessage(const char *topic, const char *message, const int qos = 0, const bool retain = false); // Must be set before the first loop() call.
+    bool setLastWillMessage(const char *topic, const char *message, const int qos = 0, const bool retain = false); // Must be set before the first loop() call.
     void disableCleanSession();    //MQTT clean session, default clean_session is true
     void disableAutoReconnect();
+    void setReconnectPolicy(ESP32_MQTTReconnectPolicy* policy); // Must be called before createClient(). Replaces the fixed reconnect timeout with the policy's jittered backoff, disables esp-mqtt's auto reconnect.
+    void setPublishRateLimit(unsigned int messagesPerSecond, unsigned int burst); // publish() and enqueue() return -2 when the rate is exceeded, e.g. to spread out the backlog sent after reconnecting. 0 disables the limit.
+    void setProtocolVersion(int version);    // 3 (MQTT 3.1.1, default) or 5, MQTT 5 requires CONFIG_MQTT_PROTOCOL_5 in esp-mqtt
+    void enableTopicAliases(uint16_t maxAliases); // MQTT 5: QoS 0 publishes to one of the maxAliases most recently used topics send an alias instead of the topic
+    void enableAutoResubscribe();  // subscribed topics are restored after connecting without a session present, packed into as few SUBSCRIBE packets as the out packet size allows
+    void enableDispatchTask(size_t queueCapacity, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 4096, size_t maxEventDataSize = 0); // Must be called before createClient(). Callbacks run in a separate task so a slow handler doesn't stall the MQTT task. Events are copied into a queue of queueCapacity slots of maxEventDataSize bytes (topic + data, defaults to the in packet size), events are dropped when the queue is full. In-flight completions and restoring the subscriptions are handled in the MQTT task before queuing and are never dropped, their handlers run in the MQTT task.
+    void enableAsyncPublish(size_t queueCapacity, size_t maxMessageSize, ESP32_MQTTQueueFullPolicy fullPolicy = ESP32_MQTTQueueFullPolicy::FailFast, unsigned long blockTimeoutMs = 1000, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 4096); // Must be called before createClient(). publishAsync() copies messages into a queue of queueCapacity slots of maxMessageSize bytes (topic + payload), a publish task sends them.
+    int addPublishClass(uint8_t weight, size_t queueCapacity, unsigned int messagesPerSecond = 0, unsigned int burst = 0); // Must be called before createClient(). Adds a publishAsync() traffic class with its own queue and rate limit (0 = none), returns the class id or -1. The default class 0 has weight 1.
+    bool addPublishClassTopic(int classId, const char* topicFilter);    // publishAsync() to a matching topic goes to the class, the class added first wins if several match
+    void enableInflightTracking(size_t capacity); // Must be called before createClient(). Allows up to capacity QoS 1/2 publishes with a completion handler or token to be outstanding.
+    void setMessageRetransmitTimeout(int retransmitTimeoutMs); // esp-mqtt resends unconfirmed QoS 1/2 messages after this timeout
+    void setPersistentOutbox(ESP32_MQTTPersistentOutbox* outbox, unsigned int replayMessagesPerSecond = 20); // publish() stores messages in the outbox while disconnected, they are replayed in order after connecting
+    void enableMessageReassembly(size_t maxMessageSize, size_t bufferCount = 1, ESP32_MQTTReassemblyDropPolicy dropPolicy = ESP32_MQTTReassemblyDropPolicy::DropMessage); // Must be called before createClient(). Messages bigger than the in packet size are delivered in one piece, maxMessageSize must fit the topic and the payload. The buffers are allocated once in createClient().
+    bool enableCompression(const char* topicFilter, size_t maxMessageSize = 4096); // Must be called before createClient(). Payloads published to and received from matching topics are LZ4 compressed, both sides must enable it for the same topics. maxMessageSize limits the uncompressed payload (received: topic + payload).
+    void enableRetainedCache(size_t capacity, unsigned long refreshIntervalMs = 0); // Must be called before createClient(). Retained publishes of the payload last sent to the topic are suppressed (publish() returns 0), an unchanged value is sent again after refreshIntervalMs (0 = never). Up to capacity topics are remembered.
+    bool setRetainedDeadband(const char* topicFilter, float deadband); // numeric retained payloads to matching topics are suppressed while they are within deadband of the last value sent
+    void enableRetainedStore(size_t capacity, size_t maxMessageSize); // Must be called before createClient(). Keeps copies of up to capacity received retained messages of at most maxMessageSize bytes (topic + payload), subscribe() with a handler delivers the stored matches right away.
+    void setHousekeepingTask(int priority, int coreId = tskNO_AFFINITY, uint32_t stackSize = 4096); // Must be called before the setters needing the task (reconnect policy, persistent outbox, in-flight tracking, metrics publishing).
+    void enableHealthMonitor(const char* probeTopic, unsigned long probeIntervalMs = 5000, unsigned long probeTimeoutMs = 2000, unsigned int deadAfterLosses = 3, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 3072); // Must be called before createClient(). probeTopic is private to this client, e.g. "devices/esp32-01/$SYS/probe"
+    void setHealthThresholds(unsigned long degradedRttMs, unsigned long degradedJitterMs); // the link is degraded while the smoothed RTT or its variance is above these (defaults 1500 and 1000 ms)
   
     int publish(const char* topic, const char* payload, int qos = 0, bool retain = false);
     int enqueue(const char* topic, const char* payload, int qos = 0, bool retain = false, bool store = true);  // store - if true, all messages are enqueued; otherwise only QoS 1 and QoS 2 are enqueued
+    int publish(const char* topic, const uint8_t* payload, size_t length, int qos = 0, bool retain = false);  // binary payload, may contain zeros
+    int enqueue(const char* topic, const uint8_t* payload, size_t length, int qos = 0, bool retain = false, bool store = true);
+    int publish(const char* topic, const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, int qos = 0, bool retain = false); // payload assembled from several buffers, e.g. header + data + crc
+    int enqueue(const char* topic, const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, int qos = 0, bool retain = false, bool store = true);
+
+    int publishAsync(const char* topic, const char* payload, int qos = 0, bool retain = false);  // safe from any number of tasks, never waits for the network. Returns 0 if queued, -1 if the message doesn't fit a slot, -2 if the queue is full.
+    int publishAsync(const char* topic, const uint8_t* payload, size_t length, int qos = 0, bool retain = false);
+
+    int publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, const ESP32_MQTTPublishProperties& properties); // MQTT 5 message expiry, response topic, correlation data, content type and user properties
+    int publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler); // handler is called once the message is confirmed, deleted or not confirmed within timeoutMs (0 = no timeout), requires enableInflightTracking(). Returns -2 if too many messages are in flight. A timed out message isn't published again, esp-mqtt retransmits it.
+    int publish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTPublishToken& token); // token.wait() blocks until the message is completed, the token must outlive the completion
+    int publishStream(const char* topic, size_t totalLength, ESP32_MQTTCallbacks::OnMqttStreamReadCallback reader, int qos = 1, unsigned long timeoutMs = 10000); // payload of any size read by reader and sent in segments, received with subscribeStream(..., segmented = true). Blocks, not from the MQTT callbacks. Needs a connection, segments bypass compression, the retained cache and the persistent outbox.
+
+    template<template<typename> class Codec = ESP32_MQTTTextCodec, typename T>
+    int publishValue(const char* topic, const T& value, int qos = 0, bool retain = false);    // publishValue(topic, 21.5f) or publishValue<ESP32_MQTTCborCodec>(topic, 21.5f), encoded on the stack
+    template<typename T, template<typename> class Codec = ESP32_MQTTTextCodec, typename Handler>
+    int subscribeValue(const char* topic, int qos, Handler handler);  // subscribeValue<float>(topic, 0, [](const char* topic, int topicLen, float value) {}), messages which can't be decoded are dropped with a Data warning
 
     int subscribe(const char* topic, int qos = 0);
+    int subscribe(const char* topic, int qos, ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback handler); // messages matching the topic filter (+ and # wildcards supported) are routed to the handler instead of onMqttMessageReceived. Safe to call from any task.
+    int subscribeStream(const char* topic, int qos, ESP32_MQTTStreamSink* sink, ESP32_MQTTStreamDigest digest = ESP32_MQTTStreamDigest::None, ESP32_MQTTCallbacks::OnMqttStreamVerifyCallback verify = nullptr, bool segmented = false); // messages of any size are passed to the sink chunk by chunk in the MQTT task, the sink must outlive the subscription
     int unsubscribe(const char* topic);
 
+    int getRetainedMessage(const char* topic, uint8_t* buf, size_t bufSize);   // payload of a received retained message kept by enableRetainedStore(), returns its length, -1 if not stored or buf is too small
+
+    bool getMessageProperties(ESP32_MQTTMessageProperties& properties);     // MQTT 5 properties of the received message, only in the message callbacks
+    void forEachMessageUserProperty(std::function<void(const char* key, const char* value)> visitor);  // MQTT 5 user properties of the received message, only in the message callbacks
+
     inline bool isConnected() { return _isConnected; };
     inline const char *getClientName() { return _mqttClientName; };
     inline const char *getURI() { return _mqttUri; };
     inline const int getOutboxBufferSize() { return _mqttClient != nullptr ? esp_mqtt_client_get_outbox_size(_mqttClient) : -1; }
     inline const int getKeepAliveSeconds() { return _mqttKeepAliveSeconds; }
+    inline const unsigned int getReconnectDelay() { return _mqttReconnectionAttemptDelay; }  // delay before the last scheduled reconnection attempt
+    inline const size_t getSubscriptionCount() { return loadTopicRoutes()->trie.getCount(); }
+    int getSubscriptionGrantedQos(const char* topic); // granted qos from SUBACK, 0x80 on failure, -1 if not acknowledged (yet)
+    inline const uint32_t getTopicAliasSavedBytes() { return _topicAliases.getSavedBytes(); }  // topic bytes not sent thanks to topic aliases
+    inline const uint32_t getCompressionInputBytes() { return _compressionInputBytes; }    // payload bytes before and after compression
+    inline const uint32_t getCompressionOutputBytes() { return _compressionOutputBytes; }
+    inline const unsigned int getDecompressionDropCount() { return _decompressionDropCount; }  // received compressed messages which were malformed, too big or fragmented
+    inline const uint32_t getRetainedPublishCount() { return _retainedCache.getCheckedCount(); }   // retained publishes checked by the retained cache
+    inline const uint32_t getRetainedSuppressedCount() { return _retainedCache.getSuppressedCount(); }
+    inline const size_t getRetainedCacheMemoryUsage() { return _retainedCache.getMemoryUsage() + _retainedStore.getMemoryUsage(); }
+    inline const size_t getStringStorageUsed() { return _stringStorageUsed; }
+    inline const size_t getInflightCount() { return _inflight.getCount(); }
+    inline const unsigned int getReassemblyDropCount() { return _reassemblyDropCount; }
+    inline const unsigned int getStreamFailedCount() { return _streamFailedCount; }    // streamed messages which were cut off, refused by the sink or failed verification
+    inline const size_t getPublishQueueHighWaterMark(int classId = 0) { return isPublishClass(classId) ? _publishClasses[classId].queue.getHighWaterMark() : 0; }
+    inline const unsigned int getPublishQueueDropCount(int classId = 0) { return isPublishClass(classId) ? _publishClasses[classId].queue.getDropCount() : 0; }  // messages dropped or rejected because the queue was full, 0 for an unknown class
+    inline const size_t getDispatchQueueHighWaterMark() { return _eventQueue.getHighWaterMark(); }
+    inline const unsigned int getDispatchQueueDropCount() { return _eventQueue.getDropCount(); }
+    inline const ESP32_MQTTLinkHealth getLinkHealth() { return _health.getHealth(); }
+    inline const uint32_t getRttUs() { return _health.getSmoothedRttUs(); }    // smoothed RTT of the health probes, 0 if not measured
+    inline const uint32_t getRttVarianceUs() { return _health.getRttVarianceUs(); }
+    inline const unsigned int getLostProbeCount() { return _health.getLostProbeCount(); }
+    inline const unsigned int getFailoverCount() { return _failoverCount; }
+
+    ESP32_MQTTMetricsSnapshot getMetrics();  // counters, byte totals and latency histograms since start or resetMetrics()
+    void resetMetrics();
+    void enableMetricsPublishing(const char* topic, unsigned long intervalMs); // periodically publishes getMetrics() as JSON to the topic (e.g. "devices/esp32-01/$SYS/mqtt") while connected
 
     void printError(esp_mqtt_error_codes_t *error_handle);
 
@@ -79,13 +231,20 @@ public:
     bool disconnect();   // This api is typically used to force disconnection from the broker.
     
 private:
+    friend class ESP32_MQTTConnectionManager;
+
     esp_mqtt_client_config_t _mqttConfig;
     esp_mqtt_client_handle_t _mqttClient;
 
-    bool _isConnected;
+    std::atomic<bool> _isConnected;     // written by the MQTT task, read by any task
     unsigned long _nextMqttConnectionAttemptMillis;
     unsigned int _mqttReconnectionAttemptDelay;
-    char* _uriBuf;
+    ESP32_MQTTReconnectPolicy* _reconnectPolicy;
+    std::atomic<bool> _reconnectScheduled;
+    ESP32_MQTTTokenBucket _publishRateLimit;
+    char* _uriBuf;                  // uri formatted by setBrokerUrl() or setBrokerIp() without string storage
+    char* _uriSlot;                 // uri in the string storage, reused by the next uri if it fits
+    size_t _uriSlotSize;
     const char* _mqttUri;
     const char* _mqttUsername;
     const char* _mqttClientName;
@@ -93,6 +252,276 @@ private:
     int _mqttMaxOutPacketSize;
     int _mqttKeepAliveSeconds;
 
+    char* _stringStorage;
+    size_t _stringStorageSize;
+    size_t _stringStorageUsed;
+
+    char* allocString(size_t size);
+    const char* storeString(const char* str);
+    char* allocUri(size_t size);
+
+    // subscribed topic filter, with or without a handler. Only the subscription state changes once it is in a table.
+    struct TopicRoute
+    {
+        char* filter;
+        int qos;
+        ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback handler;
+        std::atomic<int> subscribeMsgId;     // last SUBSCRIBE packet containing the filter
+        std::atomic<int> subscribeIndex;     // position of the filter in that packet
+        std::atomic<int> grantedQos;
+        ESP32_MQTTStreamSink* streamSink;   // set by subscribeStream()
+        ESP32_MQTTStreamDigest streamDigest;
+        ESP32_MQTTCallbacks::OnMqttStreamVerifyCallback streamVerify;
+        bool streamSegmented;
+
+        TopicRoute(const char* filter, int qos);
+        ~TopicRoute();
+    };
+
+    // The subscribed filters. subscribe() and unsubscribe() build a new table and swap it in (copy on write), so they
+    // can be called from any task while the MQTT task matches messages against the table it loaded.
+    struct TopicRouteTable
+    {
+        std::vector<std::shared_ptr<TopicRoute>> routes;    // indexed by the route ids of the trie
+        ESP32_MQTTTopicTrie trie;
+        int streamRouteCount;
+    };
+    typedef std::shared_ptr<const TopicRouteTable> TopicRouteTablePtr;
+
+    struct TopicRouteDispatch
+    {
+        const TopicRouteTable* table;
+        const esp_mqtt_event_t* event;
+        char* topic;
+        int topicLen;
+        int handled;
+    };
+
+    TopicRouteTablePtr _topicRoutes;    // accessed with std::atomic_load() and std::atomic_store()
+    std::mutex _topicRouteMutex;        // one writer at a time
+    inline TopicRouteTablePtr loadTopicRoutes() const { return std::atomic_load(&_topicRoutes); }
+    char* _dispatchTopicBuf;        // topic of the message being received, esp-mqtt sends it only with the first chunk
+    int _dispatchTopicBufSize;
+    int _dispatchTopicLen;
+
+    uint8_t* _gatherBuf;            // reused for assembling scatter-gather payloads, grows to the largest payload
+    size_t _gatherBufSize;
+    std::mutex _gatherBufMutex;
+    uint8_t* _mqttTaskGatherBuf;    // used only by the MQTT task, which must not wait for _gatherBufMutex
+    size_t _mqttTaskGatherBufSize;
+
+    size_t gatherPayload(const ESP32_MQTTPayloadSegment* segments, size_t segmentCount, uint8_t*& buf, size_t& bufSize);
+
+    struct MessageReassembly
+    {
+        uint8_t* buffer;
+        int topicLen;
+        int receivedLen;
+        bool dropping;
+        bool passthrough;
+    };
+
+    ESP32_MQTTBufferPool _reassemblyPoolStorage;
+    ESP32_MQTTBufferPool* _reassemblyPool;      // _reassemblyPoolStorage or the pool shared by a connection manager
+    size_t _reassemblyMaxMessageSize;
+    size_t _reassemblyBufferCount;
+    ESP32_MQTTReassemblyDropPolicy _reassemblyDropPolicy;
+    MessageReassembly _reassembly;
+    std::atomic<unsigned int> _reassemblyDropCount;    // written by the MQTT task, read by any task
+
+    // message being passed to a stream sink, only touched by the MQTT task
+    struct StreamReception
+    {
+        ESP32_MQTTStreamSink* sink;     // nullptr if no stream is open
+        std::shared_ptr<TopicRoute> route;
+        size_t totalLength;
+        size_t receivedLength;
+        bool begun;         // the sink accepted begin(), end() is due
+        bool segmented;
+        size_t messageRemaining;    // bytes of the MQTT message being received which belong to the stream
+        bool skipMessage;           // a repeated segment or one of a stream which wasn't open
+        ESP32_MQTTStreamDigest digest;
+        uint32_t crc32;
+        mbedtls_sha256_context sha256;
+    };
+
+    StreamReception _stream;
+    std::atomic<int> _streamRouteCount;    // of the current route table, lets other messages skip the stream lookup
+    std::atomic<unsigned int> _streamFailedCount;
+    std::mutex _streamPublishMutex;     // one publishStream() at a time
+    std::atomic<TaskHandle_t> _streamPublishTask;  // waiting for acknowledgements, notified on MQTT_EVENT_PUBLISHED
+
+    std::shared_ptr<TopicRoute> findStreamRoute(const char* topic, int topicLen);
+    void beginStream(const std::shared_ptr<TopicRoute>& route, const char* topic, int topicLen, size_t totalLength);
+    bool receiveStream(const esp_mqtt_event_t* event);
+    void finishStream(bool complete);
+
+    ESP32_MQTTEventQueue _eventQueue;
+    size_t _dispatchQueueCapacity;
+    size_t _dispatchQueueSlotSize;
+    int _dispatchTaskPriority;
+    int _dispatchTaskCoreId;
+    uint32_t _dispatchTaskStackSize;
+    TaskHandle_t _dispatchTask;
+    bool _dispatchTaskShared;       // the task belongs to a connection manager
+
+    // traffic class of publishAsync()
+    struct PublishClass
+    {
+        ESP32_MQTTPublishQueue queue;
+        size_t queueCapacity;
+        ESP32_MQTTTokenBucket rateLimit;
+        uint8_t weight;
+        int credit;         // smooth weighted round robin
+    };
+
+    PublishClass _publishClasses[ESP32_MQTTCLIENT_MAX_PUBLISH_CLASSES];
+    size_t _publishClassCount;
+    inline bool isPublishClass(int classId) { return classId >= 0 && (size_t)classId < _publishClassCount; }
+    ESP32_MQTTTopicTrie _publishClassTrie;
+    size_t _publishQueueSlotSize;
+    ESP32_MQTTQueueFullPolicy _publishQueueFullPolicy;
+    unsigned long _publishQueueBlockTimeoutMs;
+    int _publishTaskPriority;
+    int _publishTaskCoreId;
+    uint32_t _publishTaskStackSize;
+    TaskHandle_t _publishTask;
+
+    static void publishTaskStatic(void* arg);
+    void sendQueuedMessages();
+    PublishClass* nextPublishClass();
+    bool hasQueuedMessages();
+
+    ESP32_MQTTMetrics _metrics;
+    const char* _metricsTopic;
+    unsigned long _metricsIntervalMs;
+    unsigned long _nextMetricsPublishMillis;
+
+    ESP32_MQTTInflightTable _inflight;
+    size_t _inflightCapacity;
+
+    int publishTracked(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler, ESP32_MQTTPublishToken* token);
+
+    ESP32_MQTTPersistentOutbox* _persistentOutbox;
+    unsigned int _outboxReplayRate;
+    unsigned long _outboxReplayCredit;      // messages * 1000 which can be replayed now
+    unsigned long _lastOutboxReplayMillis;
+    std::atomic<unsigned int> _outboxLiveCount;    // messages stored while connected, replayed on top of _outboxReplayRate
+
+    void replayPersistentOutbox(unsigned long now);
+
+    ESP32_MQTTHealthMonitor _health;
+    const char* _healthProbeTopic;
+    size_t _healthProbeTopicLen;
+    int _healthProbeSubscribeMsgId;         // SUBACK not passed to onMqttTopicSubscribed, MQTT task only
+    int _healthTaskPriority;
+    int _healthTaskCoreId;
+    uint32_t _healthTaskStackSize;
+    TaskHandle_t _healthTask;
+    ESP32_MQTTLinkHealth _reportedHealth;   // last passed to the callback
+    bool _connectionEstablished;            // CONNECTED since the last DISCONNECTED, a DISCONNECTED without it is a failed attempt
+    std::atomic<bool> _healthFailoverPending;   // set by the health task, the failover is done on the DISCONNECTED event
+    std::atomic<unsigned int> _failoverCount;
+
+    static void healthTaskStatic(void* arg);
+    void healthTask();
+    bool isHealthProbe(const esp_mqtt_event_t* event);
+    bool failover();
+
+    esp_timer_handle_t _housekeepingTimer;     // only notifies _housekeepingTask, the esp_timer task must not block
+    TaskHandle_t _housekeepingTask;
+    int _housekeepingTaskPriority;
+    int _housekeepingTaskCoreId;
+    uint32_t _housekeepingTaskStackSize;
+
+    void scheduleReconnect();
+    bool startHousekeeping();
+    static void housekeepingTimerStatic(void* arg);
+    static void housekeepingTaskStatic(void* arg);
+    void housekeeping();
+    void publishMetrics();
+
+    static void dispatchTaskStatic(void* arg);
+    bool dispatchQueuedEvent();
+    void forwardEvent(int32_t event_id, const esp_mqtt_event_t* event, uint8_t* poolBuffer);
+    void trackEvent(int32_t event_id, const esp_mqtt_event_t* event);
+    void processEvent(int32_t event_id, const esp_mqtt_event_t* event);
+
+    bool reassembleMessage(const esp_mqtt_event_t* event);
+    void forwardMessage(const esp_mqtt_event_t* event, uint8_t* poolBuffer);
+    void deliverMessage(const esp_mqtt_event_t* event);
+
+    std::mutex _publishPropertyMutex;   // esp-mqtt keeps the MQTT 5 publish properties until they are changed
+    ESP32_MQTTTopicAliasTable _topicAliases;
+    std::atomic<bool> _topicAliasReset;
+    TaskHandle_t _mqttTask;
+    const esp_mqtt_event_t* _currentMessage;    // message being delivered to the callbacks
+
+    int publishMessage(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, const ESP32_MQTTPublishProperties* properties);
+    int sendPublish(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties);
+    int sendPublishPacket(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    int sendPublishV5(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties);
+#endif
+
+    ESP32_MQTTTopicTrie _compressionTrie;   // topic filters with compression enabled
+    ESP32_MQTTCompressor _compressor;
+    size_t _compressionMaxMessageSize;
+    uint8_t* _compressBuf;
+    size_t _compressBufSize;
+    std::mutex _compressMutex;
+    uint8_t* _decompressBuf;            // topic + decompressed payload of the message being forwarded
+    bool _decompressingMessage;         // the chunks being received belong to a compressed message
+    std::atomic<uint32_t> _compressionInputBytes;     // written with _compressMutex locked, read by any task
+    std::atomic<uint32_t> _compressionOutputBytes;
+    std::atomic<unsigned int> _decompressionDropCount;    // written by the MQTT task, read by any task
+
+    bool isCompressedTopic(const char* topic, int topicLen);
+    int sendCompressed(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, bool enqueue, bool store, const ESP32_MQTTPublishProperties* properties);
+
+    ESP32_MQTTRetainedCache _retainedCache;
+    size_t _retainedCacheCapacity;
+    unsigned long _retainedRefreshIntervalMs;
+    ESP32_MQTTTopicTrie _retainedDeadbandTrie;
+    std::vector<float> _retainedDeadbands;     // indexed by the route id in _retainedDeadbandTrie
+    ESP32_MQTTRetainedStore _retainedStore;
+    size_t _retainedStoreCapacity;
+    size_t _retainedStoreMaxMessageSize;
+
+    float getRetainedDeadband(const char* topic);
+    void replayRetainedMessages(const char* topicFilter, ESP32_MQTTCallbacks::OnMqttMessageReceivedCallback& handler);
+    static void replayRetainedMessageStatic(char* topic, int topicLen, char* payload, int length, void* context);
+
+    bool _autoResubscribe;
+    int _pendingResubscribeAcks;
+    int _resubscribeFailedCount;
+    std::vector<esp_mqtt_topic_t> _resubscribeTopics;
+    ESP32_MQTTCallbacks::OnMqttSubscriptionsRestoredCallback _onMqttSubscriptionsRestoredCallback;
+    ESP32_MQTTCallbacks::OnMqttHealthChangedCallback _onMqttHealthChangedCallback;
+
+    void restoreSubscriptions();
+    void handleSubscribeAck(const esp_mqtt_event_t* event);
+    int sendSubscribe(const char* topic, int qos);
+
+    // SUBACKs handled before sendSubscribe() stored their msg_id in the route
+    struct EarlySubscribeAck
+    {
+        int msgId;
+        int grantedQos;
+    };
+    static const size_t MaxEarlySubscribeAcks = 4;
+    std::mutex _subscribeAckMutex;
+    int _subscribesInProgress;
+    EarlySubscribeAck _earlySubscribeAcks[MaxEarlySubscribeAcks];
+    size_t _earlySubscribeAckCount;
+
+    std::shared_ptr<TopicRoute> createTopicRoute(const char* filter, int qos);
+    void setTopicRoute(const std::shared_ptr<TopicRoute>& route, bool keepHandler);
+    void removeTopicRoute(const char* filter);
+    void publishTopicRoutes(const std::shared_ptr<TopicRouteTable>& table);
+    bool dispatchTopicRoutes(const esp_mqtt_event_t* event);
+    static void dispatchTopicRouteStatic(int routeId, void* context);
+
     static void handleMqttEventStatic(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
     void handleMqttEvent(esp_event_base_t event_base, int32_t event_id, void* event_data);
 
@@ -107,3 +536,42 @@ private:
     ESP32_MQTTCallbacks::OnMqttErrorCallback _onMqttErrorCallback;
     ESP32_MQTTCallbacks::OnMqttCustomEventCallback _onMqttCustomEventCallback;
 };
+
+template<template<typename> class Codec, typename T>
+int ESP32_MQTTClient::publishValue(const char* topic, const T& value, int qos, bool retain)
+{
+    uint8_t buf[Codec<T>::maxSize];
+    size_t length = Codec<T>::encode(value, buf);
+    return publish(topic, buf, length, qos, retain);
+}
+
+template<typename T, template<typename> class Codec, typename Handler>
+int ESP32_MQTTClient::subscribeValue(const char* topic, int qos, Handler handler)
+{
+    return subscribe(topic, qos, [handler](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+        // a value is never fragmented unless the in buffer is tiny
+        if (currentDataOffset != 0 || dataLen != totalDataLen)
+            return;
+
+        T value;
+        if (Codec<T>::decode((const uint8_t*)data, dataLen, value))
+            handler((const char*)topic, topicLen, value);
+        else
+            ESP32_MQTT_LOG(Data, Warning, "Can't decode message on topic %s", ESP32_MQTTLogText(topic, topicLen));
+    });
+}
+
+// Client which keeps copies of all configuration strings in a buffer of ConfigStorageSize bytes inside the object,
+// so the strings passed to the setters don't have to be kept alive and no heap is used for them.
+template<size_t ConfigStorageSize>
+class ESP32_MQTTStaticClient : public ESP32_MQTTClient
+{
+public:
+    ESP32_MQTTStaticClient()
+    {
+        setStringStorage(_configStorage, ConfigStorageSize);
+    }
+
+private:
+    char _configStorage[ConfigStorageSize];
+};
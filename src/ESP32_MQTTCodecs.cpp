@@ -0,0 +1,343 @@
+#include "ESP32_MQTTCodecs.h"
+#include <math.h>
+
+namespace ESP32_MQTTCodec
+{
+
+size_t formatUnsigned(uint64_t value, char* buf)
+{
+	char digits[20];
+	size_t count = 0;
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	for (size_t i = 0; i < count; i++)
+		buf[i] = digits[count - 1 - i];
+	return count;
+}
+
+size_t formatSigned(int64_t value, char* buf)
+{
+	if (value >= 0)
+		return formatUnsigned((uint64_t)value, buf);
+
+	buf[0] = '-';
+	// negate in unsigned arithmetic, -INT64_MIN doesn't fit int64_t
+	return 1 + formatUnsigned(0 - (uint64_t)value, buf + 1);
+}
+
+static size_t formatFixed(double value, int decimals, char* buf)
+{
+	uint64_t scale = 1;
+	for (int i = 0; i < decimals; i++)
+		scale *= 10;
+
+	uint64_t whole = (uint64_t)value;
+	uint64_t fraction = (uint64_t)((value - (double)whole) * (double)scale + 0.5);
+	if (fraction >= scale)
+	{
+		whole++;
+		fraction -= scale;
+	}
+
+	size_t len = formatUnsigned(whole, buf);
+	if (fraction == 0)
+		return len;
+
+	buf[len++] = '.';
+	for (uint64_t digit = scale / 10; digit > 0 && fraction > 0; digit /= 10)
+	{
+		buf[len++] = '0' + fraction / digit;
+		fraction %= digit;
+	}
+	return len;
+}
+
+size_t formatDouble(double value, int decimals, char* buf)
+{
+	if (isnan(value))
+	{
+		memcpy(buf, "nan", 3);
+		return 3;
+	}
+
+	size_t len = 0;
+	if (signbit(value) && value != 0)
+	{
+		buf[len++] = '-';
+		value = -value;
+	}
+	if (isinf(value))
+	{
+		memcpy(buf + len, "inf", 3);
+		return len + 3;
+	}
+
+	if (value == 0 || (value >= 1e-4 && value < 1e15))
+		return len + formatFixed(value, decimals, buf + len);
+
+	int exponent = (int)floor(log10(value));
+	double mantissa = value / pow(10, exponent);
+	if (mantissa >= 10)
+	{
+		mantissa /= 10;
+		exponent++;
+	}
+	len += formatFixed(mantissa, decimals, buf + len);
+	buf[len++] = 'e';
+	len += formatSigned(exponent, buf + len);
+	return len;
+}
+
+bool parseUnsigned(const char* text, size_t length, uint64_t& value)
+{
+	if (length == 0 || length > 20)
+		return false;
+
+	uint64_t result = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		if (text[i] < '0' || text[i] > '9')
+			return false;
+		uint64_t digit = text[i] - '0';
+		if (result > (UINT64_MAX - digit) / 10)
+			return false;
+		result = result * 10 + digit;
+	}
+	value = result;
+	return true;
+}
+
+bool parseSigned(const char* text, size_t length, int64_t& value)
+{
+	bool negative = length > 0 && text[0] == '-';
+	if (negative || (length > 0 && text[0] == '+'))
+	{
+		text++;
+		length--;
+	}
+
+	uint64_t magnitude;
+	if (!parseUnsigned(text, length, magnitude))
+		return false;
+	if (magnitude > (negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))
+		return false;
+
+	value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+	return true;
+}
+
+bool parseDouble(const char* text, size_t length, double& value)
+{
+	size_t i = 0;
+	bool negative = false;
+	if (i < length && (text[i] == '-' || text[i] == '+'))
+		negative = text[i++] == '-';
+
+	if (length - i == 3 && memcmp(text + i, "nan", 3) == 0)
+	{
+		value = NAN;
+		return true;
+	}
+	if (length - i == 3 && memcmp(text + i, "inf", 3) == 0)
+	{
+		value = negative ? -INFINITY : INFINITY;
+		return true;
+	}
+
+	// up to 19 significant digits are collected in an integer, the rest only moves the exponent
+	uint64_t mantissa = 0;
+	int significantDigits = 0;
+	int exponent = 0;
+	bool anyDigit = false;
+	for (; i < length && text[i] >= '0' && text[i] <= '9'; i++)
+	{
+		anyDigit = true;
+		if (significantDigits < 19)
+		{
+			mantissa = mantissa * 10 + (text[i] - '0');
+			if (mantissa != 0)
+				significantDigits++;
+		}
+		else
+			exponent++;
+	}
+	if (i < length && text[i] == '.')
+	{
+		for (i++; i < length && text[i] >= '0' && text[i] <= '9'; i++)
+		{
+			anyDigit = true;
+			if (significantDigits < 19)
+			{
+				mantissa = mantissa * 10 + (text[i] - '0');
+				if (mantissa != 0)
+					significantDigits++;
+				exponent--;
+			}
+		}
+	}
+	if (!anyDigit)
+		return false;
+
+	if (i < length && (text[i] == 'e' || text[i] == 'E'))
+	{
+		int64_t e;
+		if (!parseSigned(text + i + 1, length - i - 1, e) || e < -400 || e > 400)
+			return false;
+		exponent += (int)e;
+		i = length;
+	}
+	if (i != length)
+		return false;
+
+	double result = (double)mantissa;
+	if (exponent < 0)
+		result /= pow(10, -exponent);
+	else if (exponent > 0)
+		result *= pow(10, exponent);
+	value = negative ? -result : result;
+	return true;
+}
+
+static size_t cborEncodeHead(uint8_t majorType, uint64_t argument, uint8_t* buf)
+{
+	majorType <<= 5;
+	if (argument < 24)
+	{
+		buf[0] = majorType | (uint8_t)argument;
+		return 1;
+	}
+
+	size_t size;
+	if (argument <= 0xff)
+	{
+		buf[0] = majorType | 24;
+		size = 1;
+	}
+	else if (argument <= 0xffff)
+	{
+		buf[0] = majorType | 25;
+		size = 2;
+	}
+	else if (argument <= 0xffffffff)
+	{
+		buf[0] = majorType | 26;
+		size = 4;
+	}
+	else
+	{
+		buf[0] = majorType | 27;
+		size = 8;
+	}
+
+	// big-endian
+	for (size_t i = 0; i < size; i++)
+		buf[size - i] = (uint8_t)(argument >> (8 * i));
+	return 1 + size;
+}
+
+size_t cborEncodeUnsigned(uint64_t value, uint8_t* buf)
+{
+	return cborEncodeHead(0, value, buf);
+}
+
+size_t cborEncodeInteger(int64_t value, uint8_t* buf)
+{
+	if (value >= 0)
+		return cborEncodeHead(0, (uint64_t)value, buf);
+	// negative integers are encoded as -1 - n
+	return cborEncodeHead(1, (uint64_t)(-1 - value), buf);
+}
+
+size_t cborEncodeDouble(double value, bool singlePrecision, uint8_t* buf)
+{
+	if (singlePrecision)
+	{
+		float f = (float)value;
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		buf[0] = 0xfa;
+		for (int i = 0; i < 4; i++)
+			buf[4 - i] = (uint8_t)(bits >> (8 * i));
+		return 5;
+	}
+
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	buf[0] = 0xfb;
+	for (int i = 0; i < 8; i++)
+		buf[8 - i] = (uint8_t)(bits >> (8 * i));
+	return 9;
+}
+
+static double cborHalfToDouble(uint16_t half)
+{
+	int exponent = (half >> 10) & 0x1f;
+	int mantissa = half & 0x3ff;
+	double value;
+	if (exponent == 0)
+		value = ldexp(mantissa, -24);
+	else if (exponent != 31)
+		value = ldexp(mantissa + 1024, exponent - 25);
+	else
+		value = mantissa == 0 ? INFINITY : NAN;
+	return (half & 0x8000) ? -value : value;
+}
+
+bool cborDecodeNumber(const uint8_t* data, size_t length, bool& isInteger, bool& isNegative, uint64_t& integerValue, double& doubleValue)
+{
+	if (length == 0)
+		return false;
+
+	uint8_t majorType = data[0] >> 5;
+	uint8_t info = data[0] & 0x1f;
+
+	size_t size;
+	if (info < 24)
+		size = 0;
+	else if (info <= 27)
+		size = (size_t)1 << (info - 24);
+	else
+		return false;
+	// exactly one data item
+	if (length != 1 + size)
+		return false;
+
+	uint64_t argument = size == 0 ? info : 0;
+	for (size_t i = 0; i < size; i++)
+		argument = (argument << 8) | data[1 + i];
+
+	if (majorType == 0 || majorType == 1)
+	{
+		isInteger = true;
+		isNegative = majorType == 1;
+		integerValue = argument;
+		return true;
+	}
+	if (majorType != 7 || size < 2)
+		return false;
+
+	isInteger = false;
+	isNegative = false;
+	if (size == 2)
+	{
+		doubleValue = cborHalfToDouble((uint16_t)argument);
+	}
+	else if (size == 4)
+	{
+		uint32_t bits = (uint32_t)argument;
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		doubleValue = f;
+	}
+	else
+	{
+		memcpy(&doubleValue, &argument, sizeof(doubleValue));
+	}
+	return true;
+}
+
+}
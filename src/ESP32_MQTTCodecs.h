@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits>
+#include <type_traits>
+
+// Payload codecs used by ESP32_MQTTClient::publishValue() / subscribeValue(). A codec is a class template with
+//   static constexpr size_t maxSize;                                          // upper bound of the encoded size
+//   static size_t encode(const T& value, uint8_t* buf);                       // buf has maxSize bytes, returns the encoded size
+//   static bool decode(const uint8_t* data, size_t length, T& value);
+// The codec is a template argument, so encoding is resolved at compile time and uses only the stack.
+
+// helpers shared by the codecs, implemented in ESP32_MQTTCodecs.cpp
+namespace ESP32_MQTTCodec
+{
+    size_t formatUnsigned(uint64_t value, char* buf);
+    size_t formatSigned(int64_t value, char* buf);
+    size_t formatDouble(double value, int decimals, char* buf);    // fixed point with trailing zeros removed, exponent notation outside 1e-4 .. 1e15
+    bool parseUnsigned(const char* text, size_t length, uint64_t& value);
+    bool parseSigned(const char* text, size_t length, int64_t& value);
+    bool parseDouble(const char* text, size_t length, double& value);
+
+    size_t cborEncodeInteger(int64_t value, uint8_t* buf);
+    size_t cborEncodeUnsigned(uint64_t value, uint8_t* buf);
+    size_t cborEncodeDouble(double value, bool singlePrecision, uint8_t* buf);
+    // integer items set isInteger and integerValue (negative if isNegative), floating point items set doubleValue
+    bool cborDecodeNumber(const uint8_t* data, size_t length, bool& isInteger, bool& isNegative, uint64_t& integerValue, double& doubleValue);
+
+    constexpr size_t formatDoubleMaxSize = 32;
+}
+
+// The value's memory as is, i.e. little-endian on the ESP32. For arithmetic types and plain structs shared with
+// a peer of the same architecture and compiler.
+template<typename T>
+class ESP32_MQTTRawCodec
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ESP32_MQTTRawCodec requires a trivially copyable type");
+
+public:
+    static constexpr size_t maxSize = sizeof(T);
+
+    static size_t encode(const T& value, uint8_t* buf)
+    {
+        memcpy(buf, &value, sizeof(T));
+        return sizeof(T);
+    }
+
+    static bool decode(const uint8_t* data, size_t length, T& value)
+    {
+        if (length != sizeof(T))
+            return false;
+        memcpy(&value, data, sizeof(T));
+        return true;
+    }
+};
+
+// Decimal text ("21.5", "-3", "true") formatted and parsed without printf/strtod. float values are written with
+// up to 4 decimals, double values with up to 6.
+template<typename T>
+class ESP32_MQTTTextCodec
+{
+    static_assert(std::is_arithmetic<T>::value, "ESP32_MQTTTextCodec requires an arithmetic type");
+
+public:
+    static constexpr size_t maxSize = std::is_floating_point<T>::value ? ESP32_MQTTCodec::formatDoubleMaxSize : 21;
+    static constexpr int decimals = std::is_same<T, float>::value ? 4 : 6;
+
+    static size_t encode(const T& value, uint8_t* buf)
+    {
+        char* text = reinterpret_cast<char*>(buf);
+        if (std::is_same<T, bool>::value)
+        {
+            const char* str = value ? "true" : "false";
+            size_t len = strlen(str);
+            memcpy(text, str, len);
+            return len;
+        }
+        if (std::is_floating_point<T>::value)
+            return ESP32_MQTTCodec::formatDouble((double)value, decimals, text);
+        if (std::is_signed<T>::value)
+            return ESP32_MQTTCodec::formatSigned((int64_t)value, text);
+        return ESP32_MQTTCodec::formatUnsigned((uint64_t)value, text);
+    }
+
+    static bool decode(const uint8_t* data, size_t length, T& value)
+    {
+        const char* text = reinterpret_cast<const char*>(data);
+        if (std::is_same<T, bool>::value)
+        {
+            if ((length == 4 && memcmp(text, "true", 4) == 0) || (length == 1 && text[0] == '1'))
+                value = (T)1;
+            else if ((length == 5 && memcmp(text, "false", 5) == 0) || (length == 1 && text[0] == '0'))
+                value = (T)0;
+            else
+                return false;
+            return true;
+        }
+        if (std::is_floating_point<T>::value)
+        {
+            double d;
+            if (!ESP32_MQTTCodec::parseDouble(text, length, d))
+                return false;
+            value = (T)d;
+            return true;
+        }
+        if (std::is_signed<T>::value)
+        {
+            int64_t i;
+            if (!ESP32_MQTTCodec::parseSigned(text, length, i) || i < (int64_t)std::numeric_limits<T>::min() || i > (int64_t)std::numeric_limits<T>::max())
+                return false;
+            value = (T)i;
+            return true;
+        }
+        uint64_t u;
+        if (!ESP32_MQTTCodec::parseUnsigned(text, length, u) || u > (uint64_t)std::numeric_limits<T>::max())
+            return false;
+        value = (T)u;
+        return true;
+    }
+};
+
+// A single CBOR (RFC 8949) data item: integers in the shortest encoding, float as single and double as double
+// precision, bool as simple values. Decoding accepts any integer or half/single/double precision float.
+template<typename T>
+class ESP32_MQTTCborCodec
+{
+    static_assert(std::is_arithmetic<T>::value, "ESP32_MQTTCborCodec requires an arithmetic type");
+
+public:
+    static constexpr size_t maxSize = 9;
+
+    static size_t encode(const T& value, uint8_t* buf)
+    {
+        if (std::is_same<T, bool>::value)
+        {
+            buf[0] = value ? 0xf5 : 0xf4;
+            return 1;
+        }
+        if (std::is_floating_point<T>::value)
+            return ESP32_MQTTCodec::cborEncodeDouble((double)value, std::is_same<T, float>::value, buf);
+        if (std::is_signed<T>::value)
+            return ESP32_MQTTCodec::cborEncodeInteger((int64_t)value, buf);
+        return ESP32_MQTTCodec::cborEncodeUnsigned((uint64_t)value, buf);
+    }
+
+    static bool decode(const uint8_t* data, size_t length, T& value)
+    {
+        if (std::is_same<T, bool>::value)
+        {
+            if (length != 1 || (data[0] != 0xf4 && data[0] != 0xf5))
+                return false;
+            value = (T)(data[0] == 0xf5);
+            return true;
+        }
+
+        bool isInteger, isNegative;
+        uint64_t integerValue;
+        double doubleValue;
+        if (!ESP32_MQTTCodec::cborDecodeNumber(data, length, isInteger, isNegative, integerValue, doubleValue))
+            return false;
+
+        if (std::is_floating_point<T>::value)
+        {
+            if (isInteger)
+                value = isNegative ? (T)(-1.0 - (double)integerValue) : (T)integerValue;
+            else
+                value = (T)doubleValue;
+            return true;
+        }
+
+        // integral types don't accept floating point items
+        if (!isInteger)
+            return false;
+        if (isNegative)
+        {
+            // encoded as -1 - integerValue
+            if (!std::is_signed<T>::value || integerValue > (uint64_t)(-(std::numeric_limits<T>::min() + 1)))
+                return false;
+            value = (T)(-1 - (int64_t)integerValue);
+            return true;
+        }
+        if (integerValue > (uint64_t)std::numeric_limits<T>::max())
+            return false;
+        value = (T)integerValue;
+        return true;
+    }
+};
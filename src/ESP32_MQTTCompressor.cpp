@@ -0,0 +1,293 @@
+#include "ESP32_MQTTCompressor.h"
+
+// LZ4 block format limits
+#define MIN_MATCH 4
+#define LAST_LITERALS 5         // the last 5 bytes are always literals
+#define MATCH_FIND_LIMIT 12     // the last match starts at least 12 bytes before the end
+#define MAX_DISTANCE 65535
+
+#define METHOD_STORED 0
+#define METHOD_LZ4 1
+
+ESP32_MQTTCompressor::ESP32_MQTTCompressor()
+{
+	_hashTable = nullptr;
+	_hashBits = 0;
+}
+
+ESP32_MQTTCompressor::~ESP32_MQTTCompressor()
+{
+	deinit();
+}
+
+bool ESP32_MQTTCompressor::init(uint8_t hashBits)
+{
+	deinit();
+
+	if (hashBits < 8 || hashBits > 16)
+		return false;
+
+	_hashTable = (uint32_t*)malloc(sizeof(uint32_t) << hashBits);
+	if (_hashTable == nullptr)
+	{
+		log_e("Can't allocate compression table of %u bytes", sizeof(uint32_t) << hashBits);
+		return false;
+	}
+	_hashBits = hashBits;
+	return true;
+}
+
+void ESP32_MQTTCompressor::deinit()
+{
+	if (_hashTable != nullptr)
+		free(_hashTable);
+	_hashTable = nullptr;
+	_hashBits = 0;
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint8_t* writeLength(uint8_t* op, size_t length)
+{
+	// length beyond the 4 bits of the token continues in bytes of 255, terminated by a smaller one
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+size_t ESP32_MQTTCompressor::compress(const uint8_t* payload, size_t length, uint8_t* buf, size_t bufSize)
+{
+	if (bufSize < ESP32_MQTT_COMPRESSION_HEADER_SIZE || length > UINT32_MAX)
+		return 0;
+
+	buf[1] = (uint8_t)length;
+	buf[2] = (uint8_t)(length >> 8);
+	buf[3] = (uint8_t)(length >> 16);
+	buf[4] = (uint8_t)(length >> 24);
+
+	size_t compressedLen = 0;
+	if (_hashTable != nullptr && length >= ESP32_MQTT_COMPRESSION_MIN_SIZE)
+		compressedLen = compressBlock(payload, length, buf + ESP32_MQTT_COMPRESSION_HEADER_SIZE, bufSize - ESP32_MQTT_COMPRESSION_HEADER_SIZE);
+
+	if (compressedLen > 0 && compressedLen < length)
+	{
+		buf[0] = METHOD_LZ4;
+		return ESP32_MQTT_COMPRESSION_HEADER_SIZE + compressedLen;
+	}
+
+	// incompressible (already compressed, encrypted, too short)
+	if (bufSize - ESP32_MQTT_COMPRESSION_HEADER_SIZE < length)
+		return 0;
+	buf[0] = METHOD_STORED;
+	if (length > 0)
+		memcpy(buf + ESP32_MQTT_COMPRESSION_HEADER_SIZE, payload, length);
+	return ESP32_MQTT_COMPRESSION_HEADER_SIZE + length;
+}
+
+int ESP32_MQTTCompressor::getOriginalLength(const uint8_t* data, size_t length)
+{
+	if (data == nullptr || length < ESP32_MQTT_COMPRESSION_HEADER_SIZE || data[0] > METHOD_LZ4)
+		return -1;
+
+	uint32_t originalLen = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+	return originalLen <= INT32_MAX ? (int)originalLen : -1;
+}
+
+int ESP32_MQTTCompressor::decompress(const uint8_t* data, size_t length, uint8_t* buf, size_t bufSize)
+{
+	int originalLen = getOriginalLength(data, length);
+	if (originalLen < 0 || (size_t)originalLen > bufSize)
+		return -1;
+
+	const uint8_t* src = data + ESP32_MQTT_COMPRESSION_HEADER_SIZE;
+	size_t srcLen = length - ESP32_MQTT_COMPRESSION_HEADER_SIZE;
+	if (data[0] == METHOD_STORED)
+	{
+		if (srcLen != (size_t)originalLen)
+			return -1;
+		memcpy(buf, src, srcLen);
+		return originalLen;
+	}
+
+	// the output is limited to the announced length, a block decoding to anything else is corrupted
+	return decompressBlock(src, srcLen, buf, originalLen) == originalLen ? originalLen : -1;
+}
+
+/// <summary>
+/// Greedy LZ4 compression: every position is hashed into the table, a match is taken when the last position with
+/// the same hash holds the same 4 bytes. Runs without matches are skipped in growing steps, so incompressible data
+/// costs little time.
+/// </summary>
+/// <returns>compressed length, 0 if it doesn't fit dstSize</returns>
+size_t ESP32_MQTTCompressor::compressBlock(const uint8_t* src, size_t length, uint8_t* dst, size_t dstSize)
+{
+	memset(_hashTable, 0, sizeof(uint32_t) << _hashBits);
+	const int shift = 32 - _hashBits;
+
+	uint8_t* op = dst;
+	uint8_t* const opEnd = dst + dstSize;
+	size_t anchor = 0;     // start of the pending literals
+	size_t ip = 1;         // position 0 is the table's empty value
+	size_t matchStartLimit = length >= MATCH_FIND_LIMIT ? length - MATCH_FIND_LIMIT : 0;
+	size_t matchEndLimit = length - LAST_LITERALS;
+
+	while (ip <= matchStartLimit)
+	{
+		uint32_t sequence = read32(src + ip);
+		uint32_t hash = (sequence * 2654435761u) >> shift;
+		size_t candidate = _hashTable[hash];
+		_hashTable[hash] = ip;
+
+		if (candidate == 0 || ip - candidate > MAX_DISTANCE || read32(src + candidate) != sequence)
+		{
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		// extend the match backwards into the literals and forwards up to the last literals
+		while (ip > anchor && candidate > 0 && src[ip - 1] == src[candidate - 1])
+		{
+			ip--;
+			candidate--;
+		}
+		size_t matchLen = MIN_MATCH;
+		while (ip + matchLen < matchEndLimit && src[ip + matchLen] == src[candidate + matchLen])
+			matchLen++;
+
+		size_t literalLen = ip - anchor;
+		// token, literal length, literals, offset, match length
+		if ((size_t)(opEnd - op) < 1 + literalLen / 255 + 1 + literalLen + 2 + (matchLen - MIN_MATCH) / 255 + 1)
+			return 0;
+
+		uint8_t* token = op++;
+		if (literalLen >= 15)
+		{
+			*token = 15 << 4;
+			op = writeLength(op, literalLen - 15);
+		}
+		else
+		{
+			*token = literalLen << 4;
+		}
+		memcpy(op, src + anchor, literalLen);
+		op += literalLen;
+
+		size_t distance = ip - candidate;
+		*op++ = (uint8_t)distance;
+		*op++ = (uint8_t)(distance >> 8);
+
+		if (matchLen - MIN_MATCH >= 15)
+		{
+			*token |= 15;
+			op = writeLength(op, matchLen - MIN_MATCH - 15);
+		}
+		else
+		{
+			*token |= matchLen - MIN_MATCH;
+		}
+
+		ip += matchLen;
+		anchor = ip;
+		// the position just before the end of the match is often where the next one starts
+		if (ip - 2 <= matchStartLimit)
+			_hashTable[(read32(src + ip - 2) * 2654435761u) >> shift] = ip - 2;
+	}
+
+	size_t literalLen = length - anchor;
+	if ((size_t)(opEnd - op) < 1 + literalLen / 255 + 1 + literalLen)
+		return 0;
+
+	if (literalLen >= 15)
+	{
+		*op++ = 15 << 4;
+		op = writeLength(op, literalLen - 15);
+	}
+	else
+	{
+		*op++ = literalLen << 4;
+	}
+	memcpy(op, src + anchor, literalLen);
+	op += literalLen;
+	return op - dst;
+}
+
+/// <summary>
+/// Decodes an LZ4 block, every length and offset is checked against the input and the output, so malformed data
+/// from the network can't read or write out of bounds.
+/// </summary>
+/// <returns>decompressed length, -1 on malformed data or if it doesn't fit dstSize</returns>
+int ESP32_MQTTCompressor::decompressBlock(const uint8_t* src, size_t length, uint8_t* dst, size_t dstSize)
+{
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < length)
+	{
+		uint8_t token = src[ip++];
+
+		size_t literalLen = token >> 4;
+		if (literalLen == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= length)
+					return -1;
+				b = src[ip++];
+				literalLen += b;
+			} while (b == 255);
+		}
+		if (literalLen > length - ip || literalLen > dstSize - op)
+			return -1;
+		memcpy(dst + op, src + ip, literalLen);
+		ip += literalLen;
+		op += literalLen;
+
+		// the last sequence has only literals
+		if (ip == length)
+			break;
+
+		if (length - ip < 2)
+			return -1;
+		size_t distance = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (distance == 0 || distance > op)
+			return -1;
+
+		size_t matchLen = token & 15;
+		if (matchLen == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= length)
+					return -1;
+				b = src[ip++];
+				matchLen += b;
+			} while (b == 255);
+		}
+		matchLen += MIN_MATCH;
+		if (matchLen > dstSize - op)
+			return -1;
+
+		uint8_t* out = dst + op;
+		const uint8_t* match = out - distance;
+		if (distance >= matchLen)
+		{
+			memcpy(out, match, matchLen);
+		}
+		else
+		{
+			// overlapping copy repeats the last distance bytes
+			for (size_t i = 0; i < matchLen; i++)
+				out[i] = match[i];
+		}
+		op += matchLen;
+	}
+	return (int)op;
+}
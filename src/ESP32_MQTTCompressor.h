@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+
+#define ESP32_MQTT_COMPRESSION_HASH_BITS 10         // match finder table of 2^bits positions (4 KB), more bits find more matches in long payloads
+#define ESP32_MQTT_COMPRESSION_MIN_SIZE 64          // shorter payloads are sent stored, the sequence overhead outweighs the matches
+#define ESP32_MQTT_COMPRESSION_HEADER_SIZE 5        // method (0 stored, 1 LZ4 block) and the original length (4 bytes, little-endian)
+
+// LZ4 block compression with a fixed size match finder table allocated in init(). Compressed payloads start with
+// a header carrying the method and the original length, so the receiver knows the output size before decompressing
+// and rejects anything bigger than its buffer. The block format is the one of LZ4_compress_default(), peers can
+// decompress the data after the header with LZ4_decompress_safe(). compress() is not thread safe, decompress() is.
+class ESP32_MQTTCompressor
+{
+public:
+    ESP32_MQTTCompressor();
+    ~ESP32_MQTTCompressor();
+
+    bool init(uint8_t hashBits = ESP32_MQTT_COMPRESSION_HASH_BITS);
+    void deinit();
+
+    size_t compress(const uint8_t* payload, size_t length, uint8_t* buf, size_t bufSize);  // header + data, stored if it doesn't get smaller. Returns 0 if buf is too small.
+    static int decompress(const uint8_t* data, size_t length, uint8_t* buf, size_t bufSize);    // returns the original length, -1 if the data is malformed or doesn't fit buf
+    static int getOriginalLength(const uint8_t* data, size_t length);   // from the header, -1 if there is no valid header
+
+    static inline size_t getMaxCompressedSize(size_t length) { return ESP32_MQTT_COMPRESSION_HEADER_SIZE + length + length / 255 + 16; }
+    inline bool isInitialized() { return _hashTable != nullptr; }
+    inline size_t getWorkingMemorySize() { return sizeof(uint32_t) << _hashBits; }
+
+private:
+    uint32_t* _hashTable;       // last position of every hashed 4 byte sequence
+    uint8_t _hashBits;
+
+    size_t compressBlock(const uint8_t* src, size_t length, uint8_t* dst, size_t dstSize);
+    static int decompressBlock(const uint8_t* src, size_t length, uint8_t* dst, size_t dstSize);
+};
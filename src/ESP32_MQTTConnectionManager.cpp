@@ -0,0 +1,237 @@
+#include "ESP32_MQTTConnectionManager.h"
+
+ESP32_MQTTConnectionManager::ESP32_MQTTConnectionManager()
+{
+	_connectionCount = 0;
+	_forwardedCount = 0;
+	_forwardDropCount = 0;
+	_dispatchQueueCapacity = 0;
+	_dispatchTaskPriority = 1;
+	_dispatchTaskCoreId = tskNO_AFFINITY;
+	_dispatchTaskStackSize = 4096;
+	_dispatchTask = nullptr;
+	_dispatchStopRequested = false;
+	_dispatchStopped = false;
+	_reassemblyMaxMessageSize = 0;
+	_reassemblyBufferCount = 0;
+}
+
+ESP32_MQTTConnectionManager::~ESP32_MQTTConnectionManager()
+{
+	// no more events once the esp-mqtt tasks are stopped, the shared task ends after dispatching the queued ones
+	if (_dispatchTask != nullptr)
+	{
+		stop();
+		_dispatchStopRequested = true;
+		xTaskNotifyGive(_dispatchTask);
+		while (!_dispatchStopped)
+			vTaskDelay(1);
+	}
+	for (size_t i = 0; i < _connectionCount; i++)
+		delete _connections[i];
+	for (ForwardingRule* rule : _forwardingRules)
+	{
+		free(rule->fromPrefix);
+		free(rule->toPrefix);
+		delete rule;
+	}
+}
+
+int ESP32_MQTTConnectionManager::addConnection(const char* uri)
+{
+	if (_connectionCount == ESP32_MQTT_MAX_CONNECTIONS)
+	{
+		log_e("Can't add more than %d connections", ESP32_MQTT_MAX_CONNECTIONS);
+		return -1;
+	}
+
+	ESP32_MQTTClient* client = new ESP32_MQTTClient();
+	client->setBrokerUri(uri);
+	_connections[_connectionCount] = client;
+	return _connectionCount++;
+}
+
+void ESP32_MQTTConnectionManager::enableSharedDispatch(size_t queueCapacity, int priority, int coreId, uint32_t stackSize)
+{
+	_dispatchQueueCapacity = queueCapacity;
+	_dispatchTaskPriority = priority;
+	_dispatchTaskCoreId = coreId;
+	_dispatchTaskStackSize = stackSize;
+}
+
+void ESP32_MQTTConnectionManager::enableSharedReassembly(size_t maxMessageSize, size_t bufferCount)
+{
+	_reassemblyMaxMessageSize = maxMessageSize;
+	_reassemblyBufferCount = bufferCount;
+}
+
+/// <summary>
+/// Subscribes the source connection to fromPrefix + topicFilter and publishes every message received on it to the destination
+/// connection, with fromPrefix replaced by toPrefix. e.g. fromPrefix "plant/", topicFilter "line1/#" and toPrefix "site-42/plant/"
+/// forward "plant/line1/press/temperature" as "site-42/plant/line1/press/temperature". The subscription is restored after every
+/// reconnect. Rules in opposite directions must not match each other's output, a message would go back and forth.
+/// </summary>
+/// <returns>rule id, -1 if a connection or the filter is invalid</returns>
+int ESP32_MQTTConnectionManager::addForwardingRule(int fromConnection, const char* topicFilter, int toConnection, int qos, const char* fromPrefix, const char* toPrefix)
+{
+	ESP32_MQTTClient* source = getConnection(fromConnection);
+	if (source == nullptr || getConnection(toConnection) == nullptr || fromConnection == toConnection)
+	{
+		log_e("Invalid forwarding from connection %d to %d", fromConnection, toConnection);
+		return -1;
+	}
+
+	// the prefix is cut off by length
+	if ((fromPrefix != nullptr && strpbrk(fromPrefix, "+#") != nullptr) || (toPrefix != nullptr && strpbrk(toPrefix, "+#") != nullptr))
+	{
+		log_e("Forwarding prefixes can't contain wildcards");
+		return -1;
+	}
+
+	size_t fromPrefixLen = fromPrefix != nullptr ? strlen(fromPrefix) : 0;
+	size_t filterLen = strlen(topicFilter);
+	char* filter = (char*)malloc(fromPrefixLen + filterLen + 1);
+	if (filter == nullptr)
+		return -1;
+	memcpy(filter, fromPrefix, fromPrefixLen);
+	memcpy(filter + fromPrefixLen, topicFilter, filterLen + 1);
+	if (!ESP32_MQTTTopicTrie::isValidFilter(filter))
+	{
+		log_e("Invalid topic filter '%s'", filter);
+		free(filter);
+		return -1;
+	}
+
+	ForwardingRule* rule = new ForwardingRule();
+	rule->toConnection = toConnection;
+	rule->qos = qos;
+	rule->fromPrefix = strdup(fromPrefix != nullptr ? fromPrefix : "");
+	rule->fromPrefixLen = fromPrefixLen;
+	rule->toPrefix = strdup(toPrefix != nullptr ? toPrefix : "");
+	rule->toPrefixLen = strlen(rule->toPrefix);
+	_forwardingRules.push_back(rule);
+
+	// sent once connected
+	source->enableAutoResubscribe();
+	source->subscribe(filter, qos, [this, rule](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+		forward(*rule, topic, topicLen, data, dataLen, currentDataOffset, totalDataLen, retain);
+	});
+	free(filter);
+	return _forwardingRules.size() - 1;
+}
+
+void ESP32_MQTTConnectionManager::forward(ForwardingRule& rule, const char* topic, int topicLen, const char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain)
+{
+	// chunks can't be published one by one, enableSharedReassembly() delivers big messages in one piece
+	if (currentDataOffset != 0 || dataLen != totalDataLen)
+	{
+		if (currentDataOffset == 0)
+			_forwardDropCount++;
+		return;
+	}
+
+	char rewrittenTopic[ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH + 1];
+	size_t suffixLen = topicLen - rule.fromPrefixLen;
+	if (rule.toPrefixLen + suffixLen > ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH)
+	{
+		ESP32_MQTT_LOG(Data, Warning, "Forwarded topic %s too long", ESP32_MQTTLogText(topic, topicLen));
+		_forwardDropCount++;
+		return;
+	}
+	memcpy(rewrittenTopic, rule.toPrefix, rule.toPrefixLen);
+	memcpy(rewrittenTopic + rule.toPrefixLen, topic + rule.fromPrefixLen, suffixLen);
+	rewrittenTopic[rule.toPrefixLen + suffixLen] = '\0';
+
+	// the async publish queue keeps the dispatch task from waiting for the destination's socket
+	ESP32_MQTTClient* destination = _connections[rule.toConnection];
+	int result;
+	if (destination->_publishClasses[0].queue.isInitialized())
+		result = destination->publishAsync(rewrittenTopic, (const uint8_t*)data, dataLen, rule.qos, retain);
+	else
+		result = destination->publish(rewrittenTopic, (const uint8_t*)data, dataLen, rule.qos, retain);
+
+	if (result < 0)
+		_forwardDropCount++;
+	else
+		_forwardedCount++;
+}
+
+bool ESP32_MQTTConnectionManager::start()
+{
+	if (_reassemblyMaxMessageSize > 0 && !_reassemblyPool.isInitialized())
+	{
+		if (!_reassemblyPool.init(_reassemblyMaxMessageSize, _reassemblyBufferCount))
+			return false;
+	}
+
+	if (_dispatchQueueCapacity > 0 && _dispatchTask == nullptr)
+	{
+		if (xTaskCreatePinnedToCore(dispatchTaskStatic, "mqtt_dispatch", _dispatchTaskStackSize, this, _dispatchTaskPriority, &_dispatchTask, _dispatchTaskCoreId) != pdPASS)
+		{
+			log_e("Can't create MQTT dispatch task");
+			_dispatchTask = nullptr;
+			return false;
+		}
+		ESP32_MQTT_TRACE_TASK_NAME(_dispatchTask, "shared dispatch");
+	}
+
+	bool started = true;
+	for (size_t i = 0; i < _connectionCount; i++)
+	{
+		ESP32_MQTTClient* client = _connections[i];
+		if (_reassemblyPool.isInitialized())
+			client->_reassemblyPool = &_reassemblyPool;
+		if (_dispatchTask != nullptr)
+		{
+			// createClient() allocates the queue and leaves the task alone
+			client->_dispatchQueueCapacity = _dispatchQueueCapacity;
+			client->_dispatchTask = _dispatchTask;
+			client->_dispatchTaskShared = true;
+		}
+		if (!client->start())
+		{
+			log_e("Can't start connection %u", i);
+			started = false;
+		}
+	}
+	return started;
+}
+
+bool ESP32_MQTTConnectionManager::stop()
+{
+	bool stopped = true;
+	for (size_t i = 0; i < _connectionCount; i++)
+	{
+		if (!_connections[i]->stop())
+			stopped = false;
+	}
+	return stopped;
+}
+
+size_t ESP32_MQTTConnectionManager::getSharedMemoryUsage()
+{
+	return _reassemblyPool.getBufferSize() * _reassemblyPool.getBufferCount();
+}
+
+void ESP32_MQTTConnectionManager::dispatchTaskStatic(void* arg)
+{
+	ESP32_MQTTConnectionManager* manager = static_cast<ESP32_MQTTConnectionManager*>(arg);
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (manager->_dispatchStopRequested)
+		{
+			manager->_dispatchStopped = true;
+			vTaskDelete(nullptr);
+		}
+
+		// one event of every connection in turn, a busy broker doesn't hold back the others
+		bool dispatched;
+		do
+		{
+			dispatched = false;
+			for (size_t i = 0; i < manager->_connectionCount; i++)
+				dispatched |= manager->_connections[i]->dispatchQueuedEvent();
+		} while (dispatched);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "ESP32_MQTTClient.h"
+
+#define ESP32_MQTT_MAX_CONNECTIONS 4                // broker connections of one manager
+#define ESP32_MQTT_FORWARD_MAX_TOPIC_LENGTH 128     // rewritten topics are built on the stack
+
+// Several broker connections (e.g. a plant floor broker and a cloud broker) sharing what doesn't have to be per
+// connection. esp-mqtt runs every connection in its own task, but the events of all of them go through
+// handleMqttEventStatic() into per-connection queues drained by one dispatch task, and the reassembly buffers come
+// from one pool. Forwarding rules bridge messages between the connections, optionally replacing a topic prefix.
+// The manager owns the connections, configure them through getConnection() before start().
+class ESP32_MQTTConnectionManager
+{
+public:
+    ESP32_MQTTConnectionManager();
+    ~ESP32_MQTTConnectionManager();
+
+    int addConnection(const char* uri);     // returns the connection id, -1 if there are already ESP32_MQTT_MAX_CONNECTIONS
+    inline ESP32_MQTTClient* getConnection(int connectionId) { return connectionId >= 0 && connectionId < (int)_connectionCount ? _connections[connectionId] : nullptr; }
+    inline size_t getConnectionCount() { return _connectionCount; }
+
+    void enableSharedDispatch(size_t queueCapacity, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 4096); // Must be called before start(). The callbacks of all connections run in one task, each connection queues up to queueCapacity events.
+    void enableSharedReassembly(size_t maxMessageSize, size_t bufferCount = 1); // Must be called before start(). Messages bigger than the in packet size of any connection are reassembled in bufferCount shared buffers.
+    int addForwardingRule(int fromConnection, const char* topicFilter, int toConnection, int qos = 0, const char* fromPrefix = "", const char* toPrefix = ""); // Must be called before start(). Messages to fromPrefix + topicFilter are published to toPrefix + the rest of the topic, returns the rule id or -1.
+
+    bool start();   // creates and starts every connection
+    bool stop();
+
+    inline uint32_t getForwardedCount() { return _forwardedCount; }
+    inline uint32_t getForwardDropCount() { return _forwardDropCount; }    // fragmented, too long topic or refused by the destination
+    size_t getSharedMemoryUsage();      // shared reassembly buffers, the dispatch task stack is not included
+
+private:
+    struct ForwardingRule
+    {
+        int toConnection;
+        int qos;
+        char* fromPrefix;
+        size_t fromPrefixLen;
+        char* toPrefix;
+        size_t toPrefixLen;
+    };
+
+    ESP32_MQTTClient* _connections[ESP32_MQTT_MAX_CONNECTIONS];
+    size_t _connectionCount;
+    std::vector<ForwardingRule*> _forwardingRules;  // allocated one by one, the subscribe handlers keep pointers to them
+    std::atomic<uint32_t> _forwardedCount;
+    std::atomic<uint32_t> _forwardDropCount;
+
+    size_t _dispatchQueueCapacity;
+    int _dispatchTaskPriority;
+    int _dispatchTaskCoreId;
+    uint32_t _dispatchTaskStackSize;
+    TaskHandle_t _dispatchTask;
+    std::atomic<bool> _dispatchStopRequested;  // set by the destructor, the task deletes itself once it's done with the connections
+    std::atomic<bool> _dispatchStopped;
+
+    ESP32_MQTTBufferPool _reassemblyPool;
+    size_t _reassemblyMaxMessageSize;
+    size_t _reassemblyBufferCount;
+
+    static void dispatchTaskStatic(void* arg);
+    void forward(ForwardingRule& rule, const char* topic, int topicLen, const char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain);
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 (IEEE 802.3), start with crc = 0 and pass the previous result to continue with the next block.
+uint32_t ESP32_MQTTCrc32(uint32_t crc, const void* data, size_t length);
@@ -0,0 +1,200 @@
+#include "ESP32_MQTTEventQueue.h"
+
+ESP32_MQTTEventQueue::ESP32_MQTTEventQueue()
+{
+	_slots = nullptr;
+	_slotData = nullptr;
+	_capacity = 0;
+	_slotDataSize = 0;
+	_head = 0;
+	_tail = 0;
+	_highWaterMark = 0;
+	_dropCount = 0;
+}
+
+ESP32_MQTTEventQueue::~ESP32_MQTTEventQueue()
+{
+	deinit();
+}
+
+bool ESP32_MQTTEventQueue::init(size_t capacity, size_t slotDataSize)
+{
+	deinit();
+
+	if (capacity == 0)
+		return false;
+
+	// one slot is kept empty to distinguish full from empty
+	_slots = new ESP32_MQTTQueuedEvent[capacity + 1];
+	_slotData = (uint8_t*)malloc((capacity + 1) * slotDataSize);
+	if (_slotData == nullptr)
+	{
+		log_e("Can't allocate event queue of %u x %u bytes", capacity, slotDataSize);
+		deinit();
+		return false;
+	}
+
+	for (size_t i = 0; i <= capacity; i++)
+	{
+		_slots[i].data = _slotData + i * slotDataSize;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		_slots[i].property.user_property = nullptr;
+#endif
+	}
+
+	_capacity = capacity;
+	_slotDataSize = slotDataSize;
+	_head = 0;
+	_tail = 0;
+	return true;
+}
+
+void ESP32_MQTTEventQueue::deinit()
+{
+	if (_slots != nullptr)
+		delete[] _slots;
+	if (_slotData != nullptr)
+		free(_slotData);
+
+	_slots = nullptr;
+	_slotData = nullptr;
+	_capacity = 0;
+	_slotDataSize = 0;
+}
+
+bool ESP32_MQTTEventQueue::push(int32_t eventId, const esp_mqtt_event_t* event, uint8_t* poolBuffer)
+{
+	size_t head = _head.load(std::memory_order_relaxed);
+	size_t next = head == _capacity ? 0 : head + 1;
+	if (next == _tail.load(std::memory_order_acquire))
+	{
+		_dropCount.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	ESP32_MQTTQueuedEvent& slot = _slots[head];
+	slot.eventId = eventId;
+	slot.event = *event;
+	slot.poolBuffer = poolBuffer;
+
+	if (event->error_handle != nullptr)
+	{
+		slot.error = *event->error_handle;
+		slot.event.error_handle = &slot.error;
+	}
+
+	// topic and data of a pool buffer are already owned by the slot, others have to be copied
+	size_t used = 0;
+	if (poolBuffer == nullptr)
+	{
+		int topicLen = event->topic != nullptr ? event->topic_len : 0;
+		int dataLen = event->data != nullptr ? event->data_len : 0;
+		if ((size_t)(topicLen + dataLen) > _slotDataSize)
+		{
+			_dropCount.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		if (topicLen > 0)
+			memcpy(slot.data, event->topic, topicLen);
+		if (dataLen > 0)
+			memcpy(slot.data + topicLen, event->data, dataLen);
+		slot.event.topic = event->topic != nullptr ? (char*)slot.data : nullptr;
+		slot.event.data = event->data != nullptr ? (char*)slot.data + topicLen : nullptr;
+		used = topicLen + dataLen;
+	}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	if (event->property != nullptr)
+	{
+		if (!copyProperty(slot, event->property, slot.data + used, _slotDataSize - used))
+		{
+			_dropCount.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		slot.event.property = &slot.property;
+	}
+#endif
+
+	_head.store(next, std::memory_order_release);
+
+	size_t size = getSize();
+	if (size > _highWaterMark.load(std::memory_order_relaxed))
+		_highWaterMark.store(size, std::memory_order_relaxed);
+	return true;
+}
+
+ESP32_MQTTQueuedEvent* ESP32_MQTTEventQueue::front()
+{
+	size_t tail = _tail.load(std::memory_order_relaxed);
+	if (tail == _head.load(std::memory_order_acquire))
+		return nullptr;
+	return &_slots[tail];
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+bool ESP32_MQTTEventQueue::copyProperty(ESP32_MQTTQueuedEvent& slot, const esp_mqtt5_event_property_t* property, uint8_t* buf, size_t size)
+{
+	int responseTopicLen = property->response_topic != nullptr ? property->response_topic_len : 0;
+	int correlationDataLen = property->correlation_data != nullptr ? property->correlation_data_len : 0;
+	int contentTypeLen = property->content_type != nullptr ? property->content_type_len : 0;
+	if ((size_t)(responseTopicLen + correlationDataLen + contentTypeLen) > size)
+		return false;
+
+	slot.property = *property;
+	slot.property.user_property = nullptr;
+
+	if (responseTopicLen > 0)
+		memcpy(buf, property->response_topic, responseTopicLen);
+	slot.property.response_topic = property->response_topic != nullptr ? (char*)buf : nullptr;
+	buf += responseTopicLen;
+	if (correlationDataLen > 0)
+		memcpy(buf, property->correlation_data, correlationDataLen);
+	slot.property.correlation_data = property->correlation_data != nullptr ? (char*)buf : nullptr;
+	buf += correlationDataLen;
+	if (contentTypeLen > 0)
+		memcpy(buf, property->content_type, contentTypeLen);
+	slot.property.content_type = property->content_type != nullptr ? (char*)buf : nullptr;
+
+	// the user property list is freed by esp-mqtt after the event, it is rebuilt from copies of the items
+	uint8_t count = property->user_property != nullptr ? esp_mqtt5_client_get_user_property_count(property->user_property) : 0;
+	if (count > 0)
+	{
+		esp_mqtt5_user_property_item_t* items = (esp_mqtt5_user_property_item_t*)calloc(count, sizeof(esp_mqtt5_user_property_item_t));
+		if (items == nullptr)
+			return false;
+		if (esp_mqtt5_client_get_user_property(property->user_property, items, &count) == ESP_OK)
+		{
+			esp_mqtt5_client_set_user_property(&slot.property.user_property, items, count);
+			for (uint8_t i = 0; i < count; i++)
+			{
+				free((char*)items[i].key);
+				free((char*)items[i].value);
+			}
+		}
+		free(items);
+	}
+	return true;
+}
+#endif
+
+void ESP32_MQTTEventQueue::pop()
+{
+	size_t tail = _tail.load(std::memory_order_relaxed);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	ESP32_MQTTQueuedEvent& slot = _slots[tail];
+	if (slot.event.property != nullptr && slot.property.user_property != nullptr)
+	{
+		esp_mqtt5_client_delete_user_property(slot.property.user_property);
+		slot.property.user_property = nullptr;
+	}
+#endif
+	_tail.store(tail == _capacity ? 0 : tail + 1, std::memory_order_release);
+}
+
+size_t ESP32_MQTTEventQueue::getSize()
+{
+	size_t head = _head.load(std::memory_order_acquire);
+	size_t tail = _tail.load(std::memory_order_acquire);
+	return head >= tail ? head - tail : head + _capacity + 1 - tail;
+}
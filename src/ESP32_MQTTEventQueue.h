@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+
+// Copy of an esp-mqtt event which outlives the event handler call. Topic, data and error point either into
+// the slot itself or into poolBuffer (a reassembled message) which has to be released after processing.
+struct ESP32_MQTTQueuedEvent
+{
+    int32_t eventId;
+    esp_mqtt_event_t event;
+    esp_mqtt_error_codes_t error;
+    uint8_t* poolBuffer;
+    uint8_t* data;          // inline storage for topic, data and MQTT 5 property strings, slotDataSize bytes
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    esp_mqtt5_event_property_t property;    // user properties are copied into a list owned by the slot
+#endif
+};
+
+// Lock-free single producer (MQTT task) / single consumer (dispatch task) ring of events with fixed capacity.
+class ESP32_MQTTEventQueue
+{
+public:
+    ESP32_MQTTEventQueue();
+    ~ESP32_MQTTEventQueue();
+
+    bool init(size_t capacity, size_t slotDataSize);
+    void deinit();
+
+    bool push(int32_t eventId, const esp_mqtt_event_t* event, uint8_t* poolBuffer);   // producer only, returns false (and counts a drop) if the queue is full or the event data doesn't fit
+    ESP32_MQTTQueuedEvent* front();     // consumer only, nullptr if empty
+    void pop();                         // consumer only
+
+    inline bool isInitialized() { return _slots != nullptr; }
+    inline size_t getCapacity() { return _capacity; }
+    size_t getSize();
+    inline size_t getHighWaterMark() { return _highWaterMark.load(std::memory_order_relaxed); }
+    inline unsigned int getDropCount() { return _dropCount.load(std::memory_order_relaxed); }
+
+private:
+    ESP32_MQTTQueuedEvent* _slots;
+    uint8_t* _slotData;
+    size_t _capacity;
+    size_t _slotDataSize;
+    std::atomic<size_t> _head;  // next slot to write, modified by producer
+    std::atomic<size_t> _tail;  // next slot to read, modified by consumer
+    std::atomic<size_t> _highWaterMark;
+    std::atomic<unsigned int> _dropCount;
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    static bool copyProperty(ESP32_MQTTQueuedEvent& slot, const esp_mqtt5_event_property_t* property, uint8_t* buf, size_t size);
+#endif
+};
@@ -0,0 +1,204 @@
+#include "ESP32_MQTTHealthMonitor.h"
+
+ESP32_MQTTHealthMonitor::ESP32_MQTTHealthMonitor()
+{
+	_uriCount = 0;
+	_currentUri = 0;
+	_failedAttempts = 0;
+	_failoverAfterAttempts = 2;
+	_cooldownMs = 60000;
+	_intervalMs = 5000;
+	_timeoutMs = 2000;
+	_deadAfterLosses = 3;
+	_degradedRttUs = 1500000;
+	_degradedJitterUs = 1000000;
+	_outstandingSequence = 0;
+	_nextSequence = 0;
+	_probeStartUs = 0;
+	_lastRttUs = 0;
+	_srttUs = 0;
+	_rttvarUs = 0;
+	_sampleCount = 0;
+	_consecutiveLosses = 0;
+	_lostCount = 0;
+}
+
+void ESP32_MQTTHealthMonitor::setProbing(unsigned long intervalMs, unsigned long timeoutMs, unsigned int deadAfterLosses)
+{
+	_intervalMs = intervalMs;
+	_timeoutMs = timeoutMs;
+	_deadAfterLosses = deadAfterLosses > 0 ? deadAfterLosses : 1;
+}
+
+void ESP32_MQTTHealthMonitor::setThresholds(unsigned long degradedRttMs, unsigned long degradedJitterMs)
+{
+	_degradedRttUs = degradedRttMs * 1000;
+	_degradedJitterUs = degradedJitterMs * 1000;
+}
+
+void ESP32_MQTTHealthMonitor::setFailover(unsigned int afterFailedAttempts, unsigned long cooldownMs)
+{
+	_failoverAfterAttempts = afterFailedAttempts > 0 ? afterFailedAttempts : 1;
+	_cooldownMs = cooldownMs;
+}
+
+int ESP32_MQTTHealthMonitor::addUri(const char* uri)
+{
+	if (uri == nullptr || _uriCount >= ESP32_MQTT_HEALTH_MAX_URIS)
+		return -1;
+
+	UriEntry& entry = _uris[_uriCount];
+	entry.uri = uri;
+	entry.srttUs = 0;
+	entry.failedMillis = 0;
+	entry.failed = false;
+	return _uriCount++;
+}
+
+/// <summary>
+/// Orders the failover candidates: URIs not given up on recently first, the one with the lowest measured RTT, then
+/// the ones never connected to in the order they were added. Among URIs all given up on recently, the one given up
+/// on longest ago.
+/// </summary>
+bool ESP32_MQTTHealthMonitor::isBetterFailover(int a, int b, unsigned long now)
+{
+	const UriEntry& ea = _uris[a];
+	const UriEntry& eb = _uris[b];
+	bool coolingA = ea.failed && now - ea.failedMillis < _cooldownMs;
+	bool coolingB = eb.failed && now - eb.failedMillis < _cooldownMs;
+	if (coolingA != coolingB)
+		return coolingB;
+	if (coolingA)
+		return (long)(ea.failedMillis - eb.failedMillis) < 0;
+	if ((ea.srttUs == 0) != (eb.srttUs == 0))
+		return eb.srttUs == 0;
+	if (ea.srttUs != eb.srttUs)
+		return ea.srttUs < eb.srttUs;
+	return a < b;
+}
+
+/// <summary>
+/// Gives up on the current URI and picks the next one to connect to.
+/// </summary>
+/// <returns>index of the new current URI, -1 if there is no other URI</returns>
+int ESP32_MQTTHealthMonitor::selectFailover(unsigned long now)
+{
+	if (_uriCount < 2)
+		return -1;
+
+	_uris[_currentUri].failed = true;
+	_uris[_currentUri].failedMillis = now;
+
+	int best = -1;
+	for (int i = 0; i < (int)_uriCount; i++)
+	{
+		if (i != _currentUri && (best < 0 || isBetterFailover(i, best, now)))
+			best = i;
+	}
+
+	_currentUri = best;
+	_failedAttempts = 0;
+	return best;
+}
+
+void ESP32_MQTTHealthMonitor::connected()
+{
+	_failedAttempts = 0;
+	if (_uriCount > 0)
+		_uris[_currentUri].failed = false;
+
+	_outstandingSequence = 0;
+	_srttUs = 0;
+	_rttvarUs = 0;
+	_sampleCount = 0;
+	_consecutiveLosses = 0;
+}
+
+bool ESP32_MQTTHealthMonitor::connectFailed()
+{
+	_failedAttempts++;
+	return _uriCount > 1 && _failedAttempts >= _failoverAfterAttempts;
+}
+
+void ESP32_MQTTHealthMonitor::startProbe(uint32_t nowUs, uint8_t* payload)
+{
+	// random start, an echo of a probe sent before a reboot doesn't match
+	if (_nextSequence == 0)
+		_nextSequence = esp_random() | 1;
+	uint32_t sequence = _nextSequence++;
+	if (_nextSequence == 0)
+		_nextSequence = 1;
+
+	_probeStartUs = nowUs;
+	for (int i = 0; i < 4; i++)
+	{
+		payload[i] = sequence >> (8 * i);
+		payload[4 + i] = nowUs >> (8 * i);
+	}
+	_outstandingSequence.store(sequence, std::memory_order_release);
+}
+
+/// <summary>
+/// Matches an echoed probe with the outstanding one and updates the RTT estimate. Called from the MQTT task, only
+/// one of probeReceived() and probeTimedOut() takes the probe.
+/// </summary>
+/// <returns>true if the probe was answered</returns>
+bool ESP32_MQTTHealthMonitor::probeReceived(const uint8_t* payload, size_t length, uint32_t nowUs)
+{
+	if (length != ESP32_MQTT_HEALTH_PROBE_SIZE)
+		return false;
+
+	uint32_t sequence = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t)payload[3] << 24);
+	uint32_t expected = _outstandingSequence.load(std::memory_order_acquire);
+	if (sequence == 0 || sequence != expected || !_outstandingSequence.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+		return false;
+
+	uint32_t rttUs = nowUs - _probeStartUs;
+	uint32_t srttUs = _srttUs;
+	uint32_t rttvarUs = _rttvarUs;
+	if (_sampleCount == 0)
+	{
+		srttUs = rttUs;
+		rttvarUs = rttUs / 2;
+	}
+	else
+	{
+		uint32_t deviation = srttUs > rttUs ? srttUs - rttUs : rttUs - srttUs;
+		rttvarUs = rttvarUs - rttvarUs / 4 + deviation / 4;
+		srttUs = srttUs - srttUs / 8 + rttUs / 8;
+	}
+	if (srttUs == 0)
+		srttUs = 1;     // 0 stands for not measured
+	_lastRttUs = rttUs;
+	_srttUs = srttUs;
+	_rttvarUs = rttvarUs;
+	_sampleCount++;
+	_consecutiveLosses = 0;
+	if (_uriCount > 0)
+		_uris[_currentUri].srttUs = srttUs;
+	return true;
+}
+
+bool ESP32_MQTTHealthMonitor::probeTimedOut()
+{
+	uint32_t expected = _outstandingSequence.load(std::memory_order_acquire);
+	if (expected == 0 || !_outstandingSequence.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+		return false;
+
+	_consecutiveLosses++;
+	_lostCount++;
+	return true;
+}
+
+ESP32_MQTTLinkHealth ESP32_MQTTHealthMonitor::getHealth()
+{
+	if (_consecutiveLosses >= _deadAfterLosses)
+		return ESP32_MQTTLinkHealth::Dead;
+	if (_consecutiveLosses > 0)
+		return ESP32_MQTTLinkHealth::Degraded;
+	if (_sampleCount == 0)
+		return ESP32_MQTTLinkHealth::Unknown;
+	if (_srttUs > _degradedRttUs || _rttvarUs > _degradedJitterUs)
+		return ESP32_MQTTLinkHealth::Degraded;
+	return ESP32_MQTTLinkHealth::Healthy;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+
+#define ESP32_MQTT_HEALTH_MAX_URIS 4        // the broker URI and its alternatives
+#define ESP32_MQTT_HEALTH_PROBE_SIZE 8      // sequence number and send time
+
+enum class ESP32_MQTTLinkHealth : uint8_t
+{
+    Unknown,    // no probe answered since connecting
+    Healthy,
+    Degraded,   // RTT or jitter above the thresholds, or the last probe was lost
+    Dead        // deadAfterLosses probes in a row were lost
+};
+
+// Link health from loopback probes: a small message published to a topic the client is subscribed to comes back
+// through the broker, its round trip time is the RTT of the whole path including the broker. The RTT is smoothed like
+// TCP's (RFC 6298): SRTT += (RTT - SRTT) / 8, RTTVAR += (|SRTT - RTT| - RTTVAR) / 4, RTTVAR is the jitter. One probe
+// is outstanding at a time, it is answered from the MQTT task and timed out by the task sending the probes. The
+// estimate is read from other tasks, the URIs and the failover state only from the MQTT task once the client started.
+// Also keeps the broker URIs to fail over to, each with the SRTT last measured while connected to it. A URI given up
+// on is not picked again for cooldownMs, unless all of them were.
+class ESP32_MQTTHealthMonitor
+{
+public:
+    ESP32_MQTTHealthMonitor();
+
+    void setProbing(unsigned long intervalMs, unsigned long timeoutMs, unsigned int deadAfterLosses);
+    void setThresholds(unsigned long degradedRttMs, unsigned long degradedJitterMs);
+    void setFailover(unsigned int afterFailedAttempts, unsigned long cooldownMs);
+
+    int addUri(const char* uri);    // returns the index, -1 if there are ESP32_MQTT_HEALTH_MAX_URIS already. The first one is current.
+    inline const char* getUri(int index) { return index >= 0 && index < (int)_uriCount ? _uris[index].uri : nullptr; }
+    inline size_t getUriCount() { return _uriCount; }
+    inline int getCurrentUri() { return _currentUri; }
+    inline uint32_t getUriRttUs(int index) { return index >= 0 && index < (int)_uriCount ? _uris[index].srttUs : 0; }  // 0 if not measured
+    int selectFailover(unsigned long now);  // gives up on the current URI and makes the best other one current, returns it or -1 if there is no other
+
+    void connected();       // starts a new estimate, the path may have changed
+    bool connectFailed();   // true when afterFailedAttempts connection attempts in a row failed, time to fail over
+
+    void startProbe(uint32_t nowUs, uint8_t* payload);  // fills the ESP32_MQTT_HEALTH_PROBE_SIZE bytes to publish
+    bool probeReceived(const uint8_t* payload, size_t length, uint32_t nowUs);  // true if it answers the outstanding probe, the RTT is sampled
+    bool probeTimedOut();   // true if the outstanding probe is lost, false if it was answered meanwhile
+    inline void cancelProbe() { _outstandingSequence.store(0, std::memory_order_release); }  // the probe couldn't be sent, e.g. disconnected meanwhile
+    inline bool isProbeOutstanding() { return _outstandingSequence.load(std::memory_order_acquire) != 0; }
+
+    ESP32_MQTTLinkHealth getHealth();
+    inline unsigned long getProbeInterval() { return _intervalMs; }
+    inline unsigned long getProbeTimeout() { return _timeoutMs; }
+    inline uint32_t getRttUs() { return _lastRttUs; }
+    inline uint32_t getSmoothedRttUs() { return _srttUs; }
+    inline uint32_t getRttVarianceUs() { return _rttvarUs; }
+    inline unsigned int getLostProbeCount() { return _lostCount; }     // since boot
+    inline unsigned int getConsecutiveLostProbes() { return _consecutiveLosses; }
+
+private:
+    struct UriEntry
+    {
+        const char* uri;
+        uint32_t srttUs;
+        unsigned long failedMillis;
+        bool failed;
+    };
+
+    UriEntry _uris[ESP32_MQTT_HEALTH_MAX_URIS];
+    size_t _uriCount;
+    int _currentUri;
+    unsigned int _failedAttempts;
+    unsigned int _failoverAfterAttempts;
+    unsigned long _cooldownMs;
+
+    unsigned long _intervalMs;
+    unsigned long _timeoutMs;
+    unsigned int _deadAfterLosses;
+    uint32_t _degradedRttUs;
+    uint32_t _degradedJitterUs;
+
+    std::atomic<uint32_t> _outstandingSequence;     // 0 if none
+    uint32_t _nextSequence;
+    uint32_t _probeStartUs;
+    std::atomic<uint32_t> _lastRttUs;
+    std::atomic<uint32_t> _srttUs;
+    std::atomic<uint32_t> _rttvarUs;
+    std::atomic<unsigned int> _sampleCount;
+    std::atomic<unsigned int> _consecutiveLosses;
+    std::atomic<unsigned int> _lostCount;
+
+    bool isBetterFailover(int a, int b, unsigned long now);
+};
@@ -0,0 +1,363 @@
+#include "ESP32_MQTTInflightTable.h"
+
+ESP32_MQTTPublishToken::ESP32_MQTTPublishToken()
+{
+	_status = ESP32_MQTTPublishStatus::Pending;
+	_done = nullptr;
+	_table = nullptr;
+	_msgId = 0;
+	_latencyUs = 0;
+}
+
+ESP32_MQTTPublishToken::~ESP32_MQTTPublishToken()
+{
+	ESP32_MQTTInflightTable* table = _table;
+	if (table != nullptr && _status == ESP32_MQTTPublishStatus::Pending)
+		table->detach(_msgId, this);
+	if (_done != nullptr)
+		vSemaphoreDelete(_done);
+}
+
+void ESP32_MQTTPublishToken::reset(ESP32_MQTTInflightTable* table)
+{
+	if (_done == nullptr)
+		_done = xSemaphoreCreateBinary();
+	else
+		xSemaphoreTake(_done, 0);
+
+	_status = ESP32_MQTTPublishStatus::Pending;
+	_table = table;
+	_msgId = 0;
+	_latencyUs = 0;
+}
+
+void ESP32_MQTTPublishToken::complete(ESP32_MQTTPublishStatus status, uint32_t latencyUs)
+{
+	_latencyUs = latencyUs;
+	_table = nullptr;
+	_status = status;
+	if (_done != nullptr)
+		xSemaphoreGive(_done);
+}
+
+ESP32_MQTTPublishStatus ESP32_MQTTPublishToken::wait(unsigned long timeoutMs)
+{
+	if (_status != ESP32_MQTTPublishStatus::Pending || _done == nullptr)
+		return _status;
+
+	xSemaphoreTake(_done, timeoutMs == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs));
+	return _status;
+}
+
+ESP32_MQTTInflightTable::ESP32_MQTTInflightTable()
+{
+	_entries = nullptr;
+	_tableSize = 0;
+	_capacity = 0;
+	_count = 0;
+	_reserved = 0;
+	_reservations = nullptr;
+	_sequence = 0;
+	_earlyCompletions = nullptr;
+	_earlyCompletionCount = 0;
+	_earlyCompletionDropCount = 0;
+}
+
+ESP32_MQTTInflightTable::~ESP32_MQTTInflightTable()
+{
+	deinit();
+}
+
+bool ESP32_MQTTInflightTable::init(size_t capacity)
+{
+	deinit();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// keep the load factor at most 50% so the probe sequences stay short
+	size_t tableSize = 8;
+	while (tableSize < capacity * 2)
+		tableSize <<= 1;
+
+	_entries = new Entry[tableSize];
+	for (size_t i = 0; i < tableSize; i++)
+	{
+		_entries[i].msgId = 0;
+		_entries[i].token = nullptr;
+	}
+	_tableSize = tableSize;
+	_capacity = capacity;
+	_count = 0;
+	_reserved = 0;
+	_reservations = new uint32_t[capacity];
+	_earlyCompletionCount = capacity + EarlyCompletionSlack;
+	_earlyCompletions = new EarlyCompletion[_earlyCompletionCount];
+	for (size_t i = 0; i < _earlyCompletionCount; i++)
+		_earlyCompletions[i].msgId = 0;
+	_earlyCompletionDropCount = 0;
+	return true;
+}
+
+void ESP32_MQTTInflightTable::deinit()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_entries != nullptr)
+	{
+		for (size_t i = 0; i < _tableSize; i++)
+		{
+			if (_entries[i].msgId != 0 && _entries[i].token != nullptr)
+				_entries[i].token->complete(ESP32_MQTTPublishStatus::Cancelled, 0);
+		}
+		delete[] _entries;
+	}
+	if (_reservations != nullptr)
+		delete[] _reservations;
+	if (_earlyCompletions != nullptr)
+		delete[] _earlyCompletions;
+	_entries = nullptr;
+	_tableSize = 0;
+	_capacity = 0;
+	_count = 0;
+	_reserved = 0;
+	_reservations = nullptr;
+	_earlyCompletions = nullptr;
+	_earlyCompletionCount = 0;
+}
+
+uint32_t ESP32_MQTTInflightTable::nextSequence()
+{
+	if (++_sequence == 0)
+		_sequence = 1;
+	return _sequence;
+}
+
+uint32_t ESP32_MQTTInflightTable::reserve()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_entries == nullptr || _count + _reserved >= _capacity)
+		return 0;
+	uint32_t ticket = nextSequence();
+	_reservations[_reserved++] = ticket;
+	return ticket;
+}
+
+void ESP32_MQTTInflightTable::cancelReservation(uint32_t ticket)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	releaseReservation(ticket);
+}
+
+bool ESP32_MQTTInflightTable::releaseReservation(uint32_t ticket)
+{
+	if (_entries == nullptr)
+		return false;
+
+	size_t i = 0;
+	while (i < _reserved && _reservations[i] != ticket)
+		i++;
+	if (i == _reserved)
+		return false;
+	_reservations[i] = _reservations[--_reserved];
+
+	// no publish in progress can claim the remaining early completions
+	if (_reserved == 0)
+	{
+		for (size_t j = 0; j < _earlyCompletionCount; j++)
+			_earlyCompletions[j].msgId = 0;
+	}
+	return true;
+}
+
+/// <summary>
+/// Remembers the completion of a msg_id which isn't in the table for the publishes in progress. A record is reused once it
+/// is older than every reservation, no publish in progress can claim it then. If all records are newer, the oldest one is dropped,
+/// which takes more completions of untracked messages arriving during one publish than the table capacity + EarlyCompletionSlack.
+/// </summary>
+void ESP32_MQTTInflightTable::recordEarlyCompletion(int msgId, ESP32_MQTTPublishStatus status)
+{
+	uint32_t oldestTicket = _reservations[0];
+	for (size_t i = 1; i < _reserved; i++)
+	{
+		if ((int32_t)(_reservations[i] - oldestTicket) < 0)
+			oldestTicket = _reservations[i];
+	}
+
+	size_t slot = (size_t)-1;
+	size_t oldest = 0;
+	for (size_t i = 0; i < _earlyCompletionCount && slot == (size_t)-1; i++)
+	{
+		EarlyCompletion& record = _earlyCompletions[i];
+		if (record.msgId == 0 || (int32_t)(record.sequence - oldestTicket) < 0)
+			slot = i;
+		else if ((int32_t)(record.sequence - _earlyCompletions[oldest].sequence) < 0)
+			oldest = i;
+	}
+	if (slot == (size_t)-1)
+	{
+		slot = oldest;
+		_earlyCompletionDropCount++;
+	}
+
+	_earlyCompletions[slot] = { msgId, status, nextSequence() };
+}
+
+size_t ESP32_MQTTInflightTable::indexOf(int msgId)
+{
+	size_t mask = _tableSize - 1;
+	size_t index = ((uint32_t)msgId * 2654435761u) & mask;
+	while (_entries[index].msgId != 0)
+	{
+		if (_entries[index].msgId == msgId)
+			return index;
+		index = (index + 1) & mask;
+	}
+	return (size_t)-1;
+}
+
+void ESP32_MQTTInflightTable::removeAt(size_t index)
+{
+	// backward shift deletion keeps the linear probe sequences without tombstones
+	size_t mask = _tableSize - 1;
+	size_t next = index;
+	while (true)
+	{
+		next = (next + 1) & mask;
+		if (_entries[next].msgId == 0)
+			break;
+
+		size_t home = ((uint32_t)_entries[next].msgId * 2654435761u) & mask;
+		bool stays = index <= next ? (index < home && home <= next) : (index < home || home <= next);
+		if (stays)
+			continue;
+
+		_entries[index] = std::move(_entries[next]);
+		index = next;
+	}
+
+	_entries[index].msgId = 0;
+	_entries[index].handler = nullptr;
+	_entries[index].token = nullptr;
+	_count--;
+}
+
+void ESP32_MQTTInflightTable::add(uint32_t ticket, int msgId, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler, ESP32_MQTTPublishToken* token)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	if (_entries == nullptr)
+		return;
+
+	// a completion received before the reservation belongs to an earlier message with the same msg_id
+	for (size_t i = 0; i < _earlyCompletionCount; i++)
+	{
+		if (_earlyCompletions[i].msgId == msgId && (int32_t)(_earlyCompletions[i].sequence - ticket) > 0)
+		{
+			ESP32_MQTTPublishStatus status = _earlyCompletions[i].status;
+			_earlyCompletions[i].msgId = 0;
+			releaseReservation(ticket);
+			if (token != nullptr)
+			{
+				token->_msgId = msgId;
+				token->complete(status, 0);
+			}
+			lock.unlock();
+			if (handler)
+				handler(msgId, status, 0);
+			return;
+		}
+	}
+	releaseReservation(ticket);
+
+	size_t mask = _tableSize - 1;
+	size_t index = ((uint32_t)msgId * 2654435761u) & mask;
+	while (_entries[index].msgId != 0 && _entries[index].msgId != msgId)
+		index = (index + 1) & mask;
+
+	Entry& entry = _entries[index];
+	if (entry.msgId == 0)
+		_count++;
+	entry.msgId = msgId;
+	entry.startUs = micros();
+	entry.hasDeadline = timeoutMs > 0;
+	entry.deadlineMillis = millis() + timeoutMs;
+	entry.handler = handler;
+	entry.token = token;
+	if (token != nullptr)
+		token->_msgId = msgId;
+}
+
+void ESP32_MQTTInflightTable::finish(Entry& entry, ESP32_MQTTPublishStatus status, uint32_t latencyUs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback& handler)
+{
+	if (entry.token != nullptr)
+		entry.token->complete(status, latencyUs);
+	handler = std::move(entry.handler);
+}
+
+void ESP32_MQTTInflightTable::complete(int msgId, ESP32_MQTTPublishStatus status)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	if (_entries == nullptr || msgId <= 0)
+		return;
+
+	size_t index = indexOf(msgId);
+	if (index == (size_t)-1)
+	{
+		// publish() may not have returned yet, remember the completion for add()
+		if (_reserved > 0)
+			recordEarlyCompletion(msgId, status);
+		return;
+	}
+
+	uint32_t latencyUs = micros() - _entries[index].startUs;
+	ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler;
+	finish(_entries[index], status, latencyUs, handler);
+	removeAt(index);
+	lock.unlock();
+
+	if (handler)
+		handler(msgId, status, latencyUs);
+}
+
+void ESP32_MQTTInflightTable::expire()
+{
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if (_entries == nullptr || _count == 0)
+			return;
+
+		unsigned long now = millis();
+		size_t index = 0;
+		while (index < _tableSize && !(_entries[index].msgId != 0 && _entries[index].hasDeadline && (long)(now - _entries[index].deadlineMillis) >= 0))
+			index++;
+		if (index == _tableSize)
+			return;
+
+		int msgId = _entries[index].msgId;
+		uint32_t latencyUs = micros() - _entries[index].startUs;
+		ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler;
+		finish(_entries[index], ESP32_MQTTPublishStatus::TimedOut, latencyUs, handler);
+		removeAt(index);
+		lock.unlock();
+
+		if (handler)
+			handler(msgId, ESP32_MQTTPublishStatus::TimedOut, latencyUs);
+	}
+}
+
+void ESP32_MQTTInflightTable::detach(int msgId, ESP32_MQTTPublishToken* token)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_entries == nullptr)
+		return;
+
+	size_t index = indexOf(msgId);
+	if (index != (size_t)-1 && _entries[index].token == token)
+		_entries[index].token = nullptr;
+}
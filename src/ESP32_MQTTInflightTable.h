@@ -0,0 +1,113 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+#include <mutex>
+
+enum class ESP32_MQTTPublishStatus
+{
+    Pending,
+    Confirmed,      // MQTT_EVENT_PUBLISHED received (or QoS 0 message sent)
+    Deleted,        // message was deleted from the outbox by esp-mqtt (MQTT_EVENT_DELETED)
+    TimedOut,       // no confirmation before the deadline
+    Failed,         // message couldn't be published
+    Stored,         // message was stored in the persistent outbox while disconnected, its delivery is not tracked
+    Cancelled       // tracking was stopped before completion
+};
+
+namespace ESP32_MQTTCallbacks
+{
+    typedef std::function<void(int msgId, ESP32_MQTTPublishStatus status, uint32_t latencyUs)> OnMqttPublishCompletedCallback;
+}
+
+class ESP32_MQTTInflightTable;
+
+// Completion of one publish which can be waited for from another task. Must not be waited for in the MQTT callbacks.
+class ESP32_MQTTPublishToken
+{
+public:
+    ESP32_MQTTPublishToken();
+    ~ESP32_MQTTPublishToken();
+
+    ESP32_MQTTPublishStatus wait(unsigned long timeoutMs = portMAX_DELAY);   // returns Pending if the wait timed out
+    inline ESP32_MQTTPublishStatus getStatus() { return _status; }
+    inline int getMsgId() { return _msgId; }
+    inline uint32_t getLatencyUs() { return _latencyUs; }
+
+private:
+    friend class ESP32_MQTTInflightTable;
+    friend class ESP32_MQTTClient;
+
+    std::atomic<ESP32_MQTTPublishStatus> _status;
+    SemaphoreHandle_t _done;
+    ESP32_MQTTInflightTable* _table;
+    int _msgId;
+    uint32_t _latencyUs;
+
+    void reset(ESP32_MQTTInflightTable* table);
+    void complete(ESP32_MQTTPublishStatus status, uint32_t latencyUs);
+};
+
+// Outstanding QoS 1/2 publishes, open addressing hash table on msg_id with fixed capacity.
+class ESP32_MQTTInflightTable
+{
+public:
+    ESP32_MQTTInflightTable();
+    ~ESP32_MQTTInflightTable();
+
+    bool init(size_t capacity);
+    void deinit();
+
+    uint32_t reserve();     // reserves a slot before publishing, returns the reservation ticket, 0 if the table is full
+    void cancelReservation(uint32_t ticket);
+    void add(uint32_t ticket, int msgId, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler, ESP32_MQTTPublishToken* token);   // uses the reserved slot
+    void complete(int msgId, ESP32_MQTTPublishStatus status);
+    void expire();          // completes entries past their deadline with TimedOut
+    void detach(int msgId, ESP32_MQTTPublishToken* token);
+
+    inline bool isInitialized() { return _entries != nullptr; }
+    inline size_t getCapacity() { return _capacity; }
+    inline size_t getCount() { std::lock_guard<std::mutex> lock(_mutex); return _count; }
+    inline unsigned long getEarlyCompletionDropCount() { std::lock_guard<std::mutex> lock(_mutex); return _earlyCompletionDropCount; }
+
+private:
+    struct Entry
+    {
+        int msgId;              // 0 if empty
+        uint32_t startUs;
+        unsigned long deadlineMillis;
+        bool hasDeadline;
+        ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback handler;
+        ESP32_MQTTPublishToken* token;
+    };
+
+    // completion of an unknown msg_id received while a publish was in progress, esp-mqtt can confirm a message before
+    // publish() returns the msg_id. Only a reservation made before the completion was received can claim it.
+    struct EarlyCompletion
+    {
+        int msgId;              // 0 if free
+        ESP32_MQTTPublishStatus status;
+        uint32_t sequence;
+    };
+
+    static const size_t EarlyCompletionSlack = 8;   // room for completions of untracked messages on top of one per reservation
+
+    Entry* _entries;
+    size_t _tableSize;      // power of two, at least twice the capacity
+    size_t _capacity;
+    size_t _count;
+    size_t _reserved;
+    uint32_t* _reservations;            // tickets of the publishes in progress, _reserved of them
+    uint32_t _sequence;                 // ticket of the latest reservation or sequence of the latest early completion
+    EarlyCompletion* _earlyCompletions;
+    size_t _earlyCompletionCount;       // capacity + EarlyCompletionSlack
+    unsigned long _earlyCompletionDropCount;
+    std::mutex _mutex;
+
+    size_t indexOf(int msgId);
+    uint32_t nextSequence();
+    bool releaseReservation(uint32_t ticket);
+    void recordEarlyCompletion(int msgId, ESP32_MQTTPublishStatus status);
+    void removeAt(size_t index);
+    void finish(Entry& entry, ESP32_MQTTPublishStatus status, uint32_t latencyUs, ESP32_MQTTCallbacks::OnMqttPublishCompletedCallback& handler);
+};
@@ -0,0 +1,209 @@
+#include "ESP32_MQTTLog.h"
+
+static_assert((ESP32_MQTT_LOG_CAPACITY & (ESP32_MQTT_LOG_CAPACITY - 1)) == 0, "ESP32_MQTT_LOG_CAPACITY must be a power of two");
+
+std::atomic<uint8_t> ESP32_MQTTLog::_levels[(size_t)ESP32_MQTTLogCategory::Count] = {
+	{ (uint8_t)ESP32_MQTT_LOG_DEFAULT_LEVEL }, { (uint8_t)ESP32_MQTT_LOG_DEFAULT_LEVEL }, { (uint8_t)ESP32_MQTT_LOG_DEFAULT_LEVEL }, { (uint8_t)ESP32_MQTT_LOG_DEFAULT_LEVEL }
+};
+std::atomic<ESP32_MQTTLog::Record*> ESP32_MQTTLog::_records(nullptr);
+std::atomic<uint32_t> ESP32_MQTTLog::_enqueuePos(0);
+std::atomic<uint32_t> ESP32_MQTTLog::_dequeuePos(0);
+std::atomic<uint32_t> ESP32_MQTTLog::_dropCount(0);
+std::atomic<uint32_t> ESP32_MQTTLog::_payloadCounter(0);
+size_t ESP32_MQTTLog::_payloadMaxLength = 32;
+uint32_t ESP32_MQTTLog::_payloadSampleEvery = 1;
+std::atomic<ESP32_MQTTLog::OutputTarget*> ESP32_MQTTLog::_nextOutput(nullptr);
+ESP32_MQTTLog::OutputTarget* ESP32_MQTTLog::_output = nullptr;
+TaskHandle_t ESP32_MQTTLog::_task = nullptr;
+std::mutex ESP32_MQTTLog::_beginMutex;
+
+bool ESP32_MQTTLog::begin(int priority, int coreId, uint32_t stackSize)
+{
+	std::lock_guard<std::mutex> lock(_beginMutex);
+	if (_records.load(std::memory_order_acquire) != nullptr)
+		return true;
+
+	Record* records = new Record[ESP32_MQTT_LOG_CAPACITY];
+	for (uint32_t i = 0; i < ESP32_MQTT_LOG_CAPACITY; i++)
+		records[i].sequence.store(i, std::memory_order_relaxed);
+	_enqueuePos = 0;
+	_dequeuePos = 0;
+
+	// the task doesn't run before the ring is published, it finds it when it first wakes up
+	if (xTaskCreatePinnedToCore(taskStatic, "mqtt_log", stackSize, nullptr, priority, &_task, coreId) != pdPASS)
+	{
+		log_e("Can't create the log task");
+		delete[] records;
+		return false;
+	}
+	_records.store(records, std::memory_order_release);
+	return true;
+}
+
+void ESP32_MQTTLog::setLevel(ESP32_MQTTLogCategory category, ESP32_MQTTLogLevel level)
+{
+	if (level != ESP32_MQTTLogLevel::None && !begin())
+		return;
+	_levels[(size_t)category].store((uint8_t)level, std::memory_order_relaxed);
+}
+
+void ESP32_MQTTLog::setLevel(ESP32_MQTTLogLevel level)
+{
+	for (size_t i = 0; i < (size_t)ESP32_MQTTLogCategory::Count; i++)
+		setLevel((ESP32_MQTTLogCategory)i, level);
+}
+
+void ESP32_MQTTLog::setPayloadLogging(size_t maxLength, uint32_t sampleEvery)
+{
+	_payloadMaxLength = maxLength;
+	_payloadSampleEvery = sampleEvery > 0 ? sampleEvery : 1;
+}
+
+void ESP32_MQTTLog::setOutput(Output output, void* context)
+{
+	// output and context go to the log task as one pair, it switches before its next line. A pair it hasn't taken yet is replaced.
+	delete _nextOutput.exchange(new OutputTarget { output, context }, std::memory_order_acq_rel);
+}
+
+bool ESP32_MQTTLog::isPayloadSampled()
+{
+	if (!isEnabled(ESP32_MQTTLogCategory::Data, ESP32_MQTTLogLevel::Verbose) || _payloadMaxLength == 0)
+		return false;
+	return _payloadSampleEvery == 1 || _payloadCounter.fetch_add(1, std::memory_order_relaxed) % _payloadSampleEvery == 0;
+}
+
+/// <summary>
+/// Claims the next record of the ring, like ESP32_MQTTPublishQueue::tryPush(). The ring is created on the first
+/// record if a level was enabled through ESP32_MQTT_LOG_DEFAULT_LEVEL instead of setLevel().
+/// </summary>
+/// <returns>the record to fill, nullptr if the ring is full</returns>
+ESP32_MQTTLog::Record* ESP32_MQTTLog::claim()
+{
+	Record* records = _records.load(std::memory_order_acquire);
+	if (records == nullptr)
+	{
+		if (!begin())
+			return nullptr;
+		records = _records.load(std::memory_order_acquire);
+	}
+
+	uint32_t pos = _enqueuePos.load(std::memory_order_relaxed);
+	Record* r;
+	while (true)
+	{
+		r = &records[pos & (ESP32_MQTT_LOG_CAPACITY - 1)];
+		int32_t diff = (int32_t)(r->sequence.load(std::memory_order_acquire) - pos);
+		if (diff == 0)
+		{
+			if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// the log task is behind by a whole ring
+			_dropCount.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		else
+		{
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	r->millis = millis();
+	return r;
+}
+
+void ESP32_MQTTLog::commit(Record* r)
+{
+	// a claimed record still has the sequence of its position
+	uint32_t pos = r->sequence.load(std::memory_order_relaxed);
+	r->sequence.store(pos + 1, std::memory_order_release);
+
+	// the task sleeps for ESP32_MQTT_LOG_FLUSH_MS, a burst wakes it up early
+	if (pos - _dequeuePos.load(std::memory_order_relaxed) == ESP32_MQTT_LOG_CAPACITY / 2)
+		xTaskNotifyGive(_task);
+}
+
+void ESP32_MQTTLog::encodeText(uint8_t*& p, uint8_t* end, const char* text, size_t length, bool printable)
+{
+	size_t available = end - p - 1;
+	if (length > available)
+		length = available;
+
+	if (printable)
+	{
+		for (size_t i = 0; i < length; i++)
+			p[i] = text[i] >= 0x20 && text[i] < 0x7F ? text[i] : '.';
+	}
+	else if (length > 0)
+	{
+		memcpy(p, text, length);
+	}
+	p[length] = '\0';
+	p += length + 1;
+}
+
+void ESP32_MQTTLog::taskStatic(void* arg)
+{
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ESP32_MQTT_LOG_FLUSH_MS));
+		while (flush())
+			;
+	}
+}
+
+/// <summary>
+/// Formats and prints the oldest record. Only the log task takes records out of the ring.
+/// </summary>
+/// <returns>true if a record was printed</returns>
+bool ESP32_MQTTLog::flush()
+{
+	static const char levelChars[] = "NEWIDV";
+	static const char* categoryNames[] = { "connection", "publish", "subscribe", "data" };
+	static uint32_t reportedDropCount = 0;
+
+	Record* records = _records.load(std::memory_order_acquire);
+	if (records == nullptr)
+		return false;
+
+	char line[ESP32_MQTT_LOG_LINE_SIZE];
+	uint32_t dropCount = _dropCount.load(std::memory_order_relaxed);
+	if (dropCount != reportedDropCount)
+	{
+		int length = snprintf(line, sizeof(line), "[%6u][W][mqtt] %u log records dropped", (unsigned int)millis(), (unsigned int)(dropCount - reportedDropCount));
+		reportedDropCount = dropCount;
+		print(line, length);
+	}
+
+	uint32_t pos = _dequeuePos.load(std::memory_order_relaxed);
+	Record& r = records[pos & (ESP32_MQTT_LOG_CAPACITY - 1)];
+	if (r.sequence.load(std::memory_order_acquire) != pos + 1)
+		return false;
+
+	int length = snprintf(line, sizeof(line), "[%6u][%c][mqtt %s] ", (unsigned int)r.millis, levelChars[(size_t)r.level], categoryNames[(size_t)r.category]);
+	int textLength = r.formatter(line + length, sizeof(line) - length, r.format, r.args);
+	length = textLength < 0 ? length : length + textLength < (int)sizeof(line) ? length + textLength : (int)sizeof(line) - 1;
+
+	// the record is free again before the line goes out, a slow output doesn't hold up the ring
+	r.sequence.store(pos + ESP32_MQTT_LOG_CAPACITY, std::memory_order_release);
+	_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+
+	print(line, length);
+	return true;
+}
+
+void ESP32_MQTTLog::print(const char* line, size_t length)
+{
+	if (_nextOutput.load(std::memory_order_relaxed) != nullptr)
+	{
+		delete _output;
+		_output = _nextOutput.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	if (_output != nullptr && _output->output != nullptr)
+		_output->output(line, length, _output->context);
+	else
+		log_printf("%s\r\n", line);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+
+#ifndef ESP32_MQTT_LOG_DEFAULT_LEVEL
+#define ESP32_MQTT_LOG_DEFAULT_LEVEL ESP32_MQTTLogLevel::None  // level of every category at boot, e.g. -DESP32_MQTT_LOG_DEFAULT_LEVEL=ESP32_MQTTLogLevel::Info
+#endif
+#ifndef ESP32_MQTT_LOG_CAPACITY
+#define ESP32_MQTT_LOG_CAPACITY 64              // records waiting for the log task, a power of two
+#endif
+#define ESP32_MQTT_LOG_ARGS_SIZE 80             // bytes of arguments of one record, strings are cut to what is left
+#define ESP32_MQTT_LOG_LINE_SIZE 192            // a formatted line, longer ones are cut
+#define ESP32_MQTT_LOG_FLUSH_MS 20              // the log task wakes up this often, or when the ring is half full
+
+enum class ESP32_MQTTLogCategory : uint8_t
+{
+    Connection,     // connect, disconnect, reconnect scheduling, errors
+    Publish,        // publish(), enqueue(), publishAsync()
+    Subscribe,      // subscribe(), unsubscribe(), acks, restoring subscriptions
+    Data,           // received messages
+    Count
+};
+
+// the values of esp_log_level_t
+enum class ESP32_MQTTLogLevel : uint8_t
+{
+    None,
+    Error,
+    Warning,
+    Info,
+    Debug,
+    Verbose     // Data: the payload too
+};
+
+// text which isn't null terminated, e.g. a topic of an event. The record gets a null terminated copy, cut to the
+// space left in it. With printable set, bytes outside of printable ASCII are copied as '.'.
+struct ESP32_MQTTLogText
+{
+    const char* text;
+    int length;
+    bool printable;
+
+    ESP32_MQTTLogText(const char* text, int length, bool printable = false) : text(text), length(length), printable(printable) {}
+};
+
+#define ESP32_MQTT_LOG(category, level, ...) do { if (ESP32_MQTTLog::isEnabled(ESP32_MQTTLogCategory::category, ESP32_MQTTLogLevel::level)) ESP32_MQTTLog::write(ESP32_MQTTLogCategory::category, ESP32_MQTTLogLevel::level, __VA_ARGS__); } while (0)
+
+// Log of all clients with a runtime level per category. A disabled level costs a relaxed load and a compare. An
+// enabled one copies the format pointer and the arguments into a ring, written lock-free from any task, formatting and
+// printing are left to a low priority task. The format must be a string literal, the arguments ints, floats, pointers,
+// const char* or ESP32_MQTTLogText; the strings are copied, the other arguments are formatted as they were when
+// logged. When the ring is full new records are dropped and counted. The ring and the task are created when a level
+// is first enabled.
+class ESP32_MQTTLog
+{
+public:
+    typedef void (*Output)(const char* line, size_t length, void* context);
+
+    static bool begin(int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 3072);  // optional, creates the ring and the log task with other than the default settings
+    static void setLevel(ESP32_MQTTLogCategory category, ESP32_MQTTLogLevel level);
+    static void setLevel(ESP32_MQTTLogLevel level);     // every category
+    static inline ESP32_MQTTLogLevel getLevel(ESP32_MQTTLogCategory category) { return (ESP32_MQTTLogLevel)_levels[(size_t)category].load(std::memory_order_relaxed); }
+    static inline bool isEnabled(ESP32_MQTTLogCategory category, ESP32_MQTTLogLevel level) { return (uint8_t)level <= _levels[(size_t)category].load(std::memory_order_relaxed); }
+    static void setPayloadLogging(size_t maxLength, uint32_t sampleEvery = 1);  // Data at Verbose logs the first maxLength bytes of every sampleEvery-th payload, default 32 bytes of every one
+    static void setOutput(Output output, void* context = nullptr);  // where the log task passes the lines from its next line on, nullptr prints them with log_printf()
+
+    static bool isPayloadSampled();     // Data is at Verbose and the payload of this message is to be logged
+    static inline ESP32_MQTTLogText payloadText(const char* data, int length) { return ESP32_MQTTLogText(data, length < (int)_payloadMaxLength ? length : (int)_payloadMaxLength, true); }
+    static inline uint32_t getDropCount() { return _dropCount; }   // records dropped because the ring was full
+
+    template<typename... Args>
+    static void write(ESP32_MQTTLogCategory category, ESP32_MQTTLogLevel level, const char* format, Args... args)
+    {
+        Record* r = claim();
+        if (r == nullptr)
+            return;
+
+        r->category = category;
+        r->level = level;
+        r->format = format;
+        r->formatter = &Formatter<Args...>::format;
+        encodeArgs(r->args, args...);
+        commit(r);
+    }
+
+private:
+    typedef int (*FormatFunction)(char* buf, size_t size, const char* format, const uint8_t* args);
+
+    struct Record
+    {
+        std::atomic<uint32_t> sequence;     // position + 1 once written, position + capacity once formatted
+        uint32_t millis;
+        const char* format;
+        FormatFunction formatter;
+        ESP32_MQTTLogCategory category;
+        ESP32_MQTTLogLevel level;
+        uint8_t args[ESP32_MQTT_LOG_ARGS_SIZE];
+    };
+
+    // how an argument is stored in a record and passed to snprintf(): strings as null terminated copies, the rest as is
+    template<typename T>
+    struct Arg
+    {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value, "log arguments are numbers, pointers or strings");
+        typedef T Stored;
+        static constexpr size_t MinSize = sizeof(T);
+        static void encode(uint8_t*& p, uint8_t* end, T value) { memcpy(p, &value, sizeof(T)); p += sizeof(T); }
+        static T decode(const uint8_t*& p) { T value; memcpy(&value, p, sizeof(T)); p += sizeof(T); return value; }
+    };
+
+    template<typename... Args>
+    struct Formatter;
+
+    static std::atomic<uint8_t> _levels[(size_t)ESP32_MQTTLogCategory::Count];
+    static std::atomic<Record*> _records;
+    static std::atomic<uint32_t> _enqueuePos;
+    static std::atomic<uint32_t> _dequeuePos;    // written by the log task only
+    static std::atomic<uint32_t> _dropCount;
+    static std::atomic<uint32_t> _payloadCounter;
+    static size_t _payloadMaxLength;
+    static uint32_t _payloadSampleEvery;
+    struct OutputTarget
+    {
+        Output output;
+        void* context;
+    };
+
+    static std::atomic<OutputTarget*> _nextOutput;  // set by setOutput(), taken over by the log task
+    static OutputTarget* _output;                   // used by the log task only
+    static TaskHandle_t _task;
+    static std::mutex _beginMutex;
+
+    static Record* claim();
+    static void commit(Record* r);
+    static void taskStatic(void* arg);
+    static bool flush();
+    static void print(const char* line, size_t length);
+    static void encodeText(uint8_t*& p, uint8_t* end, const char* text, size_t length, bool printable);
+
+    static inline void encode(uint8_t*& p, uint8_t* end) {}
+
+    // every argument leaves room for the ones after it, a string takes at least its terminator
+    template<typename T, typename... Rest>
+    static void encode(uint8_t*& p, uint8_t* end, T value, Rest... rest)
+    {
+        Arg<T>::encode(p, end - minSize<Rest...>(), value);
+        encode(p, end, rest...);
+    }
+
+    template<typename... Rest>
+    static constexpr size_t minSize() { return sumSizes(Arg<Rest>::MinSize...); }
+    static constexpr size_t sumSizes() { return 0; }
+    template<typename... Sizes>
+    static constexpr size_t sumSizes(size_t size, Sizes... sizes) { return size + sumSizes(sizes...); }
+
+    template<typename... Args>
+    static inline void encodeArgs(uint8_t* p, Args... args)
+    {
+        static_assert(minSize<Args...>() <= ESP32_MQTT_LOG_ARGS_SIZE, "too many log arguments");
+        encode(p, p + ESP32_MQTT_LOG_ARGS_SIZE, args...);
+    }
+};
+
+template<>
+struct ESP32_MQTTLog::Arg<const char*>
+{
+    typedef const char* Stored;
+    static constexpr size_t MinSize = 1;
+    static void encode(uint8_t*& p, uint8_t* end, const char* value) { encodeText(p, end, value, value != nullptr ? strlen(value) : 0, false); }
+    static const char* decode(const uint8_t*& p) { const char* value = (const char*)p; p += strlen(value) + 1; return value; }
+};
+
+template<>
+struct ESP32_MQTTLog::Arg<char*> : ESP32_MQTTLog::Arg<const char*> {};
+
+template<>
+struct ESP32_MQTTLog::Arg<ESP32_MQTTLogText>
+{
+    typedef const char* Stored;
+    static constexpr size_t MinSize = 1;
+    static void encode(uint8_t*& p, uint8_t* end, const ESP32_MQTTLogText& value) { encodeText(p, end, value.text, value.length > 0 ? value.length : 0, value.printable); }
+    static const char* decode(const uint8_t*& p) { return Arg<const char*>::decode(p); }
+};
+
+// decodes the arguments one by one, in the order they were stored, and passes them to snprintf()
+template<>
+struct ESP32_MQTTLog::Formatter<>
+{
+    static int format(char* buf, size_t size, const char* format, const uint8_t* args) { return snprintf(buf, size, "%s", format); }
+
+    template<typename... Decoded>
+    static int format(char* buf, size_t size, const char* format, const uint8_t* args, Decoded... decoded) { return snprintf(buf, size, format, decoded...); }
+};
+
+template<typename T, typename... Rest>
+struct ESP32_MQTTLog::Formatter<T, Rest...>
+{
+    template<typename... Decoded>
+    static int format(char* buf, size_t size, const char* format, const uint8_t* args, Decoded... decoded)
+    {
+        typename Arg<T>::Stored value = Arg<T>::decode(args);
+        return Formatter<Rest...>::format(buf, size, format, args, decoded..., value);
+    }
+};
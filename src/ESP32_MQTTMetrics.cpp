@@ -0,0 +1,295 @@
+#include "ESP32_MQTTMetrics.h"
+
+// pending acks older than this are considered lost and their slot is reused
+#define ESP32_MQTT_METRICS_ACK_EXPIRY_US 60000000u
+
+ESP32_MQTTHistogram::ESP32_MQTTHistogram()
+{
+	reset();
+}
+
+void ESP32_MQTTHistogram::record(uint32_t valueUs)
+{
+	int bucket = valueUs == 0 ? 0 : 31 - __builtin_clz(valueUs);
+	if (bucket >= ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS)
+		bucket = ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS - 1;
+
+	_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t max = _maxUs.load(std::memory_order_relaxed);
+	while (valueUs > max && !_maxUs.compare_exchange_weak(max, valueUs, std::memory_order_relaxed))
+		;
+}
+
+void ESP32_MQTTHistogram::snapshot(ESP32_MQTTHistogramSnapshot& snapshot) const
+{
+	uint32_t total = 0;
+	for (int i = 0; i < ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS; i++)
+	{
+		snapshot.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+		total += snapshot.buckets[i];
+	}
+	snapshot.count = total;
+	snapshot.maxUs = _maxUs.load(std::memory_order_relaxed);
+
+	auto percentile = [&](uint32_t permille) -> uint32_t {
+		if (total == 0)
+			return 0;
+		uint32_t rank = ((uint64_t)total * permille + 999) / 1000;
+		uint32_t cumulative = 0;
+		for (int i = 0; i < ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS; i++)
+		{
+			cumulative += snapshot.buckets[i];
+			if (cumulative >= rank)
+				return i == ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS - 1 ? snapshot.maxUs : (2u << i);
+		}
+		return snapshot.maxUs;
+	};
+
+	snapshot.p50Us = percentile(500);
+	snapshot.p90Us = percentile(900);
+	snapshot.p99Us = percentile(990);
+}
+
+void ESP32_MQTTHistogram::reset()
+{
+	for (int i = 0; i < ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS; i++)
+		_buckets[i].store(0, std::memory_order_relaxed);
+	_count.store(0, std::memory_order_relaxed);
+	_maxUs.store(0, std::memory_order_relaxed);
+}
+
+ESP32_MQTTMetrics::ESP32_MQTTMetrics()
+{
+	_connected = false;
+	_connectedSinceMs = 0;
+	for (int i = 0; i < ESP32_MQTT_METRICS_PENDING_ACKS; i++)
+	{
+		_pendingAcks[i].msgId = 0;
+		_pendingAcks[i].timeUs = 0;
+	}
+	reset();
+}
+
+void ESP32_MQTTMetrics::reset()
+{
+	for (int i = 0; i < ESP32_MQTT_METRICS_EVENT_TYPES; i++)
+		_eventCounts[i].store(0, std::memory_order_relaxed);
+	_publishCount = 0;
+	_publishFailures = 0;
+	_enqueueCount = 0;
+	_enqueueFailures = 0;
+	_subscribeCount = 0;
+	_subscribeFailures = 0;
+	_messagesIn = 0;
+	_bytesIn = 0;
+	_bytesOut = 0;
+	_connectCount = 0;
+	_connectedTimeMs = 0;
+	if (_connected)
+		_connectedSinceMs = millis();
+	_ackLatency.reset();
+	_callbackTime.reset();
+}
+
+void ESP32_MQTTMetrics::recordEvent(int32_t eventId, const esp_mqtt_event_t* event)
+{
+	int index = eventId >= 0 && eventId < ESP32_MQTT_METRICS_EVENT_TYPES - 1 ? eventId : ESP32_MQTT_METRICS_EVENT_TYPES - 1;
+	_eventCounts[index].fetch_add(1, std::memory_order_relaxed);
+
+	switch (eventId)
+	{
+	case MQTT_EVENT_CONNECTED:
+		_connectCount.fetch_add(1, std::memory_order_relaxed);
+		_connectedSinceMs = millis();
+		_connected = true;
+		break;
+	case MQTT_EVENT_DISCONNECTED:
+		if (_connected.exchange(false))
+			_connectedTimeMs.fetch_add(millis() - _connectedSinceMs, std::memory_order_relaxed);
+		break;
+	case MQTT_EVENT_PUBLISHED:
+		completeAck(event->msg_id, true);
+		break;
+	case MQTT_EVENT_DATA:
+		if (event->current_data_offset == 0)
+			_messagesIn.fetch_add(1, std::memory_order_relaxed);
+		_bytesIn.fetch_add(event->data_len + event->topic_len, std::memory_order_relaxed);
+		break;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+	case MQTT_EVENT_DELETED:
+		completeAck(event->msg_id, false);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+void ESP32_MQTTMetrics::recordPublish(int result, size_t bytes, int qos, uint32_t startUs)
+{
+	if (result < 0)
+	{
+		_publishFailures.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	_publishCount.fetch_add(1, std::memory_order_relaxed);
+	_bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+	if (qos > 0)
+		trackAck(result, startUs);
+}
+
+void ESP32_MQTTMetrics::recordEnqueue(int result, size_t bytes, int qos, uint32_t startUs)
+{
+	if (result < 0)
+	{
+		_enqueueFailures.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	_enqueueCount.fetch_add(1, std::memory_order_relaxed);
+	_bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+	if (qos > 0)
+		trackAck(result, startUs);
+}
+
+void ESP32_MQTTMetrics::recordSubscribe(int result)
+{
+	if (result < 0)
+		_subscribeFailures.fetch_add(1, std::memory_order_relaxed);
+	else
+		_subscribeCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ESP32_MQTTMetrics::recordCallbackTime(uint32_t durationUs)
+{
+	_callbackTime.record(durationUs);
+}
+
+/// <summary>
+/// Takes a free slot or one whose ack was probably lost for slotId, the msg_id or the negated msg_id of an early ack.
+/// </summary>
+bool ESP32_MQTTMetrics::claimSlot(int slotId, uint32_t timeUs)
+{
+	int msgId = slotId < 0 ? -slotId : slotId;
+	uint32_t now = micros();
+	for (int i = 0; i < ESP32_MQTT_METRICS_PENDING_ACKS; i++)
+	{
+		PendingAck& ack = _pendingAcks[(msgId + i) % ESP32_MQTT_METRICS_PENDING_ACKS];
+		int expected = 0;
+		if (!ack.msgId.compare_exchange_strong(expected, slotId))
+		{
+			// ack of this message was probably lost, reuse the slot
+			if (now - ack.timeUs.load(std::memory_order_relaxed) < ESP32_MQTT_METRICS_ACK_EXPIRY_US || !ack.msgId.compare_exchange_strong(expected, slotId))
+				continue;
+		}
+		ack.timeUs.store(timeUs, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Starts the ack latency of a sent message. On a fast broker the ack can be processed by the MQTT task before publish()
+/// returns, then its early record completes the message right away.
+/// </summary>
+void ESP32_MQTTMetrics::trackAck(int msgId, uint32_t startUs)
+{
+	if (msgId <= 0)
+		return;
+
+	for (int i = 0; i < ESP32_MQTT_METRICS_PENDING_ACKS; i++)
+	{
+		PendingAck& ack = _pendingAcks[(msgId + i) % ESP32_MQTT_METRICS_PENDING_ACKS];
+		if (ack.msgId.load(std::memory_order_relaxed) != -msgId)
+			continue;
+
+		uint32_t ackUs = ack.timeUs.load(std::memory_order_relaxed);
+		int expected = -msgId;
+		if (ack.msgId.compare_exchange_strong(expected, 0))
+		{
+			_ackLatency.record(ackUs - startUs);
+			return;
+		}
+	}
+	claimSlot(msgId, startUs);
+}
+
+void ESP32_MQTTMetrics::completeAck(int msgId, bool record)
+{
+	if (msgId <= 0)
+		return;
+
+	for (int i = 0; i < ESP32_MQTT_METRICS_PENDING_ACKS; i++)
+	{
+		PendingAck& ack = _pendingAcks[(msgId + i) % ESP32_MQTT_METRICS_PENDING_ACKS];
+		if (ack.msgId.load(std::memory_order_relaxed) != msgId)
+			continue;
+
+		uint32_t startUs = ack.timeUs.load(std::memory_order_relaxed);
+		int expected = msgId;
+		if (ack.msgId.compare_exchange_strong(expected, 0) && record)
+			_ackLatency.record(micros() - startUs);
+		return;
+	}
+
+	// the publishing task hasn't tracked the message yet
+	if (record)
+		claimSlot(-msgId, micros());
+}
+
+void ESP32_MQTTMetrics::snapshot(ESP32_MQTTMetricsSnapshot& snapshot) const
+{
+	for (int i = 0; i < ESP32_MQTT_METRICS_EVENT_TYPES; i++)
+		snapshot.eventCounts[i] = _eventCounts[i].load(std::memory_order_relaxed);
+	snapshot.publishCount = _publishCount;
+	snapshot.publishFailures = _publishFailures;
+	snapshot.enqueueCount = _enqueueCount;
+	snapshot.enqueueFailures = _enqueueFailures;
+	snapshot.subscribeCount = _subscribeCount;
+	snapshot.subscribeFailures = _subscribeFailures;
+	snapshot.messagesIn = _messagesIn;
+	snapshot.bytesIn = _bytesIn;
+	snapshot.bytesOut = _bytesOut;
+	snapshot.connectCount = _connectCount;
+	snapshot.reconnectCount = snapshot.connectCount > 0 ? snapshot.connectCount - 1 : 0;
+	snapshot.connected = _connected;
+	snapshot.connectedTimeMs = _connectedTimeMs + (snapshot.connected ? millis() - _connectedSinceMs : 0);
+	snapshot.outboxSize = -1;
+	_ackLatency.snapshot(snapshot.ackLatency);
+	_callbackTime.snapshot(snapshot.callbackTime);
+}
+
+int ESP32_MQTTMetrics::toJson(const ESP32_MQTTMetricsSnapshot& s, char* buf, size_t size)
+{
+	int len = snprintf(buf, size,
+		"{\"connected\":%d,\"connects\":%u,\"reconnects\":%u,\"connectedMs\":%u,\"outbox\":%d,"
+		"\"published\":%u,\"publishFailed\":%u,\"enqueued\":%u,\"enqueueFailed\":%u,\"subscribed\":%u,\"subscribeFailed\":%u,"
+		"\"messagesIn\":%u,\"bytesIn\":%u,\"bytesOut\":%u,\"events\":[",
+		s.connected, s.connectCount, s.reconnectCount, s.connectedTimeMs, s.outboxSize,
+		s.publishCount, s.publishFailures, s.enqueueCount, s.enqueueFailures, s.subscribeCount, s.subscribeFailures,
+		s.messagesIn, s.bytesIn, s.bytesOut);
+
+	for (int i = 0; i < ESP32_MQTT_METRICS_EVENT_TYPES && len > 0 && (size_t)len < size; i++)
+		len += snprintf(buf + len, size - len, i == 0 ? "%u" : ",%u", s.eventCounts[i]);
+
+	if (len > 0 && (size_t)len < size)
+		len += snprintf(buf + len, size - len, "]");
+
+	const ESP32_MQTTHistogramSnapshot* histograms[] = { &s.ackLatency, &s.callbackTime };
+	const char* names[] = { "ackLatency", "callbackTime" };
+	for (int h = 0; h < 2 && len > 0 && (size_t)len < size; h++)
+	{
+		len += snprintf(buf + len, size - len, ",\"%s\":{\"count\":%u,\"max\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"buckets\":[",
+			names[h], histograms[h]->count, histograms[h]->maxUs, histograms[h]->p50Us, histograms[h]->p90Us, histograms[h]->p99Us);
+		for (int i = 0; i < ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS && (size_t)len < size; i++)
+			len += snprintf(buf + len, size - len, i == 0 ? "%u" : ",%u", histograms[h]->buckets[i]);
+		if ((size_t)len < size)
+			len += snprintf(buf + len, size - len, "]}");
+	}
+	if (len > 0 && (size_t)len < size)
+		len += snprintf(buf + len, size - len, "}");
+	return len;
+}
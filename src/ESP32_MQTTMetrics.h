@@ -0,0 +1,104 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+
+#define ESP32_MQTT_METRICS_EVENT_TYPES 10          // MQTT_EVENT_ERROR .. MQTT_EVENT_DELETED, the last one counts other events
+#define ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS 24     // bucket i counts values in [2^i, 2^(i+1)) microseconds
+#define ESP32_MQTT_METRICS_PENDING_ACKS 32          // QoS 1/2 publishes tracked for the ack latency
+
+struct ESP32_MQTTHistogramSnapshot
+{
+    uint32_t buckets[ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t maxUs;
+    uint32_t p50Us;     // upper bound of the bucket containing the percentile
+    uint32_t p90Us;
+    uint32_t p99Us;
+};
+
+struct ESP32_MQTTMetricsSnapshot
+{
+    uint32_t eventCounts[ESP32_MQTT_METRICS_EVENT_TYPES];  // indexed by esp_mqtt_event_id_t
+    uint32_t publishCount;
+    uint32_t publishFailures;
+    uint32_t enqueueCount;
+    uint32_t enqueueFailures;
+    uint32_t subscribeCount;
+    uint32_t subscribeFailures;
+    uint32_t messagesIn;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    uint32_t connectCount;
+    uint32_t reconnectCount;
+    uint32_t connectedTimeMs;   // total time spent connected, including the current connection
+    bool connected;
+    int outboxSize;
+    ESP32_MQTTHistogramSnapshot ackLatency;     // publish to MQTT_EVENT_PUBLISHED
+    ESP32_MQTTHistogramSnapshot callbackTime;   // processing of one event including the user callbacks
+};
+
+// Log2 histogram of durations in microseconds, lock-free.
+class ESP32_MQTTHistogram
+{
+public:
+    ESP32_MQTTHistogram();
+
+    void record(uint32_t valueUs);
+    void snapshot(ESP32_MQTTHistogramSnapshot& snapshot) const;
+    void reset();
+
+private:
+    std::atomic<uint32_t> _buckets[ESP32_MQTT_METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint32_t> _count;
+    std::atomic<uint32_t> _maxUs;
+};
+
+// Counters of the client activity. Updated from the MQTT task and the publishing tasks without locking.
+class ESP32_MQTTMetrics
+{
+public:
+    ESP32_MQTTMetrics();
+
+    void recordEvent(int32_t eventId, const esp_mqtt_event_t* event);
+    void recordPublish(int result, size_t bytes, int qos, uint32_t startUs);   // startUs: micros() before the message was sent
+    void recordEnqueue(int result, size_t bytes, int qos, uint32_t startUs);
+    void recordSubscribe(int result);
+    void recordCallbackTime(uint32_t durationUs);
+
+    void snapshot(ESP32_MQTTMetricsSnapshot& snapshot) const;
+    void reset();
+
+    static int toJson(const ESP32_MQTTMetricsSnapshot& snapshot, char* buf, size_t size); // returns the length as snprintf
+
+private:
+    // msgId > 0: waiting for the ack since timeUs, msgId < 0: the ack arrived at timeUs before the publish was tracked
+    struct PendingAck
+    {
+        std::atomic<int> msgId;
+        std::atomic<uint32_t> timeUs;
+    };
+
+    std::atomic<uint32_t> _eventCounts[ESP32_MQTT_METRICS_EVENT_TYPES];
+    std::atomic<uint32_t> _publishCount;
+    std::atomic<uint32_t> _publishFailures;
+    std::atomic<uint32_t> _enqueueCount;
+    std::atomic<uint32_t> _enqueueFailures;
+    std::atomic<uint32_t> _subscribeCount;
+    std::atomic<uint32_t> _subscribeFailures;
+    std::atomic<uint32_t> _messagesIn;
+    std::atomic<uint32_t> _bytesIn;
+    std::atomic<uint32_t> _bytesOut;
+    std::atomic<uint32_t> _connectCount;
+    std::atomic<uint32_t> _connectedTimeMs;
+    std::atomic<uint32_t> _connectedSinceMs;
+    std::atomic<bool> _connected;
+
+    PendingAck _pendingAcks[ESP32_MQTT_METRICS_PENDING_ACKS];
+    ESP32_MQTTHistogram _ackLatency;
+    ESP32_MQTTHistogram _callbackTime;
+
+    void trackAck(int msgId, uint32_t startUs);
+    void completeAck(int msgId, bool record);
+    bool claimSlot(int slotId, uint32_t timeUs);
+};
@@ -0,0 +1,332 @@
+#include "ESP32_MQTTPersistentOutbox.h"
+#include "ESP32_MQTTCrc32.h"
+#include <unistd.h>
+
+ESP32_MQTTPersistentOutbox::ESP32_MQTTPersistentOutbox()
+{
+	_file = nullptr;
+	_header = {};
+	_evictionPolicy = ESP32_MQTTOutboxEvictionPolicy::DropOldest;
+	_maxMessageSize = 0;
+	_readBuf = nullptr;
+	_peeked = false;
+	_peekedRecord = {};
+	_headSequence = 0;
+	_droppedCount = 0;
+	_corruptedCount = 0;
+}
+
+ESP32_MQTTPersistentOutbox::~ESP32_MQTTPersistentOutbox()
+{
+	end();
+}
+
+bool ESP32_MQTTPersistentOutbox::begin(const char* path, size_t capacity, size_t maxMessageSize, ESP32_MQTTOutboxEvictionPolicy evictionPolicy)
+{
+	end();
+
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (sizeof(RecordHeader) + maxMessageSize > capacity)
+	{
+		log_e("Outbox capacity %u is too small for messages of %u bytes", capacity, maxMessageSize);
+		return false;
+	}
+
+	// topic is stored null terminated in the read buffer
+	_readBuf = (uint8_t*)malloc(maxMessageSize + 1);
+	if (_readBuf == nullptr)
+		return false;
+
+	_file = fopen(path, "r+b");
+	if (_file == nullptr)
+		_file = fopen(path, "w+b");
+	if (_file == nullptr)
+	{
+		log_e("Can't open outbox file %s", path);
+		free(_readBuf);
+		_readBuf = nullptr;
+		return false;
+	}
+
+	_maxMessageSize = maxMessageSize;
+	_evictionPolicy = evictionPolicy;
+	_peeked = false;
+
+	if (!loadHeader() || _header.capacity != capacity)
+	{
+		_header.capacity = capacity;
+		reset();
+	}
+	return true;
+}
+
+void ESP32_MQTTPersistentOutbox::end()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file != nullptr)
+		fclose(_file);
+	if (_readBuf != nullptr)
+		free(_readBuf);
+	_file = nullptr;
+	_readBuf = nullptr;
+	_header = {};
+}
+
+uint32_t ESP32_MQTTPersistentOutbox::headerCrc(const Header& header)
+{
+	return ESP32_MQTTCrc32(0, &header, offsetof(Header, crc));
+}
+
+uint32_t ESP32_MQTTPersistentOutbox::recordCrc(const RecordHeader& record, const void* topic, const void* payload)
+{
+	uint32_t crc = ESP32_MQTTCrc32(0, &record.payloadLen, sizeof(RecordHeader) - offsetof(RecordHeader, payloadLen));
+	crc = ESP32_MQTTCrc32(crc, topic, record.topicLen);
+	return ESP32_MQTTCrc32(crc, payload, record.payloadLen);
+}
+
+bool ESP32_MQTTPersistentOutbox::loadHeader()
+{
+	Header headers[2];
+	fseek(_file, 0, SEEK_SET);
+	size_t read = fread(headers, sizeof(Header), 2, _file);
+
+	const Header* valid = nullptr;
+	for (size_t i = 0; i < read; i++)
+	{
+		const Header& h = headers[i];
+		if (h.magic != Magic || h.crc != headerCrc(h) || h.head >= h.capacity || h.tail >= h.capacity || h.used > h.capacity)
+			continue;
+		if (valid == nullptr || (int32_t)(h.sequence - valid->sequence) > 0)
+			valid = &h;
+	}
+
+	if (valid == nullptr)
+		return false;
+
+	_header = *valid;
+	return true;
+}
+
+bool ESP32_MQTTPersistentOutbox::saveHeader()
+{
+	// the older copy is overwritten, the other one stays valid if the write is interrupted
+	_header.sequence++;
+	_header.crc = headerCrc(_header);
+
+	fseek(_file, (_header.sequence & 1) * sizeof(Header), SEEK_SET);
+	bool ok = fwrite(&_header, sizeof(Header), 1, _file) == 1;
+	fflush(_file);
+	fsync(fileno(_file));
+	return ok;
+}
+
+void ESP32_MQTTPersistentOutbox::reset()
+{
+	uint32_t capacity = _header.capacity;
+	uint32_t sequence = _header.sequence;
+	_header = {};
+	_header.magic = Magic;
+	_header.capacity = capacity;
+	_header.sequence = sequence;
+	_peeked = false;
+	_headSequence++;
+
+	// both copies describe the empty log
+	saveHeader();
+	saveHeader();
+}
+
+void ESP32_MQTTPersistentOutbox::clear()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file != nullptr)
+		reset();
+}
+
+bool ESP32_MQTTPersistentOutbox::writeRing(uint32_t offset, const void* data, size_t length)
+{
+	size_t first = length < _header.capacity - offset ? length : _header.capacity - offset;
+
+	fseek(_file, DataOffset + offset, SEEK_SET);
+	if (fwrite(data, 1, first, _file) != first)
+		return false;
+
+	if (first < length)
+	{
+		fseek(_file, DataOffset, SEEK_SET);
+		if (fwrite((const uint8_t*)data + first, 1, length - first, _file) != length - first)
+			return false;
+	}
+	return true;
+}
+
+bool ESP32_MQTTPersistentOutbox::readRing(uint32_t offset, void* data, size_t length)
+{
+	size_t first = length < _header.capacity - offset ? length : _header.capacity - offset;
+
+	fseek(_file, DataOffset + offset, SEEK_SET);
+	if (fread(data, 1, first, _file) != first)
+		return false;
+
+	if (first < length)
+	{
+		fseek(_file, DataOffset, SEEK_SET);
+		if (fread((uint8_t*)data + first, 1, length - first, _file) != length - first)
+			return false;
+	}
+	return true;
+}
+
+bool ESP32_MQTTPersistentOutbox::append(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file == nullptr)
+		return false;
+
+	size_t topicLen = strlen(topic);
+	if (topicLen + length > _maxMessageSize)
+	{
+		_droppedCount++;
+		return false;
+	}
+
+	RecordHeader record;
+	record.payloadLen = length;
+	record.topicLen = topicLen;
+	record.qos = qos;
+	record.retain = retain;
+	record.crc = recordCrc(record, topic, payload);
+
+	size_t recordSize = sizeof(RecordHeader) + topicLen + length;
+	bool evicted = false;
+	while (_header.capacity - _header.used < recordSize)
+	{
+		_droppedCount++;
+		if (_evictionPolicy == ESP32_MQTTOutboxEvictionPolicy::DropNewest || !dropOldest())
+			return false;
+		evicted = true;
+	}
+
+	// the header on flash must not point at the evicted records once they are overwritten, a power loss during the write
+	// would leave it pointing at a record with a bad CRC and the whole log would be reset
+	if (evicted && !saveHeader())
+		return false;
+
+	uint32_t offset = _header.tail;
+	bool ok = writeRing(offset, &record, sizeof(RecordHeader));
+	offset = (offset + sizeof(RecordHeader)) % _header.capacity;
+	ok = ok && writeRing(offset, topic, topicLen);
+	offset = (offset + topicLen) % _header.capacity;
+	ok = ok && (length == 0 || writeRing(offset, payload, length));
+	if (!ok)
+	{
+		log_e("Outbox write failed");
+		return false;
+	}
+
+	// data is flushed together with the header
+	_header.tail = (_header.tail + recordSize) % _header.capacity;
+	_header.used += recordSize;
+	_header.count++;
+	return saveHeader();
+}
+
+/// <summary>
+/// Reads and verifies the oldest record into _readBuf. The log is reset if it is corrupted.
+/// </summary>
+bool ESP32_MQTTPersistentOutbox::readRecord(RecordHeader& record)
+{
+	bool ok = readRing(_header.head, &record, sizeof(RecordHeader));
+	size_t bodySize = record.topicLen + record.payloadLen;
+	if (ok && bodySize <= _maxMessageSize && sizeof(RecordHeader) + bodySize <= _header.used)
+	{
+		uint32_t offset = (_header.head + sizeof(RecordHeader)) % _header.capacity;
+		ok = readRing(offset, _readBuf, record.topicLen);
+		offset = (offset + record.topicLen) % _header.capacity;
+		ok = ok && readRing(offset, _readBuf + record.topicLen + 1, record.payloadLen);
+		if (ok && record.crc == recordCrc(record, _readBuf, _readBuf + record.topicLen + 1))
+		{
+			_readBuf[record.topicLen] = '\0';
+			return true;
+		}
+	}
+
+	log_e("Outbox is corrupted, dropping %u messages", _header.count);
+	_corruptedCount++;
+	_droppedCount += _header.count;
+	reset();
+	return false;
+}
+
+bool ESP32_MQTTPersistentOutbox::peek(ESP32_MQTTStoredMessage& message)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file == nullptr || _header.count == 0)
+		return false;
+
+	if (!_peeked)
+	{
+		if (!readRecord(_peekedRecord))
+			return false;
+		_peeked = true;
+	}
+
+	message.topic = (const char*)_readBuf;
+	message.payload = _readBuf + _peekedRecord.topicLen + 1;
+	message.length = _peekedRecord.payloadLen;
+	message.qos = _peekedRecord.qos;
+	message.retain = _peekedRecord.retain;
+	message.sequence = _headSequence;
+	return true;
+}
+
+bool ESP32_MQTTPersistentOutbox::dropOldest()
+{
+	RecordHeader record;
+	if (_header.count == 0 || !readRing(_header.head, &record, sizeof(RecordHeader)))
+		return false;
+
+	size_t recordSize = sizeof(RecordHeader) + record.topicLen + record.payloadLen;
+	if (recordSize > _header.used)
+	{
+		_corruptedCount++;
+		reset();
+		return true;
+	}
+
+	_header.head = (_header.head + recordSize) % _header.capacity;
+	_header.used -= recordSize;
+	_header.count--;
+	if (_header.count == 0)
+	{
+		_header.head = 0;
+		_header.tail = 0;
+		_header.used = 0;
+	}
+	_peeked = false;
+	_headSequence++;
+	return true;
+}
+
+bool ESP32_MQTTPersistentOutbox::pop()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file == nullptr || !dropOldest())
+		return false;
+	return saveHeader();
+}
+
+bool ESP32_MQTTPersistentOutbox::popIfHead(uint32_t sequence)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	if (_file == nullptr || sequence != _headSequence || !dropOldest())
+		return false;
+	return saveHeader();
+}
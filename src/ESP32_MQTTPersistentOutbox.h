@@ -0,0 +1,95 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <stdio.h>
+#include <mutex>
+
+// what happens with a message which doesn't fit into the outbox
+enum class ESP32_MQTTOutboxEvictionPolicy
+{
+    DropOldest,     // oldest messages are removed to make room
+    DropNewest      // the new message is rejected
+};
+
+struct ESP32_MQTTStoredMessage
+{
+    const char* topic;
+    const uint8_t* payload;
+    size_t length;
+    int qos;
+    bool retain;
+    uint32_t sequence;  // identifies the record for popIfHead()
+};
+
+// Store-and-forward outbox persisted in a file (e.g. "/littlefs/mqtt_outbox" on the device, any path on Linux).
+// Messages are kept in an append-only ring log of fixed size, each record is protected by CRC. The file starts with
+// two copies of the header written alternately, so a power loss during a header write doesn't lose the log.
+class ESP32_MQTTPersistentOutbox
+{
+public:
+    ESP32_MQTTPersistentOutbox();
+    ~ESP32_MQTTPersistentOutbox();
+
+    bool begin(const char* path, size_t capacity, size_t maxMessageSize, ESP32_MQTTOutboxEvictionPolicy evictionPolicy = ESP32_MQTTOutboxEvictionPolicy::DropOldest); // opens or creates the log, capacity is the size of the ring in bytes, maxMessageSize limits topic + payload
+    void end();
+
+    bool append(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain);
+    bool peek(ESP32_MQTTStoredMessage& message);    // oldest message, valid until the next peek() or pop()
+    bool pop();                                     // removes the oldest message
+    bool popIfHead(uint32_t sequence);              // removes the oldest message if it is still the one peek() returned, an append() may have evicted it meanwhile
+    void clear();
+
+    inline bool isOpen() { return _file != nullptr; }
+    inline size_t getCount() { std::lock_guard<std::recursive_mutex> lock(_mutex); return _header.count; }
+    inline size_t getUsedBytes() { std::lock_guard<std::recursive_mutex> lock(_mutex); return _header.used; }
+    inline size_t getCapacity() { std::lock_guard<std::recursive_mutex> lock(_mutex); return _header.capacity; }
+    inline unsigned int getDroppedCount() { std::lock_guard<std::recursive_mutex> lock(_mutex); return _droppedCount; }   // messages evicted or rejected
+    inline unsigned int getCorruptedCount() { std::lock_guard<std::recursive_mutex> lock(_mutex); return _corruptedCount; } // times the log was reset because of a CRC mismatch
+
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t capacity;
+        uint32_t head;      // offset of the oldest record in the ring
+        uint32_t tail;      // offset where the next record is written
+        uint32_t used;
+        uint32_t count;
+        uint32_t crc;
+    };
+
+    struct RecordHeader
+    {
+        uint32_t crc;       // of the rest of the record header, topic and payload
+        uint32_t payloadLen;
+        uint16_t topicLen;
+        uint8_t qos;
+        uint8_t retain;
+    };
+
+    static const uint32_t Magic = 0x4D514F42;   // "MQOB"
+    static const size_t DataOffset = 2 * sizeof(Header);
+
+    FILE* _file;
+    Header _header;
+    ESP32_MQTTOutboxEvictionPolicy _evictionPolicy;
+    size_t _maxMessageSize;
+    uint8_t* _readBuf;
+    bool _peeked;
+    RecordHeader _peekedRecord;
+    uint32_t _headSequence;     // of the oldest record, counts the removed records since begin()
+    unsigned int _droppedCount;
+    unsigned int _corruptedCount;
+    std::recursive_mutex _mutex;
+
+    static uint32_t headerCrc(const Header& header);
+    static uint32_t recordCrc(const RecordHeader& record, const void* topic, const void* payload);
+    bool loadHeader();
+    bool saveHeader();
+    void reset();
+    bool writeRing(uint32_t offset, const void* data, size_t length);
+    bool readRing(uint32_t offset, void* data, size_t length);
+    bool readRecord(RecordHeader& record);
+    bool dropOldest();
+};
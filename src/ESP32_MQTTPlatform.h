@@ -0,0 +1,21 @@
+#pragma once
+
+// Everything the library uses from arduino-esp32 and ESP-IDF is included here, the library headers include only this one.
+// The host build (extras/host) provides stand-ins for these APIs:
+// - Arduino: log_d/log_w/log_e, log_printf(), millis(), micros(), IPAddress
+// - FreeRTOS: xTaskCreatePinnedToCore(), task notifications, binary semaphores
+// - esp_timer: one-shot and periodic timers
+// - esp_random()
+// - esp_partition_find_first(), esp_partition_erase_range(), esp_partition_write()
+// - mbedtls SHA-256
+// - esp-mqtt: the esp_mqtt_client_* functions and types from mqtt_client.h
+#include <Arduino.h>
+#include <esp_idf_version.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <mqtt_client.h>
@@ -0,0 +1,243 @@
+#include "ESP32_MQTTPublishQueue.h"
+
+ESP32_MQTTPublishQueue::ESP32_MQTTPublishQueue()
+{
+	_slots = nullptr;
+	_slab = nullptr;
+	_capacity = 0;
+	_slotDataSize = 0;
+	_enqueuePos = 0;
+	_dequeuePos = 0;
+	_claimedPos = 0;
+	_spaceAvailable = nullptr;
+	_blockedCount = 0;
+	_highWaterMark = 0;
+	_dropCount = 0;
+}
+
+ESP32_MQTTPublishQueue::~ESP32_MQTTPublishQueue()
+{
+	deinit();
+}
+
+bool ESP32_MQTTPublishQueue::init(size_t capacity, size_t maxMessageSize)
+{
+	deinit();
+
+	if (capacity == 0 || maxMessageSize == 0)
+		return false;
+
+	// positions are mapped to slots with a mask
+	size_t roundedCapacity = 1;
+	while (roundedCapacity < capacity)
+		roundedCapacity <<= 1;
+
+	_slab = (uint8_t*)malloc(roundedCapacity * maxMessageSize);
+	_spaceAvailable = xSemaphoreCreateBinary();
+	if (_slab == nullptr || _spaceAvailable == nullptr)
+	{
+		log_e("Can't allocate publish queue of %u x %u bytes", roundedCapacity, maxMessageSize);
+		deinit();
+		return false;
+	}
+
+	_slots = new Slot[roundedCapacity];
+	for (size_t i = 0; i < roundedCapacity; i++)
+	{
+		_slots[i].sequence.store(i, std::memory_order_relaxed);
+		_slots[i].data = _slab + i * maxMessageSize;
+	}
+
+	_capacity = roundedCapacity;
+	_slotDataSize = maxMessageSize;
+	_enqueuePos = 0;
+	_dequeuePos = 0;
+	return true;
+}
+
+void ESP32_MQTTPublishQueue::deinit()
+{
+	if (_slots != nullptr)
+		delete[] _slots;
+	if (_slab != nullptr)
+		free(_slab);
+	if (_spaceAvailable != nullptr)
+		vSemaphoreDelete(_spaceAvailable);
+
+	_slots = nullptr;
+	_slab = nullptr;
+	_spaceAvailable = nullptr;
+	_capacity = 0;
+	_slotDataSize = 0;
+}
+
+size_t ESP32_MQTTPublishQueue::getSize()
+{
+	size_t enqueuePos = _enqueuePos.load(std::memory_order_relaxed);
+	size_t dequeuePos = _dequeuePos.load(std::memory_order_relaxed);
+	return enqueuePos - dequeuePos <= _capacity ? enqueuePos - dequeuePos : 0;
+}
+
+/// <summary>
+/// Queues a copy of the message. What happens when the queue is full depends on fullPolicy.
+/// </summary>
+/// <returns>0 on success, -1 if the message doesn't fit a slot, -2 if the queue is full</returns>
+int ESP32_MQTTPublishQueue::push(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, ESP32_MQTTQueueFullPolicy fullPolicy, unsigned long blockTimeoutMs)
+{
+	if (_slots == nullptr || topic == nullptr)
+		return -1;
+
+	size_t topicLen = strlen(topic);
+	if (topicLen > UINT16_MAX || topicLen + 1 + length > _slotDataSize)
+	{
+		log_e("Message of %u bytes doesn't fit the publish queue slot of %u bytes", topicLen + 1 + length, _slotDataSize);
+		return -1;
+	}
+
+	if (tryPush(topic, topicLen, payload, length, qos, retain))
+		return 0;
+
+	if (fullPolicy == ESP32_MQTTQueueFullPolicy::DropOldest)
+	{
+		// other producers may take the freed slot first, then the next oldest goes. Nothing can be dropped when only
+		// messages being written or sent are left.
+		while (dropOldest())
+		{
+			if (tryPush(topic, topicLen, payload, length, qos, retain))
+				return 0;
+		}
+	}
+
+	if (fullPolicy == ESP32_MQTTQueueFullPolicy::Block)
+	{
+		unsigned long startMillis = millis();
+		while (true)
+		{
+			unsigned long elapsed = millis() - startMillis;
+			if (elapsed >= blockTimeoutMs)
+				break;
+
+			// the sender gives the semaphore only when it sees a blocked producer, the push is retried after registering
+			// so a slot freed in between isn't missed
+			_blockedCount.fetch_add(1, std::memory_order_seq_cst);
+			bool pushed = tryPush(topic, topicLen, payload, length, qos, retain);
+			if (!pushed)
+				xSemaphoreTake(_spaceAvailable, blockTimeoutMs == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(blockTimeoutMs - elapsed));
+			_blockedCount.fetch_sub(1, std::memory_order_relaxed);
+			if (pushed || tryPush(topic, topicLen, payload, length, qos, retain))
+				return 0;
+		}
+	}
+
+	_dropCount.fetch_add(1, std::memory_order_relaxed);
+	return -2;
+}
+
+bool ESP32_MQTTPublishQueue::tryPush(const char* topic, size_t topicLen, const uint8_t* payload, size_t length, int qos, bool retain)
+{
+	size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+	Slot* slot;
+	while (true)
+	{
+		slot = &_slots[pos & (_capacity - 1)];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0)
+		{
+			// the slot is free for this position, claim it
+			if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// the slot still holds the message of the previous round
+			return false;
+		}
+		else
+		{
+			// another producer claimed the position
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	memcpy(slot->data, topic, topicLen + 1);
+	if (length > 0)
+		memcpy(slot->data + topicLen + 1, payload, length);
+	slot->topicLen = topicLen;
+	slot->length = length;
+	slot->qos = qos;
+	slot->retain = retain;
+	slot->sequence.store(pos + 1, std::memory_order_release);
+
+	size_t size = pos + 1 - _dequeuePos.load(std::memory_order_relaxed);
+	size_t highWaterMark = _highWaterMark.load(std::memory_order_relaxed);
+	while (size <= _capacity && size > highWaterMark && !_highWaterMark.compare_exchange_weak(highWaterMark, size, std::memory_order_relaxed))
+		;
+	return true;
+}
+
+/// <summary>
+/// Takes the oldest message out, the slot stays occupied until its sequence is advanced.
+/// </summary>
+/// <returns>the slot, nullptr if the queue is empty</returns>
+ESP32_MQTTPublishQueue::Slot* ESP32_MQTTPublishQueue::dequeue(size_t& pos)
+{
+	pos = _dequeuePos.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Slot* slot = &_slots[pos & (_capacity - 1)];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+		if (diff == 0)
+		{
+			if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return slot;
+		}
+		else if (diff < 0)
+		{
+			// not written yet
+			return nullptr;
+		}
+		else
+		{
+			pos = _dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool ESP32_MQTTPublishQueue::dropOldest()
+{
+	size_t pos;
+	Slot* slot = dequeue(pos);
+	if (slot == nullptr)
+		return false;
+
+	slot->sequence.store(pos + _capacity, std::memory_order_release);
+	_dropCount.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool ESP32_MQTTPublishQueue::claim(ESP32_MQTTQueuedMessage& message)
+{
+	if (_slots == nullptr)
+		return false;
+
+	Slot* slot = dequeue(_claimedPos);
+	if (slot == nullptr)
+		return false;
+
+	message.topic = (const char*)slot->data;
+	message.payload = slot->data + slot->topicLen + 1;
+	message.length = slot->length;
+	message.qos = slot->qos;
+	message.retain = slot->retain;
+	return true;
+}
+
+void ESP32_MQTTPublishQueue::release()
+{
+	_slots[_claimedPos & (_capacity - 1)].sequence.store(_claimedPos + _capacity, std::memory_order_release);
+
+	if (_blockedCount.load(std::memory_order_seq_cst) > 0)
+		xSemaphoreGive(_spaceAvailable);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+
+// what publishAsync() does when the publish queue is full
+enum class ESP32_MQTTQueueFullPolicy
+{
+    FailFast,       // returns -2 right away
+    Block,          // waits until a slot is free or the block timeout expires
+    DropOldest      // the oldest queued message is dropped and counted in getPublishQueueDropCount()
+};
+
+// message taken from the queue, the pointers are valid until release()
+struct ESP32_MQTTQueuedMessage
+{
+    const char* topic;
+    const uint8_t* payload;
+    size_t length;
+    int qos;
+    bool retain;
+};
+
+// Lock-free bounded queue of messages waiting to be published (Dmitry Vyukov's bounded MPMC queue). Any number of tasks
+// push, one sender task takes the messages out. Each slot has a sequence number telling whether it is free or holds a
+// message of the current round, a push claims a slot with one compare-and-swap and copies the topic and the payload into
+// the slot's part of a slab allocated in init(). A DropOldest push takes the oldest message out the same way the sender does.
+class ESP32_MQTTPublishQueue
+{
+public:
+    ESP32_MQTTPublishQueue();
+    ~ESP32_MQTTPublishQueue();
+
+    bool init(size_t capacity, size_t maxMessageSize);  // capacity is rounded up to a power of two, maxMessageSize holds the topic and the payload
+    void deinit();
+
+    int push(const char* topic, const uint8_t* payload, size_t length, int qos, bool retain, ESP32_MQTTQueueFullPolicy fullPolicy, unsigned long blockTimeoutMs); // 0 on success, -1 if the message doesn't fit a slot, -2 if the queue is full
+    bool claim(ESP32_MQTTQueuedMessage& message);  // sender only, takes the oldest message, false if empty
+    void release();                                 // sender only, frees the slot of the claimed message
+
+    inline bool isInitialized() { return _slots != nullptr; }
+    inline size_t getCapacity() { return _capacity; }
+    size_t getSize();
+    inline size_t getHighWaterMark() { return _highWaterMark.load(std::memory_order_relaxed); }
+    inline unsigned int getDropCount() { return _dropCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;   // position + 1 when it holds the message of that position, position + capacity when free for it
+        uint8_t* data;                  // topic with the terminating zero, then the payload
+        size_t length;
+        uint16_t topicLen;
+        uint8_t qos;
+        bool retain;
+    };
+
+    Slot* _slots;
+    uint8_t* _slab;
+    size_t _capacity;
+    size_t _slotDataSize;
+    std::atomic<size_t> _enqueuePos;
+    std::atomic<size_t> _dequeuePos;
+    size_t _claimedPos;
+
+    SemaphoreHandle_t _spaceAvailable;  // given on release() while a Block push waits
+    std::atomic<int> _blockedCount;
+
+    std::atomic<size_t> _highWaterMark;
+    std::atomic<unsigned int> _dropCount;
+
+    bool tryPush(const char* topic, size_t topicLen, const uint8_t* payload, size_t length, int qos, bool retain);
+    Slot* dequeue(size_t& pos);
+    bool dropOldest();
+};
@@ -0,0 +1,54 @@
+#include "ESP32_MQTTReconnectPolicy.h"
+
+ESP32_MQTTReconnectPolicy::ESP32_MQTTReconnectPolicy(unsigned long baseDelayMs, unsigned long maxDelayMs, unsigned long stablePeriodMs)
+{
+	_baseDelayMs = baseDelayMs;
+	_maxDelayMs = maxDelayMs;
+	_stablePeriodMs = stablePeriodMs;
+	_connectedMillis = 0;
+	_connected = false;
+	_attemptCount = 0;
+}
+
+void ESP32_MQTTReconnectPolicy::setBackoff(unsigned long baseDelayMs, unsigned long maxDelayMs)
+{
+	_baseDelayMs = baseDelayMs;
+	_maxDelayMs = maxDelayMs;
+}
+
+void ESP32_MQTTReconnectPolicy::setStablePeriod(unsigned long stablePeriodMs)
+{
+	_stablePeriodMs = stablePeriodMs;
+}
+
+void ESP32_MQTTReconnectPolicy::connected(unsigned long now)
+{
+	_connected = true;
+	_connectedMillis = now;
+}
+
+unsigned long ESP32_MQTTReconnectPolicy::nextDelay(unsigned long now)
+{
+	// a connection which dropped right after it was established doesn't reset the backoff,
+	// otherwise a broker accepting and closing connections would be hammered at the base delay
+	if (_connected && now - _connectedMillis >= _stablePeriodMs)
+		_attemptCount = 0;
+	_connected = false;
+
+	unsigned long ceiling = _baseDelayMs;
+	for (unsigned int i = 0; i < _attemptCount && ceiling < _maxDelayMs; i++)
+		ceiling *= 2;
+	if (ceiling > _maxDelayMs)
+		ceiling = _maxDelayMs;
+
+	if (_attemptCount < 32)
+		_attemptCount++;
+
+	return ceiling > 0 ? esp_random() % (ceiling + 1) : 0;
+}
+
+void ESP32_MQTTReconnectPolicy::reset()
+{
+	_attemptCount = 0;
+	_connected = false;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+
+// Exponential backoff with full jitter: the n-th reconnection attempt waits a random time between 0 and
+// min(maxDelayMs, baseDelayMs * 2^n), so a fleet of clients disconnected at the same moment doesn't reconnect in lockstep.
+// The backoff starts over once a connection lasted stablePeriodMs.
+class ESP32_MQTTReconnectPolicy
+{
+public:
+    ESP32_MQTTReconnectPolicy(unsigned long baseDelayMs = 1000, unsigned long maxDelayMs = 60000, unsigned long stablePeriodMs = 30000);
+
+    void setBackoff(unsigned long baseDelayMs, unsigned long maxDelayMs);
+    void setStablePeriod(unsigned long stablePeriodMs);
+
+    void connected(unsigned long now);
+    unsigned long nextDelay(unsigned long now);    // delay of the next attempt after a disconnect or a failed attempt
+    void reset();
+
+    inline unsigned int getAttemptCount() { return _attemptCount; }
+    inline unsigned long getMaxDelay() { return _maxDelayMs; }
+
+private:
+    unsigned long _baseDelayMs;
+    unsigned long _maxDelayMs;
+    unsigned long _stablePeriodMs;
+    unsigned long _connectedMillis;
+    bool _connected;
+    unsigned int _attemptCount;
+};
@@ -0,0 +1,417 @@
+#include "ESP32_MQTTRetainedCache.h"
+#include "ESP32_MQTTTopicTrie.h"
+#include <math.h>
+
+ESP32_MQTTRetainedCache::ESP32_MQTTRetainedCache()
+{
+	_entries = nullptr;
+	_buckets = nullptr;
+	_bucketMask = 0;
+	_capacity = 0;
+	_count = 0;
+	_freeHead = None;
+	_lruHead = None;
+	_lruTail = None;
+	_refreshIntervalMs = 0;
+	_checkedCount = 0;
+	_suppressedCount = 0;
+}
+
+ESP32_MQTTRetainedCache::~ESP32_MQTTRetainedCache()
+{
+	deinit();
+}
+
+bool ESP32_MQTTRetainedCache::init(size_t capacity, unsigned long refreshIntervalMs)
+{
+	deinit();
+
+	if (capacity == 0 || capacity >= None)
+		return false;
+
+	// about one entry per bucket
+	size_t bucketCount = 1;
+	while (bucketCount < capacity)
+		bucketCount <<= 1;
+
+	_entries = (Entry*)malloc(capacity * sizeof(Entry));
+	_buckets = (uint16_t*)malloc(bucketCount * sizeof(uint16_t));
+	if (_entries == nullptr || _buckets == nullptr)
+	{
+		log_e("Can't allocate retained cache of %u topics", capacity);
+		free(_entries);
+		free(_buckets);
+		_entries = nullptr;
+		_buckets = nullptr;
+		return false;
+	}
+
+	_capacity = capacity;
+	_bucketMask = bucketCount - 1;
+	_refreshIntervalMs = refreshIntervalMs;
+	clear();
+	return true;
+}
+
+void ESP32_MQTTRetainedCache::deinit()
+{
+	if (_entries != nullptr)
+		free(_entries);
+	if (_buckets != nullptr)
+		free(_buckets);
+	_entries = nullptr;
+	_buckets = nullptr;
+	_bucketMask = 0;
+	_capacity = 0;
+	_count = 0;
+}
+
+void ESP32_MQTTRetainedCache::clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries == nullptr)
+		return;
+
+	for (size_t i = 0; i <= _bucketMask; i++)
+		_buckets[i] = None;
+	for (uint16_t i = 0; i < _capacity; i++)
+		_entries[i].bucketNext = i + 1 < _capacity ? i + 1 : None;
+	_freeHead = 0;
+	_lruHead = None;
+	_lruTail = None;
+	_count = 0;
+}
+
+uint32_t ESP32_MQTTRetainedCache::hash(const uint8_t* data, size_t length)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+bool ESP32_MQTTRetainedCache::parseNumber(const uint8_t* payload, size_t length, float& value)
+{
+	char buf[32];
+	if (payload == nullptr || length == 0 || length >= sizeof(buf))
+		return false;
+
+	memcpy(buf, payload, length);
+	buf[length] = '\0';
+	char* end;
+	value = strtof(buf, &end);
+	return end == buf + length && !isnan(value);
+}
+
+/// <summary>
+/// Decides whether a retained publish is sent: always for a new topic or once the refresh interval has expired since
+/// the topic was last sent, otherwise only if the payload changed and, with a deadband, if a number moved by at least
+/// the deadband since it was last sent. Small steps in one direction add up until they cross it.
+/// </summary>
+/// <returns>true if the message should be published</returns>
+bool ESP32_MQTTRetainedCache::check(const char* topic, const uint8_t* payload, size_t length, float deadband)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries == nullptr)
+		return true;
+
+	_checkedCount++;
+	uint32_t topicHash = hash((const uint8_t*)topic, strlen(topic));
+	uint32_t digest = length > 0 ? hash(payload, length) : 0;
+	uint32_t now = millis();
+	float value = 0;
+	bool hasValue = deadband > 0 && parseNumber(payload, length, value);
+
+	uint16_t index = find(topicHash);
+	if (index != None)
+	{
+		Entry& entry = _entries[index];
+		unlinkLru(index);
+		pushLru(index);
+
+		bool refreshDue = _refreshIntervalMs > 0 && now - entry.sentMillis >= _refreshIntervalMs;
+		if (!refreshDue && (entry.digest == digest || (hasValue && entry.hasValue && fabsf(value - entry.value) < deadband)))
+		{
+			_suppressedCount++;
+			return false;
+		}
+	}
+	else
+	{
+		index = allocate(topicHash);
+	}
+
+	Entry& entry = _entries[index];
+	entry.digest = digest;
+	entry.value = value;
+	entry.hasValue = hasValue;
+	entry.sentMillis = now;
+	return true;
+}
+
+void ESP32_MQTTRetainedCache::forget(const char* topic)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries == nullptr)
+		return;
+
+	uint16_t index = find(hash((const uint8_t*)topic, strlen(topic)));
+	if (index != None)
+		remove(index);
+}
+
+uint16_t ESP32_MQTTRetainedCache::find(uint32_t topicHash)
+{
+	for (uint16_t index = _buckets[topicHash & _bucketMask]; index != None; index = _entries[index].bucketNext)
+	{
+		if (_entries[index].topicHash == topicHash)
+			return index;
+	}
+	return None;
+}
+
+/// <summary>
+/// Takes a free entry, or evicts the least recently published topic, and links it in as the most recent one.
+/// </summary>
+uint16_t ESP32_MQTTRetainedCache::allocate(uint32_t topicHash)
+{
+	if (_freeHead == None)
+		remove(_lruTail);
+
+	uint16_t index = _freeHead;
+	Entry& entry = _entries[index];
+	_freeHead = entry.bucketNext;
+
+	uint16_t& bucket = _buckets[topicHash & _bucketMask];
+	entry.topicHash = topicHash;
+	entry.bucketNext = bucket;
+	bucket = index;
+	pushLru(index);
+	_count++;
+	return index;
+}
+
+void ESP32_MQTTRetainedCache::remove(uint16_t index)
+{
+	Entry& entry = _entries[index];
+	uint16_t* link = &_buckets[entry.topicHash & _bucketMask];
+	while (*link != index)
+		link = &_entries[*link].bucketNext;
+	*link = entry.bucketNext;
+
+	unlinkLru(index);
+	entry.bucketNext = _freeHead;
+	_freeHead = index;
+	_count--;
+}
+
+void ESP32_MQTTRetainedCache::unlinkLru(uint16_t index)
+{
+	Entry& entry = _entries[index];
+	if (entry.lruPrev != None)
+		_entries[entry.lruPrev].lruNext = entry.lruNext;
+	else
+		_lruHead = entry.lruNext;
+	if (entry.lruNext != None)
+		_entries[entry.lruNext].lruPrev = entry.lruPrev;
+	else
+		_lruTail = entry.lruPrev;
+}
+
+void ESP32_MQTTRetainedCache::pushLru(uint16_t index)
+{
+	Entry& entry = _entries[index];
+	entry.lruPrev = None;
+	entry.lruNext = _lruHead;
+	if (_lruHead != None)
+		_entries[_lruHead].lruPrev = index;
+	else
+		_lruTail = index;
+	_lruHead = index;
+}
+
+ESP32_MQTTRetainedStore::ESP32_MQTTRetainedStore()
+{
+	_entries = nullptr;
+	_slab = nullptr;
+	_capacity = 0;
+	_slotSize = 0;
+	_count = 0;
+	_useCounter = 0;
+}
+
+ESP32_MQTTRetainedStore::~ESP32_MQTTRetainedStore()
+{
+	deinit();
+}
+
+bool ESP32_MQTTRetainedStore::init(size_t capacity, size_t maxMessageSize)
+{
+	deinit();
+
+	if (capacity == 0 || maxMessageSize == 0)
+		return false;
+
+	_slab = (uint8_t*)malloc(capacity * maxMessageSize);
+	if (_slab == nullptr)
+	{
+		log_e("Can't allocate retained store of %u x %u bytes", capacity, maxMessageSize);
+		return false;
+	}
+
+	_entries = new Entry[capacity];
+	for (size_t i = 0; i < capacity; i++)
+		_entries[i].data = _slab + i * maxMessageSize;
+	_capacity = capacity;
+	_slotSize = maxMessageSize;
+	_count = 0;
+	return true;
+}
+
+void ESP32_MQTTRetainedStore::deinit()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries != nullptr)
+		delete[] _entries;
+	if (_slab != nullptr)
+		free(_slab);
+	_entries = nullptr;
+	_slab = nullptr;
+	_capacity = 0;
+	_slotSize = 0;
+	_count = 0;
+}
+
+uint32_t ESP32_MQTTRetainedStore::hashTopic(const char* topic, int topicLen)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < topicLen; i++)
+	{
+		hash ^= (uint8_t)topic[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int ESP32_MQTTRetainedStore::indexOf(const char* topic, int topicLen, uint32_t hash)
+{
+	for (size_t i = 0; i < _count; i++)
+	{
+		Entry& entry = _entries[i];
+		if (entry.hash == hash && entry.topicLen == topicLen && memcmp(entry.data, topic, topicLen) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void ESP32_MQTTRetainedStore::removeAt(size_t index)
+{
+	// the last entry takes the place, its slot goes with it
+	_count--;
+	if (index != _count)
+	{
+		Entry removed = _entries[index];
+		_entries[index] = _entries[_count];
+		_entries[_count] = removed;
+	}
+}
+
+void ESP32_MQTTRetainedStore::store(const char* topic, int topicLen, const uint8_t* payload, size_t length, bool retain)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries == nullptr || topic == nullptr || topicLen <= 0)
+		return;
+
+	uint32_t hash = hashTopic(topic, topicLen);
+	int index = indexOf(topic, topicLen, hash);
+	if (index < 0 && !retain)
+		return;
+
+	// an empty retained message clears the topic, a message too big for a slot would leave a stale value behind
+	if ((retain && length == 0) || topicLen + length > _slotSize || topicLen > UINT16_MAX)
+	{
+		if (index >= 0)
+			removeAt(index);
+		return;
+	}
+
+	if (index < 0)
+	{
+		if (_count < _capacity)
+		{
+			index = _count++;
+		}
+		else
+		{
+			index = 0;
+			for (size_t i = 1; i < _count; i++)
+			{
+				// wrap-around safe comparison of the use counters
+				if ((int32_t)(_entries[i].lastUse - _entries[index].lastUse) < 0)
+					index = i;
+			}
+		}
+	}
+
+	Entry& entry = _entries[index];
+	memcpy(entry.data, topic, topicLen);
+	if (length > 0)
+		memcpy(entry.data + topicLen, payload, length);
+	entry.hash = hash;
+	entry.topicLen = topicLen;
+	entry.length = length;
+	entry.lastUse = ++_useCounter;
+}
+
+int ESP32_MQTTRetainedStore::get(const char* topic, uint8_t* buf, size_t bufSize)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries == nullptr || topic == nullptr)
+		return -1;
+
+	int topicLen = strlen(topic);
+	int index = indexOf(topic, topicLen, hashTopic(topic, topicLen));
+	if (index < 0 || _entries[index].length > bufSize)
+		return -1;
+
+	memcpy(buf, _entries[index].data + topicLen, _entries[index].length);
+	return _entries[index].length;
+}
+
+/// <summary>
+/// Passes a copy of every stored message matching the topic filter to the visitor. The lock is not held while the
+/// visitor runs, so it may publish or subscribe. buf gets the null terminated topic followed by the payload.
+/// </summary>
+/// <returns>number of messages passed to the visitor</returns>
+int ESP32_MQTTRetainedStore::forEachMatching(const char* filter, uint8_t* buf, Visitor visitor, void* context)
+{
+	int matchCount = 0;
+	for (size_t i = 0; ; i++)
+	{
+		int topicLen;
+		size_t length;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (i >= _count)
+				break;
+
+			Entry& entry = _entries[i];
+			if (!ESP32_MQTTTopicTrie::matches(filter, (const char*)entry.data, entry.topicLen))
+				continue;
+			topicLen = entry.topicLen;
+			length = entry.length;
+			memcpy(buf, entry.data, topicLen);
+			buf[topicLen] = '\0';
+			memcpy(buf + topicLen + 1, entry.data + topicLen, length);
+		}
+
+		visitor((char*)buf, topicLen, (char*)buf + topicLen + 1, length, context);
+		matchCount++;
+	}
+	return matchCount;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <mutex>
+
+// Last value of every retained topic published, kept as a 32-bit topic hash and a 32-bit payload digest (FNV-1a) in a
+// fixed number of entries. check() tells whether a retained publish changes anything: an identical payload or a number
+// within the deadband of the last one sent is suppressed until the refresh interval expires. Topics are found through
+// a chained hash table, the least recently published one is evicted when all entries are taken. Topics are not stored,
+// two topics with the same hash share an entry and the refresh interval limits how long one can hide the other. Thread safe.
+class ESP32_MQTTRetainedCache
+{
+public:
+    ESP32_MQTTRetainedCache();
+    ~ESP32_MQTTRetainedCache();
+
+    bool init(size_t capacity, unsigned long refreshIntervalMs);   // capacity up to 65534 topics, refreshIntervalMs 0 never resends an unchanged value
+    void deinit();
+
+    bool check(const char* topic, const uint8_t* payload, size_t length, float deadband);  // true if the message should be published, it is then remembered as sent
+    void forget(const char* topic);     // the next message to the topic is published, e.g. after the publish failed
+    void clear();
+
+    inline bool isInitialized() { return _entries != nullptr; }
+    inline size_t getCapacity() { return _capacity; }
+    inline size_t getCount() { return _count; }
+    inline size_t getMemoryUsage() { return _capacity * sizeof(Entry) + (_bucketMask + 1) * sizeof(uint16_t); }
+    inline uint32_t getCheckedCount() { return _checkedCount; }
+    inline uint32_t getSuppressedCount() { return _suppressedCount; }
+
+    static bool parseNumber(const uint8_t* payload, size_t length, float& value);   // decimal text payload, e.g. "21.5"
+
+private:
+    static const uint16_t None = 0xFFFF;
+
+    struct Entry
+    {
+        uint32_t topicHash;
+        uint32_t digest;
+        float value;            // last sent number, if hasValue
+        uint32_t sentMillis;
+        uint16_t bucketNext;    // next entry in the bucket, or in the free list
+        uint16_t lruPrev;       // towards the most recently published
+        uint16_t lruNext;
+        bool hasValue;
+    };
+
+    Entry* _entries;
+    uint16_t* _buckets;     // first entry of each bucket
+    size_t _bucketMask;
+    uint16_t _capacity;
+    uint16_t _count;
+    uint16_t _freeHead;
+    uint16_t _lruHead;
+    uint16_t _lruTail;
+    unsigned long _refreshIntervalMs;
+    uint32_t _checkedCount;
+    uint32_t _suppressedCount;
+    std::mutex _mutex;
+
+    static uint32_t hash(const uint8_t* data, size_t length);
+    uint16_t find(uint32_t topicHash);
+    uint16_t allocate(uint32_t topicHash);
+    void remove(uint16_t index);
+    void unlinkLru(uint16_t index);
+    void pushLru(uint16_t index);
+};
+
+// Copies of received retained messages, so a handler subscribed later gets the current value right away. Messages
+// with the retain flag are stored, later messages to a stored topic replace it even without the flag (brokers forward
+// retained publishes to existing subscribers without it), an empty retained payload removes the topic. Each entry has
+// a slot of maxMessageSize bytes (topic + payload) in a slab allocated in init(), the least recently updated one is
+// replaced when all are taken. Lookup scans the entries, it is meant for tens of topics. Thread safe.
+class ESP32_MQTTRetainedStore
+{
+public:
+    typedef void (*Visitor)(char* topic, int topicLen, char* payload, int length, void* context);
+
+    ESP32_MQTTRetainedStore();
+    ~ESP32_MQTTRetainedStore();
+
+    bool init(size_t capacity, size_t maxMessageSize);
+    void deinit();
+
+    void store(const char* topic, int topicLen, const uint8_t* payload, size_t length, bool retain);
+    int get(const char* topic, uint8_t* buf, size_t bufSize);  // copies the payload, returns its length, -1 if the topic is not stored or buf is too small
+    int forEachMatching(const char* filter, uint8_t* buf, Visitor visitor, void* context);    // copies every matching message into buf (maxMessageSize + 1 bytes) and calls visitor outside of the lock, returns the number of messages
+
+    inline bool isInitialized() { return _entries != nullptr; }
+    inline size_t getCount() { return _count; }
+    inline size_t getMaxMessageSize() { return _slotSize; }
+    inline size_t getMemoryUsage() { return _capacity * (sizeof(Entry) + _slotSize); }
+
+private:
+    struct Entry
+    {
+        uint32_t hash;
+        uint32_t lastUse;
+        uint16_t topicLen;
+        size_t length;
+        uint8_t* data;      // topic, then the payload
+    };
+
+    Entry* _entries;
+    uint8_t* _slab;
+    size_t _capacity;
+    size_t _slotSize;
+    size_t _count;
+    uint32_t _useCounter;
+    std::mutex _mutex;
+
+    static uint32_t hashTopic(const char* topic, int topicLen);
+    int indexOf(const char* topic, int topicLen, uint32_t hash);
+    void removeAt(size_t index);
+};
@@ -0,0 +1,416 @@
+#include "ESP32_MQTTRpc.h"
+
+#define RPC_TYPE_REQUEST 1
+#define RPC_TYPE_RESPONSE 2
+#define RPC_STATUS_OK 0
+#define RPC_STATUS_ERROR 1
+#define RPC_HEADER_SIZE 6           // type, status, correlation id
+#define RPC_REQUEST_HEADER_SIZE 8   // + reply topic length
+
+static void writeUint32(uint8_t* buf, uint32_t value)
+{
+	buf[0] = (uint8_t)value;
+	buf[1] = (uint8_t)(value >> 8);
+	buf[2] = (uint8_t)(value >> 16);
+	buf[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t readUint32(const uint8_t* buf)
+{
+	return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+int ESP32_MQTTRpcRequest::reply(const uint8_t* payload, size_t length, bool error)
+{
+	if (_replied)
+		return -1;
+	_replied = true;
+	return _rpc->sendResponse(_replyTopic, _correlationId, payload, length, error);
+}
+
+int ESP32_MQTTRpcRequest::reply(const char* payload, bool error)
+{
+	return reply((const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), error);
+}
+
+ESP32_MQTTRpc::ESP32_MQTTRpc(ESP32_MQTTClient& client) : _client(client)
+{
+	_replyTopic = nullptr;
+	_replyTopicLen = 0;
+	_qos = 0;
+	_calls = nullptr;
+	_freeList = nullptr;
+	_capacity = 0;
+	_freeCount = 0;
+	_currentTick = 0;
+	_generation = 0;
+	_tickTimer = nullptr;
+	_tickTask = nullptr;
+	_lastTickMillis = 0;
+	_pendingCount = 0;
+	_maxPendingCount = 0;
+	_timeoutCount = 0;
+	for (int i = 0; i < ESP32_MQTT_RPC_WHEEL_SLOTS; i++)
+		_wheel[i] = -1;
+}
+
+ESP32_MQTTRpc::~ESP32_MQTTRpc()
+{
+	end();
+}
+
+bool ESP32_MQTTRpc::begin(const char* replyTopic, size_t maxPendingCalls, int qos, int priority, int coreId, uint32_t stackSize)
+{
+	end();
+
+	size_t replyTopicLen = strlen(replyTopic);
+	if (maxPendingCalls == 0 || maxPendingCalls > INT16_MAX || replyTopicLen > ESP32_MQTT_RPC_MAX_TOPIC_LENGTH)
+	{
+		log_e("Invalid RPC configuration");
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_calls = new PendingCall[maxPendingCalls];
+		_freeList = new int16_t[maxPendingCalls];
+		for (size_t i = 0; i < maxPendingCalls; i++)
+		{
+			_calls[i].correlationId = 0;
+			// lowest index is allocated first
+			_freeList[i] = maxPendingCalls - 1 - i;
+		}
+		_capacity = maxPendingCalls;
+		_freeCount = maxPendingCalls;
+		_replyTopic = strdup(replyTopic);
+		_replyTopicLen = replyTopicLen;
+		_qos = qos;
+		// responses to calls made before a reboot don't match the new correlation ids
+		_generation = (uint16_t)esp_random();
+		_currentTick = 0;
+		_lastTickMillis = millis();
+		for (int i = 0; i < ESP32_MQTT_RPC_WHEEL_SLOTS; i++)
+			_wheel[i] = -1;
+	}
+
+	if (xTaskCreatePinnedToCore(tickTaskStatic, "mqtt_rpc", stackSize, this, priority, &_tickTask, coreId) != pdPASS)
+	{
+		log_e("Can't create RPC task");
+		_tickTask = nullptr;
+		end();
+		return false;
+	}
+	ESP32_MQTT_TRACE_TASK_NAME(_tickTask, "rpc");
+
+	esp_timer_create_args_t timerArgs = {};
+	timerArgs.callback = tickTimerStatic;
+	timerArgs.arg = this;
+	timerArgs.name = "mqtt_rpc";
+	if (esp_timer_create(&timerArgs, &_tickTimer) != ESP_OK)
+	{
+		log_e("Can't create RPC timer");
+		_tickTimer = nullptr;
+		end();
+		return false;
+	}
+	esp_timer_start_periodic(_tickTimer, ESP32_MQTT_RPC_TICK_MS * 1000);
+
+	_client.subscribe(_replyTopic, qos, [this](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) {
+		if (currentDataOffset == 0 && dataLen == totalDataLen)
+			handleResponse((const uint8_t*)data, dataLen);
+	});
+	return true;
+}
+
+void ESP32_MQTTRpc::end()
+{
+	if (_tickTimer != nullptr)
+	{
+		esp_timer_stop(_tickTimer);
+		esp_timer_delete(_tickTimer);
+		_tickTimer = nullptr;
+	}
+	// deleted while it waits for a notification or for the lock, not while it holds it
+	if (_tickTask != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		vTaskDelete(_tickTask);
+		_tickTask = nullptr;
+	}
+
+	if (_replyTopic != nullptr)
+		_client.unsubscribe(_replyTopic);
+
+	// complete the pending calls one by one, handlers are called outside of the lock
+	while (true)
+	{
+		ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			size_t i = 0;
+			while (i < _capacity && _calls[i].correlationId == 0)
+				i++;
+			if (i == _capacity)
+				break;
+			takeCall(_calls[i].correlationId, handler);
+		}
+		if (handler)
+			handler(ESP32_MQTTRpcStatus::Cancelled, nullptr, 0);
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_calls != nullptr)
+		delete[] _calls;
+	if (_freeList != nullptr)
+		delete[] _freeList;
+	if (_replyTopic != nullptr)
+		free(_replyTopic);
+	_calls = nullptr;
+	_freeList = nullptr;
+	_replyTopic = nullptr;
+	_capacity = 0;
+	_freeCount = 0;
+	_pendingCount = 0;
+}
+
+int16_t ESP32_MQTTRpc::allocateCall()
+{
+	if (_freeCount == 0)
+		return -1;
+
+	int16_t index = _freeList[--_freeCount];
+	_generation++;
+	if (_generation == 0)
+		_generation = 1;	// correlation id 0 marks a free call
+	_calls[index].correlationId = ((uint32_t)_generation << 16) | (uint16_t)index;
+
+	_pendingCount++;
+	if (_pendingCount > _maxPendingCount)
+		_maxPendingCount = _pendingCount;
+	return index;
+}
+
+void ESP32_MQTTRpc::releaseCall(int16_t index)
+{
+	_calls[index].correlationId = 0;
+	_calls[index].handler = nullptr;
+	_freeList[_freeCount++] = index;
+	_pendingCount--;
+}
+
+void ESP32_MQTTRpc::wheelInsert(int16_t index)
+{
+	PendingCall& call = _calls[index];
+	int16_t& head = _wheel[call.expireTick % ESP32_MQTT_RPC_WHEEL_SLOTS];
+	call.prev = -1;
+	call.next = head;
+	if (head >= 0)
+		_calls[head].prev = index;
+	head = index;
+}
+
+void ESP32_MQTTRpc::wheelRemove(int16_t index)
+{
+	PendingCall& call = _calls[index];
+	if (call.prev >= 0)
+		_calls[call.prev].next = call.next;
+	else
+		_wheel[call.expireTick % ESP32_MQTT_RPC_WHEEL_SLOTS] = call.next;
+	if (call.next >= 0)
+		_calls[call.next].prev = call.prev;
+}
+
+/// <summary>
+/// Removes the pending call, the handler is moved out to be called after the lock is released. Requires the lock.
+/// </summary>
+bool ESP32_MQTTRpc::takeCall(uint32_t correlationId, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback& handler, unsigned long* startUs)
+{
+	uint16_t index = correlationId & 0xffff;
+	if (correlationId == 0 || index >= _capacity || _calls[index].correlationId != correlationId)
+		return false;
+
+	wheelRemove(index);
+	if (startUs != nullptr)
+		*startUs = _calls[index].startUs;
+	handler = std::move(_calls[index].handler);
+	releaseCall(index);
+	return true;
+}
+
+int ESP32_MQTTRpc::call(const char* topic, const char* payload, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler)
+{
+	return call(topic, (const uint8_t*)payload, payload == NULL ? 0 : strlen(payload), timeoutMs, handler);
+}
+
+int ESP32_MQTTRpc::call(const char* topic, const uint8_t* payload, size_t length, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler)
+{
+	uint8_t header[RPC_REQUEST_HEADER_SIZE];
+	uint32_t correlationId;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_calls == nullptr)
+		{
+			log_e("RPC is not started, use begin() first");
+			return -1;
+		}
+
+		int16_t index = allocateCall();
+		if (index < 0)
+		{
+			ESP32_MQTT_LOG(Publish, Warning, "Too many pending RPC calls");
+			return -2;
+		}
+
+		PendingCall& pending = _calls[index];
+		correlationId = pending.correlationId;
+		// round up so the call doesn't expire before its timeout
+		pending.expireTick = _currentTick + (timeoutMs + ESP32_MQTT_RPC_TICK_MS - 1) / ESP32_MQTT_RPC_TICK_MS + 1;
+		pending.startUs = micros();
+		pending.handler = handler;
+		wheelInsert(index);
+	}
+
+	header[0] = RPC_TYPE_REQUEST;
+	header[1] = RPC_STATUS_OK;
+	writeUint32(header + 2, correlationId);
+	header[6] = (uint8_t)_replyTopicLen;
+	header[7] = (uint8_t)(_replyTopicLen >> 8);
+
+	ESP32_MQTTPayloadSegment segments[] = { { header, sizeof(header) }, { _replyTopic, _replyTopicLen }, { payload, length } };
+	int result = _client.publish(topic, segments, 3, _qos, false);
+	if (result < 0)
+	{
+		ESP32_MQTTCallbacks::OnMqttRpcResponseCallback failedHandler;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			takeCall(correlationId, failedHandler);
+		}
+		// the caller gets the error code, the handler is not called
+	}
+	return result;
+}
+
+int ESP32_MQTTRpc::serve(const char* topic, ESP32_MQTTCallbacks::OnMqttRpcRequestCallback handler)
+{
+	return _client.subscribe(topic, _qos, [this, handler](int msgId, char* topic, int topicLen, char* data, int dataLen, int currentDataOffset, int totalDataLen, bool retain, int qos, bool dup) mutable {
+		if (currentDataOffset == 0 && dataLen == totalDataLen)
+			handleRequest(handler, topic, topicLen, (const uint8_t*)data, dataLen);
+	});
+}
+
+void ESP32_MQTTRpc::handleRequest(ESP32_MQTTCallbacks::OnMqttRpcRequestCallback& handler, const char* topic, int topicLen, const uint8_t* data, size_t length)
+{
+	if (length < RPC_REQUEST_HEADER_SIZE || data[0] != RPC_TYPE_REQUEST)
+		return;
+
+	size_t replyTopicLen = data[6] | (data[7] << 8);
+	if (replyTopicLen == 0 || replyTopicLen > ESP32_MQTT_RPC_MAX_TOPIC_LENGTH || RPC_REQUEST_HEADER_SIZE + replyTopicLen > length)
+	{
+		ESP32_MQTT_LOG(Data, Warning, "Invalid RPC request on topic %s", ESP32_MQTTLogText(topic, topicLen));
+		return;
+	}
+
+	ESP32_MQTTRpcRequest request;
+	request.topic = topic;
+	request.topicLen = topicLen;
+	request.payload = data + RPC_REQUEST_HEADER_SIZE + replyTopicLen;
+	request.length = length - RPC_REQUEST_HEADER_SIZE - replyTopicLen;
+	request._rpc = this;
+	request._correlationId = readUint32(data + 2);
+	memcpy(request._replyTopic, data + RPC_REQUEST_HEADER_SIZE, replyTopicLen);
+	request._replyTopic[replyTopicLen] = '\0';
+	request._replied = false;
+
+	handler(request);
+}
+
+int ESP32_MQTTRpc::sendResponse(const char* replyTopic, uint32_t correlationId, const uint8_t* payload, size_t length, bool error)
+{
+	uint8_t header[RPC_HEADER_SIZE];
+	header[0] = RPC_TYPE_RESPONSE;
+	header[1] = error ? RPC_STATUS_ERROR : RPC_STATUS_OK;
+	writeUint32(header + 2, correlationId);
+
+	ESP32_MQTTPayloadSegment segments[] = { { header, sizeof(header) }, { payload, length } };
+	return _client.publish(replyTopic, segments, 2, _qos, false);
+}
+
+void ESP32_MQTTRpc::handleResponse(const uint8_t* data, size_t length)
+{
+	if (length < RPC_HEADER_SIZE || data[0] != RPC_TYPE_RESPONSE)
+		return;
+
+	ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler;
+	unsigned long startUs;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_calls == nullptr || !takeCall(readUint32(data + 2), handler, &startUs))
+			return;		// late response of an expired call
+	}
+	_latency.record(micros() - startUs);
+
+	ESP32_MQTTRpcStatus status = data[1] == RPC_STATUS_OK ? ESP32_MQTTRpcStatus::Ok : ESP32_MQTTRpcStatus::Error;
+	if (handler)
+		handler(status, data + RPC_HEADER_SIZE, length - RPC_HEADER_SIZE);
+}
+
+void ESP32_MQTTRpc::tickTimerStatic(void* arg)
+{
+	xTaskNotifyGive(static_cast<ESP32_MQTTRpc*>(arg)->_tickTask);
+}
+
+void ESP32_MQTTRpc::tickTaskStatic(void* arg)
+{
+	ESP32_MQTTRpc* rpc = static_cast<ESP32_MQTTRpc*>(arg);
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		rpc->tick();
+	}
+}
+
+/// <summary>
+/// Advances the timer wheel to the current time and completes the expired calls, runs in the RPC task.
+/// </summary>
+void ESP32_MQTTRpc::tick()
+{
+	unsigned long now = millis();
+	uint32_t targetTick;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		uint32_t elapsedTicks = (now - _lastTickMillis) / ESP32_MQTT_RPC_TICK_MS;
+		if (elapsedTicks == 0)
+			return;
+		_lastTickMillis += elapsedTicks * ESP32_MQTT_RPC_TICK_MS;
+		targetTick = _currentTick + elapsedTicks;
+	}
+
+	while (true)
+	{
+		ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_calls == nullptr)
+				return;
+
+			// expired call in the current bucket, calls of later rounds stay
+			int16_t index = _wheel[_currentTick % ESP32_MQTT_RPC_WHEEL_SLOTS];
+			while (index >= 0 && (int32_t)(_calls[index].expireTick - _currentTick) > 0)
+				index = _calls[index].next;
+
+			if (index < 0)
+			{
+				if (_currentTick == targetTick)
+					return;
+				_currentTick++;
+				continue;
+			}
+
+			takeCall(_calls[index].correlationId, handler);
+			_timeoutCount++;
+		}
+		if (handler)
+			handler(ESP32_MQTTRpcStatus::TimedOut, nullptr, 0);
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ESP32_MQTTClient.h"
+
+#define ESP32_MQTT_RPC_TICK_MS 50               // timeout resolution
+#define ESP32_MQTT_RPC_WHEEL_SLOTS 64           // timer wheel buckets, timeouts longer than TICK_MS * WHEEL_SLOTS take more rounds
+#define ESP32_MQTT_RPC_MAX_TOPIC_LENGTH 128     // reply topic carried in a request
+
+enum class ESP32_MQTTRpcStatus
+{
+    Ok,
+    Error,          // the server replied with an error
+    TimedOut,
+    Cancelled       // end() was called
+};
+
+namespace ESP32_MQTTCallbacks
+{
+    typedef std::function<void(ESP32_MQTTRpcStatus status, const uint8_t* payload, size_t length)> OnMqttRpcResponseCallback;
+}
+
+class ESP32_MQTTRpc;
+
+// Request being served, valid only during the serve() handler.
+class ESP32_MQTTRpcRequest
+{
+public:
+    const char* topic;
+    int topicLen;
+    const uint8_t* payload;
+    size_t length;
+
+    int reply(const uint8_t* payload, size_t length, bool error = false);  // publishes the response to the caller's reply topic, at most once
+    int reply(const char* payload, bool error = false);
+
+private:
+    friend class ESP32_MQTTRpc;
+
+    ESP32_MQTTRpc* _rpc;
+    uint32_t _correlationId;
+    char _replyTopic[ESP32_MQTT_RPC_MAX_TOPIC_LENGTH + 1];
+    bool _replied;
+};
+
+namespace ESP32_MQTTCallbacks
+{
+    typedef std::function<void(ESP32_MQTTRpcRequest& request)> OnMqttRpcRequestCallback;
+}
+
+// Request/response calls over MQTT. A request carries a correlation id and the caller's reply topic in a small header
+// in front of the payload, the response comes back to the reply topic with the same correlation id. Pending calls are kept
+// in a fixed table indexed by the correlation id and expire through a timer wheel, both O(1). All memory is allocated in begin().
+// Envelope (little-endian): type (1 request, 2 response), status (0 ok, 1 error), correlation id (4 bytes),
+// requests only: reply topic length (2 bytes) and reply topic. The payload follows.
+class ESP32_MQTTRpc
+{
+public:
+    ESP32_MQTTRpc(ESP32_MQTTClient& client);
+    ~ESP32_MQTTRpc();
+
+    bool begin(const char* replyTopic, size_t maxPendingCalls, int qos = 0, int priority = 1, int coreId = tskNO_AFFINITY, uint32_t stackSize = 3072); // subscribes to the reply topic (e.g. "devices/esp32-01/rpc/reply"), call it from onMqttConnected or use enableAutoResubscribe(). Timeout handlers run in a task with the given priority, core and stack size.
+    void end();     // pending calls complete with Cancelled, don't call it from a response handler
+
+    int call(const char* topic, const uint8_t* payload, size_t length, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler); // returns the message id of the request, -1 if it couldn't be published, -2 if too many calls are pending
+    int call(const char* topic, const char* payload, unsigned long timeoutMs, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler);
+    int serve(const char* topic, ESP32_MQTTCallbacks::OnMqttRpcRequestCallback handler); // topic filter, wildcards allowed
+
+    inline size_t getPendingCount() { return _pendingCount; }
+    inline size_t getMaxPendingCount() { return _maxPendingCount; }   // high water mark of concurrent calls
+    inline unsigned long getTimeoutCount() { return _timeoutCount; }
+    inline void getLatency(ESP32_MQTTHistogramSnapshot& snapshot) { _latency.snapshot(snapshot); }  // round trip of the answered calls
+
+private:
+    friend class ESP32_MQTTRpcRequest;
+
+    struct PendingCall
+    {
+        uint32_t correlationId;     // generation << 16 | index, 0 if free
+        uint32_t expireTick;
+        int16_t prev;               // timer wheel bucket list, -1 terminated
+        int16_t next;
+        unsigned long startUs;
+        ESP32_MQTTCallbacks::OnMqttRpcResponseCallback handler;
+    };
+
+    ESP32_MQTTClient& _client;
+    char* _replyTopic;
+    size_t _replyTopicLen;
+    int _qos;
+    PendingCall* _calls;
+    int16_t* _freeList;
+    size_t _capacity;
+    size_t _freeCount;
+    int16_t _wheel[ESP32_MQTT_RPC_WHEEL_SLOTS];
+    uint32_t _currentTick;
+    uint16_t _generation;
+    esp_timer_handle_t _tickTimer;     // only notifies _tickTask, the timeout handlers must not run in the esp_timer task
+    TaskHandle_t _tickTask;
+    unsigned long _lastTickMillis;
+    std::mutex _mutex;
+
+    size_t _pendingCount;
+    size_t _maxPendingCount;
+    unsigned long _timeoutCount;
+    ESP32_MQTTHistogram _latency;
+
+    int16_t allocateCall();
+    void releaseCall(int16_t index);
+    void wheelInsert(int16_t index);
+    void wheelRemove(int16_t index);
+    bool takeCall(uint32_t correlationId, ESP32_MQTTCallbacks::OnMqttRpcResponseCallback& handler, unsigned long* startUs = nullptr);
+
+    static void tickTimerStatic(void* arg);
+    static void tickTaskStatic(void* arg);
+    void tick();
+    void handleResponse(const uint8_t* data, size_t length);
+    void handleRequest(ESP32_MQTTCallbacks::OnMqttRpcRequestCallback& handler, const char* topic, int topicLen, const uint8_t* data, size_t length);
+    int sendResponse(const char* replyTopic, uint32_t correlationId, const uint8_t* payload, size_t length, bool error);
+};
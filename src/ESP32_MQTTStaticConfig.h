@@ -0,0 +1,42 @@
+#pragma once
+
+// Client configuration which can be built at compile time, e.g.
+// static constexpr ESP32_MQTTStaticConfig config = ESP32_MQTTStaticConfig().brokerUri("mqtt://192.168.1.100:1883").clientName("esp32-01").keepAlive(15);
+// Strings are referenced, not copied, so they must have static storage (string literals). Zero values keep the client defaults.
+struct ESP32_MQTTStaticConfig
+{
+    const char* uri = nullptr;
+    const char* name = nullptr;
+    const char* username = nullptr;
+    const char* password = nullptr;
+    const char* clientCertificate = nullptr;
+    const char* caCertificate = nullptr;
+    const char* clientKey = nullptr;
+    const char* lastWillTopic = nullptr;
+    const char* lastWillMessage = nullptr;
+    int lastWillQos = 0;
+    bool lastWillRetain = false;
+    int keepAliveSeconds = 0;
+    int maxInPacketSize = 0;
+    int maxOutPacketSize = 0;
+    int taskPriority = 0;
+    int reconnectTimeoutMs = 0;
+    int networkOperationTimeoutMs = 0;
+    bool cleanSessionDisabled = false;
+    bool autoReconnectDisabled = false;
+
+    constexpr ESP32_MQTTStaticConfig brokerUri(const char* value) const { ESP32_MQTTStaticConfig c = *this; c.uri = value; return c; }
+    constexpr ESP32_MQTTStaticConfig clientName(const char* value) const { ESP32_MQTTStaticConfig c = *this; c.name = value; return c; }
+    constexpr ESP32_MQTTStaticConfig credentials(const char* user, const char* pass) const { ESP32_MQTTStaticConfig c = *this; c.username = user; c.password = pass; return c; }
+    constexpr ESP32_MQTTStaticConfig clientCert(const char* value) const { ESP32_MQTTStaticConfig c = *this; c.clientCertificate = value; return c; }
+    constexpr ESP32_MQTTStaticConfig caCert(const char* value) const { ESP32_MQTTStaticConfig c = *this; c.caCertificate = value; return c; }
+    constexpr ESP32_MQTTStaticConfig authKey(const char* value) const { ESP32_MQTTStaticConfig c = *this; c.clientKey = value; return c; }
+    constexpr ESP32_MQTTStaticConfig lastWill(const char* topic, const char* message, int qos = 0, bool retain = false) const { ESP32_MQTTStaticConfig c = *this; c.lastWillTopic = topic; c.lastWillMessage = message; c.lastWillQos = qos; c.lastWillRetain = retain; return c; }
+    constexpr ESP32_MQTTStaticConfig keepAlive(int seconds) const { ESP32_MQTTStaticConfig c = *this; c.keepAliveSeconds = seconds; return c; }
+    constexpr ESP32_MQTTStaticConfig maxPacketSize(int inSize, int outSize) const { ESP32_MQTTStaticConfig c = *this; c.maxInPacketSize = inSize; c.maxOutPacketSize = outSize; return c; }
+    constexpr ESP32_MQTTStaticConfig priority(int value) const { ESP32_MQTTStaticConfig c = *this; c.taskPriority = value; return c; }
+    constexpr ESP32_MQTTStaticConfig reconnectTimeout(int ms) const { ESP32_MQTTStaticConfig c = *this; c.reconnectTimeoutMs = ms; return c; }
+    constexpr ESP32_MQTTStaticConfig networkOperationTimeout(int ms) const { ESP32_MQTTStaticConfig c = *this; c.networkOperationTimeoutMs = ms; return c; }
+    constexpr ESP32_MQTTStaticConfig disableCleanSession() const { ESP32_MQTTStaticConfig c = *this; c.cleanSessionDisabled = true; return c; }
+    constexpr ESP32_MQTTStaticConfig disableAutoReconnect() const { ESP32_MQTTStaticConfig c = *this; c.autoReconnectDisabled = true; return c; }
+};
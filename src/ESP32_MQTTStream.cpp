@@ -0,0 +1,153 @@
+#include "ESP32_MQTTStream.h"
+
+ESP32_MQTTCallbackSink::ESP32_MQTTCallbackSink(ESP32_MQTTCallbacks::OnMqttStreamBeginCallback onBegin, ESP32_MQTTCallbacks::OnMqttStreamChunkCallback onChunk, ESP32_MQTTCallbacks::OnMqttStreamEndCallback onEnd)
+{
+	_onBegin = onBegin;
+	_onChunk = onChunk;
+	_onEnd = onEnd;
+}
+
+bool ESP32_MQTTCallbackSink::begin(const char* topic, int topicLen, size_t totalLength)
+{
+	return !_onBegin || _onBegin(topic, topicLen, totalLength);
+}
+
+bool ESP32_MQTTCallbackSink::write(const uint8_t* data, size_t length, size_t offset)
+{
+	return !_onChunk || _onChunk(data, length, offset);
+}
+
+void ESP32_MQTTCallbackSink::end(bool ok)
+{
+	if (_onEnd)
+		_onEnd(ok);
+}
+
+ESP32_MQTTFileSink::ESP32_MQTTFileSink(const char* path)
+{
+	size_t pathLen = strlen(path);
+	_path = strdup(path);
+	_partPath = (char*)malloc(pathLen + sizeof(".part"));
+	if (_partPath != nullptr)
+	{
+		memcpy(_partPath, path, pathLen);
+		memcpy(_partPath + pathLen, ".part", sizeof(".part"));
+	}
+	_file = nullptr;
+}
+
+ESP32_MQTTFileSink::~ESP32_MQTTFileSink()
+{
+	if (_file != nullptr)
+		fclose(_file);
+	free(_path);
+	free(_partPath);
+}
+
+bool ESP32_MQTTFileSink::begin(const char* topic, int topicLen, size_t totalLength)
+{
+	if (_partPath == nullptr)
+		return false;
+
+	_file = fopen(_partPath, "wb");
+	if (_file == nullptr)
+	{
+		log_e("Can't create %s", _partPath);
+		return false;
+	}
+	return true;
+}
+
+bool ESP32_MQTTFileSink::write(const uint8_t* data, size_t length, size_t offset)
+{
+	if (fwrite(data, 1, length, _file) != length)
+	{
+		log_e("Can't write %u bytes to %s", length, _partPath);
+		return false;
+	}
+	return true;
+}
+
+void ESP32_MQTTFileSink::end(bool ok)
+{
+	bool closed = fclose(_file) == 0;
+	_file = nullptr;
+
+	// rename() doesn't replace an existing file on every file system
+	if (ok && closed)
+	{
+		remove(_path);
+		if (rename(_partPath, _path) == 0)
+			return;
+		log_e("Can't rename %s to %s", _partPath, _path);
+	}
+	remove(_partPath);
+}
+
+ESP32_MQTTPartitionSink::ESP32_MQTTPartitionSink(const char* label)
+{
+	_label = label;
+	_partition = nullptr;
+	_erasedLength = 0;
+	_writtenLength = 0;
+}
+
+ESP32_MQTTPartitionSink::ESP32_MQTTPartitionSink(const esp_partition_t* partition)
+{
+	_label = nullptr;
+	_partition = partition;
+	_erasedLength = 0;
+	_writtenLength = 0;
+}
+
+bool ESP32_MQTTPartitionSink::begin(const char* topic, int topicLen, size_t totalLength)
+{
+	if (_partition == nullptr && _label != nullptr)
+		_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _label);
+	if (_partition == nullptr)
+	{
+		log_e("Partition %s not found", _label != nullptr ? _label : "");
+		return false;
+	}
+	if (totalLength > _partition->size)
+	{
+		log_e("Payload of %u bytes doesn't fit partition %s of %u bytes", totalLength, _partition->label, _partition->size);
+		return false;
+	}
+
+	_erasedLength = 0;
+	_writtenLength = 0;
+	return true;
+}
+
+bool ESP32_MQTTPartitionSink::write(const uint8_t* data, size_t length, size_t offset)
+{
+	size_t end = offset + length;
+	if (end > _erasedLength)
+	{
+		size_t eraseEnd = (end + ESP32_MQTT_PARTITION_SECTOR_SIZE - 1) / ESP32_MQTT_PARTITION_SECTOR_SIZE * ESP32_MQTT_PARTITION_SECTOR_SIZE;
+		if (eraseEnd > _partition->size)
+			eraseEnd = _partition->size;
+		esp_err_t result = esp_partition_erase_range(_partition, _erasedLength, eraseEnd - _erasedLength);
+		if (result != ESP_OK)
+		{
+			log_e("Can't erase partition %s at %u: %s", _partition->label, _erasedLength, esp_err_to_name(result));
+			return false;
+		}
+		_erasedLength = eraseEnd;
+	}
+
+	esp_err_t result = esp_partition_write(_partition, offset, data, length);
+	if (result != ESP_OK)
+	{
+		log_e("Can't write partition %s at %u: %s", _partition->label, offset, esp_err_to_name(result));
+		return false;
+	}
+	_writtenLength = end;
+	return true;
+}
+
+void ESP32_MQTTPartitionSink::end(bool ok)
+{
+	// nothing to finish, the caller decides what an incomplete partition means (e.g. not switching to it)
+}
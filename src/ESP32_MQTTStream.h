@@ -0,0 +1,103 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <stdio.h>
+
+#define ESP32_MQTT_PARTITION_SECTOR_SIZE 4096       // flash erase unit
+#define ESP32_MQTT_STREAM_SEGMENT_HEADER_SIZE 8     // offset and total length, both 32-bit big endian, in front of every segment
+#define ESP32_MQTT_STREAM_WINDOW_SEGMENTS 4         // QoS 1/2 segments of publishStream() waiting for the broker's acknowledgement
+
+// digest computed over a streamed payload while it is received
+enum class ESP32_MQTTStreamDigest
+{
+    None,
+    Crc32,      // IEEE 802.3, as ESP32_MQTTCrc32()
+    Sha256
+};
+
+// outcome of a streamed message, passed to the verify callback of subscribeStream()
+struct ESP32_MQTTStreamResult
+{
+    bool complete;          // every byte was received and accepted by the sink
+    size_t length;          // bytes received
+    uint32_t crc32;         // with ESP32_MQTTStreamDigest::Crc32
+    uint8_t sha256[32];     // with ESP32_MQTTStreamDigest::Sha256
+};
+
+namespace ESP32_MQTTCallbacks
+{
+    typedef std::function<bool(const char* topic, int topicLen, size_t totalLength)> OnMqttStreamBeginCallback;
+    typedef std::function<bool(const uint8_t* data, size_t length, size_t offset)> OnMqttStreamChunkCallback;
+    typedef std::function<void(bool ok)> OnMqttStreamEndCallback;
+    typedef std::function<bool(const ESP32_MQTTStreamResult& result)> OnMqttStreamVerifyCallback;
+    typedef std::function<int(uint8_t* buf, size_t length, size_t offset)> OnMqttStreamReadCallback;    // copies up to length bytes of the payload from offset into buf, returns their count, 0 or less aborts the stream
+}
+
+// Receiver of messages subscribed with subscribeStream(). The calls come from the MQTT task in order: begin(), write() for
+// every chunk in the order of the payload, end(). esp-mqtt reads the socket only after write() returns, so a slow sink
+// slows the sender down through TCP flow control instead of the payload piling up in RAM. A false return aborts the
+// message, its remaining chunks are skipped and end(false) follows. end() is called only after a successful begin().
+class ESP32_MQTTStreamSink
+{
+public:
+    virtual ~ESP32_MQTTStreamSink() {}
+
+    virtual bool begin(const char* topic, int topicLen, size_t totalLength) = 0;   // topic is not null terminated
+    virtual bool write(const uint8_t* data, size_t length, size_t offset) = 0;
+    virtual void end(bool ok) = 0;      // ok if the message is complete and the verify callback accepted it
+};
+
+// Passes the stream to callbacks, begin and chunk callbacks which are not set accept everything.
+class ESP32_MQTTCallbackSink : public ESP32_MQTTStreamSink
+{
+public:
+    ESP32_MQTTCallbackSink(ESP32_MQTTCallbacks::OnMqttStreamBeginCallback onBegin, ESP32_MQTTCallbacks::OnMqttStreamChunkCallback onChunk, ESP32_MQTTCallbacks::OnMqttStreamEndCallback onEnd);
+
+    bool begin(const char* topic, int topicLen, size_t totalLength) override;
+    bool write(const uint8_t* data, size_t length, size_t offset) override;
+    void end(bool ok) override;
+
+private:
+    ESP32_MQTTCallbacks::OnMqttStreamBeginCallback _onBegin;
+    ESP32_MQTTCallbacks::OnMqttStreamChunkCallback _onChunk;
+    ESP32_MQTTCallbacks::OnMqttStreamEndCallback _onEnd;
+};
+
+// Writes the stream into a file (e.g. "/littlefs/config.bin"). The data goes to path + ".part" first, the file is
+// replaced only when the stream ends complete, so an interrupted transfer leaves the previous file intact.
+class ESP32_MQTTFileSink : public ESP32_MQTTStreamSink
+{
+public:
+    ESP32_MQTTFileSink(const char* path);  // the path is copied
+    ~ESP32_MQTTFileSink();
+
+    bool begin(const char* topic, int topicLen, size_t totalLength) override;
+    bool write(const uint8_t* data, size_t length, size_t offset) override;
+    void end(bool ok) override;
+
+private:
+    char* _path;
+    char* _partPath;
+    FILE* _file;
+};
+
+// Writes the stream into a flash partition from its start. Every sector is erased just before the first write into it,
+// so no call blocks for erasing the whole partition. The content is valid only after end(true).
+class ESP32_MQTTPartitionSink : public ESP32_MQTTStreamSink
+{
+public:
+    ESP32_MQTTPartitionSink(const char* label);    // data partition with the label, looked up in begin()
+    ESP32_MQTTPartitionSink(const esp_partition_t* partition);
+
+    bool begin(const char* topic, int topicLen, size_t totalLength) override;
+    bool write(const uint8_t* data, size_t length, size_t offset) override;
+    void end(bool ok) override;
+
+    inline size_t getWrittenLength() { return _writtenLength; }
+
+private:
+    const char* _label;
+    const esp_partition_t* _partition;
+    size_t _erasedLength;
+    size_t _writtenLength;
+};
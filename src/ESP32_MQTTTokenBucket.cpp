@@ -0,0 +1,59 @@
+#include "ESP32_MQTTTokenBucket.h"
+
+ESP32_MQTTTokenBucket::ESP32_MQTTTokenBucket()
+{
+	_ratePerSecond = 0;
+	_burst = 0;
+	_credit = 0;
+	_lastRefillMillis = 0;
+}
+
+void ESP32_MQTTTokenBucket::init(unsigned int ratePerSecond, unsigned int burst)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_ratePerSecond = ratePerSecond;
+	_burst = burst > 0 ? burst : 1;
+	_credit = (uint64_t)_burst * 1000;
+	_lastRefillMillis = millis();
+}
+
+void ESP32_MQTTTokenBucket::refill(unsigned long now)
+{
+	unsigned long elapsed = now - _lastRefillMillis;
+	_lastRefillMillis = now;
+
+	_credit += (uint64_t)elapsed * _ratePerSecond;
+	if (_credit > (uint64_t)_burst * 1000)
+		_credit = (uint64_t)_burst * 1000;
+}
+
+bool ESP32_MQTTTokenBucket::tryConsume(unsigned int tokens)
+{
+	if (_ratePerSecond == 0)
+		return true;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	refill(millis());
+	if (_credit < (uint64_t)tokens * 1000)
+		return false;
+
+	_credit -= (uint64_t)tokens * 1000;
+	return true;
+}
+
+void ESP32_MQTTTokenBucket::fill()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_credit = (uint64_t)_burst * 1000;
+	_lastRefillMillis = millis();
+}
+
+unsigned int ESP32_MQTTTokenBucket::getAvailable()
+{
+	if (_ratePerSecond == 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	refill(millis());
+	return _credit / 1000;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <mutex>
+
+// Token bucket rate limiter, refilled at ratePerSecond tokens up to burst tokens. A rate of 0 disables the limit.
+class ESP32_MQTTTokenBucket
+{
+public:
+    ESP32_MQTTTokenBucket();
+
+    void init(unsigned int ratePerSecond, unsigned int burst);  // the bucket starts full
+    bool tryConsume(unsigned int tokens = 1);   // returns false if there are not enough tokens, nothing is consumed then
+    void fill();
+
+    inline bool isEnabled() { return _ratePerSecond > 0; }
+    inline unsigned int getRatePerSecond() { return _ratePerSecond; }
+    inline unsigned int getBurst() { return _burst; }
+    unsigned int getAvailable();
+
+private:
+    std::mutex _mutex;
+    unsigned int _ratePerSecond;
+    unsigned int _burst;
+    uint64_t _credit;               // tokens * 1000
+    unsigned long _lastRefillMillis;
+
+    void refill(unsigned long now);
+};
@@ -0,0 +1,140 @@
+#include "ESP32_MQTTTopicAliasTable.h"
+
+ESP32_MQTTTopicAliasTable::ESP32_MQTTTopicAliasTable()
+{
+	_entries = nullptr;
+	_capacity = 0;
+	_limit = 0;
+	_used = 0;
+	_useCounter = 0;
+	_hitCount = 0;
+	_savedBytes = 0;
+}
+
+ESP32_MQTTTopicAliasTable::~ESP32_MQTTTopicAliasTable()
+{
+	deinit();
+}
+
+bool ESP32_MQTTTopicAliasTable::init(uint16_t capacity)
+{
+	deinit();
+
+	if (capacity == 0)
+		return false;
+
+	_entries = new Entry[capacity];
+	for (uint16_t i = 0; i < capacity; i++)
+	{
+		_entries[i].topic = nullptr;
+		_entries[i].topicSize = 0;
+	}
+	_capacity = capacity;
+	_limit = capacity;
+	_used = 0;
+	return true;
+}
+
+void ESP32_MQTTTopicAliasTable::deinit()
+{
+	if (_entries != nullptr)
+	{
+		for (uint16_t i = 0; i < _capacity; i++)
+			free(_entries[i].topic);
+		delete[] _entries;
+	}
+	_entries = nullptr;
+	_capacity = 0;
+	_limit = 0;
+	_used = 0;
+}
+
+uint16_t ESP32_MQTTTopicAliasTable::getAlias(const char* topic, size_t topicLen, bool& established)
+{
+	established = false;
+	if (_entries == nullptr || _limit == 0)
+		return 0;
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < topicLen; i++)
+	{
+		hash ^= (uint8_t)topic[i];
+		hash *= 16777619u;
+	}
+
+	_useCounter++;
+	for (uint16_t i = 0; i < _used; i++)
+	{
+		Entry& entry = _entries[i];
+		if (entry.hash == hash && strncmp(entry.topic, topic, topicLen) == 0 && entry.topic[topicLen] == '\0')
+		{
+			entry.lastUse = _useCounter;
+			// until a publish with the topic succeeded, the topic is sent with the alias again
+			established = entry.established;
+			if (established)
+			{
+				_hitCount++;
+				_savedBytes += topicLen;
+			}
+			return i + 1;
+		}
+	}
+
+	uint16_t index;
+	bool isNew = _used < _limit;
+	if (isNew)
+	{
+		index = _used++;
+	}
+	else
+	{
+		index = 0;
+		for (uint16_t i = 1; i < _used; i++)
+		{
+			// wrap-around safe comparison of the use counters
+			if ((int32_t)(_entries[i].lastUse - _entries[index].lastUse) < 0)
+				index = i;
+		}
+	}
+
+	Entry& entry = _entries[index];
+	if (entry.topicSize < topicLen + 1)
+	{
+		char* buf = (char*)realloc(entry.topic, topicLen + 1);
+		if (buf == nullptr)
+		{
+			// a reassigned entry keeps its previous topic, the broker still maps the alias to it
+			if (isNew)
+				_used--;
+			return 0;
+		}
+		entry.topic = buf;
+		entry.topicSize = topicLen + 1;
+	}
+	memcpy(entry.topic, topic, topicLen);
+	entry.topic[topicLen] = '\0';
+	entry.hash = hash;
+	entry.lastUse = _useCounter;
+	entry.established = false;
+	return index + 1;
+}
+
+void ESP32_MQTTTopicAliasTable::confirm(uint16_t alias)
+{
+	if (alias > 0 && alias <= _used)
+		_entries[alias - 1].established = true;
+}
+
+void ESP32_MQTTTopicAliasTable::reset()
+{
+	_used = 0;
+	_limit = _capacity;
+}
+
+void ESP32_MQTTTopicAliasTable::setLimit(uint16_t limit)
+{
+	_limit = limit < _capacity ? limit : _capacity;
+	if (_used > _limit)
+		_used = _limit;
+}
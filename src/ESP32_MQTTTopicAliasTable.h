@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+
+// Client side MQTT 5 topic alias assignment. Every topic gets an alias 1..limit, the least recently used one is
+// reassigned when all are taken. Aliases are valid for one network connection, reset() forgets them.
+// Lookup scans the table, it is meant for tens of aliases. Not thread safe.
+class ESP32_MQTTTopicAliasTable
+{
+public:
+    ESP32_MQTTTopicAliasTable();
+    ~ESP32_MQTTTopicAliasTable();
+
+    bool init(uint16_t capacity);
+    void deinit();
+
+    uint16_t getAlias(const char* topic, size_t topicLen, bool& established);  // 0 if disabled, established is true if the broker already knows the alias
+    void confirm(uint16_t alias);   // the message carrying the alias and the topic was published, the broker knows the alias from now on
+    void reset();
+    void setLimit(uint16_t limit);  // lowers the number of used aliases (broker's Topic Alias Maximum), at most the capacity
+
+    inline bool isInitialized() { return _entries != nullptr; }
+    inline uint16_t getLimit() { return _limit; }
+    inline uint32_t getHitCount() { return _hitCount; }
+    inline uint32_t getSavedBytes() { return _savedBytes; }    // topic bytes not sent thanks to aliases
+
+private:
+    struct Entry
+    {
+        uint32_t hash;
+        uint32_t lastUse;
+        bool established;
+        char* topic;
+        size_t topicSize;   // allocated size of topic
+    };
+
+    Entry* _entries;
+    uint16_t _capacity;
+    uint16_t _limit;
+    uint16_t _used;
+    uint32_t _useCounter;
+    uint32_t _hitCount;
+    uint32_t _savedBytes;
+};
@@ -0,0 +1,326 @@
+#include "ESP32_MQTTTopicTrie.h"
+
+ESP32_MQTTTopicTrie::ESP32_MQTTTopicTrie()
+{
+	_root = createNode(nullptr, "", 0);
+	_count = 0;
+}
+
+ESP32_MQTTTopicTrie::~ESP32_MQTTTopicTrie()
+{
+	destroyNode(_root);
+}
+
+uint32_t ESP32_MQTTTopicTrie::hashLevel(const char* level, int len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)level[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+ESP32_MQTTTopicTrie::Node* ESP32_MQTTTopicTrie::createNode(Node* parent, const char* level, int len)
+{
+	Node* node = new Node();
+	node->level = new char[len + 1];
+	memcpy(node->level, level, len);
+	node->level[len] = '\0';
+	node->levelLen = len;
+	node->levelHash = hashLevel(level, len);
+	node->routeId = -1;
+	node->parent = parent;
+	node->firstChild = nullptr;
+	node->nextSibling = nullptr;
+	node->plusChild = nullptr;
+	node->hashChild = nullptr;
+	return node;
+}
+
+void ESP32_MQTTTopicTrie::destroyNode(Node* node)
+{
+	if (node == nullptr)
+		return;
+
+	Node* child = node->firstChild;
+	while (child != nullptr)
+	{
+		Node* next = child->nextSibling;
+		destroyNode(child);
+		child = next;
+	}
+	destroyNode(node->plusChild);
+	destroyNode(node->hashChild);
+	delete[] node->level;
+	delete node;
+}
+
+void ESP32_MQTTTopicTrie::clear()
+{
+	destroyNode(_root);
+	_root = createNode(nullptr, "", 0);
+	_count = 0;
+}
+
+bool ESP32_MQTTTopicTrie::isValidFilter(const char* filter)
+{
+	if (filter == nullptr || filter[0] == '\0')
+		return false;
+
+	int len = strlen(filter);
+	for (int i = 0; i < len; i++)
+	{
+		if (filter[i] != '+' && filter[i] != '#')
+			continue;
+
+		// wildcards must occupy a whole level
+		if (i > 0 && filter[i - 1] != '/')
+			return false;
+		if (i + 1 < len && filter[i + 1] != '/')
+			return false;
+		// multi level wildcard must be the last character
+		if (filter[i] == '#' && i != len - 1)
+			return false;
+	}
+	return true;
+}
+
+bool ESP32_MQTTTopicTrie::insert(const char* filter, int routeId)
+{
+	if (!isValidFilter(filter))
+		return false;
+
+	Node* node = _root;
+	int len = strlen(filter);
+	int start = 0;
+	while (start <= len)
+	{
+		int end = start;
+		while (end < len && filter[end] != '/')
+			end++;
+
+		int levelLen = end - start;
+		const char* level = filter + start;
+
+		if (levelLen == 1 && level[0] == '+')
+		{
+			if (node->plusChild == nullptr)
+				node->plusChild = createNode(node, level, levelLen);
+			node = node->plusChild;
+		}
+		else if (levelLen == 1 && level[0] == '#')
+		{
+			if (node->hashChild == nullptr)
+				node->hashChild = createNode(node, level, levelLen);
+			node = node->hashChild;
+		}
+		else
+		{
+			uint32_t hash = hashLevel(level, levelLen);
+			Node* child = node->firstChild;
+			while (child != nullptr && !(child->levelHash == hash && child->levelLen == levelLen && memcmp(child->level, level, levelLen) == 0))
+				child = child->nextSibling;
+
+			if (child == nullptr)
+			{
+				child = createNode(node, level, levelLen);
+				child->nextSibling = node->firstChild;
+				node->firstChild = child;
+			}
+			node = child;
+		}
+
+		start = end + 1;
+	}
+
+	if (node->routeId < 0)
+		_count++;
+	node->routeId = routeId;
+	return true;
+}
+
+ESP32_MQTTTopicTrie::Node* ESP32_MQTTTopicTrie::findNode(const char* filter) const
+{
+	if (!isValidFilter(filter))
+		return nullptr;
+
+	Node* node = _root;
+	int len = strlen(filter);
+	int start = 0;
+	while (start <= len && node != nullptr)
+	{
+		int end = start;
+		while (end < len && filter[end] != '/')
+			end++;
+
+		int levelLen = end - start;
+		const char* level = filter + start;
+
+		if (levelLen == 1 && level[0] == '+')
+			node = node->plusChild;
+		else if (levelLen == 1 && level[0] == '#')
+			node = node->hashChild;
+		else
+		{
+			uint32_t hash = hashLevel(level, levelLen);
+			Node* child = node->firstChild;
+			while (child != nullptr && !(child->levelHash == hash && child->levelLen == levelLen && memcmp(child->level, level, levelLen) == 0))
+				child = child->nextSibling;
+			node = child;
+		}
+
+		start = end + 1;
+	}
+	return node;
+}
+
+int ESP32_MQTTTopicTrie::find(const char* filter) const
+{
+	Node* node = findNode(filter);
+	return node != nullptr ? node->routeId : -1;
+}
+
+int ESP32_MQTTTopicTrie::remove(const char* filter)
+{
+	Node* node = findNode(filter);
+	if (node == nullptr || node->routeId < 0)
+		return -1;
+
+	int routeId = node->routeId;
+	node->routeId = -1;
+	_count--;
+	prune(node);
+	return routeId;
+}
+
+void ESP32_MQTTTopicTrie::prune(Node* node)
+{
+	// remove nodes which don't lead to any route anymore
+	while (node->parent != nullptr && node->routeId < 0 && node->firstChild == nullptr && node->plusChild == nullptr && node->hashChild == nullptr)
+	{
+		Node* parent = node->parent;
+		if (parent->plusChild == node)
+			parent->plusChild = nullptr;
+		else if (parent->hashChild == node)
+			parent->hashChild = nullptr;
+		else
+		{
+			Node** link = &parent->firstChild;
+			while (*link != node)
+				link = &(*link)->nextSibling;
+			*link = node->nextSibling;
+		}
+		node->nextSibling = nullptr;
+		destroyNode(node);
+		node = parent;
+	}
+}
+
+int ESP32_MQTTTopicTrie::match(const char* topic, int topicLen, MatchVisitor visitor, void* context) const
+{
+	int matchCount = 0;
+	if (topic == nullptr || topicLen < 0)
+		return 0;
+
+	matchNode(_root, topic, 0, topicLen, visitor, context, matchCount);
+	return matchCount;
+}
+
+void ESP32_MQTTTopicTrie::matchNode(const Node* node, const char* topic, int start, int topicLen, MatchVisitor visitor, void* context, int& matchCount)
+{
+	// start > topicLen means that all topic levels were consumed
+	if (start > topicLen)
+	{
+		if (node->routeId >= 0)
+		{
+			matchCount++;
+			visitor(node->routeId, context);
+		}
+		// "a/#" matches also the parent level "a"
+		if (node->hashChild != nullptr && node->hashChild->routeId >= 0)
+		{
+			matchCount++;
+			visitor(node->hashChild->routeId, context);
+		}
+		return;
+	}
+
+	// topics starting with '$' are not matched by wildcards at the first level
+	bool wildcardsAllowed = !(node->parent == nullptr && topicLen > 0 && topic[0] == '$');
+
+	if (wildcardsAllowed && node->hashChild != nullptr && node->hashChild->routeId >= 0)
+	{
+		matchCount++;
+		visitor(node->hashChild->routeId, context);
+	}
+
+	uint32_t hash = 2166136261u;
+	int end = start;
+	while (end < topicLen && topic[end] != '/')
+	{
+		hash ^= (uint8_t)topic[end];
+		hash *= 16777619u;
+		end++;
+	}
+	int levelLen = end - start;
+
+	for (const Node* child = node->firstChild; child != nullptr; child = child->nextSibling)
+	{
+		if (child->levelHash == hash && child->levelLen == levelLen && memcmp(child->level, topic + start, levelLen) == 0)
+		{
+			matchNode(child, topic, end + 1, topicLen, visitor, context, matchCount);
+			break;
+		}
+	}
+
+	if (wildcardsAllowed && node->plusChild != nullptr)
+		matchNode(node->plusChild, topic, end + 1, topicLen, visitor, context, matchCount);
+}
+
+bool ESP32_MQTTTopicTrie::matches(const char* filter, const char* topic, int topicLen)
+{
+	if (filter == nullptr || topic == nullptr)
+		return false;
+
+	if (topicLen > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+		return false;
+
+	int f = 0;
+	int t = 0;
+	while (true)
+	{
+		int fEnd = f;
+		while (filter[fEnd] != '\0' && filter[fEnd] != '/')
+			fEnd++;
+
+		if (fEnd - f == 1 && filter[f] == '#')
+			return true;
+
+		if (t > topicLen)
+			return false;
+
+		int tEnd = t;
+		while (tEnd < topicLen && topic[tEnd] != '/')
+			tEnd++;
+
+		bool isPlus = fEnd - f == 1 && filter[f] == '+';
+		if (!isPlus && (fEnd - f != tEnd - t || memcmp(filter + f, topic + t, fEnd - f) != 0))
+			return false;
+
+		bool filterEnded = filter[fEnd] == '\0';
+		bool topicEnded = tEnd == topicLen;
+		if (filterEnded)
+			return topicEnded;
+
+		f = fEnd + 1;
+		t = tEnd + 1;
+		if (topicEnded)
+		{
+			// only "/#" may follow the last topic level
+			return filter[f] == '#' && filter[f + 1] == '\0';
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+
+// Prefix tree of MQTT topic filters, one node per topic level. Supports the '+' (single level)
+// and '#' (multi level) wildcards. Filters are compiled once when inserted, matching walks the
+// topic in a single pass without allocating and does not require a null terminated topic.
+class ESP32_MQTTTopicTrie
+{
+public:
+    typedef void (*MatchVisitor)(int routeId, void* context);
+
+    ESP32_MQTTTopicTrie();
+    ~ESP32_MQTTTopicTrie();
+    ESP32_MQTTTopicTrie(const ESP32_MQTTTopicTrie&) = delete;
+    ESP32_MQTTTopicTrie& operator=(const ESP32_MQTTTopicTrie&) = delete;
+
+    bool insert(const char* filter, int routeId);   // returns false for an invalid filter, replaces the route id if the filter already exists
+    int remove(const char* filter);                 // returns the removed route id, -1 if the filter was not found
+    int find(const char* filter) const;             // returns the route id of an exact filter, -1 if not found
+    int match(const char* topic, int topicLen, MatchVisitor visitor, void* context) const; // calls visitor for every matching filter, returns the number of matches
+    void clear();
+    inline size_t getCount() const { return _count; }   // number of filters
+
+    static bool isValidFilter(const char* filter);
+    static bool matches(const char* filter, const char* topic, int topicLen);    // one-off match without a trie
+
+private:
+    struct Node
+    {
+        char* level;
+        uint16_t levelLen;
+        uint32_t levelHash;
+        int routeId;
+        Node* parent;
+        Node* firstChild;
+        Node* nextSibling;
+        Node* plusChild;
+        Node* hashChild;
+    };
+
+    Node* _root;
+    size_t _count;
+
+    static uint32_t hashLevel(const char* level, int len);
+    static Node* createNode(Node* parent, const char* level, int len);
+    static void destroyNode(Node* node);
+    static void prune(Node* node);
+    Node* findNode(const char* filter) const;
+
+    static void matchNode(const Node* node, const char* topic, int start, int topicLen, MatchVisitor visitor, void* context, int& matchCount);
+};
@@ -0,0 +1,169 @@
+#include "ESP32_MQTTTrace.h"
+
+static_assert((ESP32_MQTT_TRACE_CAPACITY & (ESP32_MQTT_TRACE_CAPACITY - 1)) == 0, "ESP32_MQTT_TRACE_CAPACITY must be a power of two");
+
+std::atomic<uint32_t> ESP32_MQTTTrace::_head(0);
+std::atomic<uint32_t> ESP32_MQTTTrace::_start(0);
+ESP32_MQTTTrace::TaskName ESP32_MQTTTrace::_taskNames[ESP32_MQTT_TRACE_MAX_TASK_NAMES];
+size_t ESP32_MQTTTrace::_taskNameCount = 0;
+std::mutex ESP32_MQTTTrace::_taskNameMutex;
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+ESP32_MQTTTrace::Slot ESP32_MQTTTrace::_records[ESP32_MQTT_TRACE_CAPACITY];
+#endif
+
+/// <summary>
+/// Claims the next record of the ring. The sequence is set to Writing while the fields are written, so a dump running
+/// at the same time skips the record instead of reading it half written. If a writer a whole ring ahead or behind is
+/// in the same slot, which takes more records during one write than the ring holds, the record is dropped.
+/// </summary>
+void ESP32_MQTTTrace::record(ESP32_MQTTTraceEvent event, int msgId, int arg, uint32_t startUs, uint32_t durationUs)
+{
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+	uint32_t index = _head.fetch_add(1, std::memory_order_relaxed);
+	Slot& slot = _records[index & (ESP32_MQTT_TRACE_CAPACITY - 1)];
+	uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	if (sequence == Writing || (int32_t)(index + 1 - sequence) <= 0 || !slot.sequence.compare_exchange_strong(sequence, Writing, std::memory_order_relaxed))
+		return;
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.startUs.store(startUs, std::memory_order_relaxed);
+	slot.durationUs.store(durationUs, std::memory_order_relaxed);
+	slot.task.store((uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle(), std::memory_order_relaxed);
+	slot.msgId.store(msgId, std::memory_order_relaxed);
+	slot.event.store((uint8_t)event, std::memory_order_relaxed);
+	slot.arg.store(arg, std::memory_order_relaxed);
+	slot.sequence.store(index + 1, std::memory_order_release);
+#endif
+}
+
+void ESP32_MQTTTrace::setTaskName(TaskHandle_t task, const char* name)
+{
+	std::lock_guard<std::mutex> lock(_taskNameMutex);
+	for (size_t i = 0; i < _taskNameCount; i++)
+	{
+		if (_taskNames[i].task == task)
+		{
+			_taskNames[i].name = name;
+			return;
+		}
+	}
+	if (_taskNameCount < ESP32_MQTT_TRACE_MAX_TASK_NAMES)
+		_taskNames[_taskNameCount++] = { task, name };
+}
+
+void ESP32_MQTTTrace::clear()
+{
+	_start = _head.load();
+}
+
+bool ESP32_MQTTTrace::isSpan(ESP32_MQTTTraceEvent event)
+{
+	return event <= ESP32_MQTTTraceEvent::Callback;
+}
+
+const char* ESP32_MQTTTrace::getName(ESP32_MQTTTraceEvent event, int arg)
+{
+	static const char* eventNames[] = { "ERROR", "CONNECTED", "DISCONNECTED", "SUBSCRIBED", "UNSUBSCRIBED", "PUBLISHED", "DATA", "BEFORE_CONNECT", "DELETED" };
+	static const char* names[] = { "publish", "enqueue", "publishAsync", "publishStream", "subscribe", "unsubscribe", "event", "callback", "queued", "queue drop", "start", "stop", "reconnect", "disconnect" };
+
+	// the spans of an event are named after it, the task tells which is which
+	bool hasEventId = event == ESP32_MQTTTraceEvent::MqttEvent || event == ESP32_MQTTTraceEvent::Callback;
+	if (hasEventId && arg < (int)(sizeof(eventNames) / sizeof(eventNames[0])))
+		return eventNames[arg];
+	return (size_t)event < sizeof(names) / sizeof(names[0]) ? names[(size_t)event] : "?";
+}
+
+/// <summary>
+/// Links the spans of one message across the tasks: a publish with its PUBLISHED event, a received QoS 1/2 message
+/// with its callback. Published and received messages have separate msg_id spaces.
+/// </summary>
+/// <returns>flow id, 0 if the record isn't linked</returns>
+uint32_t ESP32_MQTTTrace::getFlowId(const Record& record)
+{
+	if (record.msgId <= 0)
+		return 0;
+	switch (record.event)
+	{
+	case ESP32_MQTTTraceEvent::Publish:
+	case ESP32_MQTTTraceEvent::Enqueue:
+		return record.msgId;
+	case ESP32_MQTTTraceEvent::MqttEvent:
+	case ESP32_MQTTTraceEvent::Callback:
+		if (record.arg == MQTT_EVENT_PUBLISHED)
+			return record.msgId;
+		if (record.arg == MQTT_EVENT_DATA)
+			return 0x10000 | record.msgId;
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/// <summary>
+/// Writes the records in the Chrome trace event format ({"traceEvents":[...]}), which chrome://tracing and
+/// ui.perfetto.dev open. Every task is a thread, records of one message are linked by flow arrows. The output is
+/// passed to the writer in pieces of up to 256 bytes, e.g. to Serial or a file. Recording may go on meanwhile,
+/// records overwritten during the dump are skipped.
+/// </summary>
+/// <returns>number of records written</returns>
+size_t ESP32_MQTTTrace::dumpChromeJson(Writer writer, void* context)
+{
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf), "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ESP32_MQTTClient\"}}");
+	writer(buf, len, context);
+
+	{
+		std::lock_guard<std::mutex> lock(_taskNameMutex);
+		for (size_t i = 0; i < _taskNameCount; i++)
+		{
+			len = snprintf(buf, sizeof(buf), ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", (uint32_t)(uintptr_t)_taskNames[i].task, _taskNames[i].name);
+			writer(buf, len, context);
+		}
+	}
+
+	size_t count = 0;
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+	// 32-bit start times are extended with the current time, the ring covers much less than their 71 minute range
+	uint32_t nowUs = micros();
+	int64_t now64Us = esp_timer_get_time();
+	uint32_t head = _head.load(std::memory_order_acquire);
+	uint32_t first = _start.load();
+	if (head - first > ESP32_MQTT_TRACE_CAPACITY)
+		first = head - ESP32_MQTT_TRACE_CAPACITY;
+
+	for (uint32_t index = first; index != head; index++)
+	{
+		Slot& slot = _records[index & (ESP32_MQTT_TRACE_CAPACITY - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != index + 1)
+			continue;
+		Record r;
+		r.startUs = slot.startUs.load(std::memory_order_relaxed);
+		r.durationUs = slot.durationUs.load(std::memory_order_relaxed);
+		r.task = slot.task.load(std::memory_order_relaxed);
+		r.msgId = slot.msgId.load(std::memory_order_relaxed);
+		r.event = (ESP32_MQTTTraceEvent)slot.event.load(std::memory_order_relaxed);
+		r.arg = slot.arg.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != index + 1)
+			continue;
+
+		long long ts = now64Us - (uint32_t)(nowUs - r.startUs);
+		const char* name = getName(r.event, r.arg);
+		if (isSpan(r.event))
+			len = snprintf(buf, sizeof(buf), ",{\"name\":\"%s\",\"cat\":\"mqtt\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%u,\"pid\":1,\"tid\":%u,\"args\":{\"msg_id\":%d}", name, ts, r.durationUs, r.task, r.msgId);
+		else
+			len = snprintf(buf, sizeof(buf), ",{\"name\":\"%s\",\"cat\":\"mqtt\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"msg_id\":%d}", name, ts, r.task, r.msgId);
+
+		// spans with the same bind_id are linked in time order
+		uint32_t flowId = getFlowId(r);
+		if (flowId != 0)
+			len += snprintf(buf + len, sizeof(buf) - len, ",\"bind_id\":\"0x%x\",\"flow_in\":true,\"flow_out\":true}", flowId);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, "}");
+		writer(buf, len, context);
+		count++;
+	}
+#endif
+
+	writer("]}", 2, context);
+	return count;
+}
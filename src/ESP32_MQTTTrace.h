@@ -0,0 +1,105 @@
+#pragma once
+
+#include "ESP32_MQTTPlatform.h"
+#include <atomic>
+#include <mutex>
+
+#ifndef ESP32_MQTTCLIENT_TRACING_ENABLED
+#define ESP32_MQTTCLIENT_TRACING_ENABLED 0         // set to 1 in the build flags (-DESP32_MQTTCLIENT_TRACING_ENABLED=1) to record trace events
+#endif
+#ifndef ESP32_MQTT_TRACE_CAPACITY
+#define ESP32_MQTT_TRACE_CAPACITY 512               // records kept, a power of two
+#endif
+#define ESP32_MQTT_TRACE_MAX_TASK_NAMES 8
+
+// what a trace record stands for, spans have a duration, the others are instants
+enum class ESP32_MQTTTraceEvent : uint8_t
+{
+    Publish,        // span: publish() passing the message to esp-mqtt, arg = qos
+    Enqueue,        // span: enqueue(), arg = qos
+    PublishAsync,   // span: publishAsync() copying the message into the queue, arg = publish class
+    PublishStream,  // span: whole publishStream(), arg = qos
+    Subscribe,      // span, arg = qos
+    Unsubscribe,    // span
+    MqttEvent,      // span: handleMqttEvent() in the MQTT task, arg = esp_mqtt_event_id_t
+    Callback,       // span: processing of the event including the user callbacks, arg = esp_mqtt_event_id_t
+    Queued,         // instant: event queued for the dispatch task, arg = esp_mqtt_event_id_t
+    QueueDrop,      // instant: event dropped, the dispatch queue was full, arg = esp_mqtt_event_id_t
+    Start,          // instant
+    Stop,           // instant
+    Reconnect,      // instant
+    Disconnect      // instant
+};
+
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+#define ESP32_MQTT_TRACE_START(startUs) unsigned long startUs = micros()
+#define ESP32_MQTT_TRACE_SPAN(event, msgId, arg, startUs) ESP32_MQTTTrace::record(event, msgId, arg, startUs, micros() - (startUs))
+#define ESP32_MQTT_TRACE_INSTANT(event, msgId, arg) ESP32_MQTTTrace::record(event, msgId, arg, micros(), 0)
+#define ESP32_MQTT_TRACE_TASK_NAME(task, name) ESP32_MQTTTrace::setTaskName(task, name)
+#else
+#define ESP32_MQTT_TRACE_START(startUs)
+#define ESP32_MQTT_TRACE_SPAN(event, msgId, arg, startUs) ((void)0)
+#define ESP32_MQTT_TRACE_INSTANT(event, msgId, arg) ((void)0)
+#define ESP32_MQTT_TRACE_TASK_NAME(task, name) ((void)0)
+#endif
+
+// Trace records of all clients in a fixed ring, written lock-free from any task: event, msg_id, start time (micros()),
+// duration and task. Each record costs a fetch_add, a compare-and-swap and a few stores, the oldest ones are overwritten. With
+// ESP32_MQTTCLIENT_TRACING_ENABLED 0 the trace points compile to nothing and no ring is allocated, dumpChromeJson()
+// then writes an empty trace.
+class ESP32_MQTTTrace
+{
+public:
+    typedef void (*Writer)(const char* text, size_t length, void* context);
+
+    static void record(ESP32_MQTTTraceEvent event, int msgId, int arg, uint32_t startUs, uint32_t durationUs);
+    static void setTaskName(TaskHandle_t task, const char* name);  // shown as the thread name, name must stay valid
+    static void clear();    // dumps start after the records written so far
+
+    static size_t dumpChromeJson(Writer writer, void* context);    // Chrome trace / Perfetto JSON of the ring in pieces, returns the number of records written
+    static inline size_t getCapacity() { return ESP32_MQTT_TRACE_CAPACITY; }
+    static inline uint32_t getRecordCount() { return _head; }     // records written since boot, including overwritten ones
+
+private:
+    struct Record
+    {
+        uint32_t startUs;
+        uint32_t durationUs;
+        uint32_t task;
+        int32_t msgId;
+        ESP32_MQTTTraceEvent event;
+        uint8_t arg;
+    };
+
+    // a Record in the ring, its fields are relaxed atomics as a dump may read them while they are written
+    struct Slot
+    {
+        std::atomic<uint32_t> sequence;     // index + 1 once written, Writing while being written
+        std::atomic<uint32_t> startUs;
+        std::atomic<uint32_t> durationUs;
+        std::atomic<uint32_t> task;
+        std::atomic<int32_t> msgId;
+        std::atomic<uint8_t> event;
+        std::atomic<uint8_t> arg;
+    };
+    static const uint32_t Writing = 0xFFFFFFFF;
+
+    struct TaskName
+    {
+        TaskHandle_t task;
+        const char* name;
+    };
+
+    static std::atomic<uint32_t> _head;
+    static std::atomic<uint32_t> _start;
+    static TaskName _taskNames[ESP32_MQTT_TRACE_MAX_TASK_NAMES];
+    static size_t _taskNameCount;
+    static std::mutex _taskNameMutex;
+#if ESP32_MQTTCLIENT_TRACING_ENABLED
+    static Slot _records[ESP32_MQTT_TRACE_CAPACITY];
+#endif
+
+    static bool isSpan(ESP32_MQTTTraceEvent event);
+    static const char* getName(ESP32_MQTTTraceEvent event, int arg);
+    static uint32_t getFlowId(const Record& record);
+};